@@ -0,0 +1,184 @@
+// Measures time, heap allocations and memory of the profile list paths on
+// a synthetic config with many profiles: loading config.json, normalizing
+// it, holding it as vector<Profile> versus a ProfileTable, and syncing and
+// filtering the TUI list model.
+//
+//   profile_bench [--profiles N] [--dir PATH]
+
+#include <malloc.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "config_util.hpp"
+#include "file_util.hpp"
+#include "profile_list.hpp"
+#include "profile_table.hpp"
+
+namespace {
+
+std::atomic<std::uint64_t> g_allocations{0};
+std::atomic<std::int64_t> g_live_bytes{0};
+
+}  // namespace
+
+void* operator new(std::size_t size) {
+  void* p = std::malloc(size == 0 ? 1 : size);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  g_live_bytes.fetch_add(static_cast<std::int64_t>(malloc_usable_size(p)),
+                         std::memory_order_relaxed);
+  return p;
+}
+
+void operator delete(void* p) noexcept {
+  if (p) {
+    g_live_bytes.fetch_sub(static_cast<std::int64_t>(malloc_usable_size(p)),
+                           std::memory_order_relaxed);
+    std::free(p);
+  }
+}
+
+void operator delete(void* p, std::size_t) noexcept { operator delete(p); }
+
+namespace {
+
+using namespace uhd_helper;
+
+struct Sample {
+  double ms = 0;
+  std::uint64_t allocations = 0;
+  // Heap growth across the step, i.e. what its result keeps alive.
+  std::int64_t bytes = 0;
+};
+
+Sample Measure(const std::function<void()>& step) {
+  const std::uint64_t allocations = g_allocations.load();
+  const std::int64_t live = g_live_bytes.load();
+  const auto start = std::chrono::steady_clock::now();
+  step();
+  Sample sample;
+  sample.ms = std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+  sample.allocations = g_allocations.load() - allocations;
+  sample.bytes = g_live_bytes.load() - live;
+  return sample;
+}
+
+void Print(const char* name, const Sample& sample) {
+  std::printf("%-28s %10.2f %12llu %12.1f\n", name, sample.ms,
+              static_cast<unsigned long long>(sample.allocations),
+              static_cast<double>(sample.bytes) / 1024.0);
+}
+
+std::vector<Profile> SyntheticProfiles(std::size_t count) {
+  const char* devices[] = {"b200", "b210", "x310", "n320", "e320"};
+  std::vector<Profile> profiles;
+  profiles.reserve(count);
+  for (std::size_t i = 0; i < count; ++i) {
+    Profile profile;
+    const std::string device = devices[i % 5];
+    profile.id = device + "_build_" + std::to_string(i);
+    profile.display_name = "UHD 4." + std::to_string(i % 9) + " " + device +
+                           " build " + std::to_string(i);
+    profile.folder_name = "I_P_" + profile.id;
+    profile.size_bytes = 40ULL * 1024 * 1024 + i;
+    profile.last_used = 1700000000 + static_cast<std::int64_t>(i);
+    profile.packed = i % 7 == 0;
+    if (i % 2 == 0) {
+      profile.root_hash = std::string(64, "0123456789abcdef"[i % 16]);
+    }
+    profiles.push_back(std::move(profile));
+  }
+  return profiles;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::size_t count = 20000;
+  std::filesystem::path dir =
+      std::filesystem::temp_directory_path() / "uhd_helper_profile_bench";
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--profiles" && i + 1 < argc) {
+      count = static_cast<std::size_t>(std::max(1, std::atoi(argv[++i])));
+    } else if (arg == "--dir" && i + 1 < argc) {
+      dir = argv[++i];
+    } else {
+      std::fprintf(stderr, "Usage: %s [--profiles N] [--dir PATH]\n",
+                   argv[0]);
+      return 2;
+    }
+  }
+
+  std::string error;
+  FileUtil::RemoveAll(dir, &error);
+  const auto config_path = dir / "config.json";
+  const std::vector<Profile> profiles = SyntheticProfiles(count);
+  {
+    ConfigManager writer(config_path);
+    if (!writer.Load(&error)) {
+      std::fprintf(stderr, "Failed to create config: %s\n", error.c_str());
+      return 1;
+    }
+    writer.config().roots.resize(1);
+    writer.config().roots[0].uhd_dir = dir / "uhd";
+    writer.config().roots[0].profiles = profiles;
+    if (!writer.Save(&error)) {
+      std::fprintf(stderr, "Failed to write config: %s\n", error.c_str());
+      return 1;
+    }
+  }
+  std::printf("%zu profiles, config.json %.1f KiB\n", count,
+              static_cast<double>(std::filesystem::file_size(config_path)) /
+                  1024.0);
+  std::printf("%-28s %10s %12s %12s\n", "step", "ms", "allocations",
+              "KiB kept");
+
+  ConfigManager config(config_path);
+  Print("load config.json", Measure([&] { config.Load(&error); }));
+  Print("normalize", Measure([&] { NormalizeProfiles(config.config()); }));
+
+  std::vector<Profile> copy;
+  Print("vector<Profile> copy", Measure([&] { copy = profiles; }));
+  ProfileTable table;
+  Print("ProfileTable assign", Measure([&] { table.Assign(profiles); }));
+  Print("ProfileTable reassign", Measure([&] { table.Assign(profiles); }));
+  std::size_t found = 0;
+  Print("ProfileTable find x1000", Measure([&] {
+          for (std::size_t i = 0; i < 1000; ++i) {
+            found += table.Find(profiles[(i * 7919) % count].id) !=
+                     ProfileTable::npos;
+          }
+        }));
+
+  ProfileListModel model;
+  const std::string active = profiles[count / 2].id;
+  Print("list sync, cold", Measure([&] { model.Sync(profiles, active); }));
+  Print("list sync, unchanged", Measure([&] { model.Sync(profiles, active); }));
+  std::vector<Profile> renamed = profiles;
+  renamed[count / 3].display_name += " (renamed)";
+  Print("list sync, one rename", Measure([&] { model.Sync(renamed, active); }));
+  Print("list sync, reactivate",
+        Measure([&] { model.Sync(renamed, profiles[0].id); }));
+  Print("filter \"b2\"", Measure([&] { model.SetFilter("b2"); }));
+  Print("filter \"b21 4.3\"", Measure([&] { model.SetFilter("b21 4.3"); }));
+  Print("filter cleared", Measure([&] { model.SetFilter(""); }));
+
+  std::printf("ProfileTable holds %.1f KiB, list model %.1f KiB (%zu found)\n",
+              static_cast<double>(table.MemoryBytes()) / 1024.0,
+              static_cast<double>(model.MemoryBytes()) / 1024.0, found);
+  FileUtil::RemoveAll(dir, &error);
+  return 0;
+}
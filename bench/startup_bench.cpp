@@ -0,0 +1,212 @@
+// Times what a TUI launch costs before the first frame can be drawn, with
+// the roots reconciled up front (eager) or on a background thread after the
+// first frame (deferred), on a synthetic UHD root holding an images folder
+// and N idle profiles.
+//
+//   startup_bench [--dir PATH] [--profiles N] [--scale PERCENT] [--runs N]
+//
+// A cold launch finds a config that lists no profiles and no official copy,
+// the way a fresh install or an external change leaves it, so the reconcile
+// copies the images and registers every folder; file pages are dropped
+// first. A warm launch finds everything in place and cached.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "config_util.hpp"
+#include "file_util.hpp"
+#include "index_util.hpp"
+#include "profile_list.hpp"
+#include "profile_util.hpp"
+#include "res.hpp"
+#include "synthetic_tree.hpp"
+
+namespace {
+
+using namespace uhd_helper;
+
+struct Layout {
+  std::filesystem::path uhd_dir;
+  std::filesystem::path config_path;
+};
+
+double ElapsedMs(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+double MedianMs(std::vector<double> samples) {
+  std::sort(samples.begin(), samples.end());
+  return samples[samples.size() / 2];
+}
+
+// What the TUI needs after loading the config: the installed release, the
+// list model and, when eager, the index.
+bool LoadViews(ProfileManager* manager, bool with_index, std::string* error) {
+  InstalledUhdRelease(manager->UhdDir());
+  ProfileListModel list;
+  list.Sync(manager->Profiles(), manager->ActiveProfileId());
+  if (!with_index) {
+    return true;
+  }
+  ImageIndex index(manager->IndexPath());
+  return index.Load(error);
+}
+
+// Rewrites the config so it knows the root and nothing in it, and removes
+// the official copy, so the next reconcile has the full job to do.
+bool ResetCold(const Layout& layout, std::string* error) {
+  ConfigManager config(layout.config_path);
+  if (!config.Load(error)) {
+    return false;
+  }
+  for (auto& root : config.config().roots) {
+    root.profiles.clear();
+    root.history.clear();
+    root.active_profile_id.clear();
+  }
+  NormalizeProfiles(config.config());
+  if (!config.Save(error) ||
+      !FileUtil::RemoveAll(layout.uhd_dir / Defaults().official_profile_folder,
+                           error)) {
+    return false;
+  }
+  ForgetInstalledUhdReleases();
+  bench::DropCache(layout.uhd_dir);
+  bench::DropCache(layout.config_path.parent_path());
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::filesystem::path dir =
+      std::filesystem::temp_directory_path() / "uhd_helper_startup_bench";
+  int profiles = 16;
+  int scale = 5;
+  int runs = 3;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--dir" && i + 1 < argc) {
+      dir = argv[++i];
+    } else if (arg == "--profiles" && i + 1 < argc) {
+      profiles = std::max(1, std::atoi(argv[++i]));
+    } else if (arg == "--scale" && i + 1 < argc) {
+      scale = std::max(1, std::atoi(argv[++i]));
+    } else if (arg == "--runs" && i + 1 < argc) {
+      runs = std::max(1, std::atoi(argv[++i]));
+    } else {
+      std::fprintf(stderr,
+                   "Usage: %s [--dir PATH] [--profiles N] [--scale PERCENT] "
+                   "[--runs N]\n",
+                   argv[0]);
+      return 2;
+    }
+  }
+
+  std::string error;
+  FileUtil::RemoveAll(dir, &error);
+  Layout layout;
+  layout.uhd_dir = dir / "usr" / "share" / "uhd";
+  layout.config_path = dir / "config" / "config.json";
+  std::uint64_t total_bytes = 0;
+  std::size_t total_files = 0;
+  // An empty stand-in, so the release lookup has a library to find.
+  if (!bench::WriteSyntheticTree(layout.uhd_dir, profiles + 1, scale,
+                                 &total_bytes, &total_files) ||
+      !FileUtil::EnsureDir(dir / "usr" / "lib", &error) ||
+      !std::ofstream(dir / "usr" / "lib" / "libuhd.so.4.6.0").is_open()) {
+    std::fprintf(stderr, "Failed to create %s\n", dir.c_str());
+    return 1;
+  }
+  for (int i = 1; i <= profiles; ++i) {
+    std::error_code ec;
+    std::filesystem::rename(
+        layout.uhd_dir / ("images_" + std::to_string(i)),
+        layout.uhd_dir /
+            (Defaults().idle_profile_prefix + "p" + std::to_string(i)),
+        ec);
+  }
+  {
+    ConfigManager config(layout.config_path);
+    ProfileManager manager(&config);
+    ImageIndex index(manager.IndexPath());
+    if (!config.Load(&error)) {
+      std::fprintf(stderr, "Failed to create config: %s\n", error.c_str());
+      return 1;
+    }
+    config.config().roots.resize(1);
+    config.config().roots[0].uhd_dir = layout.uhd_dir;
+    IndexStats stats;
+    if (!config.Save(&error) || !manager.Initialize(&error) ||
+        !manager.UpdateIndex(&index, &stats, &error) ||
+        !index.Save(&error)) {
+      std::fprintf(stderr, "Setup failed: %s\n", error.c_str());
+      return 1;
+    }
+  }
+  std::printf("%d profiles, %zu files, %.1f MiB, %d runs\n", profiles,
+              total_files, static_cast<double>(total_bytes) / (1024 * 1024),
+              runs);
+  std::printf("%-6s %-10s %16s %16s\n", "launch", "path", "first frame ms",
+              "background ms");
+
+  for (const bool cold : {true, false}) {
+    for (const bool deferred : {false, true}) {
+      std::vector<double> first_frame;
+      std::vector<double> background;
+      for (int run = 0; run < runs; ++run) {
+        if (cold && !ResetCold(layout, &error)) {
+          std::fprintf(stderr, "Reset failed: %s\n", error.c_str());
+          return 1;
+        }
+        ConfigManager config(layout.config_path);
+        ProfileManager manager(&config);
+        auto start = std::chrono::steady_clock::now();
+        const bool loaded =
+            deferred ? manager.InitializeFromCache(&error) &&
+                           LoadViews(&manager, false, &error)
+                     : manager.Initialize(&error) &&
+                           LoadViews(&manager, true, &error);
+        if (!loaded) {
+          std::fprintf(stderr, "Launch failed: %s\n", error.c_str());
+          return 1;
+        }
+        first_frame.push_back(ElapsedMs(start));
+        if (!deferred) {
+          continue;
+        }
+        // The TUI's background thread: a second manager reconciles and
+        // saves, then the index is loaded and the first one reloads.
+        start = std::chrono::steady_clock::now();
+        ConfigManager scanner_config(layout.config_path);
+        ProfileManager scanner(&scanner_config);
+        if (!scanner.Initialize(&error) ||
+            !LoadViews(&scanner, true, &error) ||
+            !manager.InitializeFromCache(&error)) {
+          std::fprintf(stderr, "Reconcile failed: %s\n", error.c_str());
+          return 1;
+        }
+        background.push_back(ElapsedMs(start));
+      }
+      char background_ms[32] = "-";
+      if (!background.empty()) {
+        std::snprintf(background_ms, sizeof(background_ms), "%.1f",
+                      MedianMs(background));
+      }
+      std::printf("%-6s %-10s %16.1f %16s\n", cold ? "cold" : "warm",
+                  deferred ? "deferred" : "eager", MedianMs(first_frame),
+                  background_ms);
+    }
+  }
+
+  FileUtil::RemoveAll(dir, &error);
+  return 0;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "walk_util.hpp"
+
+namespace uhd_helper {
+namespace bench {
+
+// Shape of a UHD images folder: per device family a few large FPGA
+// bitstreams, a LabVIEW bitfile and a handful of small firmware files.
+struct SyntheticFile {
+  const char* name;
+  std::uint64_t size;
+};
+
+inline const std::vector<SyntheticFile>& SyntheticImageSet() {
+  static const std::vector<SyntheticFile> files = {
+      {"usrp_b200_fpga.bin", 1400 * 1024},
+      {"usrp_b200mini_fpga.bin", 1300 * 1024},
+      {"usrp_b205mini_fpga.bin", 1300 * 1024},
+      {"usrp_b210_fpga.bin", 3800 * 1024},
+      {"usrp_b200_fw.hex", 40 * 1024},
+      {"usrp_x300_fpga_HG.bit", 7800 * 1024},
+      {"usrp_x300_fpga_XG.bit", 7800 * 1024},
+      {"usrp_x310_fpga_HG.bit", 11800 * 1024},
+      {"usrp_x310_fpga_XG.bit", 11800 * 1024},
+      {"usrp_x310_fpga_HG.lvbitx", 15 * 1024 * 1024},
+      {"usrp_n310_fpga_HG.bit", 9 * 1024 * 1024},
+      {"usrp_n310_fpga_HG.dts", 12 * 1024},
+      {"usrp_n320_fpga_XG.bit", 10 * 1024 * 1024},
+      {"usrp_e310_sg3_fpga.bit", 2 * 1024 * 1024},
+      {"usrp_e320_fpga_1G.bit", 5 * 1024 * 1024},
+      {"usrp_n210_r4_fpga.bin", 1200 * 1024},
+      {"usrp_n210_fw.bin", 24 * 1024},
+      {"usrp1_fpga.rbf", 180 * 1024},
+      {"usrp1_fw.ihx", 20 * 1024},
+      {"octoclock_r4_fw.hex", 30 * 1024},
+      {"usrp_x410_fpga_X4_200.bin", 24 * 1024 * 1024},
+      {"usrp_x410_fpga_X4_200.dts", 16 * 1024},
+      {"inventory.json", 4 * 1024},
+  };
+  return files;
+}
+
+// Writes copies synthetic images folders below root, one per subfolder
+// (images, images_1, ...), scaled by scale_percent. Content is
+// pseudo-random so dedup and compression cannot shortcut the I/O.
+inline bool WriteSyntheticTree(const std::filesystem::path& root, int copies,
+                               int scale_percent, std::uint64_t* total_bytes,
+                               std::size_t* total_files) {
+  std::uint64_t state = 0x9e3779b97f4a7c15ULL;
+  std::vector<char> chunk(64 * 1024);
+  std::uint64_t bytes = 0;
+  std::size_t files = 0;
+  for (int copy = 0; copy < copies; ++copy) {
+    const auto dir =
+        root / (copy == 0 ? std::string("images")
+                          : "images_" + std::to_string(copy));
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    if (ec) {
+      return false;
+    }
+    for (const auto& file : SyntheticImageSet()) {
+      std::ofstream out(dir / file.name, std::ios::binary | std::ios::trunc);
+      if (!out.is_open()) {
+        return false;
+      }
+      std::uint64_t remaining = file.size * scale_percent / 100;
+      bytes += remaining;
+      while (remaining > 0) {
+        for (std::size_t i = 0; i < chunk.size(); i += sizeof(state)) {
+          state ^= state << 13;
+          state ^= state >> 7;
+          state ^= state << 17;
+          std::memcpy(&chunk[i], &state, sizeof(state));
+        }
+        const auto n = std::min<std::uint64_t>(remaining, chunk.size());
+        out.write(chunk.data(), static_cast<std::streamsize>(n));
+        remaining -= n;
+      }
+      ++files;
+    }
+  }
+  if (total_bytes) {
+    *total_bytes = bytes;
+  }
+  if (total_files) {
+    *total_files = files;
+  }
+  return true;
+}
+
+// Drops the page cache of every file below dir with POSIX_FADV_DONTNEED,
+// so the next read goes to the device.
+inline void DropCache(const std::filesystem::path& dir) {
+  TreeWalker::Walk(
+      dir, WalkOptions(),
+      [](const WalkEntry& entry) {
+        if (entry.type == EntryType::kFile) {
+          const int fd = ::openat(entry.parent_fd, entry.name->c_str(),
+                                  O_RDONLY | O_CLOEXEC);
+          if (fd >= 0) {
+            ::fdatasync(fd);
+            ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            ::close(fd);
+          }
+        }
+        return WalkAction::kContinue;
+      },
+      nullptr, nullptr);
+}
+
+}  // namespace bench
+}  // namespace uhd_helper
@@ -0,0 +1,1294 @@
+#include "archive_util.hpp"
+
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+
+#include "hash_util.hpp"
+#include "trace_util.hpp"
+#include "walk_util.hpp"
+
+#if defined(UHD_HELPER_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(UHD_HELPER_HAVE_LZMA)
+#include <lzma.h>
+#endif
+
+namespace uhd_helper {
+namespace {
+
+constexpr std::size_t kBufferSize = 256 * 1024;
+
+class InputStream {
+ public:
+  virtual ~InputStream() = default;
+  // Short reads only happen at end of stream.
+  virtual bool Read(char* buffer, std::size_t size, std::size_t* got,
+                    std::string* error) = 0;
+
+  bool ReadFull(char* buffer, std::size_t size, std::string* error) {
+    std::size_t got = 0;
+    if (!Read(buffer, size, &got, error)) {
+      return false;
+    }
+    if (got != size) {
+      if (error) {
+        *error = "Unexpected end of archive";
+      }
+      return false;
+    }
+    return true;
+  }
+
+  bool Skip(std::uint64_t size, std::string* error) {
+    char scratch[16 * 1024];
+    while (size > 0) {
+      const auto chunk =
+          static_cast<std::size_t>(std::min<std::uint64_t>(size, sizeof(scratch)));
+      if (!ReadFull(scratch, chunk, error)) {
+        return false;
+      }
+      size -= chunk;
+    }
+    return true;
+  }
+};
+
+// Buffered fd reader. Decoders work straight on its buffer through
+// Peek/Consume so they never read past the end of their own data.
+class FdStream : public InputStream {
+ public:
+  explicit FdStream(int fd) : fd_(fd), buffer_(kBufferSize) {}
+
+  // Makes at least min(want, rest of stream) bytes available.
+  bool Peek(std::size_t want, const char** data, std::size_t* available,
+            std::string* error) {
+    want = std::min(want, buffer_.size());
+    if (end_ - pos_ < want && !eof_) {
+      std::memmove(buffer_.data(), buffer_.data() + pos_, end_ - pos_);
+      end_ -= pos_;
+      pos_ = 0;
+      while (end_ < want && !eof_) {
+        const ssize_t n =
+            ::read(fd_, buffer_.data() + end_, buffer_.size() - end_);
+        UHD_TRACE_COUNT(kSyscalls, 1);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n < 0) {
+          if (error) {
+            *error = std::string("Failed to read archive: ") +
+                     std::strerror(errno);
+          }
+          return false;
+        }
+        if (n == 0) {
+          eof_ = true;
+        }
+        end_ += static_cast<std::size_t>(n);
+      }
+    }
+    *data = buffer_.data() + pos_;
+    *available = end_ - pos_;
+    return true;
+  }
+
+  void Consume(std::size_t size) { pos_ += size; }
+
+  bool Read(char* buffer, std::size_t size, std::size_t* got,
+            std::string* error) override {
+    std::size_t done = 0;
+    while (done < size) {
+      const char* data = nullptr;
+      std::size_t available = 0;
+      if (!Peek(size - done, &data, &available, error)) {
+        return false;
+      }
+      if (available == 0) {
+        break;
+      }
+      const std::size_t n = std::min(available, size - done);
+      std::memcpy(buffer + done, data, n);
+      Consume(n);
+      done += n;
+    }
+    *got = done;
+    return true;
+  }
+
+ private:
+  int fd_;
+  std::vector<char> buffer_;
+  std::size_t pos_ = 0;
+  std::size_t end_ = 0;
+  bool eof_ = false;
+};
+
+#if defined(UHD_HELPER_HAVE_ZLIB)
+// gzip, including concatenated members.
+class GzipStream : public InputStream {
+ public:
+  explicit GzipStream(FdStream* source) : source_(source) {
+    std::memset(&stream_, 0, sizeof(stream_));
+    ok_ = inflateInit2(&stream_, 16 + MAX_WBITS) == Z_OK;
+  }
+  ~GzipStream() override { inflateEnd(&stream_); }
+
+  bool Read(char* buffer, std::size_t size, std::size_t* got,
+            std::string* error) override {
+    *got = 0;
+    if (!ok_) {
+      if (error) {
+        *error = "Failed to initialize gzip decoder";
+      }
+      return false;
+    }
+    stream_.next_out = reinterpret_cast<Bytef*>(buffer);
+    stream_.avail_out = static_cast<uInt>(size);
+    while (stream_.avail_out > 0 && !finished_) {
+      const char* data = nullptr;
+      std::size_t available = 0;
+      if (!source_->Peek(kBufferSize, &data, &available, error)) {
+        return false;
+      }
+      if (available == 0) {
+        if (error) {
+          *error = "Truncated gzip stream";
+        }
+        return false;
+      }
+      stream_.next_in =
+          reinterpret_cast<Bytef*>(const_cast<char*>(data));
+      stream_.avail_in = static_cast<uInt>(available);
+      const int ret = inflate(&stream_, Z_NO_FLUSH);
+      source_->Consume(available - stream_.avail_in);
+      if (ret == Z_STREAM_END) {
+        // Another member may follow.
+        if (!source_->Peek(1, &data, &available, error)) {
+          return false;
+        }
+        if (available == 0) {
+          finished_ = true;
+        } else {
+          inflateReset(&stream_);
+        }
+      } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        if (error) {
+          *error = std::string("Corrupt gzip stream: ") +
+                   (stream_.msg ? stream_.msg : "inflate failed");
+        }
+        return false;
+      }
+    }
+    *got = size - stream_.avail_out;
+    return true;
+  }
+
+ private:
+  FdStream* source_;
+  z_stream stream_;
+  bool ok_ = false;
+  bool finished_ = false;
+};
+#endif
+
+#if defined(UHD_HELPER_HAVE_LZMA)
+class XzStream : public InputStream {
+ public:
+  explicit XzStream(FdStream* source) : source_(source) {
+    ok_ = lzma_stream_decoder(&stream_, UINT64_MAX, LZMA_CONCATENATED) ==
+          LZMA_OK;
+  }
+  ~XzStream() override { lzma_end(&stream_); }
+
+  bool Read(char* buffer, std::size_t size, std::size_t* got,
+            std::string* error) override {
+    *got = 0;
+    if (!ok_) {
+      if (error) {
+        *error = "Failed to initialize xz decoder";
+      }
+      return false;
+    }
+    stream_.next_out = reinterpret_cast<std::uint8_t*>(buffer);
+    stream_.avail_out = size;
+    while (stream_.avail_out > 0 && !finished_) {
+      const char* data = nullptr;
+      std::size_t available = 0;
+      if (!source_->Peek(kBufferSize, &data, &available, error)) {
+        return false;
+      }
+      stream_.next_in = reinterpret_cast<const std::uint8_t*>(data);
+      stream_.avail_in = available;
+      const lzma_ret ret =
+          lzma_code(&stream_, available == 0 ? LZMA_FINISH : LZMA_RUN);
+      source_->Consume(available - stream_.avail_in);
+      if (ret == LZMA_STREAM_END) {
+        finished_ = true;
+      } else if (ret != LZMA_OK) {
+        if (error) {
+          *error = "Corrupt xz stream (lzma error " + std::to_string(ret) + ")";
+        }
+        return false;
+      }
+    }
+    *got = size - stream_.avail_out;
+    return true;
+  }
+
+ private:
+  FdStream* source_;
+  lzma_stream stream_ = LZMA_STREAM_INIT;
+  bool ok_ = false;
+  bool finished_ = false;
+};
+#endif
+
+std::uint64_t ParseOctal(const char* field, std::size_t size) {
+  // GNU base-256 for values that do not fit in octal.
+  if (static_cast<unsigned char>(field[0]) & 0x80) {
+    std::uint64_t value = static_cast<unsigned char>(field[0]) & 0x7f;
+    for (std::size_t i = 1; i < size; ++i) {
+      value = (value << 8) | static_cast<unsigned char>(field[i]);
+    }
+    return value;
+  }
+  std::uint64_t value = 0;
+  for (std::size_t i = 0; i < size && field[i]; ++i) {
+    if (field[i] >= '0' && field[i] <= '7') {
+      value = value * 8 + static_cast<std::uint64_t>(field[i] - '0');
+    }
+  }
+  return value;
+}
+
+std::string FieldString(const char* field, std::size_t size) {
+  return std::string(field, strnlen(field, size));
+}
+
+class TarReader : public ArchiveReader {
+ public:
+  TarReader(std::unique_ptr<FdStream> fd_stream,
+            std::unique_ptr<InputStream> decoder)
+      : fd_stream_(std::move(fd_stream)), decoder_(std::move(decoder)) {}
+
+  bool Next(ArchiveEntry* entry, bool* done, std::string* error) override {
+    *done = false;
+    if (!stream()->Skip(remaining_ + padding_, error)) {
+      return false;
+    }
+    remaining_ = padding_ = 0;
+
+    std::string long_name;
+    std::string long_link;
+    while (true) {
+      char header[512];
+      std::size_t got = 0;
+      if (!stream()->Read(header, sizeof(header), &got, error)) {
+        return false;
+      }
+      if (got == 0 || std::all_of(header, header + got,
+                                  [](char ch) { return ch == 0; })) {
+        *done = true;
+        return true;
+      }
+      if (got != sizeof(header) || !ChecksumOk(header)) {
+        if (error) {
+          *error = "Corrupt tar header";
+        }
+        return false;
+      }
+
+      const std::uint64_t size = ParseOctal(header + 124, 12);
+      const std::uint64_t padding = (512 - size % 512) % 512;
+      const char type = header[156];
+      if (type == 'L' || type == 'K' || type == 'x') {
+        std::string data;
+        if (!ReadBlob(size, padding, &data, error)) {
+          return false;
+        }
+        if (type == 'L') {
+          long_name = FieldString(data.data(), data.size());
+        } else if (type == 'K') {
+          long_link = FieldString(data.data(), data.size());
+        } else {
+          ParsePax(data, &long_name, &long_link);
+        }
+        continue;
+      }
+
+      std::string name = FieldString(header, 100);
+      if (std::memcmp(header + 257, "ustar", 5) == 0 && header[345]) {
+        name = FieldString(header + 345, 155) + "/" + name;
+      }
+      entry->path = long_name.empty() ? name : long_name;
+      entry->link_target =
+          long_link.empty() ? FieldString(header + 157, 100) : long_link;
+      entry->mode = static_cast<std::uint32_t>(ParseOctal(header + 100, 8));
+      long_name.clear();
+      long_link.clear();
+
+      remaining_ = 0;
+      padding_ = 0;
+      switch (type) {
+        case '0':
+        case '\0':
+        case '7':
+          entry->type = ArchiveEntryType::kFile;
+          remaining_ = size;
+          padding_ = padding;
+          return true;
+        case '5':
+          entry->type = ArchiveEntryType::kDir;
+          return true;
+        case '2':
+          entry->type = ArchiveEntryType::kSymlink;
+          return true;
+        case '1':
+          entry->type = ArchiveEntryType::kHardlink;
+          return true;
+        default:
+          // Devices, fifos, global pax headers: nothing to extract.
+          if (!stream()->Skip(size + padding, error)) {
+            return false;
+          }
+          break;
+      }
+    }
+  }
+
+  bool Read(char* buffer, std::size_t capacity, std::size_t* got,
+            std::string* error) override {
+    const auto want = static_cast<std::size_t>(
+        std::min<std::uint64_t>(capacity, remaining_));
+    *got = 0;
+    if (want == 0) {
+      return true;
+    }
+    if (!stream()->ReadFull(buffer, want, error)) {
+      return false;
+    }
+    remaining_ -= want;
+    *got = want;
+    return true;
+  }
+
+ private:
+  InputStream* stream() {
+    return decoder_ ? decoder_.get() : static_cast<InputStream*>(fd_stream_.get());
+  }
+
+  static bool ChecksumOk(const char* header) {
+    unsigned sum = 0;
+    for (int i = 0; i < 512; ++i) {
+      sum += (i >= 148 && i < 156) ? ' ' : static_cast<unsigned char>(header[i]);
+    }
+    return sum == ParseOctal(header + 148, 8);
+  }
+
+  bool ReadBlob(std::uint64_t size, std::uint64_t padding, std::string* data,
+                std::string* error) {
+    if (size > (1u << 20)) {
+      if (error) {
+        *error = "Tar extended header too large";
+      }
+      return false;
+    }
+    data->resize(static_cast<std::size_t>(size));
+    return stream()->ReadFull(&(*data)[0], data->size(), error) &&
+           stream()->Skip(padding, error);
+  }
+
+  // Records are "<length> <key>=<value>\n".
+  static void ParsePax(const std::string& data, std::string* path,
+                       std::string* link) {
+    std::size_t pos = 0;
+    while (pos < data.size()) {
+      const std::size_t space = data.find(' ', pos);
+      if (space == std::string::npos) {
+        return;
+      }
+      const std::size_t length = std::strtoul(data.c_str() + pos, nullptr, 10);
+      if (length == 0 || pos + length > data.size()) {
+        return;
+      }
+      const std::string record = data.substr(space + 1, pos + length - space - 2);
+      const std::size_t eq = record.find('=');
+      if (eq != std::string::npos) {
+        const std::string key = record.substr(0, eq);
+        if (key == "path") {
+          *path = record.substr(eq + 1);
+        } else if (key == "linkpath") {
+          *link = record.substr(eq + 1);
+        }
+      }
+      pos += length;
+    }
+  }
+
+  std::unique_ptr<FdStream> fd_stream_;
+  std::unique_ptr<InputStream> decoder_;
+  std::uint64_t remaining_ = 0;
+  std::uint64_t padding_ = 0;
+};
+
+#if defined(UHD_HELPER_HAVE_ZLIB)
+std::uint16_t Le16(const char* p) {
+  return static_cast<std::uint16_t>(static_cast<unsigned char>(p[0]) |
+                                    static_cast<unsigned char>(p[1]) << 8);
+}
+
+std::uint32_t Le32(const char* p) {
+  return static_cast<std::uint32_t>(Le16(p)) |
+         static_cast<std::uint32_t>(Le16(p + 2)) << 16;
+}
+
+std::uint64_t Le64(const char* p) {
+  return static_cast<std::uint64_t>(Le32(p)) |
+         static_cast<std::uint64_t>(Le32(p + 4)) << 32;
+}
+
+// Walks local file headers front to back; the central directory at the end
+// is never needed. Entries written with a data descriptor (sizes after the
+// data) are fine for deflate, whose stream marks its own end.
+class ZipReader : public ArchiveReader {
+ public:
+  explicit ZipReader(std::unique_ptr<FdStream> source)
+      : source_(std::move(source)) {
+    std::memset(&inflater_, 0, sizeof(inflater_));
+    inflater_ok_ = inflateInit2(&inflater_, -MAX_WBITS) == Z_OK;
+  }
+  ~ZipReader() override { inflateEnd(&inflater_); }
+
+  bool Next(ArchiveEntry* entry, bool* done, std::string* error) override {
+    *done = false;
+    if (in_entry_) {
+      char scratch[64 * 1024];
+      std::size_t got = 0;
+      do {
+        if (!Read(scratch, sizeof(scratch), &got, error)) {
+          return false;
+        }
+      } while (got > 0);
+    }
+
+    char header[30];
+    std::size_t got = 0;
+    if (!source_->Read(header, 4, &got, error)) {
+      return false;
+    }
+    const std::uint32_t signature = got == 4 ? Le32(header) : 0;
+    if (got == 0 || signature == 0x02014b50 || signature == 0x06054b50) {
+      *done = true;
+      return true;
+    }
+    if (signature != 0x04034b50 ||
+        !source_->ReadFull(header + 4, sizeof(header) - 4, error)) {
+      if (error && signature != 0x04034b50) {
+        *error = "Corrupt zip local header";
+      }
+      return false;
+    }
+
+    flags_ = Le16(header + 6);
+    method_ = Le16(header + 8);
+    crc_expected_ = Le32(header + 14);
+    compressed_left_ = Le32(header + 18);
+    std::uint64_t uncompressed = Le32(header + 22);
+    const std::uint16_t name_length = Le16(header + 26);
+    const std::uint16_t extra_length = Le16(header + 28);
+    std::string name(name_length, '\0');
+    std::string extra(extra_length, '\0');
+    if (!source_->ReadFull(&name[0], name_length, error) ||
+        !source_->ReadFull(&extra[0], extra_length, error)) {
+      return false;
+    }
+    zip64_ = false;
+    for (std::size_t pos = 0; pos + 4 <= extra.size();) {
+      const std::uint16_t id = Le16(&extra[pos]);
+      const std::uint16_t length = Le16(&extra[pos + 2]);
+      if (id == 0x0001 && pos + 4 + length <= extra.size()) {
+        zip64_ = true;
+        std::size_t field = pos + 4;
+        if (uncompressed == 0xffffffffu && field + 8 <= pos + 4 + length) {
+          uncompressed = Le64(&extra[field]);
+          field += 8;
+        }
+        if (compressed_left_ == 0xffffffffu && field + 8 <= pos + 4 + length) {
+          compressed_left_ = Le64(&extra[field]);
+        }
+      }
+      pos += 4 + length;
+    }
+
+    if (flags_ & 0x1) {
+      if (error) {
+        *error = "Encrypted zip entries are not supported: " + name;
+      }
+      return false;
+    }
+    const bool descriptor = flags_ & 0x8;
+    if (method_ != 0 && method_ != 8) {
+      if (error) {
+        *error = "Unsupported zip compression method " +
+                 std::to_string(method_) + ": " + name;
+      }
+      return false;
+    }
+    if (method_ == 0 && descriptor) {
+      if (error) {
+        *error = "Stored zip entry without sizes cannot be streamed: " + name;
+      }
+      return false;
+    }
+    sizes_known_ = !descriptor;
+
+    entry->path = name;
+    entry->mode = 0644;
+    entry->link_target.clear();
+    entry->type = !name.empty() && name.back() == '/' ? ArchiveEntryType::kDir
+                                                       : ArchiveEntryType::kFile;
+    crc_ = crc32(0L, Z_NULL, 0);
+    stream_end_ = false;
+    in_entry_ = true;
+    inflateReset(&inflater_);
+    return true;
+  }
+
+  bool Read(char* buffer, std::size_t capacity, std::size_t* got,
+            std::string* error) override {
+    *got = 0;
+    if (!in_entry_) {
+      return true;
+    }
+    if (method_ == 0) {
+      const auto want = static_cast<std::size_t>(
+          std::min<std::uint64_t>(capacity, compressed_left_));
+      if (want > 0 && !source_->ReadFull(buffer, want, error)) {
+        return false;
+      }
+      compressed_left_ -= want;
+      *got = want;
+      stream_end_ = compressed_left_ == 0;
+    } else if (!Inflate(buffer, capacity, got, error)) {
+      return false;
+    }
+    crc_ = crc32(crc_, reinterpret_cast<const Bytef*>(buffer),
+                 static_cast<uInt>(*got));
+    if (*got == 0 || stream_end_) {
+      if (stream_end_ && *got > 0) {
+        return true;
+      }
+      return FinishEntry(error);
+    }
+    return true;
+  }
+
+ private:
+  bool Inflate(char* buffer, std::size_t capacity, std::size_t* got,
+               std::string* error) {
+    if (!inflater_ok_) {
+      if (error) {
+        *error = "Failed to initialize zip decoder";
+      }
+      return false;
+    }
+    inflater_.next_out = reinterpret_cast<Bytef*>(buffer);
+    inflater_.avail_out = static_cast<uInt>(capacity);
+    while (inflater_.avail_out > 0 && !stream_end_) {
+      const char* data = nullptr;
+      std::size_t available = 0;
+      if (!source_->Peek(kBufferSize, &data, &available, error)) {
+        return false;
+      }
+      if (sizes_known_) {
+        available = static_cast<std::size_t>(
+            std::min<std::uint64_t>(available, compressed_left_));
+      }
+      if (available == 0) {
+        if (error) {
+          *error = "Truncated zip entry";
+        }
+        return false;
+      }
+      inflater_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+      inflater_.avail_in = static_cast<uInt>(available);
+      const int ret = inflate(&inflater_, Z_NO_FLUSH);
+      const std::size_t used = available - inflater_.avail_in;
+      source_->Consume(used);
+      if (sizes_known_) {
+        compressed_left_ -= used;
+      }
+      if (ret == Z_STREAM_END) {
+        stream_end_ = true;
+      } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        if (error) {
+          *error = std::string("Corrupt zip entry: ") +
+                   (inflater_.msg ? inflater_.msg : "inflate failed");
+        }
+        return false;
+      }
+    }
+    *got = capacity - inflater_.avail_out;
+    return true;
+  }
+
+  bool FinishEntry(std::string* error) {
+    in_entry_ = false;
+    if (sizes_known_ && compressed_left_ > 0 &&
+        !source_->Skip(compressed_left_, error)) {
+      return false;
+    }
+    std::uint32_t expected = crc_expected_;
+    if (flags_ & 0x8) {
+      // Optional signature, then crc and both sizes.
+      char descriptor[4];
+      if (!source_->ReadFull(descriptor, 4, error)) {
+        return false;
+      }
+      if (Le32(descriptor) == 0x08074b50 &&
+          !source_->ReadFull(descriptor, 4, error)) {
+        return false;
+      }
+      expected = Le32(descriptor);
+      if (!source_->Skip(zip64_ ? 16 : 8, error)) {
+        return false;
+      }
+    }
+    if (crc_ != expected) {
+      if (error) {
+        *error = "Zip entry failed its CRC check";
+      }
+      return false;
+    }
+    return true;
+  }
+
+  std::unique_ptr<FdStream> source_;
+  z_stream inflater_;
+  bool inflater_ok_ = false;
+  bool in_entry_ = false;
+  bool sizes_known_ = true;
+  bool stream_end_ = false;
+  bool zip64_ = false;
+  std::uint16_t flags_ = 0;
+  std::uint16_t method_ = 0;
+  std::uint32_t crc_expected_ = 0;
+  uLong crc_ = 0;
+  std::uint64_t compressed_left_ = 0;
+};
+#endif
+
+bool MakeParents(const std::filesystem::path& dest, const std::string& rel,
+                 std::string* error) {
+  const auto parent = (dest / rel).parent_path();
+  std::error_code ec;
+  std::filesystem::create_directories(parent, ec);
+  if (ec) {
+    if (error) {
+      *error = "Failed to create " + parent.string() + ": " + ec.message();
+    }
+    return false;
+  }
+  return true;
+}
+
+bool WriteEntry(ArchiveReader* reader, const std::filesystem::path& path,
+                std::uint32_t mode, ExtractedFile* info, std::vector<char>* buffer,
+                std::string* error) {
+  const int fd = ::open(path.c_str(),
+                        O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                        (mode & 0777) | 0600);
+  if (fd < 0) {
+    if (error) {
+      *error = "Failed to create " + path.string() + ": " + std::strerror(errno);
+    }
+    return false;
+  }
+  Sha256 sha;
+  info->size = 0;
+  bool ok = true;
+  while (ok) {
+    std::size_t got = 0;
+    if (!reader->Read(buffer->data(), buffer->size(), &got, error)) {
+      ok = false;
+      break;
+    }
+    if (got == 0) {
+      break;
+    }
+    sha.Update(buffer->data(), got);
+    for (std::size_t done = 0; done < got;) {
+      const ssize_t n = ::write(fd, buffer->data() + done, got - done);
+      UHD_TRACE_COUNT(kSyscalls, 1);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        if (error) {
+          *error = "Failed to write " + path.string() + ": " +
+                   std::strerror(errno);
+        }
+        ok = false;
+        break;
+      }
+      done += static_cast<std::size_t>(n);
+    }
+    info->size += got;
+  }
+  ::close(fd);
+  UHD_TRACE_COUNT(kBytesCopied, info->size);
+  UHD_TRACE_COUNT(kFilesCopied, 1);
+  info->sha256 = sha.HexDigest();
+  return ok;
+}
+
+}  // namespace
+
+bool SafeRelativePath(const std::string& path, std::string* cleaned) {
+  cleaned->clear();
+  if (!path.empty() && path[0] == '/') {
+    return false;
+  }
+  std::size_t start = 0;
+  while (start <= path.size()) {
+    std::size_t end = path.find('/', start);
+    if (end == std::string::npos) {
+      end = path.size();
+    }
+    const std::string part = path.substr(start, end - start);
+    if (part == "..") {
+      return false;
+    }
+    if (!part.empty() && part != ".") {
+      if (!cleaned->empty()) {
+        *cleaned += '/';
+      }
+      *cleaned += part;
+    }
+    start = end + 1;
+  }
+  return true;
+}
+
+std::unique_ptr<ArchiveReader> ArchiveReader::Open(int fd, std::string* error) {
+  auto source = std::make_unique<FdStream>(fd);
+  const char* magic = nullptr;
+  std::size_t available = 0;
+  if (!source->Peek(512, &magic, &available, error)) {
+    return nullptr;
+  }
+  const auto starts_with = [&](const char* prefix, std::size_t size) {
+    return available >= size && std::memcmp(magic, prefix, size) == 0;
+  };
+
+  if (starts_with("PK\x03\x04", 4)) {
+#if defined(UHD_HELPER_HAVE_ZLIB)
+    return std::make_unique<ZipReader>(std::move(source));
+#else
+    if (error) {
+      *error = "zip support needs zlib; rebuild with zlib available";
+    }
+    return nullptr;
+#endif
+  }
+  if (starts_with("\x1f\x8b", 2)) {
+#if defined(UHD_HELPER_HAVE_ZLIB)
+    auto decoder = std::make_unique<GzipStream>(source.get());
+    return std::make_unique<TarReader>(std::move(source), std::move(decoder));
+#else
+    if (error) {
+      *error = "tar.gz support needs zlib; rebuild with zlib available";
+    }
+    return nullptr;
+#endif
+  }
+  if (starts_with("\xfd" "7zXZ\0", 6)) {
+#if defined(UHD_HELPER_HAVE_LZMA)
+    auto decoder = std::make_unique<XzStream>(source.get());
+    return std::make_unique<TarReader>(std::move(source), std::move(decoder));
+#else
+    if (error) {
+      *error = "tar.xz support needs liblzma; rebuild with liblzma available";
+    }
+    return nullptr;
+#endif
+  }
+  if (available >= 262 && std::memcmp(magic + 257, "ustar", 5) == 0) {
+    return std::make_unique<TarReader>(std::move(source), nullptr);
+  }
+  if (error) {
+    *error = "Unrecognized archive format (expected zip, tar, tar.gz or tar.xz)";
+  }
+  return nullptr;
+}
+
+bool ExtractArchive(ArchiveReader* reader, const std::filesystem::path& dest,
+                    const ExtractedFileFn& on_file,
+                    std::vector<ExtractedFile>* files, std::string* error) {
+  UHD_TRACE_SCOPE("ExtractArchive");
+  std::vector<char> buffer(kBufferSize);
+  std::unordered_map<std::string, std::size_t> file_index;
+  while (true) {
+    ArchiveEntry entry;
+    bool done = false;
+    if (!reader->Next(&entry, &done, error)) {
+      return false;
+    }
+    if (done) {
+      return true;
+    }
+    std::string rel;
+    if (!SafeRelativePath(entry.path, &rel)) {
+      if (error) {
+        *error = "Refusing unsafe archive path: " + entry.path;
+      }
+      return false;
+    }
+    if (rel.empty()) {
+      continue;  // "./"
+    }
+    const auto path = dest / rel;
+
+    switch (entry.type) {
+      case ArchiveEntryType::kDir: {
+        std::error_code ec;
+        std::filesystem::create_directories(path, ec);
+        if (ec) {
+          if (error) {
+            *error = "Failed to create " + path.string() + ": " + ec.message();
+          }
+          return false;
+        }
+        break;
+      }
+      case ArchiveEntryType::kSymlink: {
+        std::string target;
+        const std::string joined =
+            std::filesystem::path(rel).parent_path().empty()
+                ? entry.link_target
+                : std::filesystem::path(rel).parent_path().generic_string() +
+                      "/" + entry.link_target;
+        if (entry.link_target.empty() || entry.link_target[0] == '/' ||
+            !SafeRelativePath(joined, &target)) {
+          if (error) {
+            *error = "Refusing symlink that leaves the archive: " + entry.path;
+          }
+          return false;
+        }
+        if (!MakeParents(dest, rel, error)) {
+          return false;
+        }
+        ::unlink(path.c_str());
+        if (::symlink(entry.link_target.c_str(), path.c_str()) != 0) {
+          if (error) {
+            *error = "Failed to create symlink " + path.string();
+          }
+          return false;
+        }
+        break;
+      }
+      case ArchiveEntryType::kHardlink: {
+        std::string target;
+        if (!SafeRelativePath(entry.link_target, &target) || target.empty()) {
+          if (error) {
+            *error = "Refusing unsafe hardlink: " + entry.path;
+          }
+          return false;
+        }
+        if (!MakeParents(dest, rel, error)) {
+          return false;
+        }
+        ::unlink(path.c_str());
+        if (::link((dest / target).c_str(), path.c_str()) != 0) {
+          if (error) {
+            *error = "Failed to link " + path.string() + " to " + target;
+          }
+          return false;
+        }
+        auto it = file_index.find(target);
+        if (files && it != file_index.end()) {
+          ExtractedFile info = (*files)[it->second];
+          info.path = rel;
+          file_index[rel] = files->size();
+          files->push_back(std::move(info));
+        }
+        break;
+      }
+      case ArchiveEntryType::kFile: {
+        if (!MakeParents(dest, rel, error)) {
+          return false;
+        }
+        ExtractedFile info;
+        info.path = rel;
+        if (!WriteEntry(reader, path, entry.mode, &info, &buffer, error)) {
+          return false;
+        }
+        if (on_file && !on_file(path, info, error)) {
+          return false;
+        }
+        if (files) {
+          file_index[rel] = files->size();
+          files->push_back(std::move(info));
+        }
+        break;
+      }
+    }
+  }
+}
+
+ArchiveCompression PreferredCompression() {
+#if defined(UHD_HELPER_HAVE_LZMA)
+  return ArchiveCompression::kXz;
+#elif defined(UHD_HELPER_HAVE_ZLIB)
+  return ArchiveCompression::kGzip;
+#else
+  return ArchiveCompression::kNone;
+#endif
+}
+
+// Streaming gzip or xz compressor in front of the output fd. xz runs at
+// preset 3, which keeps most of the ratio on bitstreams at several times
+// the speed of the default.
+class TarWriter::Encoder {
+ public:
+  using Sink = std::function<bool(const char*, std::size_t, std::string*)>;
+
+  explicit Encoder(ArchiveCompression compression)
+      : compression_(compression), out_(kBufferSize) {
+#if defined(UHD_HELPER_HAVE_ZLIB)
+    if (compression_ == ArchiveCompression::kGzip) {
+      std::memset(&zstream_, 0, sizeof(zstream_));
+      ok_ = deflateInit2(&zstream_, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                         16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    }
+#endif
+#if defined(UHD_HELPER_HAVE_LZMA)
+    if (compression_ == ArchiveCompression::kXz) {
+      ok_ = lzma_easy_encoder(&xstream_, 3, LZMA_CHECK_CRC64) == LZMA_OK;
+    }
+#endif
+  }
+
+  ~Encoder() {
+#if defined(UHD_HELPER_HAVE_ZLIB)
+    if (compression_ == ArchiveCompression::kGzip && ok_) {
+      deflateEnd(&zstream_);
+    }
+#endif
+#if defined(UHD_HELPER_HAVE_LZMA)
+    if (compression_ == ArchiveCompression::kXz) {
+      lzma_end(&xstream_);
+    }
+#endif
+  }
+
+  bool Run(const char* data, std::size_t size, bool finish, const Sink& sink,
+           std::string* error) {
+    if (!ok_) {
+      if (error) {
+        *error = "Compression is not available in this build";
+      }
+      return false;
+    }
+#if defined(UHD_HELPER_HAVE_ZLIB)
+    if (compression_ == ArchiveCompression::kGzip) {
+      zstream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+      zstream_.avail_in = static_cast<uInt>(size);
+      while (true) {
+        zstream_.next_out = reinterpret_cast<Bytef*>(out_.data());
+        zstream_.avail_out = static_cast<uInt>(out_.size());
+        const int ret = deflate(&zstream_, finish ? Z_FINISH : Z_NO_FLUSH);
+        if (ret == Z_STREAM_ERROR) {
+          if (error) {
+            *error = "gzip compression failed";
+          }
+          return false;
+        }
+        const std::size_t produced = out_.size() - zstream_.avail_out;
+        if (produced > 0 && !sink(out_.data(), produced, error)) {
+          return false;
+        }
+        if (finish ? ret == Z_STREAM_END
+                   : zstream_.avail_in == 0 && zstream_.avail_out > 0) {
+          return true;
+        }
+      }
+    }
+#endif
+#if defined(UHD_HELPER_HAVE_LZMA)
+    if (compression_ == ArchiveCompression::kXz) {
+      xstream_.next_in = reinterpret_cast<const std::uint8_t*>(data);
+      xstream_.avail_in = size;
+      while (true) {
+        xstream_.next_out = reinterpret_cast<std::uint8_t*>(out_.data());
+        xstream_.avail_out = out_.size();
+        const lzma_ret ret =
+            lzma_code(&xstream_, finish ? LZMA_FINISH : LZMA_RUN);
+        if (ret != LZMA_OK && ret != LZMA_STREAM_END) {
+          if (error) {
+            *error = "xz compression failed (lzma error " +
+                     std::to_string(ret) + ")";
+          }
+          return false;
+        }
+        const std::size_t produced = out_.size() - xstream_.avail_out;
+        if (produced > 0 && !sink(out_.data(), produced, error)) {
+          return false;
+        }
+        if (finish ? ret == LZMA_STREAM_END
+                   : xstream_.avail_in == 0 && xstream_.avail_out > 0) {
+          return true;
+        }
+      }
+    }
+#endif
+    (void)data;
+    (void)size;
+    (void)finish;
+    (void)sink;
+    return true;
+  }
+
+ private:
+  ArchiveCompression compression_;
+  std::vector<char> out_;
+  bool ok_ = false;
+#if defined(UHD_HELPER_HAVE_ZLIB)
+  z_stream zstream_;
+#endif
+#if defined(UHD_HELPER_HAVE_LZMA)
+  lzma_stream xstream_ = LZMA_STREAM_INIT;
+#endif
+};
+
+TarWriter::TarWriter(int fd, ArchiveCompression compression) : fd_(fd) {
+  if (compression != ArchiveCompression::kNone) {
+    encoder_ = std::make_unique<Encoder>(compression);
+  }
+}
+
+TarWriter::~TarWriter() = default;
+
+bool TarWriter::Emit(const char* data, std::size_t size, std::string* error) {
+  std::size_t done = 0;
+  while (done < size) {
+    const ssize_t n = ::write(fd_, data + done, size - done);
+    UHD_TRACE_COUNT(kSyscalls, 1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      if (error) {
+        *error = std::string("Failed to write archive: ") + std::strerror(errno);
+      }
+      return false;
+    }
+    done += static_cast<std::size_t>(n);
+  }
+  return true;
+}
+
+bool TarWriter::WriteAll(const char* data, std::size_t size,
+                         std::string* error) {
+  const bool ok =
+      encoder_ ? encoder_->Run(data, size, false,
+                               [this](const char* out, std::size_t n,
+                                      std::string* sink_error) {
+                                 return Emit(out, n, sink_error);
+                               },
+                               error)
+               : Emit(data, size, error);
+  if (ok) {
+    bytes_written_ += size;
+  }
+  return ok;
+}
+
+bool TarWriter::Pad(std::uint64_t size, std::string* error) {
+  static const char kZeros[512] = {};
+  const auto padding = static_cast<std::size_t>((512 - size % 512) % 512);
+  return WriteAll(kZeros, padding, error);
+}
+
+bool TarWriter::WriteHeader(const std::string& path, char type,
+                            std::uint64_t size, std::uint32_t mode,
+                            std::int64_t mtime,
+                            const std::string& link_target,
+                            std::string* error) {
+  // Records are "<length> <key>=<value>\n" where length counts itself.
+  std::string pax;
+  const auto add_record = [&pax](const std::string& key,
+                                 const std::string& value) {
+    const std::size_t body = key.size() + value.size() + 3;
+    std::size_t length = body + 1;
+    while (std::to_string(length).size() + body != length) {
+      ++length;
+    }
+    pax += std::to_string(length) + " " + key + "=" + value + "\n";
+  };
+  if (path.size() > 99) {
+    add_record("path", path);
+  }
+  if (link_target.size() > 99) {
+    add_record("linkpath", link_target);
+  }
+  if (!pax.empty() &&
+      (!WriteHeader("PaxHeader", 'x', pax.size(), 0644, mtime, "", error) ||
+       !WriteAll(pax.data(), pax.size(), error) || !Pad(pax.size(), error))) {
+    return false;
+  }
+
+  char header[512] = {};
+  std::memcpy(header, path.data(), std::min<std::size_t>(path.size(), 99));
+  std::snprintf(header + 100, 8, "%07o", mode & 07777);
+  std::snprintf(header + 108, 8, "%07o", 0);
+  std::snprintf(header + 116, 8, "%07o", 0);
+  if (size < 077777777777ULL) {
+    std::snprintf(header + 124, 12, "%011llo",
+                  static_cast<unsigned long long>(size));
+  } else {
+    // GNU base-256 for files of 8 GiB and more.
+    header[124] = static_cast<char>(0x80);
+    for (int i = 0; i < 8; ++i) {
+      header[135 - i] = static_cast<char>((size >> (8 * i)) & 0xff);
+    }
+  }
+  std::snprintf(header + 136, 12, "%011llo",
+                static_cast<unsigned long long>(
+                    std::clamp<std::int64_t>(mtime, 0, 077777777777LL)));
+  header[156] = type;
+  std::memcpy(header + 157, link_target.data(),
+              std::min<std::size_t>(link_target.size(), 99));
+  std::memcpy(header + 257, "ustar", 6);
+  std::memcpy(header + 263, "00", 2);
+  std::memset(header + 148, ' ', 8);
+  unsigned sum = 0;
+  for (const char ch : header) {
+    sum += static_cast<unsigned char>(ch);
+  }
+  std::snprintf(header + 148, 8, "%06o", sum);
+  return WriteAll(header, sizeof(header), error);
+}
+
+bool TarWriter::AddDirectory(const std::string& path, std::uint32_t mode,
+                             std::string* error) {
+  return WriteHeader(path + "/", '5', 0, mode, 0, "", error);
+}
+
+bool TarWriter::AddSymlink(const std::string& path, const std::string& target,
+                           std::string* error) {
+  return WriteHeader(path, '2', 0, 0777, 0, target, error);
+}
+
+bool TarWriter::AddData(const std::string& path, const std::string& data,
+                        std::uint32_t mode, std::string* error) {
+  return WriteHeader(path, '0', data.size(), mode, 0, "", error) &&
+         WriteAll(data.data(), data.size(), error) && Pad(data.size(), error);
+}
+
+bool TarWriter::AddFile(const std::string& path, int src_fd, std::uint64_t size,
+                        std::uint32_t mode, std::int64_t mtime,
+                        std::string* error) {
+  if (!WriteHeader(path, '0', size, mode, mtime, "", error)) {
+    return false;
+  }
+  // sendfile covers file and pipe targets alike; the read/write loop is
+  // for sources it refuses and for compressed output.
+  std::uint64_t remaining = size;
+  while (!encoder_ && remaining > 0) {
+    const ssize_t n = ::sendfile(
+        fd_, src_fd, nullptr,
+        static_cast<std::size_t>(std::min<std::uint64_t>(remaining, 1 << 30)));
+    UHD_TRACE_COUNT(kSyscalls, 1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    remaining -= static_cast<std::uint64_t>(n);
+    bytes_written_ += static_cast<std::uint64_t>(n);
+  }
+  std::vector<char> buffer;
+  while (remaining > 0) {
+    if (buffer.empty()) {
+      buffer.resize(kBufferSize);
+    }
+    const ssize_t n = ::read(
+        src_fd, buffer.data(),
+        static_cast<std::size_t>(std::min<std::uint64_t>(remaining, buffer.size())));
+    UHD_TRACE_COUNT(kSyscalls, 1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      if (error) {
+        *error = path + " shrank while it was archived";
+      }
+      return false;
+    }
+    if (!WriteAll(buffer.data(), static_cast<std::size_t>(n), error)) {
+      return false;
+    }
+    remaining -= static_cast<std::uint64_t>(n);
+  }
+  return Pad(size, error);
+}
+
+bool TarWriter::Finish(std::string* error) {
+  static const char kZeros[1024] = {};
+  if (!WriteAll(kZeros, sizeof(kZeros), error)) {
+    return false;
+  }
+  return !encoder_ ||
+         encoder_->Run(nullptr, 0, true,
+                       [this](const char* out, std::size_t n,
+                              std::string* sink_error) {
+                         return Emit(out, n, sink_error);
+                       },
+                       error);
+}
+
+bool HoistSingleDirectory(const std::filesystem::path& dir,
+                          std::string* prefix, std::string* error) {
+  prefix->clear();
+  while (true) {
+    std::vector<DirEntry> entries;
+    if (!TreeWalker::ReadDir(dir, false, &entries, error)) {
+      return false;
+    }
+    if (entries.size() != 1 || entries[0].type != EntryType::kDir) {
+      return true;
+    }
+    const std::string name = entries[0].name;
+    auto hoisted = dir;
+    hoisted += ".hoist";
+    std::error_code ec;
+    std::filesystem::rename(dir / name, hoisted, ec);
+    if (!ec) {
+      std::filesystem::remove(dir, ec);
+    }
+    if (!ec) {
+      std::filesystem::rename(hoisted, dir, ec);
+    }
+    if (ec) {
+      if (error) {
+        *error = "Failed to hoist " + (dir / name).string() + ": " +
+                 ec.message();
+      }
+      return false;
+    }
+    *prefix += name + "/";
+  }
+}
+
+}  // namespace uhd_helper
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace uhd_helper {
+
+enum class ArchiveEntryType {
+  kFile,
+  kDir,
+  kSymlink,
+  kHardlink,
+};
+
+struct ArchiveEntry {
+  std::string path;
+  ArchiveEntryType type = ArchiveEntryType::kFile;
+  std::uint32_t mode = 0644;
+  std::string link_target;
+};
+
+// Forward-only reader over zip, tar, tar.gz and tar.xz streams. Nothing is
+// buffered beyond the current entry, so pipes and stdin work.
+class ArchiveReader {
+ public:
+  virtual ~ArchiveReader() = default;
+
+  // Picks the format from the first bytes of fd. fd stays owned by the
+  // caller. zip and tar.gz need zlib, tar.xz needs liblzma at build time.
+  static std::unique_ptr<ArchiveReader> Open(int fd, std::string* error);
+
+  // Moves to the next entry, discarding unread data of the current one.
+  // Sets *done instead of filling entry at the end of the archive.
+  virtual bool Next(ArchiveEntry* entry, bool* done, std::string* error) = 0;
+
+  // Reads data of the current entry; *got is 0 once it is exhausted.
+  virtual bool Read(char* buffer, std::size_t capacity, std::size_t* got,
+                    std::string* error) = 0;
+};
+
+struct ExtractedFile {
+  std::string path;
+  std::uint64_t size = 0;
+  std::string sha256;
+};
+
+// Runs after each regular file is written and closed.
+using ExtractedFileFn = std::function<bool(const std::filesystem::path& file,
+                                           const ExtractedFile& info,
+                                           std::string* error)>;
+
+// Rejects anything that could land outside a root it is joined to:
+// absolute paths and ".." components. "." and empty components are
+// dropped, so cleaned may end up empty.
+bool SafeRelativePath(const std::string& path, std::string* cleaned);
+
+// Writes every entry below dest in one pass, hashing regular files as they
+// are written. Entries that are absolute, contain "..", or symlink out of
+// dest are rejected.
+bool ExtractArchive(ArchiveReader* reader, const std::filesystem::path& dest,
+                    const ExtractedFileFn& on_file,
+                    std::vector<ExtractedFile>* files, std::string* error);
+
+enum class ArchiveCompression {
+  kNone,
+  kGzip,
+  kXz,
+};
+
+// The strongest codec compiled in: xz, then gzip, then none.
+ArchiveCompression PreferredCompression();
+
+// Sequential ustar writer. Paths and link targets that do not fit the
+// header go into pax records, so everything ArchiveReader accepts
+// round-trips. Only appends, so fd can be a pipe; fd stays owned by the
+// caller.
+class TarWriter {
+ public:
+  explicit TarWriter(int fd,
+                     ArchiveCompression compression = ArchiveCompression::kNone);
+  ~TarWriter();
+
+  bool AddDirectory(const std::string& path, std::uint32_t mode,
+                    std::string* error);
+  bool AddSymlink(const std::string& path, const std::string& target,
+                  std::string* error);
+  bool AddData(const std::string& path, const std::string& data,
+               std::uint32_t mode, std::string* error);
+  // Streams size bytes of src_fd from its current offset.
+  bool AddFile(const std::string& path, int src_fd, std::uint64_t size,
+               std::uint32_t mode, std::int64_t mtime, std::string* error);
+  // Writes the end-of-archive blocks and flushes the compressor.
+  bool Finish(std::string* error);
+
+  // Tar bytes produced so far, before compression.
+  std::uint64_t bytes_written() const { return bytes_written_; }
+
+ private:
+  class Encoder;
+
+  bool Emit(const char* data, std::size_t size, std::string* error);
+  bool WriteHeader(const std::string& path, char type, std::uint64_t size,
+                   std::uint32_t mode, std::int64_t mtime,
+                   const std::string& link_target, std::string* error);
+  bool WriteAll(const char* data, std::size_t size, std::string* error);
+  bool Pad(std::uint64_t size, std::string* error);
+
+  int fd_;
+  std::unique_ptr<Encoder> encoder_;
+  std::uint64_t bytes_written_ = 0;
+};
+
+// Vendor archives wrap the images in one or more directories
+// (uhd-images_4.6.0.0/...). While dir holds nothing but a single
+// directory, that directory's contents are moved up by rename. *prefix
+// receives the stripped path, '/'-terminated, or "" when nothing moved.
+bool HoistSingleDirectory(const std::filesystem::path& dir,
+                          std::string* prefix, std::string* error);
+
+}  // namespace uhd_helper
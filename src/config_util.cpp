@@ -1,11 +1,15 @@
 #include "config_util.hpp"
 
+#include <algorithm>
+#include <cstdint>
 #include <fstream>
-#include <unordered_set>
+#include <string_view>
+#include <utility>
 
 #include "file_util.hpp"
 #include "json_min.hpp"
 #include "res.hpp"
+#include "trace_util.hpp"
 
 namespace uhd_helper {
 namespace {
@@ -36,6 +40,17 @@ int GetInt(const json_min::Object& obj, const char* key, int fallback) {
   return static_cast<int>(*value->AsNumber());
 }
 
+// JSON numbers are doubles, exact up to 2^53, which covers byte counts and
+// timestamps.
+std::int64_t GetInt64(const json_min::Object& obj, const char* key,
+                      std::int64_t fallback) {
+  const auto* value = GetObjectValue(obj, key);
+  if (!value || !value->IsNumber()) {
+    return fallback;
+  }
+  return static_cast<std::int64_t>(*value->AsNumber());
+}
+
 bool GetBool(const json_min::Object& obj, const char* key, bool fallback) {
   const auto* value = GetObjectValue(obj, key);
   if (!value || !value->IsBool()) {
@@ -51,6 +66,13 @@ Profile ParseProfile(const json_min::Object& obj, const AppConfig& defaults) {
   profile.folder_name =
       GetString(obj, "folder_name", defaults.idle_profile_prefix + profile.id);
   profile.is_official = GetBool(obj, "is_official", false);
+  profile.size_bytes =
+      static_cast<std::uint64_t>(std::max<std::int64_t>(
+          GetInt64(obj, "size_bytes", 0), 0));
+  profile.last_used = GetInt64(obj, "last_used", 0);
+  profile.packed = GetBool(obj, "packed", false);
+  profile.root_hash = GetString(obj, "root_hash", "");
+  profile.uhd_version = GetString(obj, "uhd_version", "");
   return profile;
 }
 
@@ -60,24 +82,201 @@ json_min::Value ProfileToJson(const Profile& profile) {
   obj.emplace("display_name", json_min::Value(profile.display_name));
   obj.emplace("folder_name", json_min::Value(profile.folder_name));
   obj.emplace("is_official", json_min::Value(profile.is_official));
+  obj.emplace("size_bytes",
+              json_min::Value(static_cast<double>(profile.size_bytes)));
+  obj.emplace("last_used",
+              json_min::Value(static_cast<double>(profile.last_used)));
+  if (profile.packed) {
+    obj.emplace("packed", json_min::Value(true));
+  }
+  if (!profile.root_hash.empty()) {
+    obj.emplace("root_hash", json_min::Value(profile.root_hash));
+  }
+  if (!profile.uhd_version.empty()) {
+    obj.emplace("uhd_version", json_min::Value(profile.uhd_version));
+  }
   return json_min::Value(std::move(obj));
 }
 
+// FNV-1a over the serialized config, used to skip no-op rewrites.
+std::uint64_t HashContent(const std::string& content) {
+  std::uint64_t hash = 1469598103934665603ULL;
+  for (unsigned char c : content) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash ^ static_cast<std::uint64_t>(content.size());
+}
+
+json_min::Array ProfilesToJson(const std::vector<Profile>& profiles) {
+  json_min::Array array;
+  array.reserve(profiles.size());
+  for (const auto& profile : profiles) {
+    array.push_back(ProfileToJson(profile));
+  }
+  return array;
+}
+
+std::vector<Profile> ParseProfiles(const json_min::Object& obj,
+                                   const AppConfig& defaults) {
+  std::vector<Profile> profiles;
+  const auto* profiles_value = GetObjectValue(obj, "profiles");
+  if (!profiles_value || !profiles_value->IsArray()) {
+    return profiles;
+  }
+  profiles.reserve(profiles_value->AsArray()->size());
+  for (const auto& item : *profiles_value->AsArray()) {
+    if (!item.IsObject()) {
+      continue;
+    }
+    Profile profile = ParseProfile(*item.AsObject(), defaults);
+    if (!profile.id.empty()) {
+      profiles.push_back(std::move(profile));
+    }
+  }
+  return profiles;
+}
+
+std::vector<Activation> ParseHistory(const json_min::Object& obj) {
+  std::vector<Activation> history;
+  const auto* history_value = GetObjectValue(obj, "history");
+  if (!history_value || !history_value->IsArray()) {
+    return history;
+  }
+  for (const auto& item : *history_value->AsArray()) {
+    if (!item.IsObject()) {
+      continue;
+    }
+    const auto& fields = *item.AsObject();
+    Activation activation;
+    activation.profile_id = GetString(fields, "profile_id", "");
+    activation.previous_id = GetString(fields, "previous_id", "");
+    activation.time = GetInt64(fields, "time", 0);
+    activation.manifest_sha256 = GetString(fields, "manifest_sha256", "");
+    if (!activation.profile_id.empty()) {
+      history.push_back(std::move(activation));
+    }
+  }
+  const std::size_t limit = Defaults().activation_history_limit;
+  if (history.size() > limit) {
+    history.erase(history.begin(), history.end() - limit);
+  }
+  return history;
+}
+
+json_min::Array HistoryToJson(const std::vector<Activation>& history) {
+  json_min::Array array;
+  array.reserve(history.size());
+  for (const auto& activation : history) {
+    json_min::Object obj;
+    obj.emplace("profile_id", json_min::Value(activation.profile_id));
+    obj.emplace("previous_id", json_min::Value(activation.previous_id));
+    obj.emplace("time",
+                json_min::Value(static_cast<double>(activation.time)));
+    obj.emplace("manifest_sha256",
+                json_min::Value(activation.manifest_sha256));
+    array.push_back(json_min::Value(std::move(obj)));
+  }
+  return array;
+}
+
+UhdRoot ParseRoot(const json_min::Object& obj, const AppConfig& defaults) {
+  UhdRoot root;
+  root.name = GetString(obj, "name", "");
+  root.uhd_dir = GetString(obj, "uhd_dir", "");
+  root.images_folder_name =
+      GetString(obj, "images_folder_name",
+                GetImagesFolderName(UhdVersion::kDefault));
+  root.active_profile_id = GetString(obj, "active_profile_id", "");
+  root.profiles = ParseProfiles(obj, defaults);
+  root.history = ParseHistory(obj);
+  return root;
+}
+
+json_min::Value RootToJson(const UhdRoot& root) {
+  json_min::Object obj;
+  obj.emplace("name", json_min::Value(root.name));
+  obj.emplace("uhd_dir", json_min::Value(root.uhd_dir.string()));
+  obj.emplace("images_folder_name", json_min::Value(root.images_folder_name));
+  obj.emplace("active_profile_id", json_min::Value(root.active_profile_id));
+  obj.emplace("profiles", json_min::Value(ProfilesToJson(root.profiles)));
+  if (!root.history.empty()) {
+    obj.emplace("history", json_min::Value(HistoryToJson(root.history)));
+  }
+  return json_min::Value(std::move(obj));
+}
+
+ProfileGroup ParseGroup(const json_min::Object& obj) {
+  ProfileGroup group;
+  group.name = GetString(obj, "name", "");
+  const auto* members_value = GetObjectValue(obj, "members");
+  if (!members_value || !members_value->IsArray()) {
+    return group;
+  }
+  for (const auto& item : *members_value->AsArray()) {
+    if (!item.IsObject()) {
+      continue;
+    }
+    GroupMember member;
+    member.root = GetString(*item.AsObject(), "root", "");
+    member.profile_id = GetString(*item.AsObject(), "profile_id", "");
+    if (!member.root.empty() && !member.profile_id.empty()) {
+      group.members.push_back(std::move(member));
+    }
+  }
+  return group;
+}
+
+json_min::Value GroupToJson(const ProfileGroup& group) {
+  json_min::Array members;
+  members.reserve(group.members.size());
+  for (const auto& member : group.members) {
+    json_min::Object obj;
+    obj.emplace("root", json_min::Value(member.root));
+    obj.emplace("profile_id", json_min::Value(member.profile_id));
+    members.push_back(json_min::Value(std::move(obj)));
+  }
+  json_min::Object obj;
+  obj.emplace("name", json_min::Value(group.name));
+  obj.emplace("members", json_min::Value(std::move(members)));
+  return json_min::Value(std::move(obj));
+}
+
+// Schema 1 configs described exactly one root at the top level.
+UhdRoot ParseLegacyRoot(const json_min::Object& obj,
+                        const AppConfig& defaults) {
+  UhdRoot root;
+  root.name = Defaults().default_root_name;
+  root.uhd_dir = GetString(obj, "uhd_dir", GetUhdDirByOs(DetectOs()).string());
+  root.images_folder_name =
+      GetString(obj, "images_folder_name",
+                GetImagesFolderName(UhdVersion::kDefault));
+  root.active_profile_id = GetString(obj, "active_profile_id", "");
+  root.profiles = ParseProfiles(obj, defaults);
+  return root;
+}
+
 }  // namespace
 
 ConfigManager::ConfigManager(std::filesystem::path path) : path_(std::move(path)) {}
 
 bool ConfigManager::Load(std::string* error) {
+  UHD_TRACE_SCOPE("ConfigManager::Load");
   std::error_code ec;
   if (!std::filesystem::exists(path_, ec)) {
     config_ = AppConfig{};
+    saved_hash_.reset();
     config_.schema_version = Defaults().schema_version;
-    config_.uhd_dir = GetUhdDirByOs(DetectOs());
-    config_.images_folder_name = GetImagesFolderName(UhdVersion::kDefault);
     config_.idle_profile_prefix = Defaults().idle_profile_prefix;
     config_.official_profile_folder = Defaults().official_profile_folder;
     config_.backup_profile_folder = Defaults().backup_profile_folder;
-    EnsureOfficialProfile(config_);
+    for (const auto& location : DetectUhdRoots(DetectOs())) {
+      UhdRoot root;
+      root.name = location.name;
+      root.uhd_dir = location.uhd_dir;
+      root.images_folder_name = location.images_folder_name;
+      config_.roots.push_back(std::move(root));
+    }
     NormalizeProfiles(config_);
     return Save(error);
   }
@@ -92,6 +291,7 @@ bool ConfigManager::Load(std::string* error) {
 
   std::string content((std::istreambuf_iterator<char>(input)),
                       std::istreambuf_iterator<char>());
+  const std::uint64_t disk_hash = HashContent(content);
   json_min::Value root;
   try {
     json_min::Parser parser(std::move(content));
@@ -115,11 +315,6 @@ bool ConfigManager::Load(std::string* error) {
   AppConfig cfg;
   cfg.schema_version =
       GetInt(root_obj, "schema_version", Defaults().schema_version);
-  cfg.uhd_dir = GetString(root_obj, "uhd_dir",
-                          GetUhdDirByOs(DetectOs()).string());
-  cfg.images_folder_name =
-      GetString(root_obj, "images_folder_name",
-                GetImagesFolderName(UhdVersion::kDefault));
   cfg.idle_profile_prefix =
       GetString(root_obj, "idle_profile_prefix", Defaults().idle_profile_prefix);
   cfg.official_profile_folder =
@@ -127,52 +322,118 @@ bool ConfigManager::Load(std::string* error) {
                                           Defaults().official_profile_folder);
   cfg.backup_profile_folder = GetString(root_obj, "backup_profile_folder",
                                         Defaults().backup_profile_folder);
-  cfg.active_profile_id = GetString(root_obj, "active_profile_id", "");
+  cfg.current_root = GetString(root_obj, "current_root", "");
+  cfg.idle_budget_bytes = static_cast<std::uint64_t>(
+      std::max<std::int64_t>(GetInt64(root_obj, "idle_budget_bytes", 0), 0));
+  ParseActivationMode(GetString(root_obj, "activation_mode", ""),
+                      &cfg.activation_mode);
+  cfg.io_bytes_per_second = static_cast<std::uint64_t>(
+      std::max<std::int64_t>(GetInt64(root_obj, "io_bytes_per_second", 0), 0));
+  cfg.io_ops_per_second = static_cast<std::uint64_t>(
+      std::max<std::int64_t>(GetInt64(root_obj, "io_ops_per_second", 0), 0));
+  cfg.background_idle_priority =
+      GetBool(root_obj, "background_idle_priority", false);
 
-  const auto* profiles_value = GetObjectValue(root_obj, "profiles");
-  if (profiles_value && profiles_value->IsArray()) {
-    for (const auto& item : *profiles_value->AsArray()) {
+  const auto* roots_value = GetObjectValue(root_obj, "roots");
+  if (roots_value && roots_value->IsArray()) {
+    for (const auto& item : *roots_value->AsArray()) {
       if (!item.IsObject()) {
         continue;
       }
-      Profile profile = ParseProfile(*item.AsObject(), cfg);
-      if (!profile.id.empty()) {
-        cfg.profiles.push_back(std::move(profile));
+      UhdRoot uhd_root = ParseRoot(*item.AsObject(), cfg);
+      if (!uhd_root.name.empty() && !uhd_root.uhd_dir.empty()) {
+        cfg.roots.push_back(std::move(uhd_root));
       }
     }
+  } else {
+    cfg.roots.push_back(ParseLegacyRoot(root_obj, cfg));
   }
 
+  const auto* groups_value = GetObjectValue(root_obj, "groups");
+  if (groups_value && groups_value->IsArray()) {
+    for (const auto& item : *groups_value->AsArray()) {
+      if (!item.IsObject()) {
+        continue;
+      }
+      ProfileGroup group = ParseGroup(*item.AsObject());
+      if (!group.name.empty()) {
+        cfg.groups.push_back(std::move(group));
+      }
+    }
+  }
+  cfg.schema_version = std::max(cfg.schema_version, Defaults().schema_version);
+
   config_ = std::move(cfg);
-  EnsureOfficialProfile(config_);
+  saved_hash_ = disk_hash;
   NormalizeProfiles(config_);
-  if (config_.active_profile_id.empty()) {
-    config_.active_profile_id = "official";
-  }
   return true;
 }
 
-bool ConfigManager::Save(std::string* error) const {
+std::string ConfigManager::Serialize() const {
   json_min::Object root_obj;
   root_obj.emplace("schema_version",
                    json_min::Value(static_cast<double>(config_.schema_version)));
-  root_obj.emplace("uhd_dir", json_min::Value(config_.uhd_dir.string()));
-  root_obj.emplace("images_folder_name",
-                   json_min::Value(config_.images_folder_name));
   root_obj.emplace("idle_profile_prefix",
                    json_min::Value(config_.idle_profile_prefix));
   root_obj.emplace("official_profile_folder",
                    json_min::Value(config_.official_profile_folder));
   root_obj.emplace("backup_profile_folder",
                    json_min::Value(config_.backup_profile_folder));
-  root_obj.emplace("active_profile_id",
-                   json_min::Value(config_.active_profile_id));
+  root_obj.emplace("current_root", json_min::Value(config_.current_root));
+  root_obj.emplace("idle_budget_bytes",
+                   json_min::Value(static_cast<double>(config_.idle_budget_bytes)));
+  root_obj.emplace(
+      "activation_mode",
+      json_min::Value(std::string(ActivationModeName(config_.activation_mode))));
+  root_obj.emplace("io_bytes_per_second",
+                   json_min::Value(static_cast<double>(config_.io_bytes_per_second)));
+  root_obj.emplace("io_ops_per_second",
+                   json_min::Value(static_cast<double>(config_.io_ops_per_second)));
+  root_obj.emplace("background_idle_priority",
+                   json_min::Value(config_.background_idle_priority));
+
+  json_min::Array roots;
+  roots.reserve(config_.roots.size());
+  for (const auto& uhd_root : config_.roots) {
+    roots.push_back(RootToJson(uhd_root));
+  }
+  root_obj.emplace("roots", json_min::Value(std::move(roots)));
+
+  json_min::Array groups;
+  groups.reserve(config_.groups.size());
+  for (const auto& group : config_.groups) {
+    groups.push_back(GroupToJson(group));
+  }
+  root_obj.emplace("groups", json_min::Value(std::move(groups)));
+
+  json_min::Value root(std::move(root_obj));
+  return json_min::Serialize(root, 2) + '\n';
+}
+
+bool ConfigManager::IsDirty() const {
+  if (!saved_hash_) {
+    return true;
+  }
+  return HashContent(Serialize()) != *saved_hash_;
+}
 
-  json_min::Array profiles;
-  profiles.reserve(config_.profiles.size());
-  for (const auto& profile : config_.profiles) {
-    profiles.push_back(ProfileToJson(profile));
+bool ConfigManager::ChangedOnDisk() const {
+  std::ifstream input(path_);
+  if (!input.is_open()) {
+    return saved_hash_.has_value();
+  }
+  std::string content((std::istreambuf_iterator<char>(input)),
+                      std::istreambuf_iterator<char>());
+  return !saved_hash_ || HashContent(content) != *saved_hash_;
+}
+
+bool ConfigManager::Save(std::string* error) const {
+  UHD_TRACE_SCOPE("ConfigManager::Save");
+  const std::string content = Serialize();
+  const std::uint64_t hash = HashContent(content);
+  if (saved_hash_ && *saved_hash_ == hash && FileUtil::Exists(path_)) {
+    return true;
   }
-  root_obj.emplace("profiles", json_min::Value(std::move(profiles)));
 
   std::error_code ec;
   std::filesystem::create_directories(path_.parent_path(), ec);
@@ -184,11 +445,42 @@ bool ConfigManager::Save(std::string* error) const {
     }
     return false;
   }
-  json_min::Value root(std::move(root_obj));
-  output << json_min::Serialize(root, 2) << '\n';
+  output << content;
+  output.close();
+  if (output.fail()) {
+    if (error) {
+      *error = "Failed to write config file: " + path_.string();
+    }
+    return false;
+  }
+  saved_hash_ = hash;
   return true;
 }
 
+const char* ActivationModeName(ActivationMode mode) {
+  switch (mode) {
+    case ActivationMode::kRename:
+      return "rename";
+    case ActivationMode::kSymlink:
+      return "symlink";
+    case ActivationMode::kHardlinks:
+      return "hardlinks";
+  }
+  return "unknown";
+}
+
+bool ParseActivationMode(const std::string& name, ActivationMode* mode) {
+  for (const ActivationMode candidate :
+       {ActivationMode::kRename, ActivationMode::kSymlink,
+        ActivationMode::kHardlinks}) {
+    if (name == ActivationModeName(candidate)) {
+      *mode = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
 std::filesystem::path DefaultConfigPath() {
   const char* xdg = std::getenv("XDG_CONFIG_HOME");
   const char* home = std::getenv("HOME");
@@ -203,8 +495,56 @@ std::filesystem::path DefaultConfigPath() {
   return base / "uhd-helper" / "config.json";
 }
 
-Profile* FindProfileById(AppConfig& config, const std::string& id) {
-  for (auto& profile : config.profiles) {
+UhdRoot* FindRootByName(AppConfig& config, const std::string& name) {
+  for (auto& root : config.roots) {
+    if (root.name == name) {
+      return &root;
+    }
+  }
+  return nullptr;
+}
+
+const UhdRoot* FindRootByName(const AppConfig& config,
+                              const std::string& name) {
+  for (const auto& root : config.roots) {
+    if (root.name == name) {
+      return &root;
+    }
+  }
+  return nullptr;
+}
+
+UhdRoot& CurrentRoot(AppConfig& config) {
+  UhdRoot* root = FindRootByName(config, config.current_root);
+  return root ? *root : config.roots.front();
+}
+
+const UhdRoot& CurrentRoot(const AppConfig& config) {
+  const UhdRoot* root = FindRootByName(config, config.current_root);
+  return root ? *root : config.roots.front();
+}
+
+ProfileGroup* FindGroupByName(AppConfig& config, const std::string& name) {
+  for (auto& group : config.groups) {
+    if (group.name == name) {
+      return &group;
+    }
+  }
+  return nullptr;
+}
+
+const ProfileGroup* FindGroupByName(const AppConfig& config,
+                                    const std::string& name) {
+  for (const auto& group : config.groups) {
+    if (group.name == name) {
+      return &group;
+    }
+  }
+  return nullptr;
+}
+
+Profile* FindProfileById(UhdRoot& root, const std::string& id) {
+  for (auto& profile : root.profiles) {
     if (profile.id == id) {
       return &profile;
     }
@@ -212,8 +552,8 @@ Profile* FindProfileById(AppConfig& config, const std::string& id) {
   return nullptr;
 }
 
-const Profile* FindProfileById(const AppConfig& config, const std::string& id) {
-  for (const auto& profile : config.profiles) {
+const Profile* FindProfileById(const UhdRoot& root, const std::string& id) {
+  for (const auto& profile : root.profiles) {
     if (profile.id == id) {
       return &profile;
     }
@@ -221,15 +561,15 @@ const Profile* FindProfileById(const AppConfig& config, const std::string& id) {
   return nullptr;
 }
 
-void EnsureOfficialProfile(AppConfig& config) {
-  Profile* existing = FindProfileById(config, "official");
+void EnsureOfficialProfile(const AppConfig& config, UhdRoot& root) {
+  Profile* existing = FindProfileById(root, "official");
   if (!existing) {
     Profile official;
     official.id = "official";
     official.display_name = "NI Official";
     official.folder_name = config.official_profile_folder;
     official.is_official = true;
-    config.profiles.push_back(std::move(official));
+    root.profiles.push_back(std::move(official));
     return;
   }
   existing->folder_name = config.official_profile_folder;
@@ -240,32 +580,85 @@ void EnsureOfficialProfile(AppConfig& config) {
 }
 
 void NormalizeProfiles(AppConfig& config) {
-  std::unordered_set<std::string> seen_ids;
-  std::vector<Profile> normalized;
-  normalized.reserve(config.profiles.size());
+  if (config.roots.empty()) {
+    UhdRoot root;
+    root.name = Defaults().default_root_name;
+    root.uhd_dir = GetUhdDirByOs(DetectOs());
+    root.images_folder_name = GetImagesFolderName(UhdVersion::kDefault);
+    config.roots.push_back(std::move(root));
+  }
+  if (!FindRootByName(config, config.current_root)) {
+    config.current_root = config.roots.front().name;
+  }
 
-  for (auto& profile : config.profiles) {
-    if (profile.id.empty()) {
-      continue;
+  for (auto& root : config.roots) {
+    EnsureOfficialProfile(config, root);
+    if (root.images_folder_name.empty()) {
+      root.images_folder_name = GetImagesFolderName(UhdVersion::kDefault);
     }
-    if (seen_ids.count(profile.id) > 0) {
-      continue;
+    if (root.active_profile_id.empty()) {
+      root.active_profile_id = "official";
     }
-    seen_ids.insert(profile.id);
-    if (profile.display_name.empty()) {
-      profile.display_name = profile.id;
+
+    // Later duplicates of an id are found by sorting views of the ids, then
+    // dropped while compacting in place, so a clean list costs two
+    // allocations instead of one per profile.
+    auto& profiles = root.profiles;
+    std::vector<std::pair<std::string_view, std::size_t>> ids;
+    ids.reserve(profiles.size());
+    for (std::size_t i = 0; i < profiles.size(); ++i) {
+      ids.emplace_back(profiles[i].id, i);
     }
-    if (profile.folder_name.empty()) {
-      if (profile.is_official) {
-        profile.folder_name = config.official_profile_folder;
-      } else {
-        profile.folder_name = config.idle_profile_prefix + profile.id;
+    std::sort(ids.begin(), ids.end());
+    std::vector<char> drop(profiles.size(), 0);
+    for (std::size_t k = 0; k < ids.size(); ++k) {
+      if (ids[k].first.empty() ||
+          (k > 0 && ids[k].first == ids[k - 1].first)) {
+        drop[ids[k].second] = 1;
       }
     }
-    normalized.push_back(std::move(profile));
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < profiles.size(); ++i) {
+      if (drop[i]) {
+        continue;
+      }
+      if (kept != i) {
+        profiles[kept] = std::move(profiles[i]);
+      }
+      Profile& profile = profiles[kept++];
+      if (profile.display_name.empty()) {
+        profile.display_name = profile.id;
+      }
+      if (profile.folder_name.empty()) {
+        if (profile.is_official) {
+          profile.folder_name = config.official_profile_folder;
+        } else {
+          profile.folder_name = config.idle_profile_prefix + profile.id;
+        }
+      }
+    }
+    profiles.erase(profiles.begin() + static_cast<std::ptrdiff_t>(kept),
+                   profiles.end());
   }
 
-  config.profiles = std::move(normalized);
+  for (auto& group : config.groups) {
+    std::vector<GroupMember> members;
+    members.reserve(group.members.size());
+    for (auto& member : group.members) {
+      const UhdRoot* root = FindRootByName(config, member.root);
+      if (!root || !FindProfileById(*root, member.profile_id)) {
+        continue;
+      }
+      const bool duplicate =
+          std::any_of(members.begin(), members.end(), [&](const auto& m) {
+            return m.root == member.root && m.profile_id == member.profile_id;
+          });
+      if (!duplicate) {
+        members.push_back(std::move(member));
+      }
+    }
+    group.members = std::move(members);
+  }
 }
 
 }  // namespace uhd_helper
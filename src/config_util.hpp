@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cstdint>
 #include <filesystem>
+#include <optional>
 #include <string>
 #include <vector>
 
@@ -8,15 +10,67 @@
 
 namespace uhd_helper {
 
-struct AppConfig {
-  int schema_version = 1;
+// One switch of a root's active profile. manifest_sha256 is the digest of
+// the activated profile's manifest file at that moment, empty if it had
+// none, so a later revert can tell whether the content has changed since.
+struct Activation {
+  std::string profile_id;
+  std::string previous_id;
+  std::int64_t time = 0;
+  std::string manifest_sha256;
+};
+
+struct UhdRoot {
+  std::string name;
   std::filesystem::path uhd_dir;
   std::string images_folder_name;
+  std::string active_profile_id;
+  std::vector<Profile> profiles;
+  // Oldest first, at most Defaults().activation_history_limit entries.
+  std::vector<Activation> history;
+};
+
+struct GroupMember {
+  std::string root;
+  std::string profile_id;
+};
+
+struct ProfileGroup {
+  std::string name;
+  std::vector<GroupMember> members;
+};
+
+// How a root's images folder holds the active profile. kRename moves the
+// profile folder into images; kSymlink leaves every profile folder in place
+// and points images at the active one, so a switch is one rename of a
+// link. kHardlinks also leaves the folders in place and fills images with
+// hardlinks to the active one's files, which are kept read-only.
+enum class ActivationMode {
+  kRename,
+  kSymlink,
+  kHardlinks,
+};
+
+const char* ActivationModeName(ActivationMode mode);
+bool ParseActivationMode(const std::string& name, ActivationMode* mode);
+
+struct AppConfig {
+  int schema_version = 2;
   std::string idle_profile_prefix;
   std::string official_profile_folder;
   std::string backup_profile_folder;
-  std::string active_profile_id;
-  std::vector<Profile> profiles;
+  std::string current_root;
+  // Upper bound for the idle profiles of each root; least recently used
+  // ones are packed once it is exceeded. 0 disables eviction.
+  std::uint64_t idle_budget_bytes = 0;
+  ActivationMode activation_mode = ActivationMode::kRename;
+  // Token-bucket limits for bulk copy, delete, hash and prewarm I/O, 0 for
+  // unlimited, and whether worker threads run at idle I/O priority.
+  std::uint64_t io_bytes_per_second = 0;
+  std::uint64_t io_ops_per_second = 0;
+  bool background_idle_priority = false;
+  std::vector<UhdRoot> roots;
+  std::vector<ProfileGroup> groups;
 };
 
 class ConfigManager {
@@ -24,21 +78,37 @@ class ConfigManager {
   explicit ConfigManager(std::filesystem::path path);
 
   bool Load(std::string* error);
+  // Writes config.json only when the serialized content differs from what
+  // was last read from or written to disk.
   bool Save(std::string* error) const;
+  bool IsDirty() const;
+  // True when config.json no longer holds what this manager last read or
+  // wrote, i.e. someone else edited it.
+  bool ChangedOnDisk() const;
 
   AppConfig& config() { return config_; }
   const AppConfig& config() const { return config_; }
   const std::filesystem::path& path() const { return path_; }
 
  private:
+  std::string Serialize() const;
+
   std::filesystem::path path_;
   AppConfig config_;
+  mutable std::optional<std::uint64_t> saved_hash_;
 };
 
 std::filesystem::path DefaultConfigPath();
-Profile* FindProfileById(AppConfig& config, const std::string& id);
-const Profile* FindProfileById(const AppConfig& config, const std::string& id);
-void EnsureOfficialProfile(AppConfig& config);
+UhdRoot* FindRootByName(AppConfig& config, const std::string& name);
+const UhdRoot* FindRootByName(const AppConfig& config, const std::string& name);
+UhdRoot& CurrentRoot(AppConfig& config);
+const UhdRoot& CurrentRoot(const AppConfig& config);
+Profile* FindProfileById(UhdRoot& root, const std::string& id);
+const Profile* FindProfileById(const UhdRoot& root, const std::string& id);
+ProfileGroup* FindGroupByName(AppConfig& config, const std::string& name);
+const ProfileGroup* FindGroupByName(const AppConfig& config,
+                                    const std::string& name);
+void EnsureOfficialProfile(const AppConfig& config, UhdRoot& root);
 void NormalizeProfiles(AppConfig& config);
 
 }  // namespace uhd_helper
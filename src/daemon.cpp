@@ -0,0 +1,592 @@
+#include "daemon.hpp"
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "config_util.hpp"
+#include "ipc_util.hpp"
+#include "manifest_util.hpp"
+#include "profile_util.hpp"
+#include "res.hpp"
+#include "throttle_util.hpp"
+
+namespace uhd_helper {
+namespace {
+
+constexpr int kWatchDebounceMs = 200;
+
+std::string GetField(const json_min::Object& obj, const char* key) {
+  auto it = obj.find(key);
+  if (it == obj.end() || !it->second.IsString()) {
+    return "";
+  }
+  return *it->second.AsString();
+}
+
+json_min::Value Reply(bool ok, const std::string& error) {
+  json_min::Object obj;
+  obj.emplace("ok", json_min::Value(ok));
+  if (!ok) {
+    obj.emplace("error", json_min::Value(error));
+  }
+  return json_min::Value(std::move(obj));
+}
+
+}  // namespace
+
+Daemon::Daemon(ProfileManager* manager, std::filesystem::path socket_path)
+    : manager_(manager),
+      socket_path_(std::move(socket_path)),
+      index_(manager->IndexPath()) {}
+
+Daemon::~Daemon() {
+  for (int fd : {listen_fd_, stop_pipe_[0], stop_pipe_[1], inotify_fd_}) {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+}
+
+void Daemon::Stop() {
+  stopping_.store(true);
+  if (stop_pipe_[1] >= 0) {
+    const char byte = 1;
+    [[maybe_unused]] ssize_t n = ::write(stop_pipe_[1], &byte, 1);
+  }
+}
+
+bool Daemon::Listen(std::string* error) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (socket_path_.string().size() >= sizeof(addr.sun_path)) {
+    if (error) {
+      *error = "Socket path too long: " + socket_path_.string();
+    }
+    return false;
+  }
+  std::strncpy(addr.sun_path, socket_path_.c_str(), sizeof(addr.sun_path) - 1);
+
+  json_min::Value probe_response;
+  json_min::Object ping;
+  ping.emplace("op", json_min::Value(std::string("ping")));
+  if (SendRequest(socket_path_, json_min::Value(std::move(ping)),
+                  &probe_response, nullptr)) {
+    if (error) {
+      *error = "A daemon is already listening on " + socket_path_.string();
+    }
+    return false;
+  }
+  ::unlink(socket_path_.c_str());
+
+  listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd_ < 0 ||
+      ::bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) !=
+          0 ||
+      ::chmod(socket_path_.c_str(), 0600) != 0 ||
+      ::listen(listen_fd_, 16) != 0) {
+    if (error) {
+      *error = "Failed to listen on " + socket_path_.string() + ": " +
+               std::strerror(errno);
+    }
+    return false;
+  }
+  return true;
+}
+
+bool Daemon::Run(std::string* error) {
+  if (::pipe2(stop_pipe_, O_CLOEXEC) != 0) {
+    if (error) {
+      *error = std::string("Failed to create pipe: ") + std::strerror(errno);
+    }
+    return false;
+  }
+  if (!Listen(error)) {
+    return false;
+  }
+  inotify_fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  RebuildWatches();
+  std::thread watcher([this] { WatchLoop(); });
+
+  while (!stopping_.load()) {
+    pollfd fds[2] = {{listen_fd_, POLLIN, 0}, {stop_pipe_[0], POLLIN, 0}};
+    if (::poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (fds[1].revents != 0) {
+      break;
+    }
+    if ((fds[0].revents & POLLIN) == 0) {
+      continue;
+    }
+    const int client = ::accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client < 0) {
+      continue;
+    }
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    for (const std::uint64_t finished : finished_connections_) {
+      auto it = connection_threads_.find(finished);
+      if (it != connection_threads_.end()) {
+        it->second.join();
+        connection_threads_.erase(it);
+      }
+    }
+    finished_connections_.clear();
+    const std::uint64_t connection = next_connection_++;
+    connection_fds_.insert(client);
+    std::thread thread(
+        [this, client, connection] { ServeConnection(client, connection); });
+    connection_threads_.emplace(connection, std::move(thread));
+  }
+
+  Stop();
+  {
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    for (int fd : connection_fds_) {
+      ::shutdown(fd, SHUT_RDWR);
+    }
+  }
+  for (auto& [connection, thread] : connection_threads_) {
+    thread.join();
+  }
+  watcher.join();
+  ::unlink(socket_path_.c_str());
+  return true;
+}
+
+void Daemon::ServeConnection(int fd, std::uint64_t connection) {
+  // Requests run bulk I/O on this thread; keep it behind the UHD streams.
+  Throttle::Instance().EnterBackground();
+  while (!stopping_.load()) {
+    json_min::Value request;
+    std::string error;
+    if (!ReadMessage(fd, &request, &error)) {
+      if (!error.empty()) {
+        WriteMessage(fd, Reply(false, error), nullptr);
+      }
+      break;
+    }
+    if (!WriteMessage(fd, Handle(request), nullptr)) {
+      break;
+    }
+  }
+  std::lock_guard<std::mutex> lock(connections_mutex_);
+  connection_fds_.erase(fd);
+  finished_connections_.push_back(connection);
+  ::close(fd);
+}
+
+json_min::Value Daemon::Handle(const json_min::Value& request) {
+  const auto* obj = request.AsObject();
+  if (!obj) {
+    return Reply(false, "Request is not an object");
+  }
+  const std::string op = GetField(*obj, "op");
+  const std::string id = GetField(*obj, "id");
+  const std::string name = GetField(*obj, "name");
+  const std::string group = GetField(*obj, "group");
+  std::string error;
+
+  if (op == "ping") {
+    return Reply(true, "");
+  }
+  if (op == "list") {
+    std::shared_lock<std::shared_mutex> lock(state_mutex_);
+    return ListState();
+  }
+  if (op == "diff") {
+    std::shared_lock<std::shared_mutex> lock(state_mutex_);
+    ManifestDiff diff;
+    if (!manager_->CompareProfiles(id, GetField(*obj, "other"), &diff,
+                                   &error)) {
+      return Reply(false, error);
+    }
+    const auto to_array = [](const std::vector<std::string>& paths) {
+      json_min::Array array;
+      for (const auto& path : paths) {
+        array.push_back(json_min::Value(path));
+      }
+      return json_min::Value(std::move(array));
+    };
+    json_min::Value reply = Reply(true, "");
+    auto& reply_obj = std::get<json_min::Object>(reply.storage);
+    reply_obj.emplace("identical", json_min::Value(diff.empty()));
+    reply_obj.emplace("added", to_array(diff.added));
+    reply_obj.emplace("removed", to_array(diff.removed));
+    reply_obj.emplace("changed", to_array(diff.changed));
+    return reply;
+  }
+  if (op == "index" || op == "query") {
+    std::shared_lock<std::shared_mutex> lock(state_mutex_);
+    std::lock_guard<std::mutex> index_lock(index_mutex_);
+    IndexQuery query;
+    if (op == "query" && !ParseIndexQuery(GetField(*obj, "expr"), &query)) {
+      return Reply(false, "Unknown query term");
+    }
+    IndexStats stats;
+    if ((!index_loaded_ && !index_.Load(&error)) ||
+        !manager_->UpdateIndex(&index_, &stats, &error) ||
+        !index_.Save(&error)) {
+      return Reply(false, error);
+    }
+    index_loaded_ = true;
+    json_min::Value reply = Reply(true, "");
+    auto& reply_obj = std::get<json_min::Object>(reply.storage);
+    if (op == "index") {
+      reply_obj.emplace("files",
+                        json_min::Value(static_cast<double>(stats.files)));
+      reply_obj.emplace(
+          "files_scanned",
+          json_min::Value(static_cast<double>(stats.files_scanned)));
+      return reply;
+    }
+    json_min::Array matches;
+    for (const auto& match : index_.Query(query)) {
+      json_min::Array versions;
+      for (const auto& version : match.file->versions) {
+        versions.push_back(json_min::Value(version));
+      }
+      json_min::Object item;
+      item.emplace("root", json_min::Value(match.profile->root));
+      item.emplace("profile_id", json_min::Value(match.profile->profile_id));
+      item.emplace("path", json_min::Value(match.file->path));
+      item.emplace("device", json_min::Value(match.file->device));
+      item.emplace("kind", json_min::Value(match.file->kind));
+      item.emplace("size",
+                   json_min::Value(static_cast<double>(match.file->size)));
+      item.emplace("sha256", json_min::Value(match.file->sha256));
+      item.emplace("versions", json_min::Value(std::move(versions)));
+      matches.push_back(json_min::Value(std::move(item)));
+    }
+    reply_obj.emplace("matches", json_min::Value(std::move(matches)));
+    return reply;
+  }
+  if (op == "verify" || op == "group_verify") {
+    // A first verify records the baseline manifest and root hash, which
+    // concurrent verifies must not race on; the others only read.
+    std::shared_lock<std::shared_mutex> read_lock(state_mutex_);
+    std::unique_lock<std::shared_mutex> write_lock(state_mutex_,
+                                                   std::defer_lock);
+    if (op == "verify" ? manager_->VerifyRecordsBaseline(id)
+                       : manager_->GroupVerifyRecordsBaseline(group)) {
+      read_lock.unlock();
+      write_lock.lock();
+    }
+    std::string report;
+    const bool ok = op == "verify"
+                        ? manager_->VerifyProfile(id, &report, &error)
+                        : manager_->VerifyGroup(group, &report, &error);
+    if (!ok) {
+      return Reply(false, error);
+    }
+    json_min::Value reply = Reply(true, "");
+    std::get<json_min::Object>(reply.storage)
+        .emplace("report", json_min::Value(report));
+    return reply;
+  }
+
+  if (op == "fsck" || op == "fsck_repair") {
+    const bool repair = op == "fsck_repair";
+    std::shared_lock<std::shared_mutex> read_lock(state_mutex_,
+                                                  std::defer_lock);
+    std::unique_lock<std::shared_mutex> write_lock(state_mutex_,
+                                                   std::defer_lock);
+    if (repair) {
+      write_lock.lock();
+    } else {
+      read_lock.lock();
+    }
+    FsckReport report;
+    const bool ok = manager_->CheckConsistency(repair, &report, &error);
+    if (repair) {
+      RebuildWatches();
+    }
+    json_min::Value reply = Reply(ok, error);
+    auto& reply_obj = std::get<json_min::Object>(reply.storage);
+    reply_obj.emplace("report", json_min::Value(DescribeFsckReport(report)));
+    reply_obj.emplace("issues", json_min::Value(static_cast<double>(
+                                    report.issues.size())));
+    reply_obj.emplace("repaired",
+                      json_min::Value(static_cast<double>(report.repaired)));
+    return reply;
+  }
+
+  std::unique_lock<std::shared_mutex> lock(state_mutex_);
+  if (op == "revert") {
+    std::string report;
+    if (!manager_->RevertActivation(&report, &error)) {
+      return Reply(false, error);
+    }
+    json_min::Value reply = Reply(true, "");
+    std::get<json_min::Object>(reply.storage)
+        .emplace("report", json_min::Value(report));
+    return reply;
+  }
+  if (op == "apply") {
+    ApplyStrategy strategy = ApplyStrategy::kRename;
+    if (!manager_->ApplyProfile(id, &strategy, &error)) {
+      return Reply(false, error);
+    }
+    RebuildWatches();
+    json_min::Value reply = Reply(true, "");
+    std::get<json_min::Object>(reply.storage)
+        .emplace("strategy",
+                 json_min::Value(std::string(ApplyStrategyName(strategy))));
+    return reply;
+  }
+  if (op == "dedup_roots") {
+    std::uint64_t saved = 0;
+    if (!manager_->DeduplicateRoots(&saved, &error)) {
+      return Reply(false, error);
+    }
+    json_min::Value reply = Reply(true, "");
+    std::get<json_min::Object>(reply.storage)
+        .emplace("bytes_saved", json_min::Value(static_cast<double>(saved)));
+    return reply;
+  }
+  bool ok = false;
+  if (op == "apply_all") {
+    ok = manager_->ApplyProfileToAllRoots(id, &error);
+  } else if (op == "add") {
+    ok = manager_->AddProfileFromActive(name, &error);
+  } else if (op == "snapshot") {
+    ok = manager_->SnapshotActive(name, nullptr, &error);
+  } else if (op == "import") {
+    // Only files the daemon can open itself; stdin imports run locally.
+    const std::string path = GetField(*obj, "path");
+    ok = !path.empty() && path != "-" &&
+         manager_->ImportArchive(name, path, nullptr, &error);
+    if (!ok && error.empty()) {
+      error = "import needs an archive path";
+    }
+  } else if (op == "export") {
+    const std::string path = GetField(*obj, "path");
+    ok = !path.empty() && path != "-" &&
+         manager_->ExportProfile(id, path, GetField(*obj, "have"), nullptr,
+                                 &error);
+    if (!ok && error.empty()) {
+      error = "export needs an output path";
+    }
+  } else if (op == "import_bundle") {
+    const std::string path = GetField(*obj, "path");
+    ok = !path.empty() && path != "-" &&
+         manager_->ImportBundle(path, nullptr, &error);
+    if (!ok && error.empty()) {
+      error = "import_bundle needs a bundle path";
+    }
+  } else if (op == "rehash") {
+    ok = manager_->RehashProfile(id, nullptr, &error);
+  } else if (op == "set_uhd_version") {
+    ok = manager_->SetProfileUhdVersion(id, GetField(*obj, "version"), &error);
+  } else if (op == "delete") {
+    ok = manager_->DeleteProfile(id, &error);
+  } else if (op == "enforce_budget") {
+    ok = manager_->EnforceDiskBudget(nullptr, &error);
+  } else if (op == "pack") {
+    ok = manager_->PackProfile(id, &error);
+  } else if (op == "refresh") {
+    ok = manager_->RefreshFromDisk(&error);
+  } else if (op == "select_root") {
+    ok = manager_->SelectRoot(name, &error);
+  } else if (op == "add_root") {
+    const std::string path = GetField(*obj, "path");
+    ok = !path.empty() && manager_->AddRoot(name, path, &error);
+    if (!ok && error.empty()) {
+      error = "add_root needs a UHD directory";
+    }
+  } else if (op == "remove_root") {
+    ok = manager_->RemoveRoot(name, &error);
+  } else if (op == "group_create") {
+    ok = manager_->CreateGroup(group, &error);
+  } else if (op == "group_delete") {
+    ok = manager_->DeleteGroup(group, &error);
+  } else if (op == "group_add") {
+    ok = manager_->AddToGroup(group, id, &error);
+  } else if (op == "group_remove") {
+    ok = manager_->RemoveFromGroup(group, id, &error);
+  } else if (op == "group_apply") {
+    ok = manager_->ApplyGroup(group, &error);
+  } else if (op == "group_delete_profiles") {
+    ok = manager_->DeleteGroupProfiles(group, &error);
+  } else if (op == "group_prewarm") {
+    ok = manager_->PrewarmGroup(group, nullptr, &error);
+  } else {
+    error = "Unknown op: " + op;
+  }
+  if (ok && op != "refresh") {
+    RebuildWatches();
+  }
+  json_min::Value reply = Reply(ok, error);
+  if (ok && (op == "add" || op == "snapshot" || op == "import")) {
+    const std::string& added = manager_->Profiles().back().id;
+    auto& reply_obj = std::get<json_min::Object>(reply.storage);
+    reply_obj.emplace("id", json_min::Value(added));
+    reply_obj.emplace("identical_to",
+                      json_min::Value(manager_->FindIdenticalProfile(added)));
+  }
+  return reply;
+}
+
+json_min::Value Daemon::ListState() const {
+  json_min::Array roots;
+  for (const auto& root : manager_->Roots()) {
+    json_min::Array profiles;
+    for (const auto& profile : root.profiles) {
+      json_min::Object item;
+      item.emplace("id", json_min::Value(profile.id));
+      item.emplace("display_name", json_min::Value(profile.display_name));
+      item.emplace("folder_name", json_min::Value(profile.folder_name));
+      item.emplace("is_official", json_min::Value(profile.is_official));
+      item.emplace("size_bytes",
+                   json_min::Value(static_cast<double>(profile.size_bytes)));
+      item.emplace("last_used",
+                   json_min::Value(static_cast<double>(profile.last_used)));
+      item.emplace("packed", json_min::Value(profile.packed));
+      item.emplace("root_hash", json_min::Value(profile.root_hash));
+      item.emplace("uhd_version", json_min::Value(profile.uhd_version));
+      profiles.push_back(json_min::Value(std::move(item)));
+    }
+    json_min::Object item;
+    item.emplace("name", json_min::Value(root.name));
+    item.emplace("uhd_dir", json_min::Value(root.uhd_dir.string()));
+    item.emplace("uhd_version", json_min::Value(FormatUhdRelease(
+                                    InstalledUhdRelease(root.uhd_dir))));
+    item.emplace("active_profile_id", json_min::Value(root.active_profile_id));
+    item.emplace("current",
+                 json_min::Value(root.name == manager_->CurrentRootName()));
+    item.emplace("profiles", json_min::Value(std::move(profiles)));
+    json_min::Array history;
+    for (const auto& activation : root.history) {
+      json_min::Object entry;
+      entry.emplace("profile_id", json_min::Value(activation.profile_id));
+      entry.emplace("previous_id", json_min::Value(activation.previous_id));
+      entry.emplace("time",
+                    json_min::Value(static_cast<double>(activation.time)));
+      history.push_back(json_min::Value(std::move(entry)));
+    }
+    item.emplace("history", json_min::Value(std::move(history)));
+    roots.push_back(json_min::Value(std::move(item)));
+  }
+  json_min::Array groups;
+  for (const auto& group : manager_->Groups()) {
+    json_min::Array members;
+    for (const auto& member : group.members) {
+      json_min::Object item;
+      item.emplace("root", json_min::Value(member.root));
+      item.emplace("profile_id", json_min::Value(member.profile_id));
+      members.push_back(json_min::Value(std::move(item)));
+    }
+    json_min::Object item;
+    item.emplace("name", json_min::Value(group.name));
+    item.emplace("members", json_min::Value(std::move(members)));
+    groups.push_back(json_min::Value(std::move(item)));
+  }
+  const ThrottleLimits limits = Throttle::Instance().Limits();
+  const ThrottleStats stats = Throttle::Instance().Stats();
+  json_min::Object throttle;
+  throttle.emplace("bytes_per_second", json_min::Value(static_cast<double>(
+                                           limits.bytes_per_second)));
+  throttle.emplace("ops_per_second", json_min::Value(static_cast<double>(
+                                         limits.ops_per_second)));
+  throttle.emplace("idle_priority", json_min::Value(limits.idle_priority));
+  throttle.emplace("bytes", json_min::Value(static_cast<double>(stats.bytes)));
+  throttle.emplace("ops", json_min::Value(static_cast<double>(stats.ops)));
+  throttle.emplace("waits", json_min::Value(static_cast<double>(stats.waits)));
+  throttle.emplace("wait_us",
+                   json_min::Value(static_cast<double>(stats.wait_us)));
+  json_min::Value reply = Reply(true, "");
+  auto& reply_obj = std::get<json_min::Object>(reply.storage);
+  reply_obj.emplace("roots", json_min::Value(std::move(roots)));
+  reply_obj.emplace("throttle", json_min::Value(std::move(throttle)));
+  reply_obj.emplace("groups", json_min::Value(std::move(groups)));
+  return reply;
+}
+
+void Daemon::RebuildWatches() {
+  if (inotify_fd_ < 0) {
+    return;
+  }
+  // Re-adding a watched path returns its existing descriptor, so only
+  // watches for roots that went away are removed.
+  std::vector<int> current;
+  const std::uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                             IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+  for (const auto& root : manager_->Roots()) {
+    const int wd = ::inotify_add_watch(inotify_fd_, root.uhd_dir.c_str(), mask);
+    if (wd >= 0) {
+      current.push_back(wd);
+    }
+  }
+  const int wd = ::inotify_add_watch(
+      inotify_fd_, manager_->ConfigPath().parent_path().c_str(),
+      IN_CLOSE_WRITE | IN_MOVED_TO);
+  if (wd >= 0) {
+    current.push_back(wd);
+  }
+  for (int old_wd : watch_descriptors_) {
+    if (std::find(current.begin(), current.end(), old_wd) == current.end()) {
+      ::inotify_rm_watch(inotify_fd_, old_wd);
+    }
+  }
+  watch_descriptors_ = std::move(current);
+}
+
+void Daemon::WatchLoop() {
+  if (inotify_fd_ < 0) {
+    return;
+  }
+  alignas(inotify_event) char buffer[16 * 1024];
+  bool pending = false;
+  while (!stopping_.load()) {
+    pollfd fds[2] = {{inotify_fd_, POLLIN, 0}, {stop_pipe_[0], POLLIN, 0}};
+    const int ready = ::poll(fds, 2, pending ? kWatchDebounceMs : -1);
+    if (ready < 0 && errno != EINTR) {
+      break;
+    }
+    if (fds[1].revents != 0) {
+      break;
+    }
+    if (ready > 0 && (fds[0].revents & POLLIN) != 0) {
+      ssize_t n;
+      while ((n = ::read(inotify_fd_, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t offset = 0; offset < n;) {
+          const auto* event =
+              reinterpret_cast<const inotify_event*>(buffer + offset);
+          if ((event->mask & IN_IGNORED) == 0) {
+            pending = true;
+          }
+          offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+        }
+      }
+      continue;
+    }
+    if (!pending) {
+      continue;
+    }
+
+    // Quiet for a full debounce window: reconcile once for the whole burst.
+    pending = false;
+    std::unique_lock<std::shared_mutex> lock(state_mutex_);
+    std::string error;
+    if (manager_->ConfigChangedOnDisk()) {
+      manager_->Initialize(&error);
+    } else {
+      manager_->RefreshFromDisk(&error);
+    }
+    RebuildWatches();
+  }
+}
+
+}  // namespace uhd_helper
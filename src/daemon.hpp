@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "index_util.hpp"
+#include "json_min.hpp"
+
+namespace uhd_helper {
+
+class ProfileManager;
+
+// Keeps ProfileManager state in memory and serves it over a Unix socket.
+// Mutating requests take the state lock exclusively; list and verify share
+// it, so read-only clients run concurrently. A verify that records a
+// baseline manifest counts as mutating.
+class Daemon {
+ public:
+  Daemon(ProfileManager* manager, std::filesystem::path socket_path);
+  ~Daemon();
+
+  Daemon(const Daemon&) = delete;
+  Daemon& operator=(const Daemon&) = delete;
+
+  bool Run(std::string* error);
+  // Safe to call from a signal handler.
+  void Stop();
+
+ private:
+  bool Listen(std::string* error);
+  void ServeConnection(int fd, std::uint64_t connection);
+  json_min::Value Handle(const json_min::Value& request);
+  json_min::Value ListState() const;
+  void WatchLoop();
+  void RebuildWatches();
+
+  ProfileManager* manager_;
+  std::filesystem::path socket_path_;
+  mutable std::shared_mutex state_mutex_;
+  int listen_fd_ = -1;
+  int stop_pipe_[2] = {-1, -1};
+  int inotify_fd_ = -1;
+  std::vector<int> watch_descriptors_;
+  // Loaded on the first index or query request; guarded by index_mutex_
+  // on top of the shared state lock.
+  std::mutex index_mutex_;
+  ImageIndex index_;
+  bool index_loaded_ = false;
+  std::atomic<bool> stopping_{false};
+
+  std::mutex connections_mutex_;
+  std::set<int> connection_fds_;
+  // Threads of open connections by number. A thread adds its number to
+  // finished_connections_ on the way out, and the accept loop joins it.
+  std::map<std::uint64_t, std::thread> connection_threads_;
+  std::vector<std::uint64_t> finished_connections_;
+  std::uint64_t next_connection_ = 0;
+};
+
+}  // namespace uhd_helper
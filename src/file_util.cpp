@@ -1,8 +1,713 @@
 #include "file_util.hpp"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <climits>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
 #include <system_error>
+#include <unordered_map>
+
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "hash_util.hpp"
+#include "throttle_util.hpp"
+#include "trace_util.hpp"
+#include "uring_util.hpp"
+#include "walk_util.hpp"
 
 namespace uhd_helper {
+namespace {
+
+// Clones src_fd into dst_fd with FICLONE; false when the filesystem cannot.
+bool TryReflinkFd(int src_fd, int dst_fd) {
+#if defined(__linux__) && defined(FICLONE)
+  UHD_TRACE_COUNT(kSyscalls, 1);
+  return ::ioctl(dst_fd, FICLONE, src_fd) == 0;
+#else
+  (void)src_fd;
+  (void)dst_fd;
+  return false;
+#endif
+}
+
+// Creates dest as a copy-on-write clone of source. Leaves nothing behind on
+// failure so callers can fall back to another strategy.
+bool TryReflink(const std::filesystem::path& source,
+                const std::filesystem::path& dest) {
+  const int src_fd = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+  if (src_fd < 0) {
+    return false;
+  }
+  struct stat st;
+  const bool have_stat = ::fstat(src_fd, &st) == 0;
+  const int dst_fd =
+      ::open(dest.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+             have_stat ? (st.st_mode & 07777) : 0644);
+  bool cloned = false;
+  if (dst_fd >= 0) {
+    cloned = TryReflinkFd(src_fd, dst_fd);
+    ::close(dst_fd);
+    if (!cloned) {
+      ::unlink(dest.c_str());
+    }
+  }
+  ::close(src_fd);
+  UHD_TRACE_COUNT(kSyscalls, 4);
+  return cloned;
+}
+
+std::atomic<IoEngine> g_io_engine{IoEngine::kAuto};
+
+std::atomic<bool> g_preserve_attributes{false};
+
+// Copies length bytes at offset with copy_file_range, dropping to
+// pread/pwrite when the kernel refuses (cross-filesystem on old kernels,
+// special files) or when kernel_copy is off. Stops early at end of file.
+bool CopyRange(int src_fd, int dst_fd, std::uint64_t offset,
+               std::uint64_t length, bool kernel_copy) {
+  Throttle& throttle = Throttle::Instance();
+  const std::uint64_t end = offset + length;
+  auto in = static_cast<off_t>(offset);
+  auto out = static_cast<off_t>(offset);
+  while (kernel_copy && static_cast<std::uint64_t>(in) < end) {
+    const ssize_t n = ::copy_file_range(
+        src_fd, &in, dst_fd, &out,
+        throttle.ChunkSize(static_cast<std::size_t>(std::min<std::uint64_t>(
+            end - static_cast<std::uint64_t>(in), SSIZE_MAX))),
+        0);
+    UHD_TRACE_COUNT(kSyscalls, 1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EXDEV && errno != ENOSYS && errno != EINVAL &&
+          errno != EOPNOTSUPP) {
+        return false;
+      }
+      break;
+    }
+    if (n == 0) {
+      return true;
+    }
+    throttle.Acquire(static_cast<std::uint64_t>(n), 1);
+  }
+
+  char buffer[128 * 1024];
+  while (static_cast<std::uint64_t>(in) < end) {
+    const ssize_t n = ::pread(
+        src_fd, buffer,
+        static_cast<size_t>(std::min<std::uint64_t>(
+            sizeof(buffer), end - static_cast<std::uint64_t>(in))),
+        in);
+    UHD_TRACE_COUNT(kSyscalls, 1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return false;
+    }
+    if (n == 0) {
+      return true;
+    }
+    throttle.Acquire(static_cast<std::uint64_t>(n), 2);
+    for (ssize_t done = 0; done < n;) {
+      const ssize_t w = ::pwrite(dst_fd, buffer + done,
+                                 static_cast<size_t>(n - done), in + done);
+      UHD_TRACE_COUNT(kSyscalls, 1);
+      if (w < 0 && errno == EINTR) {
+        continue;
+      }
+      if (w < 0) {
+        return false;
+      }
+      done += w;
+    }
+    in += n;
+  }
+  return true;
+}
+
+// Fewer allocated blocks than the size calls for means the file has holes.
+bool IsSparse(const struct stat& st) {
+  return static_cast<std::uint64_t>(st.st_blocks) * 512 <
+         static_cast<std::uint64_t>(st.st_size);
+}
+
+// Copies size bytes from src_fd to dst_fd. A sparse source is copied one
+// data extent at a time (SEEK_DATA/SEEK_HOLE) so its holes stay holes in
+// the copy.
+bool CopyFdContents(int src_fd, int dst_fd, const struct stat& st,
+                    bool kernel_copy) {
+  const auto size = static_cast<std::uint64_t>(st.st_size);
+  if (!IsSparse(st)) {
+    return CopyRange(src_fd, dst_fd, 0, size, kernel_copy);
+  }
+  off_t data = 0;
+  while (static_cast<std::uint64_t>(data) < size) {
+    data = ::lseek(src_fd, data, SEEK_DATA);
+    UHD_TRACE_COUNT(kSyscalls, 1);
+    if (data < 0) {
+      if (errno == ENXIO) {
+        // Only a hole is left.
+        break;
+      }
+      // No SEEK_DATA on this filesystem; copy it whole.
+      return CopyRange(src_fd, dst_fd, 0, size, kernel_copy);
+    }
+    off_t hole = ::lseek(src_fd, data, SEEK_HOLE);
+    UHD_TRACE_COUNT(kSyscalls, 1);
+    if (hole < 0) {
+      hole = static_cast<off_t>(size);
+    }
+    if (!CopyRange(src_fd, dst_fd, static_cast<std::uint64_t>(data),
+                   static_cast<std::uint64_t>(hole - data), kernel_copy)) {
+      return false;
+    }
+    data = hole;
+  }
+  // Sets the size past a trailing hole.
+  UHD_TRACE_COUNT(kSyscalls, 1);
+  return ::ftruncate(dst_fd, st.st_size) == 0;
+}
+
+// Copies the extended attributes of src_fd that dst_fd accepts. Names the
+// caller may not set (security.*, trusted.* without privileges) are
+// skipped.
+void CopyXattrs(int src_fd, int dst_fd) {
+  std::vector<char> names(4096);
+  ssize_t length = ::flistxattr(src_fd, names.data(), names.size());
+  if (length < 0 && errno == ERANGE) {
+    length = ::flistxattr(src_fd, nullptr, 0);
+    if (length > 0) {
+      names.resize(static_cast<std::size_t>(length));
+      length = ::flistxattr(src_fd, names.data(), names.size());
+    }
+  }
+  UHD_TRACE_COUNT(kSyscalls, 1);
+  std::vector<char> value;
+  for (ssize_t pos = 0; pos < length;) {
+    const char* name = names.data() + pos;
+    pos += static_cast<ssize_t>(std::strlen(name)) + 1;
+    const ssize_t size = ::fgetxattr(src_fd, name, nullptr, 0);
+    if (size < 0) {
+      continue;
+    }
+    value.resize(static_cast<std::size_t>(size));
+    const ssize_t got = ::fgetxattr(src_fd, name, value.data(), value.size());
+    UHD_TRACE_COUNT(kSyscalls, 3);
+    if (got >= 0) {
+      ::fsetxattr(dst_fd, name, value.data(), static_cast<size_t>(got), 0);
+    }
+  }
+}
+
+// Gives dst_fd the timestamps of st, so manifests and checkpoints that key
+// on size and mtime still match the copy. With attribute preservation on,
+// also the exact mode (not filtered by umask), owner where permitted, and
+// the extended attributes of src_fd.
+void CopyMetadata(int src_fd, int dst_fd, const struct stat& st) {
+  if (g_preserve_attributes.load(std::memory_order_relaxed)) {
+    // Only root may give files away; otherwise the copy stays ours.
+    const int owned = ::fchown(dst_fd, st.st_uid, st.st_gid);
+    (void)owned;
+    ::fchmod(dst_fd, st.st_mode & 07777);
+    CopyXattrs(src_fd, dst_fd);
+    UHD_TRACE_COUNT(kSyscalls, 2);
+  }
+  const struct timespec times[2] = {st.st_atim, st.st_mtim};
+  ::futimens(dst_fd, times);
+  UHD_TRACE_COUNT(kSyscalls, 1);
+}
+
+// CopyMetadata for a file that was written by path, as the io_uring engine
+// and reflinks do.
+void CopyMetadataAt(const std::filesystem::path& source, int dst_root_fd,
+                    const std::string& rel, const struct stat& st) {
+  const int dst_fd = ::openat(dst_root_fd, rel.c_str(),
+                              O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (dst_fd < 0) {
+    return;
+  }
+  const int src_fd =
+      g_preserve_attributes.load(std::memory_order_relaxed)
+          ? ::open(source.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC)
+          : -1;
+  CopyMetadata(src_fd, dst_fd, st);
+  if (src_fd >= 0) {
+    ::close(src_fd);
+  }
+  ::close(dst_fd);
+  UHD_TRACE_COUNT(kSyscalls, 4);
+}
+
+struct TreeCopyCounters {
+  std::atomic<std::uint64_t> files_cloned{0};
+  std::atomic<std::uint64_t> files_copied{0};
+  std::atomic<std::uint64_t> files_resumed{0};
+  std::atomic<std::uint64_t> bytes{0};
+};
+
+std::int64_t MtimeNs(const struct stat& st) {
+  return static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000LL +
+         st.st_mtim.tv_nsec;
+}
+
+constexpr char kCheckpointName[] = ".uhd_helper_checkpoint";
+
+// Append-only log of the files a staged copy has finished, one line each:
+// "<size> <source mtime ns> <sha256 of the copy, or - for a clone> <path>".
+// A line is only written once its file is complete, and a torn last line
+// is ignored, so after a kill every listed file is whole unless the disk
+// lost it, which the hash catches.
+class CopyCheckpoint {
+ public:
+  ~CopyCheckpoint() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  bool Open(const std::filesystem::path& staging, std::string* error) {
+    const auto path = staging / kCheckpointName;
+    std::ifstream in(path, std::ios::binary);
+    std::string line;
+    while (std::getline(in, line)) {
+      if (in.eof()) {
+        break;
+      }
+      std::istringstream fields(line);
+      Record record;
+      std::string rel;
+      fields >> record.size >> record.mtime_ns >> record.sha256;
+      if (fields && fields.get() == ' ' && std::getline(fields, rel) &&
+          !rel.empty()) {
+        records_[rel] = record;
+      }
+    }
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                 0644);
+    if (fd_ < 0) {
+      if (error) {
+        *error = "Failed to open checkpoint in " + staging.string();
+      }
+      return false;
+    }
+    return true;
+  }
+
+  // True when rel was finished by an earlier run from the same source file
+  // and the copy in dst_root_fd still has the recorded size and hash.
+  bool Completed(int dst_root_fd, const std::string& rel,
+                 const struct stat& src) {
+    auto it = records_.find(rel);
+    if (it == records_.end()) {
+      return false;
+    }
+    Record& record = it->second;
+    record.seen = true;
+    struct stat dst;
+    if (record.size != static_cast<std::uint64_t>(src.st_size) ||
+        record.mtime_ns != MtimeNs(src) ||
+        ::fstatat(dst_root_fd, rel.c_str(), &dst, AT_SYMLINK_NOFOLLOW) != 0 ||
+        static_cast<std::uint64_t>(dst.st_size) != record.size) {
+      return false;
+    }
+    if (record.sha256 == "-") {
+      return true;
+    }
+    const int fd =
+        ::openat(dst_root_fd, rel.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    std::string digest;
+    const bool ok = HashFd(fd, &digest, nullptr) && digest == record.sha256;
+    ::close(fd);
+    return ok;
+  }
+
+  // Hashes the finished copy unless it is a clone, which the kernel
+  // completes in one step.
+  void Add(int dst_root_fd, const std::string& rel, const struct stat& src,
+           bool cloned) {
+    std::string digest = "-";
+    if (!cloned) {
+      const int fd = ::openat(dst_root_fd, rel.c_str(),
+                              O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+      if (fd < 0 || !HashFd(fd, &digest, nullptr)) {
+        digest.clear();
+      }
+      if (fd >= 0) {
+        ::close(fd);
+      }
+    }
+    if (digest.empty()) {
+      return;
+    }
+    const std::string line = std::to_string(src.st_size) + " " +
+                             std::to_string(MtimeNs(src)) + " " + digest +
+                             " " + rel + "\n";
+    // O_APPEND keeps concurrent lines whole. A lost line only means the
+    // file is copied again.
+    UHD_TRACE_COUNT(kSyscalls, 1);
+    const ssize_t written = ::write(fd_, line.data(), line.size());
+    (void)written;
+  }
+
+  // Files of an earlier run whose source is gone.
+  void RemoveUnseen(int dst_root_fd) {
+    for (const auto& item : records_) {
+      if (!item.second.seen) {
+        ::unlinkat(dst_root_fd, item.first.c_str(), 0);
+      }
+    }
+  }
+
+ private:
+  struct Record {
+    std::uint64_t size = 0;
+    std::int64_t mtime_ns = 0;
+    std::string sha256;
+    bool seen = false;
+  };
+
+  int fd_ = -1;
+  std::unordered_map<std::string, Record> records_;
+};
+
+// Copies one regular file from (src_dir_fd, name) to (dst_root_fd, rel).
+bool CopyFileAt(int src_dir_fd, const std::string& name, int dst_root_fd,
+                const std::string& rel, bool try_reflink, bool kernel_copy,
+                TreeCopyCounters* counters, CopyCheckpoint* checkpoint,
+                std::string* error) {
+  const int src_fd =
+      ::openat(src_dir_fd, name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (src_fd < 0) {
+    if (error) {
+      *error = "Failed to open " + rel + ": " + std::strerror(errno);
+    }
+    return false;
+  }
+  struct stat st;
+  if (::fstat(src_fd, &st) != 0) {
+    ::close(src_fd);
+    if (error) {
+      *error = "Failed to stat " + rel + ": " + std::strerror(errno);
+    }
+    return false;
+  }
+  const int dst_fd =
+      ::openat(dst_root_fd, rel.c_str(),
+               O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+               st.st_mode & 07777);
+  UHD_TRACE_COUNT(kSyscalls, 3);
+  if (dst_fd < 0) {
+    ::close(src_fd);
+    if (error) {
+      *error = "Failed to create " + rel + ": " + std::strerror(errno);
+    }
+    return false;
+  }
+
+  const auto size = static_cast<std::uint64_t>(st.st_size);
+  bool ok = true;
+  const bool cloned = try_reflink && TryReflinkFd(src_fd, dst_fd);
+  if (cloned) {
+    counters->files_cloned++;
+  } else {
+    ok = CopyFdContents(src_fd, dst_fd, st, kernel_copy);
+    counters->files_copied++;
+    UHD_TRACE_COUNT(kBytesCopied, size);
+  }
+  if (ok) {
+    CopyMetadata(src_fd, dst_fd, st);
+  } else if (error) {
+    *error = "Failed to copy " + rel + ": " + std::strerror(errno);
+  }
+  counters->bytes += size;
+  UHD_TRACE_COUNT(kFilesCopied, 1);
+  ::close(dst_fd);
+  ::close(src_fd);
+  UHD_TRACE_COUNT(kSyscalls, 2);
+  if (ok && checkpoint) {
+    checkpoint->Add(dst_root_fd, rel, st, cloned);
+  }
+  return ok;
+}
+
+bool CopyTree(const std::filesystem::path& from, const std::filesystem::path& to,
+              bool try_reflink, CopyCheckpoint* checkpoint, CloneStats* stats,
+              std::string* error) {
+  std::error_code ec;
+  if (!std::filesystem::is_directory(from, ec)) {
+    if (error) {
+      *error = "Source does not exist: " + from.string();
+    }
+    return false;
+  }
+  std::filesystem::create_directories(to, ec);
+  const int dst_root_fd =
+      ::open(to.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dst_root_fd < 0) {
+    if (error) {
+      *error = "Failed to open destination " + to.string();
+    }
+    return false;
+  }
+
+  // With io_uring the walk only creates directories and symlinks and
+  // collects files; the ring copies them all afterwards.
+  const IoEngine engine = FileUtil::ActiveIoEngine();
+  const bool uring = engine == IoEngine::kIoUring;
+  std::vector<UringCopyJob> jobs;
+  std::vector<std::pair<std::string, struct stat>> job_stats;
+  // Directory times are set last, once nothing more is created in them.
+  std::vector<std::pair<std::string, struct stat>> dir_stats;
+  std::atomic<bool> reflink_ok{try_reflink};
+
+  TreeCopyCounters counters;
+  std::mutex mutex;
+  std::string copy_error;
+  const auto fail = [&](const std::string& message) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (copy_error.empty()) {
+      copy_error = message;
+    }
+    return WalkAction::kStop;
+  };
+
+  WalkOptions options;
+  options.parallel = true;
+  const bool walked = TreeWalker::Walk(
+      from, options,
+      [&](const WalkEntry& entry) {
+        const std::string& rel = *entry.rel_path;
+        switch (entry.type) {
+          case EntryType::kDir: {
+            struct stat st;
+            const bool have_stat =
+                ::fstatat(entry.parent_fd, entry.name->c_str(), &st,
+                          AT_SYMLINK_NOFOLLOW) == 0;
+            const mode_t mode = have_stat ? (st.st_mode & 07777) : 0755;
+            UHD_TRACE_COUNT(kSyscalls, 2);
+            if (::mkdirat(dst_root_fd, rel.c_str(), mode) != 0 &&
+                errno != EEXIST) {
+              return fail("Failed to create directory " + rel);
+            }
+            if (have_stat) {
+              std::lock_guard<std::mutex> lock(mutex);
+              dir_stats.emplace_back(rel, st);
+            }
+            return WalkAction::kContinue;
+          }
+          case EntryType::kSymlink: {
+            char target[4096];
+            const ssize_t n = ::readlinkat(entry.parent_fd,
+                                           entry.name->c_str(), target,
+                                           sizeof(target) - 1);
+            if (n < 0) {
+              return fail("Failed to read symlink " + rel);
+            }
+            target[n] = '\0';
+            ::unlinkat(dst_root_fd, rel.c_str(), 0);
+            UHD_TRACE_COUNT(kSyscalls, 3);
+            if (::symlinkat(target, dst_root_fd, rel.c_str()) != 0) {
+              return fail("Failed to create symlink " + rel);
+            }
+            struct stat st;
+            UHD_TRACE_COUNT(kSyscalls, 2);
+            if (::fstatat(entry.parent_fd, entry.name->c_str(), &st,
+                          AT_SYMLINK_NOFOLLOW) == 0) {
+              const struct timespec times[2] = {st.st_atim, st.st_mtim};
+              ::utimensat(dst_root_fd, rel.c_str(), times,
+                          AT_SYMLINK_NOFOLLOW);
+            }
+            return WalkAction::kContinue;
+          }
+          case EntryType::kFile: {
+            struct stat st;
+            if (uring || checkpoint) {
+              UHD_TRACE_COUNT(kSyscalls, 1);
+              if (::fstatat(entry.parent_fd, entry.name->c_str(), &st,
+                            AT_SYMLINK_NOFOLLOW) != 0) {
+                return fail("Failed to stat " + rel);
+              }
+              if (checkpoint && checkpoint->Completed(dst_root_fd, rel, st)) {
+                counters.files_resumed++;
+                counters.bytes += static_cast<std::uint64_t>(st.st_size);
+                return WalkAction::kContinue;
+              }
+            }
+            // The ring writes every byte, so sparse files take the extent
+            // copy below instead.
+            if (uring && !IsSparse(st)) {
+              const auto size = static_cast<std::uint64_t>(st.st_size);
+              if (reflink_ok.load()) {
+                ::unlinkat(dst_root_fd, rel.c_str(), 0);
+                if (TryReflink(from / rel, to / rel)) {
+                  CopyMetadataAt(from / rel, dst_root_fd, rel, st);
+                  counters.files_cloned++;
+                  counters.bytes += size;
+                  if (checkpoint) {
+                    checkpoint->Add(dst_root_fd, rel, st, true);
+                  }
+                  return WalkAction::kContinue;
+                }
+                // One refusal means the filesystem cannot clone; skip the
+                // attempt for the rest of the tree.
+                reflink_ok.store(false);
+              }
+              std::lock_guard<std::mutex> lock(mutex);
+              jobs.push_back({from / rel, to / rel,
+                              static_cast<std::uint32_t>(st.st_mode & 07777),
+                              size});
+              job_stats.emplace_back(rel, st);
+              return WalkAction::kContinue;
+            }
+            std::string file_error;
+            if (!CopyFileAt(entry.parent_fd, *entry.name, dst_root_fd, rel,
+                            try_reflink,
+                            engine == IoEngine::kCopyFileRange, &counters,
+                            checkpoint, &file_error)) {
+              return fail(file_error);
+            }
+            return WalkAction::kContinue;
+          }
+          case EntryType::kOther:
+            break;
+        }
+        return WalkAction::kContinue;
+      },
+      nullptr, error);
+  if (!walked) {
+    ::close(dst_root_fd);
+    return false;
+  }
+  if (copy_error.empty() && !jobs.empty()) {
+    // Each file is checkpointed as soon as it is closed, so a copy that
+    // fails or is interrupted later still resumes past it.
+    UringCopyFiles(
+        jobs, false,
+        [&](std::size_t index) {
+          const auto& item = job_stats[index];
+          CopyMetadataAt(from / item.first, dst_root_fd, item.first,
+                         item.second);
+          if (checkpoint) {
+            checkpoint->Add(dst_root_fd, item.first, item.second, false);
+          }
+          counters.files_copied++;
+          counters.bytes += jobs[index].size;
+        },
+        nullptr, &copy_error);
+  }
+  if (copy_error.empty() && checkpoint) {
+    checkpoint->RemoveUnseen(dst_root_fd);
+  }
+  if (copy_error.empty()) {
+    for (const auto& item : dir_stats) {
+      const struct timespec times[2] = {item.second.st_atim,
+                                        item.second.st_mtim};
+      ::utimensat(dst_root_fd, item.first.c_str(), times,
+                  AT_SYMLINK_NOFOLLOW);
+    }
+    UHD_TRACE_COUNT(kSyscalls, dir_stats.size());
+  }
+  ::close(dst_root_fd);
+  if (!copy_error.empty()) {
+    if (error) {
+      *error = copy_error;
+    }
+    return false;
+  }
+  if (stats) {
+    stats->files_cloned = counters.files_cloned;
+    stats->files_copied = counters.files_copied;
+    stats->files_resumed = counters.files_resumed;
+    stats->bytes = counters.bytes;
+  }
+  return true;
+}
+
+// Copies into ".<name>.partial" beside to and renames it into place when
+// complete, so to never exists half-written. A staging folder left by an
+// interrupted run is resumed through its checkpoint.
+bool StagedCopyTree(const std::filesystem::path& from,
+                    const std::filesystem::path& to, bool try_reflink,
+                    CloneStats* stats, std::string* error) {
+  if (FileUtil::Exists(to)) {
+    if (error) {
+      *error = "Destination already exists: " + to.string();
+    }
+    return false;
+  }
+  const auto staging = FileUtil::StagingPath(to);
+  std::error_code ec;
+  std::filesystem::create_directories(staging, ec);
+  CopyCheckpoint checkpoint;
+  if (!checkpoint.Open(staging, error) ||
+      !CopyTree(from, staging, try_reflink, &checkpoint, stats, error)) {
+    // Kept for the next attempt.
+    return false;
+  }
+  ::unlink((staging / kCheckpointName).c_str());
+  return FileUtil::Rename(staging, to, error);
+}
+
+}  // namespace
+
+const char* IoEngineName(IoEngine engine) {
+  switch (engine) {
+    case IoEngine::kAuto:
+      return "auto";
+    case IoEngine::kCopyFileRange:
+      return "copy_file_range";
+    case IoEngine::kThreadPool:
+      return "threads";
+    case IoEngine::kIoUring:
+      return "io_uring";
+  }
+  return "unknown";
+}
+
+bool ParseIoEngine(const std::string& name, IoEngine* engine) {
+  for (const IoEngine candidate :
+       {IoEngine::kAuto, IoEngine::kCopyFileRange, IoEngine::kThreadPool,
+        IoEngine::kIoUring}) {
+    if (name == IoEngineName(candidate)) {
+      *engine = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+void FileUtil::SetIoEngine(IoEngine engine) { g_io_engine.store(engine); }
+
+void FileUtil::SetPreserveAttributes(bool preserve) {
+  g_preserve_attributes.store(preserve);
+}
+
+bool FileUtil::PreserveAttributes() { return g_preserve_attributes.load(); }
+
+IoEngine FileUtil::ActiveIoEngine() {
+  const IoEngine engine = g_io_engine.load();
+  if (engine != IoEngine::kAuto && engine != IoEngine::kIoUring) {
+    return engine;
+  }
+  return IoUringAvailable() ? IoEngine::kIoUring : IoEngine::kCopyFileRange;
+}
 
 bool FileUtil::EnsureDir(const std::filesystem::path& dir, std::string* error) {
   std::error_code ec;
@@ -35,13 +740,57 @@ bool FileUtil::IsDir(const std::filesystem::path& path) {
 }
 
 bool FileUtil::RemoveAll(const std::filesystem::path& path, std::string* error) {
-  std::error_code ec;
-  std::filesystem::remove_all(path, ec);
-  if (ec) {
+  UHD_TRACE_SCOPE("FileUtil::RemoveAll");
+  struct stat st;
+  UHD_TRACE_COUNT(kSyscalls, 1);
+  if (::lstat(path.c_str(), &st) != 0) {
+    return errno == ENOENT;
+  }
+  const auto fail = [&]() {
     if (error) {
       *error = "Failed to remove: " + path.string();
     }
     return false;
+  };
+  if (!S_ISDIR(st.st_mode)) {
+    UHD_TRACE_COUNT(kSyscalls, 1);
+    return ::unlink(path.c_str()) == 0 ? true : fail();
+  }
+
+  std::atomic<bool> failed{false};
+  Throttle& throttle = Throttle::Instance();
+  WalkOptions options;
+  options.parallel = true;
+  const bool walked = TreeWalker::Walk(
+      path, options,
+      [&](const WalkEntry& entry) {
+        if (entry.type == EntryType::kDir) {
+          return WalkAction::kContinue;
+        }
+        throttle.Acquire(0, 1);
+        UHD_TRACE_COUNT(kSyscalls, 1);
+        if (::unlinkat(entry.parent_fd, entry.name->c_str(), 0) != 0 &&
+            errno != ENOENT) {
+          failed.store(true);
+          return WalkAction::kStop;
+        }
+        return WalkAction::kContinue;
+      },
+      [&](const WalkEntry& entry) {
+        throttle.Acquire(0, 1);
+        UHD_TRACE_COUNT(kSyscalls, 1);
+        if (::unlinkat(entry.parent_fd, entry.name->c_str(), AT_REMOVEDIR) !=
+                0 &&
+            errno != ENOENT) {
+          failed.store(true);
+          return WalkAction::kStop;
+        }
+        return WalkAction::kContinue;
+      },
+      nullptr);
+  UHD_TRACE_COUNT(kSyscalls, 1);
+  if (!walked || failed.load() || ::rmdir(path.c_str()) != 0) {
+    return fail();
   }
   return true;
 }
@@ -49,8 +798,11 @@ bool FileUtil::RemoveAll(const std::filesystem::path& path, std::string* error)
 bool FileUtil::Rename(const std::filesystem::path& from,
                       const std::filesystem::path& to,
                       std::string* error) {
+  UHD_TRACE_SCOPE("FileUtil::Rename");
   std::error_code ec;
   std::filesystem::rename(from, to, ec);
+  UHD_TRACE_COUNT(kSyscalls, 1);
+  UHD_TRACE_COUNT(kRenames, 1);
   if (ec) {
     if (error) {
       *error = "Failed to rename from " + from.string() + " to " + to.string();
@@ -60,42 +812,438 @@ bool FileUtil::Rename(const std::filesystem::path& from,
   return true;
 }
 
+bool FileUtil::Exchange(const std::filesystem::path& a,
+                        const std::filesystem::path& b, std::string* error) {
+  UHD_TRACE_SCOPE("FileUtil::Exchange");
+  UHD_TRACE_COUNT(kSyscalls, 1);
+  UHD_TRACE_COUNT(kRenames, 1);
+#if defined(SYS_renameat2) && defined(RENAME_EXCHANGE)
+  if (::syscall(SYS_renameat2, AT_FDCWD, a.c_str(), AT_FDCWD, b.c_str(),
+                RENAME_EXCHANGE) == 0) {
+    return true;
+  }
+  if (error) {
+    *error = "Failed to exchange " + a.string() + " and " + b.string() + ": " +
+             std::strerror(errno);
+  }
+#else
+  if (error) {
+    *error = "Atomic exchange is not supported on this system";
+  }
+#endif
+  return false;
+}
+
 bool FileUtil::CopyDir(const std::filesystem::path& from,
                        const std::filesystem::path& to,
                        std::string* error) {
-  std::error_code ec;
-  if (!std::filesystem::exists(from, ec)) {
+  UHD_TRACE_SCOPE("FileUtil::CopyDir");
+  std::string copy_error;
+  if (!StagedCopyTree(from, to, false, nullptr, &copy_error)) {
     if (error) {
-      *error = "Source does not exist: " + from.string();
+      *error = "Failed to copy from " + from.string() + " to " + to.string() +
+               ": " + copy_error;
     }
     return false;
   }
-  std::filesystem::copy(from, to,
-                        std::filesystem::copy_options::recursive |
-                            std::filesystem::copy_options::overwrite_existing,
-                        ec);
-  if (ec) {
+  return true;
+}
+
+bool FileUtil::LinkDir(const std::filesystem::path& from,
+                       const std::filesystem::path& to, std::string* error) {
+  UHD_TRACE_SCOPE("FileUtil::LinkDir");
+  if (Exists(to)) {
+    if (error) {
+      *error = "Destination already exists: " + to.string();
+    }
+    return false;
+  }
+  // Links cost no data, so a leftover staging folder is rebuilt rather
+  // than resumed.
+  const auto staging = StagingPath(to);
+  if (!RemoveAll(staging, error) || !EnsureDir(staging, error)) {
+    return false;
+  }
+  const int dst_root_fd =
+      ::open(staging.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dst_root_fd < 0) {
+    if (error) {
+      *error = "Failed to open destination " + staging.string();
+    }
+    return false;
+  }
+
+  std::mutex mutex;
+  std::string link_error;
+  std::string walk_error;
+  const auto fail = [&](const std::string& message) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (link_error.empty()) {
+      link_error = message + ": " + std::strerror(errno);
+    }
+    return WalkAction::kStop;
+  };
+  WalkOptions options;
+  options.parallel = true;
+  const bool walked = TreeWalker::Walk(
+      from, options,
+      [&](const WalkEntry& entry) {
+        const std::string& rel = *entry.rel_path;
+        UHD_TRACE_COUNT(kSyscalls, 1);
+        switch (entry.type) {
+          case EntryType::kDir: {
+            struct stat st;
+            const mode_t mode =
+                ::fstatat(entry.parent_fd, entry.name->c_str(), &st,
+                          AT_SYMLINK_NOFOLLOW) == 0
+                    ? (st.st_mode & 07777)
+                    : 0755;
+            if (::mkdirat(dst_root_fd, rel.c_str(), mode) != 0) {
+              return fail("Failed to create directory " + rel);
+            }
+            return WalkAction::kContinue;
+          }
+          case EntryType::kSymlink: {
+            char target[4096];
+            const ssize_t n = ::readlinkat(entry.parent_fd,
+                                           entry.name->c_str(), target,
+                                           sizeof(target) - 1);
+            if (n < 0) {
+              return fail("Failed to read symlink " + rel);
+            }
+            target[n] = '\0';
+            if (::symlinkat(target, dst_root_fd, rel.c_str()) != 0) {
+              return fail("Failed to create symlink " + rel);
+            }
+            return WalkAction::kContinue;
+          }
+          default:
+            if (::linkat(entry.parent_fd, entry.name->c_str(), dst_root_fd,
+                         rel.c_str(), 0) != 0) {
+              return fail("Failed to link " + rel);
+            }
+            return WalkAction::kContinue;
+        }
+      },
+      nullptr, &walk_error);
+  ::close(dst_root_fd);
+  if (!walked || !link_error.empty()) {
+    if (link_error.empty()) {
+      link_error = walk_error;
+    }
+    RemoveAll(staging, nullptr);
     if (error) {
-      *error = "Failed to copy from " + from.string() + " to " + to.string();
+      *error = "Failed to link " + from.string() + " into " + to.string() +
+               ": " + link_error;
+    }
+    return false;
+  }
+  return Rename(staging, to, error);
+}
+
+bool FileUtil::SetFilesReadOnly(const std::filesystem::path& dir,
+                                bool read_only, std::string* error) {
+  UHD_TRACE_SCOPE("FileUtil::SetFilesReadOnly");
+  std::mutex mutex;
+  std::string chmod_error;
+  std::string walk_error;
+  WalkOptions options;
+  options.parallel = true;
+  const bool walked = TreeWalker::Walk(
+      dir, options,
+      [&](const WalkEntry& entry) {
+        if (entry.type != EntryType::kFile) {
+          return WalkAction::kContinue;
+        }
+        struct stat st;
+        UHD_TRACE_COUNT(kSyscalls, 1);
+        if (::fstatat(entry.parent_fd, entry.name->c_str(), &st,
+                      AT_SYMLINK_NOFOLLOW) != 0) {
+          return WalkAction::kContinue;
+        }
+        const mode_t mode = read_only
+                                ? (st.st_mode & 07777 & ~mode_t{0222})
+                                : (st.st_mode & 07777) | S_IWUSR;
+        if (mode == (st.st_mode & 07777)) {
+          return WalkAction::kContinue;
+        }
+        UHD_TRACE_COUNT(kSyscalls, 1);
+        if (::fchmodat(entry.parent_fd, entry.name->c_str(), mode, 0) != 0) {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (chmod_error.empty()) {
+            chmod_error = "Failed to change the mode of " + *entry.rel_path +
+                          ": " + std::strerror(errno);
+          }
+          return WalkAction::kStop;
+        }
+        return WalkAction::kContinue;
+      },
+      nullptr, &walk_error);
+  if (!walked || !chmod_error.empty()) {
+    if (error) {
+      *error = chmod_error.empty() ? walk_error : chmod_error;
     }
     return false;
   }
   return true;
 }
 
+std::filesystem::path FileUtil::StagingPath(const std::filesystem::path& to) {
+  return to.parent_path() / ("." + to.filename().string() + kStagingSuffix);
+}
+
 std::vector<std::filesystem::path> FileUtil::ListDirs(
     const std::filesystem::path& parent) {
+  UHD_TRACE_SCOPE("FileUtil::ListDirs");
   std::vector<std::filesystem::path> result;
-  std::error_code ec;
-  if (!std::filesystem::is_directory(parent, ec)) {
+  std::vector<DirEntry> entries;
+  if (!TreeWalker::ReadDir(parent, true, &entries, nullptr)) {
     return result;
   }
-  for (const auto& entry : std::filesystem::directory_iterator(parent, ec)) {
-    if (entry.is_directory(ec)) {
-      result.push_back(entry.path());
+  for (const auto& entry : entries) {
+    if (entry.type == EntryType::kDir) {
+      result.push_back(parent / entry.name);
     }
   }
   return result;
 }
 
+bool FileUtil::SameFilesystem(const std::filesystem::path& a,
+                              const std::filesystem::path& b) {
+  struct stat sa;
+  struct stat sb;
+  if (::stat(a.c_str(), &sa) != 0 || ::stat(b.c_str(), &sb) != 0) {
+    return false;
+  }
+  return sa.st_dev == sb.st_dev;
+}
+
+bool FileUtil::SameMount(const std::filesystem::path& a,
+                         const std::filesystem::path& b) {
+  struct stat sa;
+  struct stat sb;
+  UHD_TRACE_COUNT(kSyscalls, 2);
+  if (::stat(a.c_str(), &sa) != 0 || ::stat(b.c_str(), &sb) != 0 ||
+      sa.st_dev != sb.st_dev) {
+    return false;
+  }
+#if defined(__linux__) && defined(STATX_MNT_ID)
+  struct statx xa;
+  struct statx xb;
+  UHD_TRACE_COUNT(kSyscalls, 2);
+  if (::statx(AT_FDCWD, a.c_str(), 0, STATX_MNT_ID, &xa) == 0 &&
+      ::statx(AT_FDCWD, b.c_str(), 0, STATX_MNT_ID, &xb) == 0 &&
+      (xa.stx_mask & xb.stx_mask & STATX_MNT_ID) != 0) {
+    return xa.stx_mnt_id == xb.stx_mnt_id;
+  }
+#endif
+  return true;
+}
+
+bool FileUtil::IsMountPoint(const std::filesystem::path& path) {
+  struct stat st;
+  UHD_TRACE_COUNT(kSyscalls, 1);
+  if (::lstat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+    return false;
+  }
+  const auto parent =
+      path.has_parent_path() ? path.parent_path() : std::filesystem::path(".");
+  return !SameMount(path, parent);
+}
+
+bool FileUtil::SameInode(const std::filesystem::path& a,
+                         const std::filesystem::path& b) {
+  struct stat sa;
+  struct stat sb;
+  if (::lstat(a.c_str(), &sa) != 0 || ::lstat(b.c_str(), &sb) != 0) {
+    return false;
+  }
+  return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+bool FileUtil::FilesEqual(const std::filesystem::path& a,
+                          const std::filesystem::path& b) {
+  std::error_code ec;
+  const auto size_a = std::filesystem::file_size(a, ec);
+  if (ec) {
+    return false;
+  }
+  const auto size_b = std::filesystem::file_size(b, ec);
+  if (ec || size_a != size_b) {
+    return false;
+  }
+  std::ifstream input_a(a, std::ios::binary);
+  std::ifstream input_b(b, std::ios::binary);
+  if (!input_a.is_open() || !input_b.is_open()) {
+    return false;
+  }
+  char buffer_a[64 * 1024];
+  char buffer_b[64 * 1024];
+  while (input_a && input_b) {
+    input_a.read(buffer_a, sizeof(buffer_a));
+    input_b.read(buffer_b, sizeof(buffer_b));
+    if (input_a.gcount() != input_b.gcount() ||
+        std::memcmp(buffer_a, buffer_b,
+                    static_cast<size_t>(input_a.gcount())) != 0) {
+      return false;
+    }
+  }
+  return input_a.eof() && input_b.eof();
+}
+
+bool FileUtil::ReplaceWithReflink(const std::filesystem::path& source,
+                                  const std::filesystem::path& duplicate,
+                                  std::string* error) {
+  UHD_TRACE_SCOPE("FileUtil::ReplaceWithReflink");
+  struct stat st;
+  if (::stat(duplicate.c_str(), &st) != 0) {
+    if (error) {
+      *error = "Failed to stat " + duplicate.string() + ": " +
+               std::strerror(errno);
+    }
+    return false;
+  }
+  const auto temp = duplicate.parent_path() /
+                    (".uhd_helper_link_" + duplicate.filename().string());
+  ::unlink(temp.c_str());
+  if (!TryReflink(source, temp)) {
+    if (error) {
+      *error = "Cannot reflink " + source.string();
+    }
+    return false;
+  }
+  // The clone takes the duplicate's place, so it keeps its mode and times
+  // and a manifest of the duplicate stays valid.
+  const struct timespec times[2] = {st.st_atim, st.st_mtim};
+  ::chmod(temp.c_str(), st.st_mode & 07777);
+  ::utimensat(AT_FDCWD, temp.c_str(), times, 0);
+  UHD_TRACE_COUNT(kSyscalls, 3);
+  if (::rename(temp.c_str(), duplicate.c_str()) != 0) {
+    ::unlink(temp.c_str());
+    if (error) {
+      *error = "Failed to replace " + duplicate.string();
+    }
+    return false;
+  }
+  UHD_TRACE_COUNT(kRenames, 1);
+  return true;
+}
+
+bool FileUtil::CloneFile(const std::filesystem::path& from,
+                         const std::filesystem::path& to, bool* reflinked,
+                         std::string* error) {
+  std::error_code ec;
+  std::filesystem::remove(to, ec);
+  if (TryReflink(from, to)) {
+    struct stat st;
+    if (::stat(from.c_str(), &st) == 0) {
+      CopyMetadataAt(from, AT_FDCWD, to.string(), st);
+    }
+    if (reflinked) {
+      *reflinked = true;
+    }
+    return true;
+  }
+  if (reflinked) {
+    *reflinked = false;
+  }
+  const int src_fd = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (src_fd < 0 || ::fstat(src_fd, &st) != 0) {
+    if (error) {
+      *error = "Failed to open " + from.string() + ": " + std::strerror(errno);
+    }
+    if (src_fd >= 0) {
+      ::close(src_fd);
+    }
+    return false;
+  }
+  const int dst_fd = ::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                            st.st_mode & 07777);
+  const bool ok = dst_fd >= 0 && CopyFdContents(src_fd, dst_fd, st, true);
+  if (ok) {
+    CopyMetadata(src_fd, dst_fd, st);
+  } else if (error) {
+    *error = "Failed to copy " + from.string() + ": " + std::strerror(errno);
+  }
+  if (dst_fd >= 0) {
+    ::close(dst_fd);
+  }
+  ::close(src_fd);
+  UHD_TRACE_COUNT(kSyscalls, 6);
+  return ok;
+}
+
+bool FileUtil::CloneDir(const std::filesystem::path& from,
+                        const std::filesystem::path& to, CloneStats* stats,
+                        std::string* error) {
+  UHD_TRACE_SCOPE("FileUtil::CloneDir");
+  return StagedCopyTree(from, to, true, stats, error);
+}
+
+bool FileUtil::PrewarmDir(const std::filesystem::path& dir,
+                          std::uint64_t* bytes, std::string* error) {
+  UHD_TRACE_SCOPE("FileUtil::PrewarmDir");
+  if (ActiveIoEngine() == IoEngine::kIoUring) {
+    std::vector<std::filesystem::path> files;
+    if (!TreeWalker::Walk(
+            dir, WalkOptions(),
+            [&](const WalkEntry& entry) {
+              if (entry.type == EntryType::kFile) {
+                files.push_back(dir / *entry.rel_path);
+              }
+              return WalkAction::kContinue;
+            },
+            nullptr, error)) {
+      return false;
+    }
+    return UringReadFiles(files, UringDataFn(), bytes, error);
+  }
+
+  std::atomic<std::uint64_t> total{0};
+  std::mutex error_mutex;
+  std::string warm_error;
+  WalkOptions options;
+  options.parallel = true;
+  const bool walked = TreeWalker::Walk(
+      dir, options,
+      [&](const WalkEntry& entry) {
+        if (entry.type != EntryType::kFile) {
+          return WalkAction::kContinue;
+        }
+        const int fd = ::openat(entry.parent_fd, entry.name->c_str(),
+                                O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          warm_error = "Failed to open " + *entry.rel_path;
+          return WalkAction::kStop;
+        }
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        char buffer[128 * 1024];
+        ssize_t n;
+        while ((n = ::read(fd, buffer, sizeof(buffer))) > 0) {
+          Throttle::Instance().Acquire(static_cast<std::uint64_t>(n), 1);
+          total += static_cast<std::uint64_t>(n);
+          UHD_TRACE_COUNT(kSyscalls, 1);
+        }
+        ::close(fd);
+        UHD_TRACE_COUNT(kSyscalls, 3);
+        return WalkAction::kContinue;
+      },
+      nullptr, error);
+  if (!walked) {
+    return false;
+  }
+  if (!warm_error.empty()) {
+    if (error) {
+      *error = warm_error;
+    }
+    return false;
+  }
+  if (bytes) {
+    *bytes = total;
+  }
+  return true;
+}
+
 }  // namespace uhd_helper
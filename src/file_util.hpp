@@ -1,13 +1,46 @@
 #pragma once
 
+#include <cstdint>
 #include <filesystem>
 #include <string>
 #include <vector>
 
 namespace uhd_helper {
 
+// Backend for bulk copy, hash and prewarm work. kCopyFileRange and
+// kThreadPool both fan files out over walker threads; the first lets the
+// kernel move the bytes, the second streams them through user space.
+// kIoUring drives every file from one thread through a single ring.
+enum class IoEngine {
+  kAuto,
+  kCopyFileRange,
+  kThreadPool,
+  kIoUring,
+};
+
+const char* IoEngineName(IoEngine engine);
+bool ParseIoEngine(const std::string& name, IoEngine* engine);
+
+struct CloneStats {
+  std::uint64_t files_cloned = 0;
+  std::uint64_t files_copied = 0;
+  // Kept from an interrupted earlier run.
+  std::uint64_t files_resumed = 0;
+  std::uint64_t bytes = 0;
+};
+
 class FileUtil {
  public:
+  // kAuto picks io_uring when the kernel allows it and falls back to the
+  // thread pool otherwise; an explicit kIoUring falls back the same way.
+  static void SetIoEngine(IoEngine engine);
+  static IoEngine ActiveIoEngine();
+  // Copies always keep file and directory timestamps and holes in sparse
+  // files. With this on they also keep the exact permission bits, the
+  // owner where the process may set it, and extended attributes.
+  static void SetPreserveAttributes(bool preserve);
+  static bool PreserveAttributes();
+
   static bool EnsureDir(const std::filesystem::path& dir, std::string* error);
   static bool Exists(const std::filesystem::path& path);
   static bool IsDir(const std::filesystem::path& path);
@@ -15,11 +48,62 @@ class FileUtil {
   static bool Rename(const std::filesystem::path& from,
                      const std::filesystem::path& to,
                      std::string* error);
+  // Swaps two existing paths in one step (renameat2 RENAME_EXCHANGE).
+  // Fails where the kernel or filesystem lacks it; callers fall back to
+  // plain renames.
+  static bool Exchange(const std::filesystem::path& a,
+                       const std::filesystem::path& b, std::string* error);
+  // CopyDir and CloneDir fill StagingPath(to) and rename it to to once it
+  // is complete; to must not exist yet. Finished files are checkpointed
+  // with their size and hash, so rerunning an interrupted copy keeps the
+  // files that still check out and copies only the rest.
   static bool CopyDir(const std::filesystem::path& from,
                       const std::filesystem::path& to,
                       std::string* error);
+  // Copy-on-write clone when the filesystem supports reflinks (btrfs, xfs,
+  // bcachefs), a regular copy otherwise.
+  static bool CloneFile(const std::filesystem::path& from,
+                        const std::filesystem::path& to, bool* reflinked,
+                        std::string* error);
+  static bool CloneDir(const std::filesystem::path& from,
+                       const std::filesystem::path& to, CloneStats* stats,
+                       std::string* error);
+  // Recreates from at to with every file hardlinked, staged like CopyDir.
+  // Fails when the two are on different mounts.
+  static bool LinkDir(const std::filesystem::path& from,
+                      const std::filesystem::path& to, std::string* error);
+  // Clears the write bits of every file below dir, or gives the owner
+  // write permission back. Hardlinks share the mode, so every name of a
+  // file changes with it.
+  static bool SetFilesReadOnly(const std::filesystem::path& dir,
+                               bool read_only, std::string* error);
+  static constexpr char kStagingSuffix[] = ".partial";
+  // ".<name>.partial" beside to.
+  static std::filesystem::path StagingPath(const std::filesystem::path& to);
+  // Pulls every file below dir into the page cache.
+  static bool PrewarmDir(const std::filesystem::path& dir,
+                         std::uint64_t* bytes, std::string* error);
   static std::vector<std::filesystem::path> ListDirs(
       const std::filesystem::path& parent);
+  static bool SameFilesystem(const std::filesystem::path& a,
+                             const std::filesystem::path& b);
+  // Stricter than SameFilesystem: link and rename also fail between bind
+  // mounts of one filesystem.
+  static bool SameMount(const std::filesystem::path& a,
+                        const std::filesystem::path& b);
+  // A directory mounted over its parent's filesystem; rename cannot move
+  // it.
+  static bool IsMountPoint(const std::filesystem::path& path);
+  static bool SameInode(const std::filesystem::path& a,
+                        const std::filesystem::path& b);
+  static bool FilesEqual(const std::filesystem::path& a,
+                         const std::filesystem::path& b);
+  // Replaces duplicate with a reflink of source; fails when the filesystem
+  // cannot clone, since a hardlink would let writes to either change both.
+  // The swap is a rename, so duplicate is never missing.
+  static bool ReplaceWithReflink(const std::filesystem::path& source,
+                                 const std::filesystem::path& duplicate,
+                                 std::string* error);
 };
 
 }  // namespace uhd_helper
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+namespace uhd_helper {
+
+class Sha256 {
+ public:
+  Sha256();
+
+  void Update(const void* data, std::size_t size);
+  std::array<std::uint8_t, 32> Digest();
+  std::string HexDigest();
+
+ private:
+  void Transform(const std::uint8_t* block);
+
+  std::uint32_t state_[8];
+  std::uint8_t buffer_[64];
+  std::size_t buffer_size_ = 0;
+  std::uint64_t total_size_ = 0;
+};
+
+std::string ToHex(const std::uint8_t* data, std::size_t size);
+// Hashes from the current offset of fd to EOF; the caller owns fd.
+bool HashFd(int fd, std::string* hex_digest, std::uint64_t* size);
+bool HashFile(const std::filesystem::path& path, std::string* hex_digest,
+              std::uint64_t* size, std::string* error);
+
+}  // namespace uhd_helper
@@ -0,0 +1,649 @@
+#include "index_util.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <fstream>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include "hash_util.hpp"
+#include "json_min.hpp"
+#include "parallel_util.hpp"
+#include "trace_util.hpp"
+#include "walk_util.hpp"
+
+namespace uhd_helper {
+namespace {
+
+// Headers sit at the start; LabVIEW bitfiles are XML with the version
+// tags a little further in.
+constexpr std::size_t kHeadBytes = 256 * 1024;
+constexpr std::size_t kLvbitxHeadBytes = 1024 * 1024;
+constexpr std::size_t kMaxVersions = 8;
+
+std::string ToLowerAscii(std::string value) {
+  for (auto& ch : value) {
+    ch = static_cast<char>(std::tolower(static_cast<unsigned char>(ch)));
+  }
+  return value;
+}
+
+std::string Extension(const std::string& file_name) {
+  const auto dot = file_name.rfind('.');
+  return dot == std::string::npos ? std::string()
+                                  : ToLowerAscii(file_name.substr(dot));
+}
+
+std::string BaseName(const std::string& path) {
+  const auto slash = path.rfind('/');
+  return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+bool CarriesVersions(const std::string& file_name) {
+  const std::string ext = Extension(file_name);
+  return ext == ".bin" || ext == ".bit" || ext == ".hex" || ext == ".ihx" ||
+         ext == ".lvbitx" || ext == ".rbf";
+}
+
+std::size_t HeadBytes(const std::string& file_name) {
+  return Extension(file_name) == ".lvbitx" ? kLvbitxHeadBytes : kHeadBytes;
+}
+
+int HexDigit(char ch) {
+  if (ch >= '0' && ch <= '9') {
+    return ch - '0';
+  }
+  ch = static_cast<char>(std::tolower(static_cast<unsigned char>(ch)));
+  return ch >= 'a' && ch <= 'f' ? ch - 'a' + 10 : -1;
+}
+
+// Data records of Intel HEX text, concatenated.
+std::string DecodeIntelHex(const char* data, std::size_t size) {
+  std::string bytes;
+  std::size_t pos = 0;
+  while (pos < size) {
+    std::size_t end = pos;
+    while (end < size && data[end] != '\n') {
+      ++end;
+    }
+    if (end - pos >= 11 && data[pos] == ':') {
+      const auto byte_at = [&](std::size_t i) {
+        const int hi = HexDigit(data[pos + 1 + 2 * i]);
+        const int lo = HexDigit(data[pos + 2 + 2 * i]);
+        return hi < 0 || lo < 0 ? -1 : hi * 16 + lo;
+      };
+      const int count = byte_at(0);
+      if (count >= 0 && byte_at(3) == 0 &&
+          pos + 11 + 2 * static_cast<std::size_t>(count) <= end) {
+        for (int i = 0; i < count; ++i) {
+          const int value = byte_at(4 + static_cast<std::size_t>(i));
+          if (value < 0) {
+            break;
+          }
+          bytes.push_back(static_cast<char>(value));
+        }
+      }
+    }
+    pos = end + 1;
+  }
+  return bytes;
+}
+
+bool IsVersionChar(char ch) {
+  return std::isalnum(static_cast<unsigned char>(ch)) || ch == '.' ||
+         ch == '_' || ch == '-' || ch == '+';
+}
+
+// A version starting at run[pos], or "" when there is none: a digit, then
+// version characters, with at least one dot.
+std::string VersionAt(const std::string& run, std::size_t pos) {
+  if (pos < run.size() && (run[pos] == 'v' || run[pos] == 'V')) {
+    ++pos;
+  }
+  if (pos >= run.size() ||
+      !std::isdigit(static_cast<unsigned char>(run[pos]))) {
+    return "";
+  }
+  std::size_t end = pos;
+  while (end < run.size() && end - pos < 40 && IsVersionChar(run[end])) {
+    ++end;
+  }
+  while (end > pos && (run[end - 1] == '.' || run[end - 1] == '-' ||
+                       run[end - 1] == '_')) {
+    --end;
+  }
+  std::string version = run.substr(pos, end - pos);
+  return version.find('.') == std::string::npos ? "" : version;
+}
+
+void ScanRun(const std::string& run, std::vector<std::string>* versions) {
+  const std::string lower = ToLowerAscii(run);
+  const auto add = [&](std::string version) {
+    if (!version.empty() && versions->size() < kMaxVersions &&
+        std::find(versions->begin(), versions->end(), version) ==
+            versions->end()) {
+      versions->push_back(std::move(version));
+    }
+  };
+  for (std::size_t at = lower.find("version"); at != std::string::npos;
+       at = lower.find("version", at + 1)) {
+    std::size_t pos = at + 7;
+    // "Version=14.7", "version: 4.6", "<BitfileVersion>4.0<".
+    for (int skipped = 0; pos < run.size() && skipped < 3 &&
+                          std::string(" =:>\"'").find(run[pos]) !=
+                              std::string::npos;
+         ++skipped) {
+      ++pos;
+    }
+    add(VersionAt(run, pos));
+  }
+  for (const char* marker : {"uhd_", "uhd-"}) {
+    for (std::size_t at = lower.find(marker); at != std::string::npos;
+         at = lower.find(marker, at + 1)) {
+      add(VersionAt(run, at + 4));
+    }
+  }
+}
+
+bool ReadHead(int fd, std::size_t limit, std::string* head,
+              std::uint64_t* bytes_read) {
+  head->resize(limit);
+  std::size_t got = 0;
+  while (got < limit) {
+    const ssize_t n = ::pread(fd, &(*head)[got], limit - got,
+                              static_cast<off_t>(got));
+    UHD_TRACE_COUNT(kSyscalls, 1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return false;
+    }
+    if (n == 0) {
+      break;
+    }
+    got += static_cast<std::size_t>(n);
+  }
+  head->resize(got);
+  *bytes_read += got;
+  return true;
+}
+
+// Hashes all of fd and keeps its first limit bytes in head.
+bool HashAndReadHead(int fd, std::size_t limit, std::string* digest,
+                     std::string* head, std::uint64_t* bytes_read) {
+  Sha256 sha;
+  std::vector<char> buffer(256 * 1024);
+  head->clear();
+  while (true) {
+    const ssize_t n = ::read(fd, buffer.data(), buffer.size());
+    UHD_TRACE_COUNT(kSyscalls, 1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return false;
+    }
+    if (n == 0) {
+      break;
+    }
+    const auto size = static_cast<std::size_t>(n);
+    sha.Update(buffer.data(), size);
+    if (head->size() < limit) {
+      head->append(buffer.data(), std::min(size, limit - head->size()));
+    }
+    *bytes_read += size;
+  }
+  *digest = sha.HexDigest();
+  return true;
+}
+
+std::string ProfileKey(const std::string& root, const std::string& id) {
+  return root + '\n' + id;
+}
+
+std::int64_t MtimeNs(const struct stat& st) {
+  return static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000LL +
+         st.st_mtim.tv_nsec;
+}
+
+const IndexedFile* FindFile(const std::vector<IndexedFile>& files,
+                            const std::string& path) {
+  auto it = std::lower_bound(
+      files.begin(), files.end(), path,
+      [](const IndexedFile& file, const std::string& value) {
+        return file.path < value;
+      });
+  return it != files.end() && it->path == path ? &*it : nullptr;
+}
+
+const ManifestEntry* FindEntry(const Manifest& manifest,
+                               const std::string& path) {
+  auto it = std::lower_bound(
+      manifest.entries.begin(), manifest.entries.end(), path,
+      [](const ManifestEntry& entry, const std::string& value) {
+        return entry.path < value;
+      });
+  return it != manifest.entries.end() && it->path == path ? &*it : nullptr;
+}
+
+std::string GetString(const json_min::Object& obj, const char* key) {
+  auto it = obj.find(key);
+  return it != obj.end() && it->second.IsString() ? *it->second.AsString()
+                                                  : std::string();
+}
+
+json_min::Value FileToJson(const IndexedFile& file) {
+  json_min::Object obj;
+  obj.emplace("path", json_min::Value(file.path));
+  obj.emplace("device", json_min::Value(file.device));
+  obj.emplace("kind", json_min::Value(file.kind));
+  obj.emplace("size", json_min::Value(static_cast<double>(file.size)));
+  obj.emplace("mtime_ns", json_min::Value(std::to_string(file.mtime_ns)));
+  obj.emplace("sha256", json_min::Value(file.sha256));
+  json_min::Array versions;
+  for (const auto& version : file.versions) {
+    versions.push_back(json_min::Value(version));
+  }
+  obj.emplace("versions", json_min::Value(std::move(versions)));
+  return json_min::Value(std::move(obj));
+}
+
+bool FileFromJson(const json_min::Object& obj, IndexedFile* file) {
+  file->path = GetString(obj, "path");
+  file->device = GetString(obj, "device");
+  file->kind = GetString(obj, "kind");
+  file->sha256 = GetString(obj, "sha256");
+  auto size = obj.find("size");
+  if (size != obj.end() && size->second.IsNumber()) {
+    file->size = static_cast<std::uint64_t>(*size->second.AsNumber());
+  }
+  const std::string mtime = GetString(obj, "mtime_ns");
+  file->mtime_ns = mtime.empty() ? 0 : std::stoll(mtime);
+  auto versions = obj.find("versions");
+  if (versions != obj.end() && versions->second.IsArray()) {
+    for (const auto& version : *versions->second.AsArray()) {
+      if (version.IsString()) {
+        file->versions.push_back(*version.AsString());
+      }
+    }
+  }
+  return !file->path.empty();
+}
+
+}  // namespace
+
+std::string DeviceFamilyFromName(const std::string& file_name) {
+  std::string base = ToLowerAscii(BaseName(file_name));
+  const auto dot = base.find('.');
+  if (dot != std::string::npos) {
+    base.resize(dot);
+  }
+  const auto first_end = base.find('_');
+  const std::string first = base.substr(0, first_end);
+  if (first == "usrp" && first_end != std::string::npos) {
+    return base.substr(first_end + 1,
+                       base.find('_', first_end + 1) - first_end - 1);
+  }
+  // usrp1_fpga.rbf, usrp2_fw.bin, octoclock_r4_fw.hex.
+  if (first.rfind("usrp", 0) == 0 || first == "octoclock") {
+    return first;
+  }
+  return "";
+}
+
+std::string ImageKindFromName(const std::string& file_name) {
+  const std::string base = ToLowerAscii(BaseName(file_name));
+  const std::string ext = Extension(base);
+  if (ext == ".dts" || ext == ".dtbo" || ext == ".dtb") {
+    return "device-tree";
+  }
+  if (base.find("fpga") != std::string::npos || ext == ".bit" ||
+      ext == ".lvbitx" || ext == ".rbf") {
+    return "fpga";
+  }
+  if (base.find("_fw") != std::string::npos || ext == ".ihx") {
+    return "firmware";
+  }
+  return "other";
+}
+
+std::vector<std::string> ExtractVersionStrings(const std::string& file_name,
+                                               const char* data,
+                                               std::size_t size) {
+  std::string decoded;
+  const std::string ext = Extension(file_name);
+  if (ext == ".hex" || ext == ".ihx") {
+    decoded = DecodeIntelHex(data, size);
+    data = decoded.data();
+    size = decoded.size();
+  }
+  std::vector<std::string> versions;
+  std::string run;
+  for (std::size_t i = 0; i <= size && versions.size() < kMaxVersions; ++i) {
+    const bool printable = i < size && data[i] >= 0x20 && data[i] < 0x7f;
+    if (printable) {
+      run.push_back(data[i]);
+      continue;
+    }
+    if (run.size() >= 4) {
+      ScanRun(run, &versions);
+    }
+    run.clear();
+  }
+  return versions;
+}
+
+bool ParseIndexQuery(const std::string& expr, IndexQuery* query) {
+  std::size_t start = 0;
+  while (start < expr.size()) {
+    std::size_t end = expr.find_first_of(" ,", start);
+    if (end == std::string::npos) {
+      end = expr.size();
+    }
+    const std::string term = expr.substr(start, end - start);
+    start = end + 1;
+    if (term.empty()) {
+      continue;
+    }
+    const auto eq = term.find('=');
+    const std::string key =
+        eq == std::string::npos ? "name" : term.substr(0, eq);
+    const std::string value =
+        eq == std::string::npos ? term : term.substr(eq + 1);
+    if (key == "device") {
+      query->device = value;
+    } else if (key == "kind") {
+      query->kind = value;
+    } else if (key == "version") {
+      query->version = value;
+    } else if (key == "name") {
+      query->name = value;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+ImageIndex::ImageIndex(std::filesystem::path path) : path_(std::move(path)) {}
+
+bool ImageIndex::Load(std::string* error) {
+  profiles_.clear();
+  std::ifstream input(path_);
+  if (!input.is_open()) {
+    return true;
+  }
+  std::string content((std::istreambuf_iterator<char>(input)),
+                      std::istreambuf_iterator<char>());
+  json_min::Value root;
+  try {
+    json_min::Parser parser(std::move(content));
+    root = parser.Parse();
+  } catch (const std::exception& ex) {
+    if (error) {
+      *error = std::string("Failed to parse index: ") + ex.what();
+    }
+    return false;
+  }
+  const auto* obj = root.AsObject();
+  if (!obj) {
+    return true;
+  }
+  auto profiles = obj->find("profiles");
+  if (profiles == obj->end() || !profiles->second.IsArray()) {
+    return true;
+  }
+  for (const auto& item : *profiles->second.AsArray()) {
+    const auto* profile_obj = item.AsObject();
+    if (!profile_obj) {
+      continue;
+    }
+    ProfileIndex profile;
+    profile.root = GetString(*profile_obj, "root");
+    profile.profile_id = GetString(*profile_obj, "id");
+    auto files = profile_obj->find("files");
+    if (files != profile_obj->end() && files->second.IsArray()) {
+      for (const auto& file_value : *files->second.AsArray()) {
+        IndexedFile file;
+        const auto* file_obj = file_value.AsObject();
+        if (file_obj && FileFromJson(*file_obj, &file)) {
+          profile.files.push_back(std::move(file));
+        }
+      }
+    }
+    std::sort(profile.files.begin(), profile.files.end(),
+              [](const IndexedFile& a, const IndexedFile& b) {
+                return a.path < b.path;
+              });
+    profiles_.push_back(std::move(profile));
+  }
+  return true;
+}
+
+bool ImageIndex::Save(std::string* error) const {
+  json_min::Array profiles;
+  for (const auto& profile : profiles_) {
+    json_min::Array files;
+    files.reserve(profile.files.size());
+    for (const auto& file : profile.files) {
+      files.push_back(FileToJson(file));
+    }
+    json_min::Object obj;
+    obj.emplace("root", json_min::Value(profile.root));
+    obj.emplace("id", json_min::Value(profile.profile_id));
+    obj.emplace("files", json_min::Value(std::move(files)));
+    profiles.push_back(json_min::Value(std::move(obj)));
+  }
+  json_min::Object root;
+  root.emplace("format", json_min::Value(1.0));
+  root.emplace("profiles", json_min::Value(std::move(profiles)));
+
+  std::error_code ec;
+  std::filesystem::create_directories(path_.parent_path(), ec);
+  const auto temp = path_.parent_path() / (path_.filename().string() + ".tmp");
+  {
+    std::ofstream output(temp);
+    if (!output.is_open()) {
+      if (error) {
+        *error = "Failed to write index: " + path_.string();
+      }
+      return false;
+    }
+    output << json_min::Serialize(json_min::Value(std::move(root)), 1) << '\n';
+  }
+  std::filesystem::rename(temp, path_, ec);
+  if (ec) {
+    if (error) {
+      *error = "Failed to write index: " + path_.string();
+    }
+    return false;
+  }
+  return true;
+}
+
+bool ImageIndex::Update(const std::vector<IndexTarget>& targets,
+                        IndexStats* stats, std::string* error) {
+  UHD_TRACE_SCOPE("ImageIndex::Update");
+  std::unordered_map<std::string, const ProfileIndex*> previous;
+  for (const auto& profile : profiles_) {
+    previous.emplace(ProfileKey(profile.root, profile.profile_id), &profile);
+  }
+
+  struct Job {
+    std::size_t profile;
+    std::size_t file;
+    std::filesystem::path path;
+    bool need_hash;
+  };
+  std::vector<ProfileIndex> next(targets.size());
+  std::vector<Job> jobs;
+  IndexStats local;
+  for (std::size_t t = 0; t < targets.size(); ++t) {
+    const IndexTarget& target = targets[t];
+    ProfileIndex& profile = next[t];
+    profile.root = target.root;
+    profile.profile_id = target.profile_id;
+    auto old = previous.find(ProfileKey(target.root, target.profile_id));
+    const ProfileIndex* old_profile =
+        old != previous.end() ? old->second : nullptr;
+    if (target.dir.empty()) {
+      if (old_profile) {
+        profile.files = old_profile->files;
+        local.files += profile.files.size();
+      }
+      continue;
+    }
+
+    std::string stat_error;
+    if (!TreeWalker::Walk(
+            target.dir, WalkOptions(),
+            [&](const WalkEntry& item) {
+              if (item.type != EntryType::kFile) {
+                return WalkAction::kContinue;
+              }
+              struct stat st;
+              UHD_TRACE_COUNT(kSyscalls, 1);
+              if (::fstatat(item.parent_fd, item.name->c_str(), &st,
+                            AT_SYMLINK_NOFOLLOW) != 0) {
+                stat_error = "Failed to stat " +
+                             (target.dir / *item.rel_path).string();
+                return WalkAction::kStop;
+              }
+              IndexedFile file;
+              file.path = *item.rel_path;
+              file.size = static_cast<std::uint64_t>(st.st_size);
+              file.mtime_ns = MtimeNs(st);
+              profile.files.push_back(std::move(file));
+              return WalkAction::kContinue;
+            },
+            nullptr, error)) {
+      return false;
+    }
+    if (!stat_error.empty()) {
+      if (error) {
+        *error = stat_error;
+      }
+      return false;
+    }
+    std::sort(profile.files.begin(), profile.files.end(),
+              [](const IndexedFile& a, const IndexedFile& b) {
+                return a.path < b.path;
+              });
+
+    for (std::size_t f = 0; f < profile.files.size(); ++f) {
+      IndexedFile& file = profile.files[f];
+      const IndexedFile* cached =
+          old_profile ? FindFile(old_profile->files, file.path) : nullptr;
+      if (cached && cached->size == file.size &&
+          cached->mtime_ns == file.mtime_ns) {
+        file = *cached;
+        continue;
+      }
+      file.device = DeviceFamilyFromName(file.path);
+      file.kind = ImageKindFromName(file.path);
+      const ManifestEntry* entry = FindEntry(target.known, file.path);
+      if (entry && entry->size == file.size &&
+          entry->mtime_ns == file.mtime_ns) {
+        file.sha256 = entry->hash;
+      }
+      const bool need_hash = file.sha256.empty();
+      if (need_hash || CarriesVersions(file.path)) {
+        jobs.push_back({t, f, target.dir / file.path, need_hash});
+      }
+    }
+    local.files += profile.files.size();
+  }
+
+  // One flat list across profiles keeps every core busy whether there is
+  // one large profile or many small ones.
+  std::mutex mutex;
+  std::string scan_error;
+  std::vector<std::uint64_t> read(jobs.size(), 0);
+  ParallelFor(jobs.size(), [&](std::size_t i) {
+    const Job& job = jobs[i];
+    IndexedFile& file = next[job.profile].files[job.file];
+    const int fd = ::open(job.path.c_str(), O_RDONLY | O_CLOEXEC);
+    UHD_TRACE_COUNT(kSyscalls, 2);
+    std::string head;
+    const std::size_t limit =
+        CarriesVersions(file.path) ? HeadBytes(file.path) : 0;
+    const bool ok =
+        fd >= 0 && (job.need_hash
+                        ? HashAndReadHead(fd, limit, &file.sha256, &head,
+                                          &read[i])
+                        : ReadHead(fd, limit, &head, &read[i]));
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    if (!ok) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (scan_error.empty()) {
+        scan_error = "Failed to read " + job.path.string();
+      }
+      return;
+    }
+    file.versions = ExtractVersionStrings(file.path, head.data(), head.size());
+  });
+  if (!scan_error.empty()) {
+    if (error) {
+      *error = scan_error;
+    }
+    return false;
+  }
+  local.files_scanned = jobs.size();
+  for (const auto bytes : read) {
+    local.bytes_read += bytes;
+  }
+
+  profiles_ = std::move(next);
+  if (stats) {
+    *stats = local;
+  }
+  return true;
+}
+
+std::vector<IndexMatch> ImageIndex::Query(const IndexQuery& query) const {
+  const std::string device = ToLowerAscii(query.device);
+  const std::string kind = ToLowerAscii(query.kind);
+  const std::string name = ToLowerAscii(query.name);
+  std::vector<IndexMatch> matches;
+  for (const auto& profile : profiles_) {
+    for (const auto& file : profile.files) {
+      if ((!device.empty() && file.device != device) ||
+          (!kind.empty() && file.kind != kind) ||
+          (!name.empty() &&
+           ToLowerAscii(file.path).find(name) == std::string::npos)) {
+        continue;
+      }
+      if (!query.version.empty() &&
+          std::none_of(file.versions.begin(), file.versions.end(),
+                       [&](const std::string& version) {
+                         return version.find(query.version) !=
+                                std::string::npos;
+                       })) {
+        continue;
+      }
+      matches.push_back({&profile, &file});
+    }
+  }
+  return matches;
+}
+
+const ProfileIndex* ImageIndex::Find(const std::string& root,
+                                     const std::string& profile_id) const {
+  for (const auto& profile : profiles_) {
+    if (profile.root == root && profile.profile_id == profile_id) {
+      return &profile;
+    }
+  }
+  return nullptr;
+}
+
+}  // namespace uhd_helper
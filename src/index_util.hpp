@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "manifest_util.hpp"
+
+namespace uhd_helper {
+
+struct IndexedFile {
+  std::string path;
+  // From the file name: "b210" for usrp_b210_fpga.bin, "x310" for
+  // usrp_x310_fpga_HG.lvbitx, "octoclock" for octoclock_r4_fw.hex.
+  std::string device;
+  // "fpga", "firmware", "device-tree" or "other".
+  std::string kind;
+  std::uint64_t size = 0;
+  std::int64_t mtime_ns = 0;
+  std::string sha256;
+  // Version strings found in the file header, in order of appearance.
+  std::vector<std::string> versions;
+};
+
+struct ProfileIndex {
+  std::string root;
+  std::string profile_id;
+  // Sorted by path.
+  std::vector<IndexedFile> files;
+};
+
+struct IndexTarget {
+  std::string root;
+  std::string profile_id;
+  // Empty keeps the profile's entries as they are, e.g. while it is packed.
+  std::filesystem::path dir;
+  // Hashes of files whose path, size and mtime match are taken from here
+  // instead of reading the file again.
+  Manifest known;
+};
+
+struct IndexStats {
+  std::uint64_t files = 0;
+  std::uint64_t files_scanned = 0;
+  std::uint64_t bytes_read = 0;
+};
+
+// Empty fields match everything. device, kind and name are compared
+// case-insensitively; device must match exactly, name and version are
+// substrings.
+struct IndexQuery {
+  std::string device;
+  std::string kind;
+  std::string version;
+  std::string name;
+};
+
+// "device=b210 kind=fpga version=4.6", terms split on spaces or commas; a
+// bare word is a name. False on an unknown key.
+bool ParseIndexQuery(const std::string& expr, IndexQuery* query);
+
+struct IndexMatch {
+  const ProfileIndex* profile = nullptr;
+  const IndexedFile* file = nullptr;
+};
+
+std::string DeviceFamilyFromName(const std::string& file_name);
+std::string ImageKindFromName(const std::string& file_name);
+// Looks for "version" followed by a number, and "uhd_"/"uhd-" followed by
+// a number, in printable runs of data. Intel HEX text (.hex, .ihx) is
+// decoded to bytes first.
+std::vector<std::string> ExtractVersionStrings(const std::string& file_name,
+                                               const char* data,
+                                               std::size_t size);
+
+// Per-file metadata of every profile, kept at path as JSON. Update only
+// reads files that are new or whose size or mtime changed.
+class ImageIndex {
+ public:
+  explicit ImageIndex(std::filesystem::path path);
+
+  // A missing index file loads as empty.
+  bool Load(std::string* error);
+  bool Save(std::string* error) const;
+
+  // Re-indexes targets, scanning their changed files in parallel across
+  // all targets at once. Profiles not in targets are dropped.
+  bool Update(const std::vector<IndexTarget>& targets, IndexStats* stats,
+              std::string* error);
+
+  std::vector<IndexMatch> Query(const IndexQuery& query) const;
+  const ProfileIndex* Find(const std::string& root,
+                           const std::string& profile_id) const;
+  const std::vector<ProfileIndex>& profiles() const { return profiles_; }
+
+ private:
+  std::filesystem::path path_;
+  std::vector<ProfileIndex> profiles_;
+};
+
+}  // namespace uhd_helper
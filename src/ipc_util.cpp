@@ -0,0 +1,160 @@
+#include "ipc_util.hpp"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+namespace uhd_helper {
+namespace {
+
+bool WriteAll(int fd, const char* data, std::size_t size) {
+  while (size > 0) {
+    const ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += n;
+    size -= static_cast<std::size_t>(n);
+  }
+  return true;
+}
+
+// Returns the number of bytes read; short only on EOF or error.
+std::size_t ReadAll(int fd, char* data, std::size_t size) {
+  std::size_t done = 0;
+  while (done < size) {
+    const ssize_t n = ::recv(fd, data + done, size - done, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    done += static_cast<std::size_t>(n);
+  }
+  return done;
+}
+
+}  // namespace
+
+std::filesystem::path DefaultSocketPath() {
+  const char* runtime = std::getenv("XDG_RUNTIME_DIR");
+  if (runtime && *runtime) {
+    return std::filesystem::path(runtime) / "uhd-helper.sock";
+  }
+  return std::filesystem::temp_directory_path() /
+         ("uhd-helper-" + std::to_string(::getuid()) + ".sock");
+}
+
+bool WriteMessage(int fd, const json_min::Value& message, std::string* error) {
+  const std::string payload = json_min::Serialize(message, 0);
+  if (payload.size() > kMaxMessageSize) {
+    if (error) {
+      *error = "Message too large";
+    }
+    return false;
+  }
+  const auto size = static_cast<std::uint32_t>(payload.size());
+  const char header[4] = {
+      static_cast<char>(size >> 24), static_cast<char>(size >> 16),
+      static_cast<char>(size >> 8), static_cast<char>(size)};
+  if (!WriteAll(fd, header, sizeof(header)) ||
+      !WriteAll(fd, payload.data(), payload.size())) {
+    if (error) {
+      *error = std::string("Failed to send message: ") + std::strerror(errno);
+    }
+    return false;
+  }
+  return true;
+}
+
+bool ReadMessage(int fd, json_min::Value* message, std::string* error) {
+  unsigned char header[4];
+  const std::size_t got =
+      ReadAll(fd, reinterpret_cast<char*>(header), sizeof(header));
+  if (got == 0) {
+    if (error) {
+      error->clear();
+    }
+    return false;
+  }
+  if (got != sizeof(header)) {
+    if (error) {
+      *error = "Truncated message header";
+    }
+    return false;
+  }
+  const std::uint32_t size = (static_cast<std::uint32_t>(header[0]) << 24) |
+                             (static_cast<std::uint32_t>(header[1]) << 16) |
+                             (static_cast<std::uint32_t>(header[2]) << 8) |
+                             static_cast<std::uint32_t>(header[3]);
+  if (size > kMaxMessageSize) {
+    if (error) {
+      *error = "Message too large";
+    }
+    return false;
+  }
+  std::string payload(size, '\0');
+  if (ReadAll(fd, payload.data(), size) != size) {
+    if (error) {
+      *error = "Truncated message body";
+    }
+    return false;
+  }
+  try {
+    json_min::Parser parser(std::move(payload));
+    *message = parser.Parse();
+  } catch (const std::exception& ex) {
+    if (error) {
+      *error = std::string("Invalid message JSON: ") + ex.what();
+    }
+    return false;
+  }
+  return true;
+}
+
+bool SendRequest(const std::filesystem::path& socket_path,
+                 const json_min::Value& request, json_min::Value* response,
+                 std::string* error) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (socket_path.string().size() >= sizeof(addr.sun_path)) {
+    if (error) {
+      *error = "Socket path too long: " + socket_path.string();
+    }
+    return false;
+  }
+  std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+  const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    if (error) {
+      *error = std::string("Failed to create socket: ") + std::strerror(errno);
+    }
+    return false;
+  }
+  if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    if (error) {
+      *error = "Failed to connect to " + socket_path.string() + ": " +
+               std::strerror(errno);
+    }
+    ::close(fd);
+    return false;
+  }
+  const bool ok = WriteMessage(fd, request, error) &&
+                  ReadMessage(fd, response, error);
+  if (!ok && error && error->empty()) {
+    *error = "Daemon closed the connection";
+  }
+  ::close(fd);
+  return ok;
+}
+
+}  // namespace uhd_helper
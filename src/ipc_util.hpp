@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+#include "json_min.hpp"
+
+namespace uhd_helper {
+
+// Wire format: a 4-byte big-endian payload length followed by one JSON
+// document of that many bytes.
+constexpr std::uint32_t kMaxMessageSize = 16 * 1024 * 1024;
+
+std::filesystem::path DefaultSocketPath();
+bool WriteMessage(int fd, const json_min::Value& message, std::string* error);
+// Returns false with an empty error when the peer closed the connection
+// cleanly before a new message started.
+bool ReadMessage(int fd, json_min::Value* message, std::string* error);
+bool SendRequest(const std::filesystem::path& socket_path,
+                 const json_min::Value& request, json_min::Value* response,
+                 std::string* error);
+
+}  // namespace uhd_helper
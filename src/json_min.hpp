@@ -1,6 +1,8 @@
 #pragma once
 
 #include <cctype>
+#include <cmath>
+#include <iomanip>
 #include <map>
 #include <cstring>
 #include <sstream>
@@ -305,7 +307,13 @@ inline void Serialize(const Value& value, std::ostringstream& out, int indent,
     return;
   }
   if (value.IsNumber()) {
-    out << *value.AsNumber();
+    const double number = *value.AsNumber();
+    if (std::fabs(number) < 9007199254740992.0 &&
+        number == static_cast<double>(static_cast<long long>(number))) {
+      out << static_cast<long long>(number);
+    } else {
+      out << std::setprecision(17) << number;
+    }
     return;
   }
   if (value.IsString()) {
@@ -1,22 +1,653 @@
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
 #include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
 
 #include "config_util.hpp"
+#include "daemon.hpp"
+#include "file_util.hpp"
+#include "index_util.hpp"
+#include "ipc_util.hpp"
+#include "manifest_util.hpp"
 #include "profile_util.hpp"
+#include "throttle_util.hpp"
+#include "trace_util.hpp"
 #include "tui.hpp"
 
-int main() {
-  using namespace uhd_helper;
+namespace {
+
+using namespace uhd_helper;
+
+Daemon* g_daemon = nullptr;
+
+void HandleStopSignal(int /*signal*/) {
+  if (g_daemon) {
+    g_daemon->Stop();
+  }
+}
+
+void PrintUsage(const char* argv0) {
+  std::cerr << "Usage:\n"
+            << "  " << argv0 << "                      run the TUI\n"
+            << "  " << argv0 << " --daemon [--socket PATH]\n"
+            << "  " << argv0
+            << " --client OP [ARG] [--socket PATH]\n"
+            << "      OP: ping | list | refresh | apply ID | apply_all ID |\n"
+            << "          revert | enforce_budget | pack ID |\n"
+            << "          add NAME | snapshot NAME | import NAME ARCHIVE |\n"
+            << "          export ID FILE | import_bundle FILE |\n"
+            << "          delete ID | verify ID | rehash ID | diff ID ID |\n"
+            << "          index | query EXPR | set_uhd_version ID VERSION |\n"
+            << "          select_root NAME | add_root NAME DIR |\n"
+            << "          remove_root NAME | dedup_roots |\n"
+            << "          group_create GROUP |\n"
+            << "          group_delete GROUP | group_add GROUP ID |\n"
+            << "          group_remove GROUP ID | group_apply GROUP |\n"
+            << "          group_verify GROUP | group_prewarm GROUP |\n"
+            << "          group_delete_profiles GROUP\n"
+            << "  " << argv0 << " --import NAME ARCHIVE|-\n"
+            << "      add a profile from a .zip, .tar, .tar.gz or .tar.xz\n"
+            << "      (- reads the archive from stdin)\n"
+            << "  " << argv0 << " --export ID|@GROUP FILE|- [--have MANIFEST]\n"
+            << "      stream a profile or group as a bundle, leaving out files\n"
+            << "      listed in MANIFEST\n"
+            << "  " << argv0 << " --import-bundle FILE|-\n"
+            << "  " << argv0 << " --inventory FILE|-\n"
+            << "      manifest of every file on this host, for --have\n"
+            << "  " << argv0 << " --revert\n"
+            << "      switch back to the previously active profile\n"
+            << "  " << argv0 << " --index\n"
+            << "      scan every profile for device, kind, hash and version\n"
+            << "  " << argv0 << " --query 'device=b210 kind=fpga version=4.6'\n"
+            << "      list indexed files matching every term; a bare word\n"
+            << "      matches the file name\n"
+            << "  " << argv0 << " --diff ID ID\n"
+            << "      list files that differ between two profiles\n"
+            << "  " << argv0 << " --rehash ID\n"
+            << "      update a profile's manifest after its files changed\n"
+            << "  " << argv0 << " --set-budget SIZE\n"
+            << "      disk budget for idle profiles per root, e.g. 20G (0 is\n"
+            << "      unlimited); least recently used profiles get packed\n"
+            << "  " << argv0 << " --enforce-budget\n"
+            << "  " << argv0 << " --pack ID\n"
+            << "  " << argv0 << " --activation-mode rename|symlink|hardlinks\n"
+            << "      symlink keeps every profile in its folder and points\n"
+            << "      images at the active one; hardlinks fills images with\n"
+            << "      links to its read-only files; existing roots are\n"
+            << "      migrated\n"
+            << "  " << argv0 << " --set-uhd-version ID VERSION|installed|none\n"
+            << "      record the UHD release a profile is for; applying it\n"
+            << "      under an incompatible release is refused\n"
+            << "  " << argv0 << " --add-root NAME DIR | --remove-root NAME\n"
+            << "      manage the UHD installs this config tracks\n"
+            << "  " << argv0 << " --dedup-roots\n"
+            << "      reflink identical idle profile files across roots on\n"
+            << "      the same filesystem\n"
+            << "  " << argv0 << " --fsck [--repair]\n"
+            << "      checks config.json against the roots and manifests;\n"
+            << "      --repair fixes what it can, all or nothing\n"
+            << "  " << argv0 << " --set-io-limit SIZE | --set-iops-limit N |\n"
+            << "      --set-idle-priority on|off\n"
+            << "      per-second caps on bulk copy, delete, hash and prewarm\n"
+            << "      I/O (0 is unlimited), and idle I/O priority for workers\n"
+            << "  --io-engine auto|io_uring|copy_file_range|threads\n"
+            << "      backend for bulk copy, hash and prewarm (default auto)\n"
+            << "  --preserve-attrs\n"
+            << "      copies also keep exact permissions, owner and extended\n"
+            << "      attributes\n";
+}
+
+int RunDaemon(ProfileManager* manager, const std::string& socket_path) {
+  Daemon daemon(manager, socket_path);
+  g_daemon = &daemon;
+  std::signal(SIGINT, HandleStopSignal);
+  std::signal(SIGTERM, HandleStopSignal);
+  std::signal(SIGPIPE, SIG_IGN);
+
+  std::string error;
+  const bool ok = daemon.Run(&error);
+  g_daemon = nullptr;
+  if (!ok) {
+    std::cerr << "Daemon failed: " << error << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+int RunClient(const std::vector<std::string>& args,
+              const std::string& socket_path) {
+  if (args.empty()) {
+    std::cerr << "Missing client operation\n";
+    return 2;
+  }
+  const std::string& op = args[0];
+  json_min::Object request;
+  request.emplace("op", json_min::Value(op));
+  const bool takes_name = op == "add" || op == "snapshot" ||
+                          op == "select_root" || op == "import" ||
+                          op == "add_root" || op == "remove_root";
+  const bool takes_group = op.rfind("group_", 0) == 0;
+  const bool takes_path = op == "import" || op == "export" ||
+                          op == "import_bundle" || op == "add_root";
+  std::size_t next = 1;
+  if (takes_group && args.size() > next) {
+    request.emplace("group", json_min::Value(args[next++]));
+  }
+  if (op != "import_bundle" && op != "query" && args.size() > next) {
+    request.emplace(takes_name ? "name" : "id", json_min::Value(args[next++]));
+  }
+  if (op == "query") {
+    std::string expr;
+    for (; next < args.size(); ++next) {
+      expr += (expr.empty() ? "" : " ") + args[next];
+    }
+    request.emplace("expr", json_min::Value(expr));
+  }
+  if (op == "diff" && args.size() > next) {
+    request.emplace("other", json_min::Value(args[next++]));
+  }
+  if (op == "set_uhd_version" && args.size() > next) {
+    request.emplace("version", json_min::Value(args[next++]));
+  }
+  if (takes_path && args.size() > next) {
+    // The daemon resolves paths against its own working directory.
+    std::error_code ec;
+    const auto path = std::filesystem::absolute(args[next], ec);
+    request.emplace("path",
+                    json_min::Value(ec ? args[next] : path.string()));
+  }
+
+  json_min::Value response;
+  std::string error;
+  if (!SendRequest(socket_path, json_min::Value(std::move(request)), &response,
+                   &error)) {
+    std::cerr << error << "\n";
+    return 1;
+  }
+  std::cout << json_min::Serialize(response, 2) << "\n";
+  const auto* obj = response.AsObject();
+  if (!obj) {
+    return 1;
+  }
+  auto ok = obj->find("ok");
+  return ok != obj->end() && ok->second.IsBool() && *ok->second.AsBool() ? 0
+                                                                          : 1;
+}
+
+int RunImport(ProfileManager* manager, const std::string& name,
+              const std::string& archive) {
+  ImportStats stats;
+  std::string error;
+  if (!manager->ImportArchive(name, archive, &stats, &error)) {
+    std::cerr << "Import failed: " << error << "\n";
+    return 1;
+  }
+  std::cout << "Imported " << stats.files << " files (" << stats.bytes
+            << " bytes), " << stats.files_deduplicated
+            << " linked to existing profiles\n";
+  const std::string twin =
+      manager->FindIdenticalProfile(manager->Profiles().back().id);
+  if (!twin.empty()) {
+    std::cout << "Identical to existing profile " << twin << "\n";
+  }
+  return 0;
+}
+
+// The bundle may be going to stdout, so the summary goes to stderr.
+int RunExport(ProfileManager* manager, const std::string& selector,
+              const std::string& out, const std::string& have) {
+  ExportStats stats;
+  std::string error;
+  const bool ok =
+      !selector.empty() && selector[0] == '@'
+          ? manager->ExportGroup(selector.substr(1), out, have, &stats, &error)
+          : manager->ExportProfile(selector, out, have, &stats, &error);
+  if (!ok) {
+    std::cerr << "Export failed: " << error << "\n";
+    return 1;
+  }
+  std::cerr << "Exported " << stats.profiles << " profiles, " << stats.files
+            << " files (" << stats.bytes << " bytes); skipped "
+            << stats.files_skipped << " files the receiver has\n";
+  return 0;
+}
+
+int RunDiff(ProfileManager* manager, const std::string& a,
+            const std::string& b) {
+  ManifestDiff diff;
+  std::string error;
+  if (!manager->CompareProfiles(a, b, &diff, &error)) {
+    std::cerr << error << "\n";
+    return 1;
+  }
+  if (diff.empty()) {
+    std::cout << a << " and " << b << " are identical\n";
+    return 0;
+  }
+  for (const auto& path : diff.added) {
+    std::cout << "+ " << path << "\n";
+  }
+  for (const auto& path : diff.removed) {
+    std::cout << "- " << path << "\n";
+  }
+  for (const auto& path : diff.changed) {
+    std::cout << "~ " << path << "\n";
+  }
+  return 1;
+}
+
+// The index is brought up to date first; unchanged files cost one stat.
+int RunIndex(ProfileManager* manager, const std::string* query_expr) {
+  IndexQuery query;
+  if (query_expr && !ParseIndexQuery(*query_expr, &query)) {
+    std::cerr << "Unknown query term in: " << *query_expr << "\n";
+    return 2;
+  }
+  ImageIndex index(manager->IndexPath());
+  IndexStats stats;
+  std::string error;
+  if (!index.Load(&error) || !manager->UpdateIndex(&index, &stats, &error) ||
+      !index.Save(&error)) {
+    std::cerr << "Indexing failed: " << error << "\n";
+    return 1;
+  }
+  if (!query_expr) {
+    std::cout << "Indexed " << stats.files << " files, read "
+              << stats.files_scanned << " (" << stats.bytes_read
+              << " bytes)\n";
+    return 0;
+  }
+  const auto matches = index.Query(query);
+  for (const auto& match : matches) {
+    std::cout << match.profile->root << "/" << match.profile->profile_id
+              << "  " << match.file->path << "  "
+              << (match.file->device.empty() ? "-" : match.file->device)
+              << " " << match.file->kind << " " << match.file->size;
+    for (const auto& version : match.file->versions) {
+      std::cout << " " << version;
+    }
+    std::cout << "\n";
+  }
+  return matches.empty() ? 1 : 0;
+}
+
+int RunFsck(ProfileManager* manager, bool repair) {
+  FsckReport report;
+  std::string error;
+  const bool ok = manager->CheckConsistency(repair, &report, &error);
+  std::cout << DescribeFsckReport(report) << "\n";
+  if (!ok) {
+    std::cerr << error << "\n";
+    return 1;
+  }
+  return report.issues.size() == report.repaired ? 0 : 1;
+}
+
+int RunImportBundle(ProfileManager* manager, const std::string& bundle) {
+  ImportStats stats;
+  std::string error;
+  if (!manager->ImportBundle(bundle, &stats, &error)) {
+    std::cerr << "Import failed: " << error << "\n";
+    return 1;
+  }
+  std::cout << "Imported " << stats.files << " files (" << stats.bytes
+            << " bytes), " << stats.files_deduplicated
+            << " taken from local profiles\n";
+  return 0;
+}
+
+// Accepts plain bytes or a K/M/G/T suffix (powers of 1024).
+bool ParseSize(const std::string& text, std::uint64_t* bytes) {
+  char* end = nullptr;
+  const unsigned long long value = std::strtoull(text.c_str(), &end, 10);
+  if (end == text.c_str()) {
+    return false;
+  }
+  int shift = 0;
+  switch (*end) {
+    case '\0':
+      break;
+    case 'K':
+    case 'k':
+      shift = 10;
+      break;
+    case 'M':
+    case 'm':
+      shift = 20;
+      break;
+    case 'G':
+    case 'g':
+      shift = 30;
+      break;
+    case 'T':
+    case 't':
+      shift = 40;
+      break;
+    default:
+      return false;
+  }
+  if (*end != '\0' && end[1] != '\0') {
+    return false;
+  }
+  *bytes = static_cast<std::uint64_t>(value) << shift;
+  return true;
+}
+
+int RunEnforceBudget(ProfileManager* manager, const std::string& budget) {
+  EvictionStats stats;
+  std::string error;
+  bool ok;
+  if (budget.empty()) {
+    ok = manager->EnforceDiskBudget(&stats, &error);
+  } else {
+    std::uint64_t bytes = 0;
+    if (!ParseSize(budget, &bytes)) {
+      std::cerr << "Invalid size: " << budget << "\n";
+      return 2;
+    }
+    ok = manager->SetDiskBudget(bytes, &stats, &error);
+  }
+  if (!ok) {
+    std::cerr << "Budget enforcement failed: " << error << "\n";
+    return 1;
+  }
+  std::cout << "Packed " << stats.profiles_packed << " profiles, freed "
+            << stats.bytes_freed << " bytes\n";
+  if (stats.roots_over_budget > 0) {
+    std::cout << stats.roots_over_budget
+              << " roots remain over budget with every idle profile packed\n";
+  }
+  return 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  bool daemon_mode = false;
+  bool client_mode = false;
+  std::string socket_path = DefaultSocketPath().string();
+  std::vector<std::string> client_args;
+  std::string import_name;
+  std::string import_archive;
+  std::string export_selector;
+  std::string export_out;
+  std::string export_have;
+  std::string import_bundle;
+  std::string inventory_out;
+  bool revert = false;
+  bool enforce_budget = false;
+  std::string budget;
+  std::string pack_id;
+  std::vector<std::string> diff_ids;
+  std::string rehash_id;
+  std::vector<std::string> uhd_version_args;
+  std::vector<std::string> add_root_args;
+  std::string remove_root;
+  bool dedup_roots = false;
+  bool index = false;
+  std::string query_expr;
+  bool query = false;
+  bool fsck = false;
+  bool repair = false;
+  std::optional<ActivationMode> activation_mode;
+  std::optional<std::uint64_t> io_limit;
+  std::optional<std::uint64_t> iops_limit;
+  std::optional<bool> idle_priority;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--daemon") {
+      daemon_mode = true;
+    } else if (arg == "--client") {
+      client_mode = true;
+    } else if (arg == "--socket" && i + 1 < argc) {
+      socket_path = argv[++i];
+    } else if (arg == "--io-engine" && i + 1 < argc) {
+      IoEngine engine;
+      if (!ParseIoEngine(argv[++i], &engine)) {
+        std::cerr << "Unknown I/O engine: " << argv[i] << "\n";
+        return 2;
+      }
+      FileUtil::SetIoEngine(engine);
+    } else if (arg == "--preserve-attrs") {
+      FileUtil::SetPreserveAttributes(true);
+    } else if (arg == "--import" && i + 2 < argc) {
+      import_name = argv[++i];
+      import_archive = argv[++i];
+    } else if (arg == "--export" && i + 2 < argc) {
+      export_selector = argv[++i];
+      export_out = argv[++i];
+    } else if (arg == "--have" && i + 1 < argc) {
+      export_have = argv[++i];
+    } else if (arg == "--import-bundle" && i + 1 < argc) {
+      import_bundle = argv[++i];
+    } else if (arg == "--inventory" && i + 1 < argc) {
+      inventory_out = argv[++i];
+    } else if (arg == "--revert") {
+      revert = true;
+    } else if (arg == "--set-budget" && i + 1 < argc) {
+      budget = argv[++i];
+      enforce_budget = true;
+    } else if (arg == "--enforce-budget") {
+      enforce_budget = true;
+    } else if (arg == "--pack" && i + 1 < argc) {
+      pack_id = argv[++i];
+    } else if (arg == "--diff" && i + 2 < argc) {
+      diff_ids = {argv[i + 1], argv[i + 2]};
+      i += 2;
+    } else if (arg == "--rehash" && i + 1 < argc) {
+      rehash_id = argv[++i];
+    } else if (arg == "--set-uhd-version" && i + 2 < argc) {
+      uhd_version_args = {argv[i + 1], argv[i + 2]};
+      i += 2;
+    } else if (arg == "--add-root" && i + 2 < argc) {
+      add_root_args = {argv[i + 1], argv[i + 2]};
+      i += 2;
+    } else if (arg == "--remove-root" && i + 1 < argc) {
+      remove_root = argv[++i];
+    } else if (arg == "--dedup-roots") {
+      dedup_roots = true;
+    } else if (arg == "--activation-mode" && i + 1 < argc) {
+      ActivationMode mode;
+      if (!ParseActivationMode(argv[++i], &mode)) {
+        std::cerr << "Unknown activation mode: " << argv[i] << "\n";
+        return 2;
+      }
+      activation_mode = mode;
+    } else if (arg == "--set-io-limit" && i + 1 < argc) {
+      std::uint64_t bytes = 0;
+      if (!ParseSize(argv[++i], &bytes)) {
+        std::cerr << "Invalid size: " << argv[i] << "\n";
+        return 2;
+      }
+      io_limit = bytes;
+    } else if (arg == "--set-iops-limit" && i + 1 < argc) {
+      std::uint64_t ops = 0;
+      if (!ParseSize(argv[++i], &ops)) {
+        std::cerr << "Invalid count: " << argv[i] << "\n";
+        return 2;
+      }
+      iops_limit = ops;
+    } else if (arg == "--set-idle-priority" && i + 1 < argc) {
+      const std::string value = argv[++i];
+      if (value != "on" && value != "off") {
+        std::cerr << "Expected on or off: " << value << "\n";
+        return 2;
+      }
+      idle_priority = value == "on";
+    } else if (arg == "--fsck") {
+      fsck = true;
+    } else if (arg == "--repair") {
+      fsck = true;
+      repair = true;
+    } else if (arg == "--index") {
+      index = true;
+    } else if (arg == "--query" && i + 1 < argc) {
+      query_expr = argv[++i];
+      query = true;
+    } else if (arg == "--help" || arg == "-h") {
+      PrintUsage(argv[0]);
+      return 0;
+    } else if (client_mode) {
+      client_args.push_back(arg);
+    } else {
+      PrintUsage(argv[0]);
+      return 2;
+    }
+  }
+
+  if (client_mode) {
+    return RunClient(client_args, socket_path);
+  }
+
+  // The TUI draws from the cached config and reconciles the roots in the
+  // background; every command works on a reconciled config.
+  const bool tui =
+      !daemon_mode && import_archive.empty() && export_out.empty() &&
+      import_bundle.empty() && inventory_out.empty() && !revert &&
+      !enforce_budget && !fsck && !index && !query && diff_ids.empty() &&
+      rehash_id.empty() && uhd_version_args.empty() && !io_limit &&
+      !iops_limit && !idle_priority && !activation_mode && pack_id.empty() &&
+      add_root_args.empty() && remove_root.empty() && !dedup_roots;
 
   ConfigManager config_manager(DefaultConfigPath());
   ProfileManager profile_manager(&config_manager);
 
   std::string error;
-  if (!profile_manager.Initialize(&error)) {
+  if (!(tui ? profile_manager.InitializeFromCache(&error)
+            : profile_manager.Initialize(&error))) {
     std::cerr << "Failed to initialize: " << error << "\n";
     return 1;
   }
 
+  if (!import_archive.empty()) {
+    return RunImport(&profile_manager, import_name, import_archive);
+  }
+  if (!export_out.empty()) {
+    return RunExport(&profile_manager, export_selector, export_out,
+                     export_have);
+  }
+  if (!import_bundle.empty()) {
+    return RunImportBundle(&profile_manager, import_bundle);
+  }
+  if (revert) {
+    std::string report;
+    if (!profile_manager.RevertActivation(&report, &error)) {
+      std::cerr << "Revert failed: " << error << "\n";
+      return 1;
+    }
+    std::cout << report << "\n";
+    return 0;
+  }
+  if (enforce_budget) {
+    return RunEnforceBudget(&profile_manager, budget);
+  }
+  if (fsck) {
+    return RunFsck(&profile_manager, repair);
+  }
+  if (index || query) {
+    return RunIndex(&profile_manager, query ? &query_expr : nullptr);
+  }
+  if (!diff_ids.empty()) {
+    return RunDiff(&profile_manager, diff_ids[0], diff_ids[1]);
+  }
+  if (!rehash_id.empty()) {
+    std::vector<std::string> changed;
+    if (!profile_manager.RehashProfile(rehash_id, &changed, &error)) {
+      std::cerr << "Rehash failed: " << error << "\n";
+      return 1;
+    }
+    std::cout << changed.size() << " files changed\n";
+    return 0;
+  }
+  if (!uhd_version_args.empty()) {
+    if (!profile_manager.SetProfileUhdVersion(uhd_version_args[0],
+                                              uhd_version_args[1], &error)) {
+      std::cerr << error << "\n";
+      return 1;
+    }
+    return 0;
+  }
+  if (!add_root_args.empty()) {
+    std::error_code ec;
+    std::filesystem::path dir = std::filesystem::absolute(add_root_args[1], ec);
+    if (ec) {
+      dir = add_root_args[1];
+    }
+    if (!profile_manager.AddRoot(add_root_args[0], dir, &error)) {
+      std::cerr << "Adding root failed: " << error << "\n";
+      return 1;
+    }
+    return 0;
+  }
+  if (!remove_root.empty()) {
+    if (!profile_manager.RemoveRoot(remove_root, &error)) {
+      std::cerr << "Removing root failed: " << error << "\n";
+      return 1;
+    }
+    return 0;
+  }
+  if (dedup_roots) {
+    std::uint64_t saved = 0;
+    if (!profile_manager.DeduplicateRoots(&saved, &error)) {
+      std::cerr << "Deduplication failed: " << error << "\n";
+      return 1;
+    }
+    std::cout << saved << " bytes saved\n";
+    return 0;
+  }
+  if (io_limit || iops_limit || idle_priority) {
+    ThrottleLimits limits = Throttle::Instance().Limits();
+    limits.bytes_per_second = io_limit.value_or(limits.bytes_per_second);
+    limits.ops_per_second = iops_limit.value_or(limits.ops_per_second);
+    limits.idle_priority = idle_priority.value_or(limits.idle_priority);
+    if (!profile_manager.SetIoLimits(limits, &error)) {
+      std::cerr << error << "\n";
+      return 1;
+    }
+    const std::string described = Throttle::Instance().DescribeLimits();
+    std::cout << (described.empty() ? "I/O unlimited" : described)
+              << (limits.idle_priority ? ", idle priority" : "") << "\n";
+    return 0;
+  }
+  if (activation_mode) {
+    if (!profile_manager.SetActivationMode(*activation_mode, &error)) {
+      std::cerr << "Switching activation mode failed: " << error << "\n";
+      return 1;
+    }
+    return 0;
+  }
+  if (!pack_id.empty()) {
+    if (!profile_manager.PackProfile(pack_id, &error)) {
+      std::cerr << "Pack failed: " << error << "\n";
+      return 1;
+    }
+    return 0;
+  }
+  if (!inventory_out.empty()) {
+    if (!profile_manager.WriteInventory(inventory_out, &error)) {
+      std::cerr << error << "\n";
+      return 1;
+    }
+    return 0;
+  }
+
+  if (daemon_mode) {
+    return RunDaemon(&profile_manager, socket_path);
+  }
+
   TuiApp app(&profile_manager);
   app.Run();
+
+  if (Tracer::Enabled()) {
+    const char* trace_file = std::getenv("UHD_HELPER_TRACE_FILE");
+    if (trace_file && *trace_file &&
+        !Tracer::Instance().DumpChromeTrace(trace_file, &error)) {
+      std::cerr << error << "\n";
+    }
+  }
   return 0;
 }
@@ -0,0 +1,642 @@
+#include "manifest_util.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <charconv>
+#include <fstream>
+#include <mutex>
+
+#include "archive_util.hpp"
+#include "file_util.hpp"
+#include "hash_util.hpp"
+#include "json_min.hpp"
+#include "trace_util.hpp"
+#include "uring_util.hpp"
+#include "walk_util.hpp"
+
+namespace uhd_helper {
+namespace {
+
+std::int64_t MtimeNs(const struct stat& st) {
+  return static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000LL +
+         st.st_mtim.tv_nsec;
+}
+
+void SortEntries(std::vector<ManifestEntry>* entries) {
+  std::sort(entries->begin(), entries->end(),
+            [](const ManifestEntry& a, const ManifestEntry& b) {
+              return a.path < b.path;
+            });
+}
+
+std::string ParentDir(const std::string& path) {
+  const auto slash = path.rfind('/');
+  return slash == std::string::npos ? std::string() : path.substr(0, slash);
+}
+
+std::size_t Depth(const std::string& dir) {
+  return dir.empty() ? 0 : std::count(dir.begin(), dir.end(), '/') + 1;
+}
+
+std::vector<ManifestEntry>::const_iterator LowerBound(
+    const std::vector<ManifestEntry>& entries,
+    std::vector<ManifestEntry>::const_iterator from, const std::string& path) {
+  return std::lower_bound(from, entries.end(), path,
+                          [](const ManifestEntry& entry,
+                             const std::string& value) {
+                            return entry.path < value;
+                          });
+}
+
+struct Child {
+  std::string name;
+  // nullptr for a subdirectory.
+  const ManifestEntry* file = nullptr;
+};
+
+// Direct children of dir in path order. Entries are sorted, so a
+// subdirectory's files are contiguous and skipped with one binary search;
+// the cost is O(children * log n), not the size of the subtree.
+std::vector<Child> ListChildren(const std::vector<ManifestEntry>& entries,
+                                const std::string& dir) {
+  std::vector<Child> children;
+  const std::string prefix = dir.empty() ? std::string() : dir + "/";
+  auto it = LowerBound(entries, entries.begin(), prefix);
+  while (it != entries.end() &&
+         it->path.compare(0, prefix.size(), prefix) == 0) {
+    const auto slash = it->path.find('/', prefix.size());
+    if (slash == std::string::npos) {
+      children.push_back({it->path.substr(prefix.size()), &*it});
+      ++it;
+    } else {
+      children.push_back(
+          {it->path.substr(prefix.size(), slash - prefix.size()), nullptr});
+      // '0' follows '/', so this is the first path past the subtree.
+      it = LowerBound(entries, it, it->path.substr(0, slash) + '0');
+    }
+  }
+  return children;
+}
+
+std::string HashDirectory(const Manifest& manifest, const std::string& dir) {
+  Sha256 hasher;
+  for (const Child& child : ListChildren(manifest.entries, dir)) {
+    std::string line;
+    if (child.file) {
+      line = "f" + child.name + '\0' + std::to_string(child.file->size) +
+             '\0' + child.file->hash + '\n';
+    } else {
+      const std::string sub = dir.empty() ? child.name : dir + "/" + child.name;
+      auto found = manifest.dir_hashes.find(sub);
+      line = "d" + child.name + '\0' +
+             (found != manifest.dir_hashes.end() ? found->second : "") + '\n';
+    }
+    hasher.Update(line.data(), line.size());
+  }
+  return hasher.HexDigest();
+}
+
+// Hashes dirs deepest first, so subdirectories are ready before parents.
+void HashDirectories(Manifest* manifest, std::vector<std::string> dirs) {
+  std::sort(dirs.begin(), dirs.end(),
+            [](const std::string& a, const std::string& b) {
+              const auto da = Depth(a);
+              const auto db = Depth(b);
+              return da != db ? da > db : a < b;
+            });
+  dirs.erase(std::unique(dirs.begin(), dirs.end()), dirs.end());
+  for (const auto& dir : dirs) {
+    if (dir.empty() || !ListChildren(manifest->entries, dir).empty()) {
+      manifest->dir_hashes[dir] = HashDirectory(*manifest, dir);
+    } else {
+      manifest->dir_hashes.erase(dir);
+    }
+  }
+}
+
+void AddSubtree(const std::vector<ManifestEntry>& entries,
+                const std::string& dir, std::vector<std::string>* out) {
+  const std::string prefix = dir + "/";
+  for (auto it = LowerBound(entries, entries.begin(), prefix);
+       it != entries.end() && it->path.compare(0, prefix.size(), prefix) == 0;
+       ++it) {
+    out->push_back(it->path);
+  }
+}
+
+void DiffDirectory(const Manifest& expected, const Manifest& actual,
+                   const std::string& dir, ManifestDiff* diff) {
+  auto a = expected.dir_hashes.find(dir);
+  auto b = actual.dir_hashes.find(dir);
+  if (a != expected.dir_hashes.end() && b != actual.dir_hashes.end() &&
+      a->second == b->second) {
+    return;
+  }
+  auto left = ListChildren(expected.entries, dir);
+  auto right = ListChildren(actual.entries, dir);
+  // Files sort before a directory of the same name.
+  const auto order = [](const Child& x, const Child& y) {
+    return x.name != y.name ? x.name < y.name
+                            : (x.file != nullptr) > (y.file != nullptr);
+  };
+  std::sort(left.begin(), left.end(), order);
+  std::sort(right.begin(), right.end(), order);
+  auto l = left.begin();
+  auto r = right.begin();
+  const auto join = [&](const std::string& name) {
+    return dir.empty() ? name : dir + "/" + name;
+  };
+  while (l != left.end() || r != right.end()) {
+    if (r == right.end() || (l != left.end() && order(*l, *r))) {
+      if (l->file) {
+        diff->removed.push_back(l->file->path);
+      } else {
+        AddSubtree(expected.entries, join(l->name), &diff->removed);
+      }
+      ++l;
+    } else if (l == left.end() || order(*r, *l)) {
+      if (r->file) {
+        diff->added.push_back(r->file->path);
+      } else {
+        AddSubtree(actual.entries, join(r->name), &diff->added);
+      }
+      ++r;
+    } else {
+      if (!l->file) {
+        DiffDirectory(expected, actual, join(l->name), diff);
+      } else if (l->file->size != r->file->size ||
+                 l->file->hash != r->file->hash) {
+        diff->changed.push_back(l->file->path);
+      }
+      ++l;
+      ++r;
+    }
+  }
+}
+
+// The walk only stats; every file is then read through one ring and
+// hashed as its chunks complete.
+bool BuildManifestUring(const std::filesystem::path& dir, Manifest* manifest,
+                        std::string* error) {
+  std::vector<ManifestEntry> entries;
+  std::vector<std::filesystem::path> paths;
+  std::string stat_error;
+  if (!TreeWalker::Walk(
+          dir, WalkOptions(),
+          [&](const WalkEntry& item) {
+            if (item.type != EntryType::kFile) {
+              return WalkAction::kContinue;
+            }
+            struct stat st;
+            UHD_TRACE_COUNT(kSyscalls, 1);
+            if (::fstatat(item.parent_fd, item.name->c_str(), &st,
+                          AT_SYMLINK_NOFOLLOW) != 0) {
+              stat_error = "Failed to stat " + (dir / *item.rel_path).string();
+              return WalkAction::kStop;
+            }
+            ManifestEntry entry;
+            entry.path = *item.rel_path;
+            entry.mtime_ns = MtimeNs(st);
+            entries.push_back(std::move(entry));
+            paths.push_back(dir / *item.rel_path);
+            return WalkAction::kContinue;
+          },
+          nullptr, error)) {
+    return false;
+  }
+  if (!stat_error.empty()) {
+    if (error) {
+      *error = stat_error;
+    }
+    return false;
+  }
+
+  std::vector<Sha256> hashers(entries.size());
+  if (!UringReadFiles(
+          paths,
+          [&](std::size_t index, const char* data, std::size_t size) {
+            hashers[index].Update(data, size);
+            entries[index].size += size;
+          },
+          nullptr, error)) {
+    return false;
+  }
+  for (std::size_t i = 0; i < entries.size(); ++i) {
+    entries[i].hash = hashers[i].HexDigest();
+  }
+  SortEntries(&entries);
+  manifest->entries = std::move(entries);
+  ComputeMerkle(manifest);
+  return true;
+}
+
+}  // namespace
+
+const std::string& Manifest::RootHash() const {
+  static const std::string kEmpty;
+  auto it = dir_hashes.find("");
+  return it != dir_hashes.end() ? it->second : kEmpty;
+}
+
+void ComputeMerkle(Manifest* manifest) {
+  UHD_TRACE_SCOPE("ComputeMerkle");
+  manifest->dir_hashes.clear();
+  std::vector<std::string> dirs;
+  dirs.emplace_back();
+  std::string last_parent;
+  for (const auto& entry : manifest->entries) {
+    std::string parent = ParentDir(entry.path);
+    if (parent == last_parent) {
+      continue;
+    }
+    last_parent = parent;
+    while (!parent.empty()) {
+      dirs.push_back(parent);
+      parent = ParentDir(parent);
+    }
+  }
+  HashDirectories(manifest, std::move(dirs));
+}
+
+void UpdateMerkle(Manifest* manifest,
+                  const std::vector<std::string>& changed_paths) {
+  if (manifest->dir_hashes.empty()) {
+    ComputeMerkle(manifest);
+    return;
+  }
+  std::vector<std::string> dirs;
+  dirs.emplace_back();
+  for (const auto& path : changed_paths) {
+    for (std::string parent = ParentDir(path); !parent.empty();
+         parent = ParentDir(parent)) {
+      dirs.push_back(parent);
+    }
+  }
+  HashDirectories(manifest, std::move(dirs));
+}
+
+bool BuildManifest(const std::filesystem::path& dir, Manifest* manifest,
+                   std::string* error) {
+  UHD_TRACE_SCOPE("BuildManifest");
+  std::error_code ec;
+  if (!std::filesystem::is_directory(dir, ec)) {
+    if (error) {
+      *error = "Not a directory: " + dir.string();
+    }
+    return false;
+  }
+
+  if (FileUtil::ActiveIoEngine() == IoEngine::kIoUring) {
+    return BuildManifestUring(dir, manifest, error);
+  }
+
+  // Files are hashed as the walk reaches them, straight from the parent
+  // directory fd, so each file costs one openat and no path resolution.
+  std::vector<ManifestEntry> entries;
+  std::mutex entries_mutex;
+  std::string walk_error;
+  WalkOptions options;
+  options.parallel = true;
+  const bool walked = TreeWalker::Walk(
+      dir, options,
+      [&](const WalkEntry& item) {
+        if (item.type != EntryType::kFile) {
+          return WalkAction::kContinue;
+        }
+        ManifestEntry entry;
+        entry.path = *item.rel_path;
+        const int fd = ::openat(item.parent_fd, item.name->c_str(),
+                                O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        UHD_TRACE_COUNT(kSyscalls, 3);
+        struct stat st;
+        const bool ok = fd >= 0 && ::fstat(fd, &st) == 0 &&
+                        HashFd(fd, &entry.hash, &entry.size);
+        if (fd >= 0) {
+          ::close(fd);
+        }
+        std::lock_guard<std::mutex> lock(entries_mutex);
+        if (!ok) {
+          walk_error = "Failed to hash " + (dir / entry.path).string();
+          return WalkAction::kStop;
+        }
+        entry.mtime_ns = MtimeNs(st);
+        entries.push_back(std::move(entry));
+        return WalkAction::kContinue;
+      },
+      nullptr, error);
+  if (!walked) {
+    return false;
+  }
+  if (!walk_error.empty()) {
+    if (error) {
+      *error = walk_error;
+    }
+    return false;
+  }
+
+  SortEntries(&entries);
+  manifest->entries = std::move(entries);
+  ComputeMerkle(manifest);
+  return true;
+}
+
+bool RefreshManifest(const std::filesystem::path& dir, Manifest* manifest,
+                     std::vector<std::string>* changed, std::string* error) {
+  UHD_TRACE_SCOPE("RefreshManifest");
+  const std::vector<ManifestEntry>& previous = manifest->entries;
+  std::vector<ManifestEntry> entries;
+  std::vector<std::string> touched;
+  std::mutex entries_mutex;
+  std::string walk_error;
+  WalkOptions options;
+  options.parallel = true;
+  const bool walked = TreeWalker::Walk(
+      dir, options,
+      [&](const WalkEntry& item) {
+        if (item.type != EntryType::kFile) {
+          return WalkAction::kContinue;
+        }
+        struct stat st;
+        UHD_TRACE_COUNT(kSyscalls, 1);
+        if (::fstatat(item.parent_fd, item.name->c_str(), &st,
+                      AT_SYMLINK_NOFOLLOW) != 0) {
+          std::lock_guard<std::mutex> lock(entries_mutex);
+          walk_error = "Failed to stat " + (dir / *item.rel_path).string();
+          return WalkAction::kStop;
+        }
+        ManifestEntry entry;
+        entry.path = *item.rel_path;
+        entry.size = static_cast<std::uint64_t>(st.st_size);
+        entry.mtime_ns = MtimeNs(st);
+        auto known = LowerBound(previous, previous.begin(), entry.path);
+        const bool same = known != previous.end() &&
+                          known->path == entry.path &&
+                          known->size == entry.size &&
+                          known->mtime_ns == entry.mtime_ns;
+        if (same) {
+          entry.hash = known->hash;
+        } else {
+          const int fd = ::openat(item.parent_fd, item.name->c_str(),
+                                  O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+          UHD_TRACE_COUNT(kSyscalls, 2);
+          const bool ok = fd >= 0 && HashFd(fd, &entry.hash, &entry.size);
+          if (fd >= 0) {
+            ::close(fd);
+          }
+          if (!ok) {
+            std::lock_guard<std::mutex> lock(entries_mutex);
+            walk_error = "Failed to hash " + (dir / entry.path).string();
+            return WalkAction::kStop;
+          }
+        }
+        std::lock_guard<std::mutex> lock(entries_mutex);
+        if (!same) {
+          touched.push_back(entry.path);
+        }
+        entries.push_back(std::move(entry));
+        return WalkAction::kContinue;
+      },
+      nullptr, error);
+  if (!walked) {
+    return false;
+  }
+  if (!walk_error.empty()) {
+    if (error) {
+      *error = walk_error;
+    }
+    return false;
+  }
+
+  SortEntries(&entries);
+  // Whatever the walk did not see was removed.
+  for (const auto& entry : previous) {
+    auto found = LowerBound(entries, entries.begin(), entry.path);
+    if (found == entries.end() || found->path != entry.path) {
+      touched.push_back(entry.path);
+    }
+  }
+  manifest->entries = std::move(entries);
+  UpdateMerkle(manifest, touched);
+  if (changed) {
+    *changed = std::move(touched);
+  }
+  return true;
+}
+
+json_min::Value ManifestToJson(const Manifest& manifest) {
+  const Manifest* hashed = &manifest;
+  Manifest computed;
+  if (manifest.dir_hashes.empty()) {
+    // Cheap next to the file hashes; entries are copied only for this.
+    computed.entries = manifest.entries;
+    SortEntries(&computed.entries);
+    ComputeMerkle(&computed);
+    hashed = &computed;
+  }
+  json_min::Object dirs;
+  for (const auto& [dir, hash] : hashed->dir_hashes) {
+    if (!dir.empty()) {
+      dirs.emplace(dir, json_min::Value(hash));
+    }
+  }
+  json_min::Array files;
+  files.reserve(manifest.entries.size());
+  for (const auto& entry : manifest.entries) {
+    json_min::Object obj;
+    obj.emplace("path", json_min::Value(entry.path));
+    obj.emplace("size", json_min::Value(static_cast<double>(entry.size)));
+    obj.emplace("mtime_ns", json_min::Value(std::to_string(entry.mtime_ns)));
+    obj.emplace("sha256", json_min::Value(entry.hash));
+    files.push_back(json_min::Value(std::move(obj)));
+  }
+  json_min::Object root;
+  root.emplace("root", json_min::Value(hashed->RootHash()));
+  root.emplace("dirs", json_min::Value(std::move(dirs)));
+  root.emplace("files", json_min::Value(std::move(files)));
+  return json_min::Value(std::move(root));
+}
+
+bool ManifestFromJson(const json_min::Value& root, Manifest* manifest,
+                      std::string* error) {
+  const auto* obj = root.AsObject();
+  if (!obj) {
+    if (error) {
+      *error = "Manifest root is not an object";
+    }
+    return false;
+  }
+  auto files = obj->find("files");
+  if (files == obj->end() || !files->second.IsArray()) {
+    if (error) {
+      *error = "Manifest has no file list";
+    }
+    return false;
+  }
+
+  manifest->entries.clear();
+  for (const auto& item : *files->second.AsArray()) {
+    const auto* file = item.AsObject();
+    if (!file) {
+      continue;
+    }
+    ManifestEntry entry;
+    for (const auto& [key, value] : *file) {
+      if (key == "path" && value.IsString()) {
+        entry.path = *value.AsString();
+      } else if (key == "size" && value.IsNumber()) {
+        entry.size = static_cast<std::uint64_t>(*value.AsNumber());
+      } else if (key == "mtime_ns" && value.IsString()) {
+        const std::string& text = *value.AsString();
+        const char* end = text.data() + text.size();
+        const auto parsed =
+            std::from_chars(text.data(), end, entry.mtime_ns);
+        if (parsed.ec != std::errc() || parsed.ptr != end) {
+          if (error) {
+            *error = "Manifest has an invalid mtime_ns: " + text;
+          }
+          return false;
+        }
+      } else if (key == "sha256" && value.IsString()) {
+        entry.hash = *value.AsString();
+      }
+    }
+    if (entry.path.empty()) {
+      continue;
+    }
+    // Paths are joined to a profile folder, and bundles bring manifests
+    // from other hosts, so only plain relative paths are accepted.
+    std::string cleaned;
+    if (!SafeRelativePath(entry.path, &cleaned) || cleaned != entry.path) {
+      if (error) {
+        *error = "Manifest has an unsafe path: " + entry.path;
+      }
+      return false;
+    }
+    manifest->entries.push_back(std::move(entry));
+  }
+  SortEntries(&manifest->entries);
+
+  // Manifests written before directory hashes existed get them here.
+  manifest->dir_hashes.clear();
+  auto root_hash = obj->find("root");
+  auto dirs = obj->find("dirs");
+  if (root_hash != obj->end() && root_hash->second.IsString() &&
+      dirs != obj->end() && dirs->second.IsObject()) {
+    manifest->dir_hashes.emplace("", *root_hash->second.AsString());
+    for (const auto& [dir, hash] : *dirs->second.AsObject()) {
+      if (hash.IsString()) {
+        manifest->dir_hashes.emplace(dir, *hash.AsString());
+      }
+    }
+  } else {
+    ComputeMerkle(manifest);
+  }
+  return true;
+}
+
+bool LoadManifest(const std::filesystem::path& path, Manifest* manifest,
+                  std::string* error) {
+  std::ifstream input(path);
+  if (!input.is_open()) {
+    if (error) {
+      *error = "Failed to open manifest: " + path.string();
+    }
+    return false;
+  }
+  std::string content((std::istreambuf_iterator<char>(input)),
+                      std::istreambuf_iterator<char>());
+  json_min::Value root;
+  try {
+    json_min::Parser parser(std::move(content));
+    root = parser.Parse();
+  } catch (const std::exception& ex) {
+    if (error) {
+      *error = std::string("Failed to parse manifest: ") + ex.what();
+    }
+    return false;
+  }
+  return ManifestFromJson(root, manifest, error);
+}
+
+bool SaveManifest(const std::filesystem::path& path, const Manifest& manifest,
+                  std::string* error) {
+  std::error_code ec;
+  std::filesystem::create_directories(path.parent_path(), ec);
+  const auto temp = path.parent_path() / (path.filename().string() + ".tmp");
+  {
+    std::ofstream output(temp);
+    if (!output.is_open()) {
+      if (error) {
+        *error = "Failed to write manifest: " + path.string();
+      }
+      return false;
+    }
+    output << json_min::Serialize(ManifestToJson(manifest), 1) << '\n';
+  }
+  std::filesystem::rename(temp, path, ec);
+  if (ec) {
+    if (error) {
+      *error = "Failed to write manifest: " + path.string();
+    }
+    return false;
+  }
+  return true;
+}
+
+ManifestDiff DiffManifests(const Manifest& expected, const Manifest& actual) {
+  ManifestDiff diff;
+  auto a = expected.entries.begin();
+  auto b = actual.entries.begin();
+  while (a != expected.entries.end() || b != actual.entries.end()) {
+    if (b == actual.entries.end() ||
+        (a != expected.entries.end() && a->path < b->path)) {
+      diff.removed.push_back(a->path);
+      ++a;
+    } else if (a == expected.entries.end() || b->path < a->path) {
+      diff.added.push_back(b->path);
+      ++b;
+    } else {
+      if (a->size != b->size || a->hash != b->hash) {
+        diff.changed.push_back(a->path);
+      }
+      ++a;
+      ++b;
+    }
+  }
+  return diff;
+}
+
+ManifestDiff DiffManifestTrees(const Manifest& expected,
+                               const Manifest& actual) {
+  if (expected.dir_hashes.empty() || actual.dir_hashes.empty()) {
+    return DiffManifests(expected, actual);
+  }
+  ManifestDiff diff;
+  DiffDirectory(expected, actual, "", &diff);
+  return diff;
+}
+
+std::string DescribeDiff(const ManifestDiff& diff) {
+  if (diff.empty()) {
+    return "no differences";
+  }
+  std::string out;
+  const auto append = [&](const char* label,
+                          const std::vector<std::string>& paths) {
+    for (const auto& path : paths) {
+      if (!out.empty()) {
+        out += ", ";
+      }
+      out += label + path;
+    }
+  };
+  append("+", diff.added);
+  append("-", diff.removed);
+  append("~", diff.changed);
+  return out;
+}
+
+}  // namespace uhd_helper
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "json_min.hpp"
+
+namespace uhd_helper {
+
+struct ManifestEntry {
+  std::string path;
+  std::uint64_t size = 0;
+  std::int64_t mtime_ns = 0;
+  std::string hash;
+};
+
+struct Manifest {
+  std::vector<ManifestEntry> entries;
+  // Merkle hash of every directory that holds files, keyed by relative
+  // path with "" for the root. A directory hashes the names, sizes and
+  // hashes of its files and the hashes of its subdirectories, so two trees
+  // are equal exactly when their root hashes are.
+  std::map<std::string, std::string> dir_hashes;
+
+  const std::string& RootHash() const;
+};
+
+struct ManifestDiff {
+  std::vector<std::string> added;
+  std::vector<std::string> removed;
+  std::vector<std::string> changed;
+
+  bool empty() const {
+    return added.empty() && removed.empty() && changed.empty();
+  }
+};
+
+// Hashes every regular file below dir; entries are sorted by relative path.
+bool BuildManifest(const std::filesystem::path& dir, Manifest* manifest,
+                   std::string* error);
+// Brings manifest up to date with dir, hashing only files whose size or
+// mtime differ from their entry, and updates directory hashes above the
+// changed paths. changed (optional) receives them.
+bool RefreshManifest(const std::filesystem::path& dir, Manifest* manifest,
+                     std::vector<std::string>* changed, std::string* error);
+// Recomputes every directory hash; entries must be sorted by path.
+void ComputeMerkle(Manifest* manifest);
+// Recomputes only the directories above changed_paths, which may name
+// added, removed or modified files. Costs O(changed directories * their
+// children) instead of a pass over every entry.
+void UpdateMerkle(Manifest* manifest,
+                  const std::vector<std::string>& changed_paths);
+// The on-disk form: {"root": hex, "dirs": {path: hex, ...},
+// "files": [{path, size, mtime_ns, sha256}, ...]}. Hashes are computed on
+// the way out when missing and on the way in when absent from the file.
+json_min::Value ManifestToJson(const Manifest& manifest);
+bool ManifestFromJson(const json_min::Value& root, Manifest* manifest,
+                      std::string* error);
+bool LoadManifest(const std::filesystem::path& path, Manifest* manifest,
+                  std::string* error);
+bool SaveManifest(const std::filesystem::path& path, const Manifest& manifest,
+                  std::string* error);
+ManifestDiff DiffManifests(const Manifest& expected, const Manifest& actual);
+// Same result as DiffManifests, but skips every subtree whose directory
+// hash matches, so identical trees cost one comparison.
+ManifestDiff DiffManifestTrees(const Manifest& expected,
+                               const Manifest& actual);
+std::string DescribeDiff(const ManifestDiff& diff);
+
+}  // namespace uhd_helper
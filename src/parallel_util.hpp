@@ -0,0 +1,53 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+#include "throttle_util.hpp"
+
+namespace uhd_helper {
+
+inline std::size_t DefaultWorkerCount() {
+  const unsigned int hw = std::thread::hardware_concurrency();
+  return hw == 0 ? 1 : static_cast<std::size_t>(hw);
+}
+
+// Runs fn(i) for every i in [0, count) on up to max_workers threads. The
+// calling thread takes part, so count == 1 never spawns a thread. Spawned
+// threads run at background priority when the throttle asks for it, and
+// the calling thread at idle I/O priority until it returns.
+template <typename Fn>
+void ParallelFor(std::size_t count, Fn&& fn, std::size_t max_workers = 0) {
+  if (count == 0) {
+    return;
+  }
+  if (max_workers == 0) {
+    max_workers = DefaultWorkerCount();
+  }
+  const std::size_t workers = std::min(count, max_workers);
+  std::atomic<std::size_t> next{0};
+  const auto run = [&]() {
+    for (std::size_t i = next.fetch_add(1); i < count; i = next.fetch_add(1)) {
+      fn(i);
+    }
+  };
+
+  const IdleIoScope idle_io;
+  std::vector<std::thread> threads;
+  threads.reserve(workers - 1);
+  for (std::size_t i = 1; i < workers; ++i) {
+    threads.emplace_back([&run] {
+      Throttle::Instance().EnterBackground();
+      run();
+    });
+  }
+  run();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+}  // namespace uhd_helper
@@ -0,0 +1,270 @@
+#include "profile_list.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <utility>
+
+namespace uhd_helper {
+namespace {
+
+void LowerInPlace(std::string* text) {
+  for (auto& ch : *text) {
+    ch = static_cast<char>(std::tolower(static_cast<unsigned char>(ch)));
+  }
+}
+
+std::string ToLowerAscii(const std::string& value) {
+  std::string lower = value;
+  LowerInPlace(&lower);
+  return lower;
+}
+
+bool IsWordBoundary(char ch) {
+  return ch == '_' || ch == '-' || ch == ' ' || ch == '.' || ch == '/';
+}
+
+template <typename T>
+std::size_t CapacityBytes(const std::vector<T>& v) {
+  return v.capacity() * sizeof(T);
+}
+
+// Greedy subsequence match with query[0] pinned at start.
+int ScoreFrom(std::string_view text, std::string_view query,
+              std::size_t start) {
+  int score = 0;
+  int run = 0;
+  std::size_t pos = start;
+  std::size_t previous = std::string_view::npos;
+  for (const char ch : query) {
+    pos = text.find(ch, pos);
+    if (pos == std::string_view::npos) {
+      return -1;
+    }
+    score += 1;
+    if (previous != std::string_view::npos && pos == previous + 1) {
+      ++run;
+      score += 2 * run;
+    } else {
+      run = 0;
+    }
+    if (pos == 0 || IsWordBoundary(text[pos - 1])) {
+      score += 3;
+    }
+    previous = pos++;
+  }
+  return score;
+}
+
+}  // namespace
+
+int FuzzyScore(std::string_view text_lower, std::string_view query_lower) {
+  if (query_lower.empty()) {
+    return 0;
+  }
+  // The leftmost anchor is not always the best one ("b210" in
+  // "build_1_b210"), so every occurrence of the first character is tried.
+  int best = -1;
+  for (std::size_t start = text_lower.find(query_lower[0]);
+       start != std::string_view::npos;
+       start = text_lower.find(query_lower[0], start + 1)) {
+    const int score = ScoreFrom(text_lower, query_lower, start);
+    if (score < 0) {
+      break;
+    }
+    best = std::max(best, score);
+  }
+  if (best < 0) {
+    return -1;
+  }
+  // Prefer texts that are mostly matched.
+  return best - static_cast<int>(std::min<std::size_t>(
+                    text_lower.size() - query_lower.size(), 16) /
+                4);
+}
+
+bool ProfileListModel::Sync(const std::vector<Profile>& profiles,
+                            const std::string& active_id) {
+  bool structural = profiles.size() != table_.size() ||
+                    table_.strings().bytes() > 2 * rebuilt_bytes_ + 4096;
+  for (std::size_t i = 0; !structural && i < profiles.size(); ++i) {
+    structural = table_.id(i) != profiles[i].id;
+  }
+
+  if (structural) {
+    // Rebuilding reuses every buffer, so it costs no more allocations
+    // than patching would.
+    table_.Assign(profiles);
+    const std::size_t count = profiles.size();
+    labels_.resize(count);
+    id_lower_.resize(count);
+    name_lower_.resize(count);
+    active_.resize(count);
+    for (std::size_t row = 0; row < count; ++row) {
+      Derive(row, profiles[row].id == active_id);
+    }
+    rebuilt_bytes_ = table_.strings().bytes();
+    Refilter(false);
+    return true;
+  }
+
+  bool changed = false;
+  bool text_changed = false;
+  for (std::size_t row = 0; row < profiles.size(); ++row) {
+    const Profile& profile = profiles[row];
+    const bool active = profile.id == active_id;
+    const bool renamed = table_.display_name(row) != profile.display_name;
+    if (!renamed && (active_[row] != 0) == active &&
+        table_.is_official(row) == profile.is_official &&
+        table_.packed(row) == profile.packed &&
+        table_.uhd_version(row) == profile.uhd_version) {
+      continue;
+    }
+    table_.Set(row, profile);
+    Derive(row, active);
+    changed = true;
+    text_changed = text_changed || renamed;
+  }
+
+  if (text_changed) {
+    Refilter(false);
+  }
+  return changed;
+}
+
+void ProfileListModel::Derive(std::size_t row, bool active) {
+  StringArena& strings = table_.strings();
+  scratch_.assign(table_.display_name(row));
+  if (active) {
+    scratch_ += " [active]";
+  }
+  if (table_.is_official(row)) {
+    scratch_ += " (official)";
+  }
+  if (table_.packed(row)) {
+    scratch_ += " [packed]";
+  }
+  if (!table_.uhd_version(row).empty()) {
+    scratch_ += " [UHD ";
+    scratch_ += table_.uhd_version(row);
+    scratch_ += "]";
+  }
+  labels_[row] = strings.Intern(scratch_);
+  scratch_.assign(table_.display_name(row));
+  LowerInPlace(&scratch_);
+  name_lower_[row] = strings.Intern(scratch_);
+  scratch_.assign(table_.id(row));
+  LowerInPlace(&scratch_);
+  id_lower_[row] = strings.Intern(scratch_);
+  active_[row] = active ? 1 : 0;
+}
+
+ProfileListModel::Entry ProfileListModel::at(std::size_t view_index) const {
+  const std::size_t row = matches_[view_index];
+  Entry entry;
+  entry.id = table_.id(row);
+  entry.display_name = table_.display_name(row);
+  entry.label = table_.strings().View(labels_[row]);
+  entry.active = active_[row] != 0;
+  entry.official = table_.is_official(row);
+  entry.packed = table_.packed(row);
+  return entry;
+}
+
+std::size_t ProfileListModel::MemoryBytes() const {
+  return table_.MemoryBytes() + CapacityBytes(labels_) +
+         CapacityBytes(id_lower_) + CapacityBytes(name_lower_) +
+         CapacityBytes(active_) + CapacityBytes(matches_) +
+         CapacityBytes(scored_) + scratch_.capacity();
+}
+
+void ProfileListModel::SetFilter(const std::string& query) {
+  std::string lower = ToLowerAscii(query);
+  if (lower == filter_lower_) {
+    filter_ = query;
+    return;
+  }
+  // Anything matching the longer query also matched its prefix, so the
+  // current matches are the only candidates.
+  const bool narrow = !filter_lower_.empty() &&
+                      lower.compare(0, filter_lower_.size(), filter_lower_) == 0;
+  filter_ = query;
+  filter_lower_ = std::move(lower);
+  Refilter(narrow);
+}
+
+int ProfileListModel::IndexOf(const std::string& id) const {
+  const std::size_t row = table_.Find(id);
+  if (row == ProfileTable::npos) {
+    return -1;
+  }
+  for (std::size_t i = 0; i < matches_.size(); ++i) {
+    if (matches_[i] == row) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+int ProfileListModel::Score(std::size_t row) const {
+  // Space separated terms must all match, each against id or name.
+  int total = 0;
+  std::size_t start = 0;
+  while (start < filter_lower_.size()) {
+    std::size_t end = filter_lower_.find(' ', start);
+    if (end == std::string::npos) {
+      end = filter_lower_.size();
+    }
+    if (end > start) {
+      const std::string_view term =
+          std::string_view(filter_lower_).substr(start, end - start);
+      const StringArena& strings = table_.strings();
+      const int score =
+          std::max(FuzzyScore(strings.View(id_lower_[row]), term),
+                   FuzzyScore(strings.View(name_lower_[row]), term));
+      if (score < 0) {
+        return -1;
+      }
+      total += score;
+    }
+    start = end + 1;
+  }
+  return total;
+}
+
+void ProfileListModel::Refilter(bool narrow) {
+  const std::size_t count = table_.size();
+  if (filter_lower_.empty()) {
+    matches_.resize(count);
+    for (std::size_t i = 0; i < count; ++i) {
+      matches_[i] = static_cast<std::uint32_t>(i);
+    }
+    return;
+  }
+
+  scored_.clear();
+  const auto consider = [&](std::uint32_t row) {
+    const int score = Score(row);
+    if (score >= 0) {
+      scored_.emplace_back(score, row);
+    }
+  };
+  if (narrow) {
+    for (const std::uint32_t row : matches_) {
+      consider(row);
+    }
+  } else {
+    for (std::size_t i = 0; i < count; ++i) {
+      consider(static_cast<std::uint32_t>(i));
+    }
+  }
+  // Rows are unique, so the tie-break makes a plain sort stable.
+  std::sort(scored_.begin(), scored_.end(), [](const auto& a, const auto& b) {
+    return a.first != b.first ? a.first > b.first : a.second < b.second;
+  });
+  matches_.clear();
+  for (const auto& item : scored_) {
+    matches_.push_back(item.second);
+  }
+}
+
+}  // namespace uhd_helper
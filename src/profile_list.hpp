@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "profile_table.hpp"
+#include "profile_util.hpp"
+
+namespace uhd_helper {
+
+// Scores query as a subsequence of text, both already lower case. Returns
+// -1 when it does not match; higher is better. Consecutive characters and
+// matches at word starts ('_', '-', ' ', '.', '/') score extra.
+int FuzzyScore(std::string_view text_lower, std::string_view query_lower);
+
+// Backing store for the TUI profile list. Rows live in a ProfileTable with
+// their label and lower-case forms interned in its arena, are patched in
+// place when profiles change, and the filtered view is maintained
+// incrementally as the query grows. A query is split on spaces and every
+// term has to match the id or the display name.
+class ProfileListModel {
+ public:
+  // Views into the model, valid until the next Sync.
+  struct Entry {
+    std::string_view id;
+    std::string_view display_name;
+    std::string_view label;
+    bool active = false;
+    bool official = false;
+    bool packed = false;
+  };
+
+  // Brings the rows in line with profiles. Rows whose id, name and flags
+  // are unchanged are kept as they are. Returns true if anything changed.
+  bool Sync(const std::vector<Profile>& profiles, const std::string& active_id);
+
+  // Narrows the current matches when query extends the previous one and
+  // rescans every entry otherwise.
+  void SetFilter(const std::string& query);
+  const std::string& filter() const { return filter_; }
+
+  // Filtered view, best match first while a filter is set and in profile
+  // order otherwise.
+  std::size_t size() const { return matches_.size(); }
+  bool empty() const { return matches_.empty(); }
+  Entry at(std::size_t view_index) const;
+  std::size_t total() const { return table_.size(); }
+
+  // View position of id, or -1 when it is filtered out or unknown.
+  int IndexOf(const std::string& id) const;
+  // Heap bytes held by the rows, their strings and the view.
+  std::size_t MemoryBytes() const;
+
+ private:
+  // Interns the label and lower-case forms of row.
+  void Derive(std::size_t row, bool active);
+  void Refilter(bool narrow);
+  int Score(std::size_t row) const;
+
+  ProfileTable table_;
+  std::vector<StringArena::Ref> labels_;
+  std::vector<StringArena::Ref> id_lower_;
+  std::vector<StringArena::Ref> name_lower_;
+  std::vector<std::uint8_t> active_;
+  // Arena size after the last full rebuild; renames append, and Sync
+  // rebuilds once they have doubled it.
+  std::size_t rebuilt_bytes_ = 0;
+  // Reused for labels and lower-casing.
+  std::string scratch_;
+  std::vector<std::uint32_t> matches_;
+  std::vector<std::pair<int, std::uint32_t>> scored_;
+  std::string filter_;
+  std::string filter_lower_;
+};
+
+}  // namespace uhd_helper
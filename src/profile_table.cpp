@@ -0,0 +1,188 @@
+#include "profile_table.hpp"
+
+#include <algorithm>
+#include <string>
+
+namespace uhd_helper {
+namespace {
+
+std::uint64_t HashText(std::string_view text) {
+  std::uint64_t hash = 1469598103934665603ULL;
+  for (const unsigned char c : text) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+template <typename T>
+std::size_t CapacityBytes(const std::vector<T>& v) {
+  return v.capacity() * sizeof(T);
+}
+
+}  // namespace
+
+StringArena::StringArena() { Clear(); }
+
+std::size_t StringArena::Slot(std::string_view text) const {
+  const std::size_t mask = slots_.size() - 1;
+  std::size_t slot = static_cast<std::size_t>(HashText(text)) & mask;
+  while (slots_[slot] != kNone && View(slots_[slot]) != text) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+void StringArena::Rehash(std::size_t slot_count) {
+  slots_.assign(slot_count, kNone);
+  for (Ref ref = 0; ref < spans_.size(); ++ref) {
+    slots_[Slot(View(ref))] = ref;
+  }
+}
+
+StringArena::Ref StringArena::Intern(std::string_view text) {
+  std::size_t slot = Slot(text);
+  if (slots_[slot] != kNone) {
+    return slots_[slot];
+  }
+  const Span span = {static_cast<std::uint32_t>(data_.size()),
+                     static_cast<std::uint32_t>(text.size())};
+  data_.insert(data_.end(), text.begin(), text.end());
+  const auto ref = static_cast<Ref>(spans_.size());
+  spans_.push_back(span);
+  slots_[slot] = ref;
+  if (spans_.size() * 2 > slots_.size()) {
+    Rehash(slots_.size() * 2);
+  }
+  return ref;
+}
+
+StringArena::Ref StringArena::Find(std::string_view text) const {
+  return slots_[Slot(text)];
+}
+
+void StringArena::Reserve(std::size_t strings, std::size_t bytes) {
+  data_.reserve(data_.size() + bytes);
+  spans_.reserve(spans_.size() + strings);
+  std::size_t slot_count = slots_.size();
+  while ((spans_.size() + strings) * 2 > slot_count) {
+    slot_count *= 2;
+  }
+  if (slot_count != slots_.size()) {
+    Rehash(slot_count);
+  }
+}
+
+void StringArena::Clear() {
+  data_.clear();
+  spans_.clear();
+  std::fill(slots_.begin(), slots_.end(), kNone);
+  if (slots_.empty()) {
+    slots_.assign(16, kNone);
+  }
+  Intern("");
+}
+
+std::size_t StringArena::MemoryBytes() const {
+  return CapacityBytes(data_) + CapacityBytes(spans_) + CapacityBytes(slots_);
+}
+
+void ProfileTable::Clear() {
+  strings_.Clear();
+  ids_.clear();
+  names_.clear();
+  folders_.clear();
+  hashes_.clear();
+  versions_.clear();
+  sizes_.clear();
+  last_used_.clear();
+  flags_.clear();
+  row_by_ref_.clear();
+}
+
+void ProfileTable::Assign(const std::vector<Profile>& profiles) {
+  Clear();
+  const std::size_t count = profiles.size();
+  // Sized for every string being distinct; shared ones leave slack.
+  std::size_t bytes = 0;
+  for (const auto& profile : profiles) {
+    bytes += profile.id.size() + profile.display_name.size() +
+             profile.folder_name.size() + profile.root_hash.size() +
+             profile.uhd_version.size();
+  }
+  strings_.Reserve(count * 5, bytes);
+  ids_.resize(count);
+  names_.resize(count);
+  folders_.resize(count);
+  hashes_.resize(count);
+  versions_.resize(count);
+  sizes_.resize(count);
+  last_used_.resize(count);
+  flags_.resize(count);
+  for (std::size_t row = 0; row < count; ++row) {
+    Set(row, profiles[row]);
+  }
+}
+
+void ProfileTable::Set(std::size_t row, const Profile& profile) {
+  const StringArena::Ref id = strings_.Intern(profile.id);
+  if (id != ids_[row] && ids_[row] < row_by_ref_.size() &&
+      row_by_ref_[ids_[row]] == row) {
+    row_by_ref_[ids_[row]] = StringArena::kNone;
+  }
+  ids_[row] = id;
+  names_[row] = strings_.Intern(profile.display_name);
+  folders_[row] = strings_.Intern(profile.folder_name);
+  hashes_[row] = strings_.Intern(profile.root_hash);
+  versions_[row] = strings_.Intern(profile.uhd_version);
+  sizes_[row] = profile.size_bytes;
+  last_used_[row] = profile.last_used;
+  flags_[row] = static_cast<std::uint8_t>(
+      (profile.is_official ? kOfficial : 0) | (profile.packed ? kPacked : 0));
+  IndexRow(row);
+}
+
+void ProfileTable::IndexRow(std::size_t row) {
+  const StringArena::Ref id = ids_[row];
+  if (id >= row_by_ref_.size()) {
+    row_by_ref_.resize(std::max<std::size_t>(id + 1, strings_.count()),
+                       StringArena::kNone);
+  }
+  // The first row keeps a duplicated id, like FindProfileById.
+  if (row_by_ref_[id] == StringArena::kNone || row_by_ref_[id] > row) {
+    row_by_ref_[id] = static_cast<std::uint32_t>(row);
+  }
+}
+
+Profile ProfileTable::Get(std::size_t row) const {
+  Profile profile;
+  profile.id = std::string(id(row));
+  profile.display_name = std::string(display_name(row));
+  profile.folder_name = std::string(folder_name(row));
+  profile.root_hash = std::string(root_hash(row));
+  profile.uhd_version = std::string(uhd_version(row));
+  profile.is_official = is_official(row);
+  profile.packed = packed(row);
+  profile.size_bytes = sizes_[row];
+  profile.last_used = last_used_[row];
+  return profile;
+}
+
+std::size_t ProfileTable::Find(std::string_view id) const {
+  const StringArena::Ref ref = strings_.Find(id);
+  if (ref == StringArena::kNone || ref >= row_by_ref_.size() ||
+      row_by_ref_[ref] == StringArena::kNone) {
+    return npos;
+  }
+  return row_by_ref_[ref];
+}
+
+std::size_t ProfileTable::MemoryBytes() const {
+  return strings_.MemoryBytes() + CapacityBytes(ids_) +
+         CapacityBytes(names_) + CapacityBytes(folders_) +
+         CapacityBytes(hashes_) + CapacityBytes(versions_) +
+         CapacityBytes(sizes_) + CapacityBytes(last_used_) +
+         CapacityBytes(flags_) + CapacityBytes(row_by_ref_);
+}
+
+}  // namespace uhd_helper
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "profile_util.hpp"
+
+namespace uhd_helper {
+
+// Interned strings in one buffer. Equal strings share a copy, and adding
+// one costs no allocation of its own, only the occasional growth of the
+// buffer and the hash table. Refs stay valid until Clear; views until the
+// next Intern.
+class StringArena {
+ public:
+  using Ref = std::uint32_t;
+  static constexpr Ref kNone = 0xffffffffu;
+  // Always present, so default-initialized refs read as "".
+  static constexpr Ref kEmpty = 0;
+
+  StringArena();
+
+  Ref Intern(std::string_view text);
+  // The ref of text if it was interned, kNone otherwise.
+  Ref Find(std::string_view text) const;
+  std::string_view View(Ref ref) const {
+    const Span& span = spans_[ref];
+    return std::string_view(data_.data() + span.offset, span.length);
+  }
+  std::size_t count() const { return spans_.size(); }
+  std::size_t bytes() const { return data_.size(); }
+  // Makes room for strings more entries holding bytes more characters,
+  // so a known fill grows nothing.
+  void Reserve(std::size_t strings, std::size_t bytes);
+  // Keeps the capacity for the next fill.
+  void Clear();
+  std::size_t MemoryBytes() const;
+
+ private:
+  struct Span {
+    std::uint32_t offset;
+    std::uint32_t length;
+  };
+
+  std::size_t Slot(std::string_view text) const;
+  void Rehash(std::size_t slot_count);
+
+  std::vector<char> data_;
+  std::vector<Span> spans_;
+  // Open addressing with linear probing, at most half full.
+  std::vector<Ref> slots_;
+};
+
+// A profile list as one column per field, every string interned in a
+// shared arena. 10k profiles take a few allocations instead of four
+// strings each, and rows compare their strings by ref.
+class ProfileTable {
+ public:
+  static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+  // Replaces the contents, reusing the columns' and the arena's capacity.
+  void Assign(const std::vector<Profile>& profiles);
+  // Overwrites one row in place; new strings are appended to the arena.
+  void Set(std::size_t row, const Profile& profile);
+  void Clear();
+
+  std::size_t size() const { return ids_.size(); }
+  std::string_view id(std::size_t row) const {
+    return strings_.View(ids_[row]);
+  }
+  std::string_view display_name(std::size_t row) const {
+    return strings_.View(names_[row]);
+  }
+  std::string_view folder_name(std::size_t row) const {
+    return strings_.View(folders_[row]);
+  }
+  std::string_view root_hash(std::size_t row) const {
+    return strings_.View(hashes_[row]);
+  }
+  std::string_view uhd_version(std::size_t row) const {
+    return strings_.View(versions_[row]);
+  }
+  bool is_official(std::size_t row) const {
+    return (flags_[row] & kOfficial) != 0;
+  }
+  bool packed(std::size_t row) const { return (flags_[row] & kPacked) != 0; }
+  std::uint64_t size_bytes(std::size_t row) const { return sizes_[row]; }
+  std::int64_t last_used(std::size_t row) const { return last_used_[row]; }
+  Profile Get(std::size_t row) const;
+
+  // Row of the first profile with id, or npos.
+  std::size_t Find(std::string_view id) const;
+
+  // For strings derived from the rows, such as labels, so they share the
+  // buffer.
+  StringArena& strings() { return strings_; }
+  const StringArena& strings() const { return strings_; }
+  // Heap bytes held by the columns and the arena.
+  std::size_t MemoryBytes() const;
+
+ private:
+  static constexpr std::uint8_t kOfficial = 1;
+  static constexpr std::uint8_t kPacked = 2;
+
+  void IndexRow(std::size_t row);
+
+  StringArena strings_;
+  std::vector<StringArena::Ref> ids_;
+  std::vector<StringArena::Ref> names_;
+  std::vector<StringArena::Ref> folders_;
+  std::vector<StringArena::Ref> hashes_;
+  std::vector<StringArena::Ref> versions_;
+  std::vector<std::uint64_t> sizes_;
+  std::vector<std::int64_t> last_used_;
+  std::vector<std::uint8_t> flags_;
+  // Row by interned id ref, kNone where the ref is no id.
+  std::vector<std::uint32_t> row_by_ref_;
+};
+
+}  // namespace uhd_helper
@@ -1,12 +1,34 @@
 #include "profile_util.hpp"
 
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <cctype>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
 #include <unordered_set>
 
+#include "archive_util.hpp"
 #include "config_util.hpp"
 #include "file_util.hpp"
+#include "hash_util.hpp"
+#include "index_util.hpp"
+#include "json_min.hpp"
+#include "manifest_util.hpp"
+#include "parallel_util.hpp"
 #include "res.hpp"
+#include "throttle_util.hpp"
+#include "trace_util.hpp"
+#include "walk_util.hpp"
 
 namespace uhd_helper {
 namespace {
@@ -39,283 +61,3612 @@ bool FolderExists(const std::filesystem::path& path) {
   return FileUtil::Exists(path) && FileUtil::IsDir(path);
 }
 
-}  // namespace
+std::filesystem::path RootImagesPath(const UhdRoot& root) {
+  return root.uhd_dir / root.images_folder_name;
+}
 
-ProfileManager::ProfileManager(ConfigManager* config_manager)
-    : config_manager_(config_manager) {}
+std::filesystem::path ProfileContentPath(const UhdRoot& root,
+                                         const Profile& profile) {
+  if (profile.id == root.active_profile_id &&
+      FolderExists(RootImagesPath(root))) {
+    return RootImagesPath(root);
+  }
+  return root.uhd_dir / profile.folder_name;
+}
 
-bool ProfileManager::Initialize(std::string* error) {
-  if (!config_manager_) {
-    if (error) {
-      *error = "Config manager is not set";
-    }
-    return false;
+// The UHD release of a new profile copied from source: what source records,
+// or the installed release for the official images, which come with it.
+std::string ReleaseOfSource(const UhdRoot& root, const Profile* source) {
+  if (!source) {
+    return "";
   }
-  if (!config_manager_->Load(error)) {
-    return false;
+  if (!source->uhd_version.empty() || !source->is_official) {
+    return source->uhd_version;
   }
-  return RefreshFromDisk(error);
+  return FormatUhdRelease(InstalledUhdRelease(root.uhd_dir));
 }
 
-const std::vector<Profile>& ProfileManager::Profiles() const {
-  return config_manager_->config().profiles;
+std::filesystem::path ManifestsDir(const ConfigManager& config_manager) {
+  return config_manager.path().parent_path() / "manifests";
 }
 
-std::string ProfileManager::ActiveProfileId() const {
-  return config_manager_->config().active_profile_id;
+std::int64_t MtimeNs(const struct stat& st) {
+  return static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000LL +
+         st.st_mtim.tv_nsec;
 }
 
-std::filesystem::path ProfileManager::UhdDir() const {
-  return config_manager_->config().uhd_dir;
-}
+// A file of an existing profile, as its manifest recorded it.
+struct KnownFile {
+  std::filesystem::path path;
+  std::uint64_t size;
+  std::int64_t mtime_ns;
+};
 
-std::filesystem::path ProfileManager::ImagesPath() const {
-  const auto& cfg = config_manager_->config();
-  return cfg.uhd_dir / cfg.images_folder_name;
+std::string KnownFileKey(std::uint64_t size, const std::string& sha256) {
+  return std::to_string(size) + ":" + sha256;
 }
 
-std::filesystem::path ProfileManager::ConfigPath() const {
-  return config_manager_->path();
+// Only trusted while size and mtime still match the manifest.
+bool KnownFileIntact(const KnownFile& file) {
+  struct stat st;
+  return ::stat(file.path.c_str(), &st) == 0 &&
+         static_cast<std::uint64_t>(st.st_size) == file.size &&
+         MtimeNs(st) == file.mtime_ns;
 }
 
-bool ProfileManager::EnsureUhdDir(std::string* error) const {
-  return FileUtil::EnsureDir(config_manager_->config().uhd_dir, error);
+// Files of every profile with a manifest, keyed by KnownFileKey. With a
+// non-empty same_fs_as only roots on that filesystem are indexed.
+std::unordered_map<std::string, KnownFile> IndexKnownFiles(
+    const AppConfig& cfg, const std::filesystem::path& manifests_dir,
+    const std::filesystem::path& same_fs_as) {
+  std::unordered_map<std::string, KnownFile> known;
+  for (const auto& root : cfg.roots) {
+    if (!same_fs_as.empty() &&
+        !FileUtil::SameFilesystem(root.uhd_dir, same_fs_as)) {
+      continue;
+    }
+    for (const auto& profile : root.profiles) {
+      Manifest manifest;
+      if (!LoadManifest(manifests_dir / root.name / (profile.id + ".json"),
+                        &manifest, nullptr)) {
+        continue;
+      }
+      const auto content = ProfileContentPath(root, profile);
+      for (const auto& entry : manifest.entries) {
+        known.emplace(KnownFileKey(entry.size, entry.hash),
+                      KnownFile{content / entry.path, entry.size,
+                                entry.mtime_ns});
+      }
+    }
+  }
+  return known;
 }
 
-std::string ProfileManager::GenerateProfileId(
-    const std::string& display_name) const {
-  const auto& config = config_manager_->config();
-  std::string base = Slugify(display_name);
-  if (base.empty()) {
-    base = "profile";
+// "-" is stdin, which stays open.
+int OpenInput(const std::filesystem::path& path, std::string* error) {
+  if (path == "-") {
+    return STDIN_FILENO;
+  }
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0 && error) {
+    *error = "Failed to open archive: " + path.string();
   }
+  return fd;
+}
 
-  std::unordered_set<std::string> existing;
-  for (const auto& profile : config.profiles) {
-    existing.insert(profile.id);
+void CloseInput(int fd) {
+  if (fd != STDIN_FILENO) {
+    ::close(fd);
   }
+}
 
-  if (existing.count(base) == 0) {
-    return base;
+constexpr char kBundleMetadata[] = "uhd-helper-bundle.json";
+constexpr char kBundleFormat[] = "uhd-helper-bundle";
+
+// Staging entries are named ".<target><suffix>" beside their target, so
+// fsck can tell the ones an interrupted operation left behind. Besides
+// FileUtil::kStagingSuffix for copies:
+constexpr char kOutgoingSuffix[] = ".outgoing";
+constexpr char kLinkSuffix[] = ".link";
+constexpr char kFarmSuffix[] = ".farm";
+constexpr char kImportSuffix[] = ".import";
+constexpr char kRestoreSuffix[] = ".restore";
+constexpr const char* kStagingSuffixes[] = {
+    FileUtil::kStagingSuffix, kOutgoingSuffix, kLinkSuffix,
+    kFarmSuffix,              kImportSuffix,   kRestoreSuffix,
+};
+
+std::filesystem::path StagingBeside(const std::filesystem::path& target,
+                                    const char* suffix) {
+  return target.parent_path() / ("." + target.filename().string() + suffix);
+}
+
+// One entry of an exported profile tree, in walk order.
+struct BundleItem {
+  std::string rel_path;
+  EntryType type = EntryType::kFile;
+  std::uint32_t mode = 0;
+  std::int64_t mtime = 0;
+  std::string link_target;
+  std::size_t manifest_index = 0;
+};
+
+// A profile as ExportMembers describes it in the bundle metadata.
+struct BundleProfile {
+  std::string root;
+  std::string id;
+  std::string display_name;
+  std::string uhd_version;
+  Manifest manifest;
+};
+
+bool ReadBundleMetadata(const std::filesystem::path& path,
+                        std::string* group_name,
+                        std::vector<BundleProfile>* profiles,
+                        std::string* error) {
+  json_min::Value metadata;
+  try {
+    std::ifstream input(path);
+    std::string content((std::istreambuf_iterator<char>(input)),
+                        std::istreambuf_iterator<char>());
+    json_min::Parser parser(std::move(content));
+    metadata = parser.Parse();
+  } catch (const std::exception& ex) {
+    if (error) {
+      *error = std::string("Not a profile bundle: ") + ex.what();
+    }
+    return false;
   }
-  for (int i = 2; i < 10000; ++i) {
-    std::string candidate = base + "_" + std::to_string(i);
-    if (existing.count(candidate) == 0) {
-      return candidate;
+  const auto* obj = metadata.AsObject();
+  if (!obj) {
+    if (error) {
+      *error = "Not a profile bundle: metadata is not an object";
     }
+    return false;
   }
-  return base + "_x";
-}
-
-bool ProfileManager::RenameActiveToIdle(std::string* error) {
-  auto& cfg = config_manager_->config();
-  const std::filesystem::path images_path = ImagesPath();
-  if (!FolderExists(images_path)) {
-    return true;
+  const json_min::Array* list = nullptr;
+  bool format_ok = false;
+  for (const auto& [key, value] : *obj) {
+    if (key == "format") {
+      format_ok = value.IsString() && *value.AsString() == kBundleFormat;
+    } else if (key == "group" && value.IsString()) {
+      *group_name = *value.AsString();
+    } else if (key == "profiles") {
+      list = value.AsArray();
+    }
+  }
+  if (!format_ok || !list || list->empty()) {
+    if (error) {
+      *error = "Not a profile bundle: " + path.filename().string() +
+               " is missing or incomplete";
+    }
+    return false;
   }
 
-  if (!cfg.active_profile_id.empty()) {
-    Profile* active = FindProfileById(cfg, cfg.active_profile_id);
-    if (active && !active->folder_name.empty()) {
-      const auto dest = cfg.uhd_dir / active->folder_name;
-      if (FolderExists(dest)) {
-        if (!FileUtil::RemoveAll(dest, error)) {
+  for (const auto& item : *list) {
+    const auto* fields = item.AsObject();
+    if (!fields) {
+      continue;
+    }
+    BundleProfile profile;
+    bool has_manifest = false;
+    for (const auto& [key, value] : *fields) {
+      if (key == "manifest") {
+        if (!ManifestFromJson(value, &profile.manifest, error)) {
           return false;
         }
+        has_manifest = true;
+      } else if (!value.IsString()) {
+        continue;
+      } else if (key == "root") {
+        profile.root = *value.AsString();
+      } else if (key == "id") {
+        profile.id = *value.AsString();
+      } else if (key == "display_name") {
+        profile.display_name = *value.AsString();
+      } else if (key == "uhd_version") {
+        profile.uhd_version = *value.AsString();
       }
-      return FileUtil::Rename(images_path, dest, error);
     }
+    if (!has_manifest) {
+      if (error) {
+        *error = "Bundle profile " + profile.id + " has no manifest";
+      }
+      return false;
+    }
+    profiles->push_back(std::move(profile));
   }
-
-  const auto backup_dest = cfg.uhd_dir / cfg.backup_profile_folder;
-  if (FolderExists(backup_dest)) {
-    FileUtil::RemoveAll(backup_dest, nullptr);
-  }
-  return FileUtil::Rename(images_path, backup_dest, error);
+  return true;
 }
 
-bool ProfileManager::ApplyProfile(const std::string& profile_id,
-                                  std::string* error) {
-  if (!EnsureUhdDir(error)) {
+// Lists dir and completes its manifest. Hashes recorded in the saved
+// manifest are reused for files whose size and mtime are unchanged, so an
+// export only reads what it sends.
+bool ScanForExport(const std::filesystem::path& dir,
+                   const std::filesystem::path& recorded_manifest,
+                   Manifest* manifest, std::vector<BundleItem>* items,
+                   std::string* error) {
+  std::string scan_error;
+  const bool walked = TreeWalker::Walk(
+      dir, WalkOptions(),
+      [&](const WalkEntry& item) {
+        struct stat st;
+        if (::fstatat(item.parent_fd, item.name->c_str(), &st,
+                      AT_SYMLINK_NOFOLLOW) != 0) {
+          scan_error = "Failed to stat " + (dir / *item.rel_path).string();
+          return WalkAction::kStop;
+        }
+        BundleItem bundle_item;
+        bundle_item.rel_path = *item.rel_path;
+        bundle_item.type = item.type;
+        bundle_item.mode = st.st_mode & 07777;
+        bundle_item.mtime = st.st_mtim.tv_sec;
+        if (item.type == EntryType::kSymlink) {
+          std::string target(PATH_MAX, '\0');
+          const ssize_t n = ::readlinkat(item.parent_fd, item.name->c_str(),
+                                         &target[0], target.size());
+          if (n < 0) {
+            scan_error = "Failed to read link " +
+                         (dir / *item.rel_path).string();
+            return WalkAction::kStop;
+          }
+          target.resize(static_cast<std::size_t>(n));
+          bundle_item.link_target = std::move(target);
+        } else if (item.type == EntryType::kFile) {
+          ManifestEntry entry;
+          entry.path = *item.rel_path;
+          entry.size = static_cast<std::uint64_t>(st.st_size);
+          entry.mtime_ns = MtimeNs(st);
+          bundle_item.manifest_index = manifest->entries.size();
+          manifest->entries.push_back(std::move(entry));
+        } else if (item.type != EntryType::kDir) {
+          return WalkAction::kContinue;
+        }
+        items->push_back(std::move(bundle_item));
+        return WalkAction::kContinue;
+      },
+      nullptr, error);
+  if (!walked) {
     return false;
   }
-
-  auto& cfg = config_manager_->config();
-  Profile* target = FindProfileById(cfg, profile_id);
-  if (!target) {
+  if (!scan_error.empty()) {
     if (error) {
-      *error = "Unknown profile id: " + profile_id;
+      *error = scan_error;
     }
     return false;
   }
 
-  const auto target_path = cfg.uhd_dir / target->folder_name;
-  if (!FolderExists(target_path)) {
-    if (profile_id == cfg.active_profile_id &&
-        FolderExists(ImagesPath())) {
-      return true;
+  Manifest recorded;
+  std::unordered_map<std::string, const ManifestEntry*> by_path;
+  if (LoadManifest(recorded_manifest, &recorded, nullptr)) {
+    for (const auto& entry : recorded.entries) {
+      by_path.emplace(entry.path, &entry);
     }
-    if (error) {
-      *error = "Profile folder does not exist: " + target_path.string();
+  }
+  std::vector<std::size_t> stale;
+  for (std::size_t i = 0; i < manifest->entries.size(); ++i) {
+    auto& entry = manifest->entries[i];
+    auto it = by_path.find(entry.path);
+    if (it != by_path.end() && it->second->size == entry.size &&
+        it->second->mtime_ns == entry.mtime_ns) {
+      entry.hash = it->second->hash;
+    } else {
+      stale.push_back(i);
+    }
+  }
+  std::vector<std::string> errors(stale.size());
+  ParallelFor(stale.size(), [&](std::size_t i) {
+    auto& entry = manifest->entries[stale[i]];
+    HashFile(dir / entry.path, &entry.hash, nullptr, &errors[i]);
+  });
+  for (const auto& message : errors) {
+    if (!message.empty()) {
+      if (error) {
+        *error = message;
+      }
+      return false;
     }
-    return false;
   }
+  return true;
+}
 
-  if (!RenameActiveToIdle(error)) {
-    return false;
+// Writes items of dir below prefix. Files for which skip returns true are
+// left out; the rest must still match their manifest entry.
+bool WriteTree(TarWriter* writer, const std::filesystem::path& dir,
+               const std::string& prefix, const std::vector<BundleItem>& items,
+               const Manifest& manifest,
+               const std::function<bool(const ManifestEntry&)>& skip,
+               std::string* error) {
+  for (const auto& item : items) {
+    const std::string name = prefix + item.rel_path;
+    if (item.type == EntryType::kDir) {
+      if (!writer->AddDirectory(name, item.mode, error)) {
+        return false;
+      }
+      continue;
+    }
+    if (item.type == EntryType::kSymlink) {
+      if (!writer->AddSymlink(name, item.link_target, error)) {
+        return false;
+      }
+      continue;
+    }
+    const ManifestEntry& entry = manifest.entries[item.manifest_index];
+    if (skip && skip(entry)) {
+      continue;
+    }
+    const auto path = dir / item.rel_path;
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    bool ok = fd >= 0 && ::fstat(fd, &st) == 0 &&
+              static_cast<std::uint64_t>(st.st_size) == entry.size &&
+              MtimeNs(st) == entry.mtime_ns;
+    if (!ok && error) {
+      *error = path.string() + " changed while it was archived";
+    }
+    ok = ok && writer->AddFile(name, fd, entry.size, item.mode, item.mtime,
+                               error);
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    if (!ok) {
+      return false;
+    }
   }
+  return true;
+}
 
-  const auto images_path = ImagesPath();
-  if (!FileUtil::Rename(target_path, images_path, error)) {
-    return false;
+// Blocks below dir; a file hardlinked n times counts 1/n of its blocks, so
+// the sizes of profiles sharing files add up to what the disk holds.
+std::uint64_t MeasureDiskUsage(const std::filesystem::path& dir) {
+  std::uint64_t total = 0;
+  TreeWalker::Walk(
+      dir, WalkOptions(),
+      [&](const WalkEntry& item) {
+        struct stat st;
+        if (::fstatat(item.parent_fd, item.name->c_str(), &st,
+                      AT_SYMLINK_NOFOLLOW) == 0) {
+          const auto bytes = static_cast<std::uint64_t>(st.st_blocks) * 512;
+          total += item.type == EntryType::kFile && st.st_nlink > 1
+                       ? bytes / st.st_nlink
+                       : bytes;
+        }
+        return WalkAction::kContinue;
+      },
+      nullptr, nullptr);
+  return total;
+}
+
+std::filesystem::path PackedPath(const UhdRoot& root, const Profile& profile) {
+  return root.uhd_dir / ".packed" / (profile.folder_name + ".pack");
+}
+
+std::uint64_t FileSize(const std::filesystem::path& path) {
+  struct stat st;
+  return ::stat(path.c_str(), &st) == 0 ? static_cast<std::uint64_t>(st.st_size)
+                                        : 0;
+}
+
+bool IsSymlink(const std::filesystem::path& path) {
+  struct stat st;
+  return ::lstat(path.c_str(), &st) == 0 && S_ISLNK(st.st_mode);
+}
+
+std::uint64_t FreeBytes(const std::filesystem::path& dir) {
+  struct statvfs st;
+  if (::statvfs(dir.c_str(), &st) != 0) {
+    return 0;
   }
+  return static_cast<std::uint64_t>(st.f_bavail) * st.f_frsize;
+}
 
-  cfg.active_profile_id = target->id;
-  return config_manager_->Save(error);
+ApplyStrategy ChooseApplyStrategy(const UhdRoot& root,
+                                  const std::filesystem::path& target_path,
+                                  ActivationMode mode) {
+  const auto images_path = RootImagesPath(root);
+  if (FileUtil::IsMountPoint(images_path)) {
+    return FileUtil::SameMount(target_path, images_path)
+               ? ApplyStrategy::kHardlinks
+               : ApplyStrategy::kCopy;
+  }
+  if (mode == ActivationMode::kHardlinks && !IsSymlink(target_path) &&
+      !FileUtil::IsMountPoint(target_path) &&
+      FileUtil::SameMount(target_path, root.uhd_dir)) {
+    return ApplyStrategy::kLinkFarm;
+  }
+  // A symlinked-in profile folder is renamed as a link, which is fine.
+  return mode != ActivationMode::kRename ||
+                 FileUtil::IsMountPoint(target_path)
+             ? ApplyStrategy::kSymlink
+             : ApplyStrategy::kRename;
 }
 
-bool ProfileManager::AddProfileFromActive(const std::string& display_name,
-                                          std::string* error) {
-  if (!EnsureUhdDir(error)) {
+// Where the files of a possibly symlinked folder really live.
+std::filesystem::path ResolveFolder(const std::filesystem::path& path) {
+  std::error_code ec;
+  const auto resolved = std::filesystem::canonical(path, ec);
+  return ec ? path : resolved;
+}
+
+// Saves the contents of a mount-point images folder to dest, which it
+// replaces only once the copy is complete. Hardlinks are used when dest
+// shares the mount.
+bool SaveImagesContents(const std::filesystem::path& images_path,
+                        const std::filesystem::path& dest,
+                        std::string* error) {
+  const auto real_dest = ResolveFolder(dest);
+  const auto fresh = StagingBeside(real_dest, kOutgoingSuffix);
+  if (!FileUtil::RemoveAll(fresh, error)) {
     return false;
   }
+  const bool linked =
+      FileUtil::SameMount(images_path, real_dest.parent_path()) &&
+      FileUtil::LinkDir(images_path, fresh, nullptr);
+  if (!linked && !FileUtil::CopyDir(images_path, fresh, error)) {
+    return false;
+  }
+  return FileUtil::RemoveAll(real_dest, error) &&
+         FileUtil::Rename(fresh, real_dest, error);
+}
 
-  const auto& cfg = config_manager_->config();
-  Profile* official = FindProfileById(config_manager_->config(), "official");
-  if (!official) {
-    if (error) {
-      *error = "Official profile is missing";
+// Replaces everything inside images_path, which stays in place, with the
+// contents of source. The new tree is assembled inside images_path first,
+// so the old contents are only removed once it is complete.
+bool RefillImages(const std::filesystem::path& images_path,
+                  const std::filesystem::path& source, bool link,
+                  std::string* error) {
+  const std::string incoming_name = ".uhd_helper_incoming";
+  const auto incoming = images_path / incoming_name;
+  if (!FileUtil::RemoveAll(incoming, error)) {
+    return false;
+  }
+  if (!(link ? FileUtil::LinkDir(source, incoming, error)
+             : FileUtil::CopyDir(source, incoming, error))) {
+    return false;
+  }
+  std::vector<DirEntry> entries;
+  if (!TreeWalker::ReadDir(images_path, false, &entries, error)) {
+    return false;
+  }
+  for (const auto& entry : entries) {
+    if (entry.name != incoming_name &&
+        !FileUtil::RemoveAll(images_path / entry.name, error)) {
+      return false;
     }
+  }
+  entries.clear();
+  if (!TreeWalker::ReadDir(incoming, false, &entries, error)) {
     return false;
   }
-
-  std::filesystem::path source_path = cfg.uhd_dir / official->folder_name;
-  if (!FolderExists(source_path)) {
-    if (cfg.active_profile_id == "official" && FolderExists(ImagesPath())) {
-      source_path = ImagesPath();
-    } else {
-      if (error) {
-        *error = "Official profile folder does not exist: " +
-                 source_path.string();
-      }
+  for (const auto& entry : entries) {
+    if (!FileUtil::Rename(incoming / entry.name, images_path / entry.name,
+                          error)) {
       return false;
     }
   }
+  return FileUtil::RemoveAll(incoming, error);
+}
 
-  Profile profile;
-  profile.id = GenerateProfileId(display_name);
-  profile.display_name = display_name.empty() ? profile.id : display_name;
-  profile.folder_name = cfg.idle_profile_prefix + profile.id;
-  profile.is_official = false;
-
-  const auto dest = cfg.uhd_dir / profile.folder_name;
-  if (FolderExists(dest)) {
+// Points images at the profile folder through a relative symlink, swapped
+// in with a rename.
+bool LinkImages(const std::filesystem::path& images_path,
+                const std::string& folder_name, std::string* error) {
+  const auto link = StagingBeside(images_path, kLinkSuffix);
+  ::unlink(link.c_str());
+  if (::symlink(folder_name.c_str(), link.c_str()) != 0) {
     if (error) {
-      *error = "Profile folder already exists: " + dest.string();
+      *error = "Failed to create symlink " + link.string() + ": " +
+               std::strerror(errno);
     }
     return false;
   }
+  return FileUtil::Rename(link, images_path, error);
+}
 
-  if (!FileUtil::CopyDir(source_path, dest, error)) {
+// Makes the files of folder read-only, so writes through images have to
+// replace a file rather than change the profile's copy, and links them
+// into images, which must not exist.
+bool LinkFarm(const std::filesystem::path& folder,
+              const std::filesystem::path& images_path, std::string* error) {
+  return FileUtil::SetFilesReadOnly(folder, true, error) &&
+         FileUtil::LinkDir(folder, images_path, error);
+}
+
+// Whether images is a farm linked from folder: some file in it is still
+// one of folder's. Files edited through images no longer are.
+bool IsLinkFarm(const std::filesystem::path& images_path,
+                const std::filesystem::path& folder) {
+  if (!FolderExists(folder)) {
     return false;
   }
+  bool shared = false;
+  TreeWalker::Walk(
+      images_path, WalkOptions(),
+      [&](const WalkEntry& entry) {
+        if (entry.type != EntryType::kFile) {
+          return WalkAction::kContinue;
+        }
+        shared = FileUtil::SameInode(images_path / *entry.rel_path,
+                                     folder / *entry.rel_path);
+        return shared ? WalkAction::kStop : WalkAction::kContinue;
+      },
+      nullptr, nullptr);
+  return shared;
+}
 
-  config_manager_->config().profiles.push_back(profile);
-  return config_manager_->Save(error);
+// Gives the owner write permission back on every profile folder of root,
+// once images is no longer a farm.
+bool ReleaseProfileFiles(const UhdRoot& root, std::string* error) {
+  for (const auto& profile : root.profiles) {
+    const auto folder = root.uhd_dir / profile.folder_name;
+    if (!profile.folder_name.empty() && FolderExists(folder) &&
+        !FileUtil::SetFilesReadOnly(folder, false, error)) {
+      return false;
+    }
+  }
+  return true;
 }
 
-bool ProfileManager::DeleteProfile(const std::string& profile_id,
-                                   std::string* error) {
-  auto& cfg = config_manager_->config();
-  if (profile_id.empty()) {
-    if (error) {
-      *error = "Profile id is empty";
+// Brings a root whose images folder was set up under another activation
+// mode in line with mode. A symlinked images names the active profile;
+// under kRename its folder is moved back into images, under kHardlinks
+// the link is replaced by a farm. A real images folder moves to the active
+// profile's idle name, replacing any folder there, and is linked, unless it
+// is a farm of that folder, which under the other modes is folded back into
+// it. Images of unknown origin and mount points are left alone.
+bool MigrateImagesLayout(UhdRoot& root, ActivationMode mode,
+                         std::string* error) {
+  const auto images_path = RootImagesPath(root);
+  if (IsSymlink(images_path)) {
+    const auto resolved = ResolveFolder(images_path);
+    const Profile* linked = nullptr;
+    for (const auto& profile : root.profiles) {
+      if (!profile.folder_name.empty() &&
+          ResolveFolder(root.uhd_dir / profile.folder_name) == resolved) {
+        linked = &profile;
+        break;
+      }
     }
-    return false;
+    if (!linked) {
+      return true;
+    }
+    root.active_profile_id = linked->id;
+    const auto folder = root.uhd_dir / linked->folder_name;
+    if (mode == ActivationMode::kSymlink || FileUtil::IsMountPoint(folder)) {
+      return true;
+    }
+    if (mode == ActivationMode::kHardlinks) {
+      if (IsSymlink(folder) || !FileUtil::SameMount(folder, root.uhd_dir)) {
+        return true;
+      }
+      return FileUtil::RemoveAll(images_path, error) &&
+             LinkFarm(folder, images_path, error);
+    }
+    // The exchange leaves the link at the idle name, where it is dropped.
+    if (FileUtil::Exchange(folder, images_path, nullptr)) {
+      return FileUtil::RemoveAll(folder, error);
+    }
+    return FileUtil::RemoveAll(images_path, error) &&
+           FileUtil::Rename(folder, images_path, error);
   }
-  if (profile_id == cfg.active_profile_id) {
-    if (error) {
-      *error = "Cannot delete the active profile";
+
+  if (!FolderExists(images_path) || FileUtil::IsMountPoint(images_path)) {
+    return true;
+  }
+  const Profile* active = FindProfileById(root, root.active_profile_id);
+  if (!active || active->folder_name.empty()) {
+    return true;
+  }
+  const auto folder = root.uhd_dir / active->folder_name;
+  const bool farm = IsLinkFarm(images_path, folder);
+  if (mode != ActivationMode::kHardlinks && farm) {
+    // The farm holds the profile as last seen through images, edits
+    // included, so it replaces the folder.
+    if (!FileUtil::RemoveAll(folder, error)) {
+      return false;
     }
+    if (mode == ActivationMode::kSymlink &&
+        !(FileUtil::Rename(images_path, folder, error) &&
+          LinkImages(images_path, active->folder_name, error))) {
+      return false;
+    }
+    return ReleaseProfileFiles(root, error) &&
+           FileUtil::SetFilesReadOnly(images_path, false, error);
+  }
+  if (mode == ActivationMode::kRename || farm || IsSymlink(folder) ||
+      FileUtil::IsMountPoint(folder)) {
+    return true;
+  }
+  // Images is the live copy. A folder left beside it, like the official
+  // copy RefreshRoot takes, is stale and gets replaced, as on any apply.
+  if (FileUtil::Exists(folder) && !FileUtil::RemoveAll(folder, error)) {
+    return false;
+  }
+  if (!FileUtil::Rename(images_path, folder, error)) {
     return false;
   }
+  return mode == ActivationMode::kSymlink
+             ? LinkImages(images_path, active->folder_name, error)
+             : LinkFarm(folder, images_path, error);
+}
 
-  auto it = std::find_if(cfg.profiles.begin(), cfg.profiles.end(),
-                         [&](const Profile& p) { return p.id == profile_id; });
-  if (it == cfg.profiles.end()) {
-    if (error) {
-      *error = "Profile not found";
-    }
+// How CheckConsistency repairs an issue. Everything before kRemove is
+// undone if a later repair or the config save fails.
+enum class FsckRepair {
+  kNone,
+  kUnregister,
+  kRegister,
+  kRenameFolder,
+  kSetFolderName,
+  kSetActive,
+  kSetRootHash,
+  kClearRootHash,
+  kClearPacked,
+  kBringIntoImages,
+  // Deletes issue.path once the repaired config is saved.
+  kRemove,
+};
+
+struct FsckFinding {
+  FsckIssue issue;
+  FsckRepair repair = FsckRepair::kNone;
+  // The folder name, profile id or root hash the repair sets.
+  std::string value;
+};
+
+void AddFinding(std::vector<FsckFinding>* findings, FsckProblem problem,
+                const std::string& root, const std::string& profile_id,
+                const std::filesystem::path& path, std::string detail,
+                FsckRepair repair = FsckRepair::kNone,
+                std::string value = "") {
+  FsckFinding finding;
+  finding.issue.problem = problem;
+  finding.issue.root = root;
+  finding.issue.profile_id = profile_id;
+  finding.issue.path = path;
+  finding.issue.detail = std::move(detail);
+  finding.issue.repairable = repair != FsckRepair::kNone;
+  finding.repair = repair;
+  finding.value = std::move(value);
+  findings->push_back(std::move(finding));
+}
+
+bool EndsWith(const std::string& value, const std::string& suffix) {
+  return value.size() >= suffix.size() &&
+         value.compare(value.size() - suffix.size(), suffix.size(),
+                       suffix) == 0;
+}
+
+bool IsStagingName(const std::string& name) {
+  if (name.empty() || name[0] != '.') {
     return false;
   }
-  if (it->is_official) {
-    if (error) {
-      *error = "Cannot delete the official profile";
+  for (const char* suffix : kStagingSuffixes) {
+    if (EndsWith(name, suffix)) {
+      return true;
     }
-    return false;
   }
+  return false;
+}
 
-  const auto target_path = cfg.uhd_dir / it->folder_name;
-  if (FolderExists(target_path)) {
-    if (!FileUtil::RemoveAll(target_path, error)) {
-      return false;
+// The active profile's content sits in images rather than its folder.
+bool ContentInImages(const AppConfig& cfg, const UhdRoot& root) {
+  const auto images_path = RootImagesPath(root);
+  return cfg.activation_mode == ActivationMode::kRename &&
+         FolderExists(images_path) && !IsSymlink(images_path) &&
+         !FileUtil::IsMountPoint(images_path);
+}
+
+void CheckProfileConsistency(const AppConfig& cfg, const UhdRoot& root,
+                             const Profile& profile,
+                             const std::filesystem::path& manifests_dir,
+                             std::vector<FsckFinding>* findings) {
+  const auto folder = root.uhd_dir / profile.folder_name;
+  const bool active = profile.id == root.active_profile_id;
+  const bool removable = !active && !profile.is_official;
+  if (profile.packed) {
+    if (!FileUtil::Exists(PackedPath(root, profile))) {
+      if (FolderExists(folder)) {
+        AddFinding(findings, FsckProblem::kMissingPack, root.name, profile.id,
+                   PackedPath(root, profile),
+                   "archive is gone but the folder is present",
+                   FsckRepair::kClearPacked);
+      } else {
+        AddFinding(findings, FsckProblem::kMissingPack, root.name, profile.id,
+                   PackedPath(root, profile), "neither archive nor folder",
+                   removable ? FsckRepair::kUnregister : FsckRepair::kNone);
+      }
     }
+  } else if (!active && !FolderExists(folder)) {
+    // A missing active profile is reported with the images folder.
+    AddFinding(findings, FsckProblem::kMissingFolder, root.name, profile.id,
+               folder, "profile folder is gone",
+               removable ? FsckRepair::kUnregister : FsckRepair::kNone);
   }
 
-  cfg.profiles.erase(it);
-  return config_manager_->Save(error);
+  const std::string expected = cfg.idle_profile_prefix + profile.id;
+  if (!profile.is_official && profile.folder_name != expected) {
+    const bool taken =
+        FileUtil::Exists(root.uhd_dir / expected) ||
+        std::any_of(root.profiles.begin(), root.profiles.end(),
+                    [&](const Profile& p) { return p.folder_name == expected; });
+    // A symlinked images names the active folder, so it keeps its name.
+    FsckRepair repair = FsckRepair::kNone;
+    if (!taken && !profile.packed) {
+      if (!FolderExists(folder)) {
+        repair = FsckRepair::kSetFolderName;
+      } else if (!active) {
+        repair = FsckRepair::kRenameFolder;
+      }
+    }
+    AddFinding(findings, FsckProblem::kMisnamedFolder, root.name, profile.id,
+               folder, "expected " + expected, repair, expected);
+  }
+
+  const auto manifest_path = manifests_dir / root.name / (profile.id + ".json");
+  if (!FileUtil::Exists(manifest_path)) {
+    if (!profile.root_hash.empty()) {
+      AddFinding(findings, FsckProblem::kMissingManifest, root.name,
+                 profile.id, manifest_path,
+                 "root hash recorded without a manifest",
+                 FsckRepair::kClearRootHash);
+    }
+    return;
+  }
+  Manifest manifest;
+  std::string load_error;
+  if (!LoadManifest(manifest_path, &manifest, &load_error)) {
+    AddFinding(findings, FsckProblem::kMissingManifest, root.name, profile.id,
+               manifest_path, "unreadable: " + load_error,
+               FsckRepair::kClearRootHash);
+    return;
+  }
+  if (manifest.RootHash() != profile.root_hash) {
+    AddFinding(findings, FsckProblem::kStaleRootHash, root.name, profile.id,
+               manifest_path,
+               profile.root_hash.empty() ? "config has no root hash"
+                                         : "config and manifest disagree",
+               FsckRepair::kSetRootHash, manifest.RootHash());
+  }
 }
 
-bool ProfileManager::ResetToOfficial(std::string* error) {
-  return ApplyProfile("official", error);
+using StatMap =
+    std::unordered_map<std::string, std::pair<std::uint64_t, std::int64_t>>;
+
+StatMap StatTree(const std::filesystem::path& dir) {
+  StatMap files;
+  TreeWalker::Walk(
+      dir, WalkOptions(),
+      [&](const WalkEntry& item) {
+        struct stat st;
+        if (item.type == EntryType::kFile &&
+            ::fstatat(item.parent_fd, item.name->c_str(), &st,
+                      AT_SYMLINK_NOFOLLOW) == 0) {
+          files.emplace(*item.rel_path,
+                        std::make_pair(static_cast<std::uint64_t>(st.st_size),
+                                       MtimeNs(st)));
+        }
+        return WalkAction::kContinue;
+      },
+      nullptr, nullptr);
+  return files;
 }
 
-bool ProfileManager::RefreshFromDisk(std::string* error) {
-  if (!EnsureUhdDir(error)) {
+// Sizes and mtimes only; enough to tell profiles apart without hashing.
+bool ManifestMatchesTree(const Manifest& manifest, const StatMap& files) {
+  if (manifest.entries.size() != files.size()) {
     return false;
   }
-
-  auto& cfg = config_manager_->config();
-  const auto official_path = cfg.uhd_dir / cfg.official_profile_folder;
-  if (!FolderExists(official_path) && FolderExists(ImagesPath())) {
-    if (!FileUtil::CopyDir(ImagesPath(), official_path, error)) {
+  for (const auto& entry : manifest.entries) {
+    auto it = files.find(entry.path);
+    if (it == files.end() || it->second.first != entry.size ||
+        it->second.second != entry.mtime_ns) {
       return false;
     }
   }
+  return true;
+}
 
-  std::unordered_set<std::string> known_folders;
-  for (const auto& profile : cfg.profiles) {
-    known_folders.insert(profile.folder_name);
+// Profiles whose recorded manifest matches the files in images.
+std::vector<const Profile*> ProfilesMatchingImages(
+    const UhdRoot& root, const std::filesystem::path& manifests_dir) {
+  const StatMap files = StatTree(RootImagesPath(root));
+  std::vector<const Profile*> matches;
+  for (const auto& profile : root.profiles) {
+    Manifest manifest;
+    if (!profile.packed &&
+        LoadManifest(manifests_dir / root.name / (profile.id + ".json"),
+                     &manifest, nullptr) &&
+        ManifestMatchesTree(manifest, files)) {
+      matches.push_back(&profile);
+    }
   }
+  return matches;
+}
 
-  const auto dirs = FileUtil::ListDirs(cfg.uhd_dir);
-  for (const auto& dir : dirs) {
-    const std::string name = dir.filename().string();
-    if (name == cfg.images_folder_name) {
-      continue;
-    }
-    if (known_folders.count(name) > 0) {
-      continue;
+void CheckImagesConsistency(const AppConfig& cfg, const UhdRoot& root,
+                            const std::filesystem::path& manifests_dir,
+                            std::vector<FsckFinding>* findings) {
+  const auto images_path = RootImagesPath(root);
+  const Profile* active = FindProfileById(root, root.active_profile_id);
+  const bool active_folder =
+      active && !active->packed &&
+      FolderExists(root.uhd_dir / active->folder_name);
+
+  if (IsSymlink(images_path)) {
+    const auto resolved = ResolveFolder(images_path);
+    const Profile* linked = nullptr;
+    for (const auto& profile : root.profiles) {
+      if (FolderExists(images_path) &&
+          ResolveFolder(root.uhd_dir / profile.folder_name) == resolved) {
+        linked = &profile;
+        break;
+      }
     }
-    if (name == cfg.backup_profile_folder) {
-      continue;
+    if (!linked) {
+      AddFinding(findings, FsckProblem::kActiveMismatch, root.name,
+                 root.active_profile_id, images_path,
+                 "images links to " + resolved.string() +
+                     ", which is no profile folder",
+                 active_folder ? FsckRepair::kBringIntoImages
+                               : FsckRepair::kNone,
+                 root.active_profile_id);
+    } else if (linked->id != root.active_profile_id) {
+      AddFinding(findings, FsckProblem::kActiveMismatch, root.name,
+                 root.active_profile_id, images_path,
+                 "images links to profile " + linked->id,
+                 FsckRepair::kSetActive, linked->id);
     }
-    if (name.rfind(cfg.idle_profile_prefix, 0) != 0) {
-      continue;
+    return;
+  }
+
+  if (!FolderExists(images_path)) {
+    const Profile* official = nullptr;
+    for (const auto& profile : root.profiles) {
+      if (profile.is_official && !profile.packed &&
+          FolderExists(root.uhd_dir / profile.folder_name)) {
+        official = &profile;
+      }
     }
-    Profile profile;
-    profile.folder_name = name;
-    profile.id = ToLowerAscii(name.substr(cfg.idle_profile_prefix.size()));
-    if (profile.id.empty()) {
+    const Profile* bring = active_folder ? active : official;
+    AddFinding(findings, FsckProblem::kImagesMissing, root.name,
+               root.active_profile_id, images_path,
+               bring ? "profile " + bring->id + " can take its place"
+                     : "no profile folder can take its place",
+               bring ? FsckRepair::kBringIntoImages : FsckRepair::kNone,
+               bring ? bring->id : "");
+    return;
+  }
+
+  if (FileUtil::Exists(images_path / ".uhd_helper_incoming")) {
+    AddFinding(findings, FsckProblem::kStrayStaging, root.name, "",
+               images_path / ".uhd_helper_incoming",
+               "unfinished refill of images", FsckRepair::kRemove);
+  }
+
+  // Under kRename the active profile's folder is gone while it sits in
+  // images; an unknown id or a folder that is still there means images may
+  // hold something else. The official folder is kept from the first run.
+  if (!ContentInImages(cfg, root) ||
+      (active && (active->is_official || !active_folder))) {
+    return;
+  }
+  const auto matches = ProfilesMatchingImages(root, manifests_dir);
+  const bool active_matches =
+      std::find(matches.begin(), matches.end(), active) != matches.end();
+  if (active && active_matches) {
+    AddFinding(findings, FsckProblem::kDuplicateFolder, root.name, active->id,
+               root.uhd_dir / active->folder_name,
+               "active profile also has an idle folder, which the next "
+               "switch replaces");
+    return;
+  }
+  std::vector<const Profile*> movable;
+  for (const Profile* match : matches) {
+    if (!FolderExists(root.uhd_dir / match->folder_name)) {
+      movable.push_back(match);
+    }
+  }
+  std::string detail =
+      active ? "profile folder still exists beside images"
+             : "active profile " + root.active_profile_id + " is not registered";
+  if (movable.size() == 1) {
+    detail += "; images matches the manifest of " + movable[0]->id;
+  }
+  AddFinding(findings, FsckProblem::kActiveMismatch, root.name,
+             root.active_profile_id, images_path, detail,
+             movable.size() == 1 ? FsckRepair::kSetActive : FsckRepair::kNone,
+             movable.size() == 1 ? movable[0]->id : "");
+}
+
+void CheckRootConsistency(const AppConfig& cfg, const UhdRoot& root,
+                          const std::filesystem::path& manifests_dir,
+                          std::vector<FsckFinding>* findings) {
+  std::unordered_map<std::string, const Profile*> by_folder;
+  for (const auto& profile : root.profiles) {
+    auto inserted = by_folder.emplace(profile.folder_name, &profile);
+    if (inserted.second) {
       continue;
     }
-    profile.display_name = profile.id;
-    profile.is_official = false;
-    cfg.profiles.push_back(std::move(profile));
+    const Profile* first = inserted.first->second;
+    const bool removable =
+        !profile.is_official && profile.id != root.active_profile_id;
+    AddFinding(findings, FsckProblem::kDuplicateFolder, root.name, profile.id,
+               root.uhd_dir / profile.folder_name,
+               "folder also registered for " + first->id,
+               removable ? FsckRepair::kUnregister : FsckRepair::kNone);
   }
 
-  NormalizeProfiles(cfg);
+  std::vector<DirEntry> entries;
+  TreeWalker::ReadDir(root.uhd_dir, false, &entries, nullptr);
+  for (const auto& entry : entries) {
+    const std::string& name = entry.name;
+    const auto path = root.uhd_dir / name;
+    if (name == root.images_folder_name || by_folder.count(name) > 0) {
+      continue;
+    }
+    if (name == ".packed") {
+      std::vector<DirEntry> packs;
+      TreeWalker::ReadDir(path, false, &packs, nullptr);
+      for (const auto& pack : packs) {
+        if (EndsWith(pack.name, ".pack.tmp")) {
+          AddFinding(findings, FsckProblem::kStrayStaging, root.name, "",
+                     path / pack.name, "unfinished pack",
+                     FsckRepair::kRemove);
+          continue;
+        }
+        if (!EndsWith(pack.name, ".pack")) {
+          continue;
+        }
+        const auto owner =
+            by_folder.find(pack.name.substr(0, pack.name.size() - 5));
+        if (owner == by_folder.end() || !owner->second->packed) {
+          AddFinding(findings, FsckProblem::kStrayPack, root.name, "",
+                     path / pack.name, "no packed profile owns it",
+                     FsckRepair::kRemove);
+        }
+      }
+      continue;
+    }
+    if (IsStagingName(name)) {
+      AddFinding(findings, FsckProblem::kStrayStaging, root.name, "", path,
+                 "left by an interrupted copy, switch, import or restore",
+                 FsckRepair::kRemove);
+      continue;
+    }
+    if (entry.type != EntryType::kDir && entry.type != EntryType::kSymlink) {
+      continue;
+    }
+    const std::string& backup = cfg.backup_profile_folder;
+    if (name == backup ||
+        (name.rfind(backup + "_", 0) == 0 &&
+         name.find_first_not_of("0123456789", backup.size() + 1) ==
+             std::string::npos)) {
+      AddFinding(findings, FsckProblem::kStrayBackup, root.name, "", path,
+                 "images of unknown origin; apply or remove it by hand");
+      continue;
+    }
+    if (name.rfind(cfg.idle_profile_prefix, 0) != 0) {
+      continue;
+    }
+    const std::string id =
+        ToLowerAscii(name.substr(cfg.idle_profile_prefix.size()));
+    if (id.empty()) {
+      continue;
+    }
+    const Profile* owner = FindProfileById(root, id);
+    if (owner) {
+      AddFinding(findings, FsckProblem::kDuplicateFolder, root.name, id, path,
+                 "id already belongs to folder " + owner->folder_name);
+    } else {
+      AddFinding(findings, FsckProblem::kUnregisteredFolder, root.name, id,
+                 path, "not in config.json", FsckRepair::kRegister, name);
+    }
+  }
+
+  CheckImagesConsistency(cfg, root, manifests_dir, findings);
+}
+
+// Manifest folders of unknown roots and manifests of unknown profiles.
+void CheckManifestsConsistency(const AppConfig& cfg,
+                               const std::filesystem::path& manifests_dir,
+                               std::vector<FsckFinding>* findings) {
+  std::vector<DirEntry> dirs;
+  TreeWalker::ReadDir(manifests_dir, false, &dirs, nullptr);
+  for (const auto& dir : dirs) {
+    const UhdRoot* root = FindRootByName(cfg, dir.name);
+    if (!root) {
+      AddFinding(findings, FsckProblem::kOrphanManifest, dir.name, "",
+                 manifests_dir / dir.name, "no such root",
+                 FsckRepair::kRemove);
+      continue;
+    }
+    std::vector<DirEntry> files;
+    TreeWalker::ReadDir(manifests_dir / dir.name, false, &files, nullptr);
+    for (const auto& file : files) {
+      if (!EndsWith(file.name, ".json")) {
+        continue;
+      }
+      const std::string id = file.name.substr(0, file.name.size() - 5);
+      if (!FindProfileById(*root, id)) {
+        AddFinding(findings, FsckProblem::kOrphanManifest, root->name, id,
+                   manifests_dir / dir.name / file.name, "no such profile",
+                   FsckRepair::kRemove);
+      }
+    }
+  }
+}
+
+}  // namespace
+
+const char* ApplyStrategyName(ApplyStrategy strategy) {
+  switch (strategy) {
+    case ApplyStrategy::kRename:
+      return "rename";
+    case ApplyStrategy::kSymlink:
+      return "symlink";
+    case ApplyStrategy::kHardlinks:
+      return "hardlinks";
+    case ApplyStrategy::kCopy:
+      return "copy";
+    case ApplyStrategy::kLinkFarm:
+      return "link-farm";
+  }
+  return "unknown";
+}
+
+const char* FsckProblemName(FsckProblem problem) {
+  switch (problem) {
+    case FsckProblem::kMissingFolder:
+      return "missing-folder";
+    case FsckProblem::kMissingPack:
+      return "missing-pack";
+    case FsckProblem::kUnregisteredFolder:
+      return "unregistered-folder";
+    case FsckProblem::kDuplicateFolder:
+      return "duplicate-folder";
+    case FsckProblem::kMisnamedFolder:
+      return "misnamed-folder";
+    case FsckProblem::kStrayStaging:
+      return "stray-staging";
+    case FsckProblem::kStrayBackup:
+      return "stray-backup";
+    case FsckProblem::kStrayPack:
+      return "stray-pack";
+    case FsckProblem::kActiveMismatch:
+      return "active-mismatch";
+    case FsckProblem::kImagesMissing:
+      return "images-missing";
+    case FsckProblem::kStaleRootHash:
+      return "stale-root-hash";
+    case FsckProblem::kMissingManifest:
+      return "missing-manifest";
+    case FsckProblem::kOrphanManifest:
+      return "orphan-manifest";
+  }
+  return "unknown";
+}
+
+std::string DescribeFsckReport(const FsckReport& report) {
+  std::string out;
+  for (const auto& issue : report.issues) {
+    out += issue.root;
+    if (!issue.profile_id.empty()) {
+      out += "/" + issue.profile_id;
+    }
+    out += ": " + std::string(FsckProblemName(issue.problem)) + ": " +
+           issue.path.string() + ": " + issue.detail;
+    if (issue.repaired) {
+      out += " [repaired]";
+    } else if (issue.repairable) {
+      out += " [repairable]";
+    }
+    out += "\n";
+  }
+  out += std::to_string(report.issues.size()) + " issues in " +
+         std::to_string(report.roots) + " roots and " +
+         std::to_string(report.profiles) + " profiles";
+  if (report.repaired > 0) {
+    out += ", " + std::to_string(report.repaired) + " repaired";
+  }
+  return out;
+}
+
+ProfileManager::ProfileManager(ConfigManager* config_manager)
+    : config_manager_(config_manager) {}
+
+bool ProfileManager::Initialize(std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::Initialize");
+  return InitializeFromCache(error) && RefreshFromDisk(error);
+}
+
+bool ProfileManager::InitializeFromCache(std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::InitializeFromCache");
+  if (!config_manager_) {
+    if (error) {
+      *error = "Config manager is not set";
+    }
+    return false;
+  }
+  if (!config_manager_->Load(error)) {
+    return false;
+  }
+  const auto& cfg = config_manager_->config();
+  ThrottleLimits limits;
+  limits.bytes_per_second = cfg.io_bytes_per_second;
+  limits.ops_per_second = cfg.io_ops_per_second;
+  limits.idle_priority = cfg.background_idle_priority;
+  Throttle::Instance().SetLimits(limits);
+  return true;
+}
+
+const std::vector<Profile>& ProfileManager::Profiles() const {
+  return CurrentRoot(config_manager_->config()).profiles;
+}
+
+const std::vector<UhdRoot>& ProfileManager::Roots() const {
+  return config_manager_->config().roots;
+}
+
+std::string ProfileManager::CurrentRootName() const {
+  return CurrentRoot(config_manager_->config()).name;
+}
+
+std::string ProfileManager::ActiveProfileId() const {
+  return CurrentRoot(config_manager_->config()).active_profile_id;
+}
+
+std::filesystem::path ProfileManager::UhdDir() const {
+  return CurrentRoot(config_manager_->config()).uhd_dir;
+}
+
+std::filesystem::path ProfileManager::ImagesPath() const {
+  return RootImagesPath(CurrentRoot(config_manager_->config()));
+}
+
+std::filesystem::path ProfileManager::ConfigPath() const {
+  return config_manager_->path();
+}
+
+bool ProfileManager::ConfigChangedOnDisk() const {
+  return config_manager_->ChangedOnDisk();
+}
+
+bool ProfileManager::EnsureUhdDir(const UhdRoot& root,
+                                  std::string* error) const {
+  return FileUtil::EnsureDir(root.uhd_dir, error);
+}
+
+std::string ProfileManager::GenerateProfileId(
+    const UhdRoot& root, const std::string& display_name) const {
+  std::string base = Slugify(display_name);
+  if (base.empty()) {
+    base = "profile";
+  }
+
+  std::unordered_set<std::string> existing;
+  for (const auto& profile : root.profiles) {
+    existing.insert(profile.id);
+  }
+
+  if (existing.count(base) == 0) {
+    return base;
+  }
+  for (int i = 2; i < 10000; ++i) {
+    std::string candidate = base + "_" + std::to_string(i);
+    if (existing.count(candidate) == 0) {
+      return candidate;
+    }
+  }
+  return base + "_x";
+}
+
+bool ProfileManager::RenameActiveToIdle(UhdRoot& root, std::string* error) {
+  const auto& cfg = config_manager_->config();
+  const std::filesystem::path images_path = RootImagesPath(root);
+  if (!FolderExists(images_path)) {
+    return true;
+  }
+  // Contents of a mount point are copied out and left for RefillImages.
+  const bool in_place = FileUtil::IsMountPoint(images_path);
+
+  if (!root.active_profile_id.empty()) {
+    Profile* active = FindProfileById(root, root.active_profile_id);
+    if (active && !active->folder_name.empty()) {
+      const auto dest = root.uhd_dir / active->folder_name;
+      if (in_place) {
+        return SaveImagesContents(images_path, dest, error);
+      }
+      // Linked in by the symlink strategy; the profile never left its
+      // folder, which may be a mount point that RemoveAll must not touch.
+      if (IsSymlink(images_path) && FolderExists(dest) &&
+          ResolveFolder(images_path) == ResolveFolder(dest)) {
+        return FileUtil::RemoveAll(images_path, error);
+      }
+      // A farm replaces the folder it was linked from: it holds the same
+      // files, with the ones edited through images replaced.
+      if (FolderExists(dest)) {
+        if (!FileUtil::RemoveAll(dest, error)) {
+          return false;
+        }
+      }
+      return FileUtil::Rename(images_path, dest, error);
+    }
+  }
+
+  // Images of unknown origin may be the only copy, so an earlier backup is
+  // never replaced; each one gets the next free name instead.
+  auto backup_dest = root.uhd_dir / cfg.backup_profile_folder;
+  for (int i = 2; FileUtil::Exists(backup_dest); ++i) {
+    backup_dest = root.uhd_dir /
+                  (cfg.backup_profile_folder + "_" + std::to_string(i));
+  }
+  if (in_place) {
+    return SaveImagesContents(images_path, backup_dest, error);
+  }
+  return FileUtil::Rename(images_path, backup_dest, error);
+}
+
+bool ProfileManager::CheckUhdRelease(const UhdRoot& root,
+                                     const std::string& profile_id,
+                                     std::string* error) const {
+  const Profile* profile = FindProfileById(root, profile_id);
+  UhdRelease target;
+  if (!profile || !ParseUhdRelease(profile->uhd_version, &target)) {
+    return true;
+  }
+  const UhdRelease installed = InstalledUhdRelease(root.uhd_dir);
+  if (UhdReleasesCompatible(target, installed)) {
+    return true;
+  }
+  if (error) {
+    *error = "Profile " + profile_id + " is for UHD " +
+             FormatUhdRelease(target) + " but root " + root.name + " has UHD " +
+             FormatUhdRelease(installed) +
+             " installed; --set-uhd-version retargets it";
+  }
+  return false;
+}
+
+bool ProfileManager::ApplyInRoot(UhdRoot& root, const std::string& profile_id,
+                                 ApplyStrategy* strategy, std::string* error) {
+  if (!EnsureUhdDir(root, error)) {
+    return false;
+  }
+
+  Profile* target = FindProfileById(root, profile_id);
+  if (!target) {
+    if (error) {
+      *error = "Unknown profile id: " + profile_id;
+    }
+    return false;
+  }
+
+  const auto target_path = root.uhd_dir / target->folder_name;
+  if (target->packed && !FolderExists(target_path) &&
+      !UnpackInRoot(root, *target, error)) {
+    return false;
+  }
+  if (!FolderExists(target_path)) {
+    if (profile_id == root.active_profile_id &&
+        FolderExists(RootImagesPath(root))) {
+      return true;
+    }
+    if (error) {
+      *error = "Profile folder does not exist: " + target_path.string();
+    }
+    return false;
+  }
+
+  const auto images_path = RootImagesPath(root);
+  const Profile* active = FindProfileById(root, root.active_profile_id);
+  const std::string previous_id = root.active_profile_id;
+  const ApplyStrategy chosen = ChooseApplyStrategy(
+      root, target_path, config_manager_->config().activation_mode);
+  if (strategy) {
+    *strategy = chosen;
+  }
+  // An outgoing farm is folded back into its folder, whose files then
+  // need write permission again.
+  const bool leaves_farm =
+      active && active != target && !active->folder_name.empty() &&
+      !IsSymlink(images_path) &&
+      IsLinkFarm(images_path, root.uhd_dir / active->folder_name);
+  if (chosen == ApplyStrategy::kHardlinks || chosen == ApplyStrategy::kCopy) {
+    // Both sides are copied at worst; check for room before touching
+    // anything rather than running out halfway.
+    const std::uint64_t outgoing = MeasureDiskUsage(images_path);
+    const std::uint64_t incoming =
+        chosen == ApplyStrategy::kCopy ? MeasureDiskUsage(target_path) : 0;
+    if (outgoing > FreeBytes(root.uhd_dir) ||
+        incoming > FreeBytes(images_path)) {
+      if (error) {
+        *error = "Not enough free space to " +
+                 std::string(ApplyStrategyName(chosen)) + " " + profile_id +
+                 " into " + images_path.string();
+      }
+      return false;
+    }
+    if (!RenameActiveToIdle(root, error)) {
+      return false;
+    }
+    if (!RefillImages(images_path, target_path,
+                      chosen == ApplyStrategy::kHardlinks, error)) {
+      return false;
+    }
+  } else if (chosen == ApplyStrategy::kLinkFarm) {
+    // Linking costs no data, only one entry per file. The farm is built
+    // beside images first, so images is only missing for the final renames;
+    // reapplying the active profile has to fold the old farm back first.
+    const auto farm = StagingBeside(images_path, kFarmSuffix);
+    const bool reapply = target == active && FolderExists(images_path);
+    if (!FileUtil::RemoveAll(farm, error)) {
+      return false;
+    }
+    // Once nothing links the target any more its files get write
+    // permission back.
+    const auto unlink_target = [&] {
+      FileUtil::RemoveAll(farm, nullptr);
+      FileUtil::SetFilesReadOnly(target_path, false, nullptr);
+    };
+    if (!reapply && !LinkFarm(target_path, farm, error)) {
+      unlink_target();
+      return false;
+    }
+    if (!RenameActiveToIdle(root, error)) {
+      if (!reapply) {
+        unlink_target();
+      }
+      return false;
+    }
+    if (!(reapply ? LinkFarm(target_path, images_path, error)
+                  : FileUtil::Rename(farm, images_path, error))) {
+      unlink_target();
+      return false;
+    }
+  } else if (chosen == ApplyStrategy::kSymlink) {
+    // An existing link is replaced in one rename, so images never goes
+    // missing; a real folder is moved to its idle name first.
+    if (!IsSymlink(images_path) && !RenameActiveToIdle(root, error)) {
+      return false;
+    }
+    if (!LinkImages(images_path, target->folder_name, error)) {
+      return false;
+    }
+  } else if (active && active != target && !active->folder_name.empty() &&
+             FolderExists(images_path) &&
+             !FileUtil::Exists(root.uhd_dir / active->folder_name) &&
+             FileUtil::Exchange(target_path, images_path, nullptr)) {
+    // When the outgoing profile has a free idle name, the switch is one
+    // atomic exchange, so the images folder is never missing; the outgoing
+    // content then takes its idle name with a second rename.
+    if (!FileUtil::Rename(target_path, root.uhd_dir / active->folder_name,
+                          error)) {
+      FileUtil::Exchange(target_path, images_path, nullptr);
+      return false;
+    }
+  } else {
+    if (!RenameActiveToIdle(root, error)) {
+      return false;
+    }
+    if (!FileUtil::Rename(target_path, images_path, error)) {
+      return false;
+    }
+  }
+
+  root.active_profile_id = target->id;
+  RecordActivation(root, previous_id);
+  return !leaves_farm ||
+         FileUtil::SetFilesReadOnly(root.uhd_dir / active->folder_name, false,
+                                    error);
+}
+
+void ProfileManager::RecordActivation(UhdRoot& root,
+                                      const std::string& previous_id) const {
+  Activation activation;
+  activation.profile_id = root.active_profile_id;
+  activation.previous_id = previous_id;
+  activation.time = static_cast<std::int64_t>(std::time(nullptr));
+  for (auto& profile : root.profiles) {
+    if (profile.id == activation.profile_id || profile.id == previous_id) {
+      profile.last_used = activation.time;
+    }
+  }
+  HashFile(ManifestPath(root, root.active_profile_id),
+           &activation.manifest_sha256, nullptr, nullptr);
+  root.history.push_back(std::move(activation));
+  const std::size_t limit = Defaults().activation_history_limit;
+  if (root.history.size() > limit) {
+    root.history.erase(root.history.begin(), root.history.end() - limit);
+  }
+}
+
+bool ProfileManager::RevertActivation(std::string* report,
+                                      std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::RevertActivation");
+  UhdRoot& root = CurrentRoot(config_manager_->config());
+  if (root.history.empty() ||
+      root.history.back().profile_id != root.active_profile_id ||
+      root.history.back().previous_id.empty()) {
+    if (error) {
+      *error = "Nothing to revert in root " + root.name;
+    }
+    return false;
+  }
+  const Activation last = root.history.back();
+  if (!FindProfileById(root, last.previous_id)) {
+    if (error) {
+      *error = "Previous profile no longer exists: " + last.previous_id;
+    }
+    return false;
+  }
+  // The revert itself is recorded too, so reverting twice goes back.
+  if (!CheckUhdRelease(root, last.previous_id, error) ||
+      !ApplyInRoot(root, last.previous_id, nullptr, error) ||
+      !config_manager_->Save(error)) {
+    return false;
+  }
+  if (report) {
+    *report = "Reverted " + last.profile_id + " to " + last.previous_id;
+    // The digest recorded when previous_id was last activated, if still in
+    // the ring, tells whether its files were edited since.
+    for (auto it = root.history.rbegin() + 1; it != root.history.rend(); ++it) {
+      if (it->profile_id == last.previous_id) {
+        if (!it->manifest_sha256.empty() &&
+            it->manifest_sha256 != root.history.back().manifest_sha256) {
+          *report += " (its manifest changed since it was last active)";
+        }
+        break;
+      }
+    }
+  }
+  return true;
+}
+
+const std::vector<Activation>& ProfileManager::History() const {
+  return CurrentRoot(config_manager_->config()).history;
+}
+
+bool ProfileManager::ApplyProfile(const std::string& profile_id,
+                                  ApplyStrategy* strategy,
+                                  std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::ApplyProfile");
+  UhdRoot& root = CurrentRoot(config_manager_->config());
+  if (!CheckUhdRelease(root, profile_id, error) ||
+      !ApplyInRoot(root, profile_id, strategy, error)) {
+    return false;
+  }
   return config_manager_->Save(error);
 }
 
+bool ProfileManager::ApplyProfileToAllRoots(const std::string& profile_id,
+                                            std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::ApplyProfileToAllRoots");
+  auto& roots = config_manager_->config().roots;
+  std::vector<UhdRoot*> targets;
+  for (auto& root : roots) {
+    if (FindProfileById(root, profile_id)) {
+      targets.push_back(&root);
+    }
+  }
+  if (targets.empty()) {
+    if (error) {
+      *error = "No root has profile: " + profile_id;
+    }
+    return false;
+  }
+  for (const UhdRoot* root : targets) {
+    if (!CheckUhdRelease(*root, profile_id, error)) {
+      return false;
+    }
+  }
+
+  std::vector<std::string> errors(targets.size());
+  ParallelFor(targets.size(), [&](std::size_t i) {
+    ApplyInRoot(*targets[i], profile_id, nullptr, &errors[i]);
+  });
+
+  std::string combined;
+  for (std::size_t i = 0; i < targets.size(); ++i) {
+    if (!errors[i].empty()) {
+      if (!combined.empty()) {
+        combined += "; ";
+      }
+      combined += targets[i]->name + ": " + errors[i];
+    }
+  }
+
+  std::string save_error;
+  const bool saved = config_manager_->Save(&save_error);
+  if (!combined.empty() || !saved) {
+    if (error) {
+      *error = combined.empty() ? save_error : combined;
+    }
+    return false;
+  }
+  return true;
+}
+
+bool ProfileManager::PrepareNewProfile(const UhdRoot& root,
+                                       const std::string& display_name,
+                                       Profile* profile,
+                                       std::string* error) const {
+  profile->id = GenerateProfileId(root, display_name);
+  profile->display_name = display_name.empty() ? profile->id : display_name;
+  profile->folder_name =
+      config_manager_->config().idle_profile_prefix + profile->id;
+  profile->is_official = false;
+  profile->last_used = static_cast<std::int64_t>(std::time(nullptr));
+
+  const auto dest = root.uhd_dir / profile->folder_name;
+  if (FolderExists(dest)) {
+    if (error) {
+      *error = "Profile folder already exists: " + dest.string();
+    }
+    return false;
+  }
+  return true;
+}
+
+bool ProfileManager::AddProfileFromActive(const std::string& display_name,
+                                          std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::AddProfileFromActive");
+  UhdRoot& root = CurrentRoot(config_manager_->config());
+  if (!EnsureUhdDir(root, error)) {
+    return false;
+  }
+
+  Profile* official = FindProfileById(root, "official");
+  if (!official) {
+    if (error) {
+      *error = "Official profile is missing";
+    }
+    return false;
+  }
+
+  std::filesystem::path source_path = root.uhd_dir / official->folder_name;
+  if (!FolderExists(source_path)) {
+    if (root.active_profile_id == "official" &&
+        FolderExists(RootImagesPath(root))) {
+      source_path = RootImagesPath(root);
+    } else {
+      if (error) {
+        *error = "Official profile folder does not exist: " +
+                 source_path.string();
+      }
+      return false;
+    }
+  }
+
+  Profile profile;
+  if (!PrepareNewProfile(root, display_name, &profile, error)) {
+    return false;
+  }
+
+  profile.uhd_version = ReleaseOfSource(root, official);
+
+  const auto dest = root.uhd_dir / profile.folder_name;
+  if (!FileUtil::CopyDir(source_path, dest, error)) {
+    return false;
+  }
+
+  if (!RecordManifest(root, profile, &profile.root_hash, error)) {
+    FileUtil::RemoveAll(dest, nullptr);
+    return false;
+  }
+  root.profiles.push_back(profile);
+  if (!config_manager_->Save(error)) {
+    root.profiles.pop_back();
+    std::error_code ec;
+    std::filesystem::remove(ManifestPath(root, profile.id), ec);
+    FileUtil::RemoveAll(dest, nullptr);
+    return false;
+  }
+  EnforceDiskBudgetIfSet();
+  return true;
+}
+
+bool ProfileManager::SnapshotActive(const std::string& display_name,
+                                    CloneStats* stats, std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::SnapshotActive");
+  UhdRoot& root = CurrentRoot(config_manager_->config());
+  if (!EnsureUhdDir(root, error)) {
+    return false;
+  }
+
+  const auto source_path = RootImagesPath(root);
+  if (!FolderExists(source_path)) {
+    if (error) {
+      *error = "Active images folder does not exist: " + source_path.string();
+    }
+    return false;
+  }
+
+  Profile profile;
+  if (!PrepareNewProfile(root, display_name, &profile, error)) {
+    return false;
+  }
+
+  const Profile* active = FindProfileById(root, root.active_profile_id);
+  profile.uhd_version = ReleaseOfSource(root, active);
+
+  const auto dest = root.uhd_dir / profile.folder_name;
+  // Under the hardlinks mode the snapshot shares the active profile's
+  // read-only files, which edits through images replace rather than change.
+  bool linked = false;
+  if (config_manager_->config().activation_mode ==
+          ActivationMode::kHardlinks &&
+      FileUtil::SameMount(ResolveFolder(source_path), root.uhd_dir)) {
+    const bool was_farm =
+        active && !active->folder_name.empty() && !IsSymlink(source_path) &&
+        IsLinkFarm(source_path, root.uhd_dir / active->folder_name);
+    linked = LinkFarm(source_path, dest, nullptr);
+    if (!linked) {
+      FileUtil::RemoveAll(dest, nullptr);
+      if (!was_farm) {
+        FileUtil::SetFilesReadOnly(source_path, false, nullptr);
+      }
+    }
+  }
+  if (!linked && !FileUtil::CloneDir(source_path, dest, stats, error)) {
+    FileUtil::RemoveAll(dest, nullptr);
+    return false;
+  }
+
+  if (!RecordManifest(root, profile, &profile.root_hash, error)) {
+    FileUtil::RemoveAll(dest, nullptr);
+    return false;
+  }
+  root.profiles.push_back(profile);
+  if (!config_manager_->Save(error)) {
+    root.profiles.pop_back();
+    std::error_code ec;
+    std::filesystem::remove(ManifestPath(root, profile.id), ec);
+    FileUtil::RemoveAll(dest, nullptr);
+    return false;
+  }
+  EnforceDiskBudgetIfSet();
+  return true;
+}
+
+bool ProfileManager::ImportArchive(const std::string& display_name,
+                                   const std::filesystem::path& archive_path,
+                                   ImportStats* stats, std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::ImportArchive");
+  UhdRoot& root = CurrentRoot(config_manager_->config());
+  if (!EnsureUhdDir(root, error)) {
+    return false;
+  }
+  Profile profile;
+  if (!PrepareNewProfile(root, display_name, &profile, error)) {
+    return false;
+  }
+
+  const int fd = OpenInput(archive_path, error);
+  if (fd < 0) {
+    return false;
+  }
+  std::unique_ptr<ArchiveReader> reader = ArchiveReader::Open(fd, error);
+  if (!reader) {
+    CloseInput(fd);
+    return false;
+  }
+
+  const auto known = IndexKnownFiles(config_manager_->config(),
+                                     ManifestsDir(*config_manager_),
+                                     root.uhd_dir);
+
+  // Written under a dot name so RefreshFromDisk never picks up a partial
+  // import, then renamed into place.
+  const auto dest = root.uhd_dir / profile.folder_name;
+  const auto staging = StagingBeside(dest, kImportSuffix);
+  FileUtil::RemoveAll(staging, nullptr);
+  ImportStats local;
+  std::vector<ExtractedFile> files;
+  bool ok = FileUtil::EnsureDir(staging, error) &&
+            ExtractArchive(
+                reader.get(), staging,
+                [&](const std::filesystem::path& file,
+                    const ExtractedFile& info, std::string* /*error*/) {
+                  ++local.files;
+                  local.bytes += info.size;
+                  auto it = known.find(KnownFileKey(info.size, info.sha256));
+                  if (it != known.end() && KnownFileIntact(it->second) &&
+                      FileUtil::ReplaceWithReflink(it->second.path, file,
+                                                   nullptr)) {
+                    ++local.files_deduplicated;
+                    local.bytes_deduplicated += info.size;
+                  }
+                  return true;
+                },
+                &files, error);
+  reader.reset();
+  CloseInput(fd);
+  std::string prefix;
+  ok = ok && HoistSingleDirectory(staging, &prefix, error);
+  if (ok && files.empty()) {
+    if (error) {
+      *error = "Archive contains no files";
+    }
+    ok = false;
+  }
+
+  // The manifest comes from the hashes taken while writing, so there is no
+  // second read of the data.
+  Manifest manifest;
+  for (const auto& file : files) {
+    if (!ok) {
+      break;
+    }
+    ManifestEntry entry;
+    entry.path = file.path.compare(0, prefix.size(), prefix) == 0
+                     ? file.path.substr(prefix.size())
+                     : file.path;
+    entry.size = file.size;
+    entry.hash = file.sha256;
+    struct stat st;
+    if (::lstat((staging / entry.path).c_str(), &st) == 0) {
+      entry.mtime_ns = MtimeNs(st);
+    }
+    manifest.entries.push_back(std::move(entry));
+  }
+  std::sort(manifest.entries.begin(), manifest.entries.end(),
+            [](const ManifestEntry& a, const ManifestEntry& b) {
+              return a.path < b.path;
+            });
+  ComputeMerkle(&manifest);
+  profile.root_hash = manifest.RootHash();
+  // Release archives and their top folder are named like
+  // uhd-images_4.6.0.0-release.
+  UhdRelease release;
+  if (FindUhdReleaseInName(archive_path.filename().string(), &release) ||
+      FindUhdReleaseInName(prefix, &release) ||
+      FindUhdReleaseInName(display_name, &release)) {
+    profile.uhd_version = FormatUhdRelease(release);
+  }
+
+  if (!ok || !FileUtil::Rename(staging, dest, error)) {
+    FileUtil::RemoveAll(staging, nullptr);
+    return false;
+  }
+  if (!SaveManifest(ManifestPath(root, profile.id), manifest, error)) {
+    FileUtil::RemoveAll(dest, nullptr);
+    return false;
+  }
+  root.profiles.push_back(profile);
+  if (!config_manager_->Save(error)) {
+    root.profiles.pop_back();
+    std::error_code ec;
+    std::filesystem::remove(ManifestPath(root, profile.id), ec);
+    FileUtil::RemoveAll(dest, nullptr);
+    return false;
+  }
+  if (stats) {
+    *stats = local;
+  }
+  EnforceDiskBudgetIfSet();
+  return true;
+}
+
+bool ProfileManager::ExportProfile(const std::string& profile_id,
+                                   const std::filesystem::path& out,
+                                   const std::filesystem::path& have_manifest,
+                                   ExportStats* stats, std::string* error) {
+  UhdRoot& root = CurrentRoot(config_manager_->config());
+  if (!FindProfileById(root, profile_id)) {
+    if (error) {
+      *error = "Unknown profile id: " + profile_id;
+    }
+    return false;
+  }
+  return ExportMembers({{&root, profile_id}}, "", out, have_manifest, stats,
+                       error);
+}
+
+bool ProfileManager::ExportGroup(const std::string& group_name,
+                                 const std::filesystem::path& out,
+                                 const std::filesystem::path& have_manifest,
+                                 ExportStats* stats, std::string* error) {
+  std::vector<ResolvedMember> members;
+  if (!ResolveGroup(group_name, &members, error)) {
+    return false;
+  }
+  return ExportMembers(members, group_name, out, have_manifest, stats, error);
+}
+
+bool ProfileManager::ExportMembers(const std::vector<ResolvedMember>& members,
+                                   const std::string& group_name,
+                                   const std::filesystem::path& out,
+                                   const std::filesystem::path& have_manifest,
+                                   ExportStats* stats, std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::ExportMembers");
+  std::unordered_set<std::string> have;
+  if (!have_manifest.empty()) {
+    Manifest theirs;
+    if (!LoadManifest(have_manifest, &theirs, error)) {
+      return false;
+    }
+    for (const auto& entry : theirs.entries) {
+      have.insert(KnownFileKey(entry.size, entry.hash));
+    }
+  }
+
+  // Everything is hashed before the first byte goes out, so the metadata
+  // can lead the stream and the receiver checks files as they arrive.
+  std::vector<std::filesystem::path> dirs(members.size());
+  std::vector<Manifest> manifests(members.size());
+  std::vector<std::vector<BundleItem>> items(members.size());
+  json_min::Array profiles;
+  for (std::size_t i = 0; i < members.size(); ++i) {
+    const UhdRoot& root = *members[i].root;
+    const Profile* profile = FindProfileById(root, members[i].profile_id);
+    dirs[i] = ProfileContentPath(root, *profile);
+    if (!ScanForExport(dirs[i], ManifestPath(root, profile->id), &manifests[i],
+                       &items[i], error)) {
+      return false;
+    }
+    Manifest sorted = manifests[i];
+    std::sort(sorted.entries.begin(), sorted.entries.end(),
+              [](const ManifestEntry& a, const ManifestEntry& b) {
+                return a.path < b.path;
+              });
+    json_min::Object obj;
+    obj.emplace("root", json_min::Value(root.name));
+    obj.emplace("id", json_min::Value(profile->id));
+    obj.emplace("display_name", json_min::Value(profile->display_name));
+    const std::string uhd_version = ReleaseOfSource(root, profile);
+    if (!uhd_version.empty()) {
+      obj.emplace("uhd_version", json_min::Value(uhd_version));
+    }
+    obj.emplace("manifest", ManifestToJson(sorted));
+    profiles.push_back(json_min::Value(std::move(obj)));
+  }
+  json_min::Object metadata;
+  metadata.emplace("format", json_min::Value(std::string(kBundleFormat)));
+  metadata.emplace("version", json_min::Value(1.0));
+  if (!group_name.empty()) {
+    metadata.emplace("group", json_min::Value(group_name));
+  }
+  metadata.emplace("profiles", json_min::Value(std::move(profiles)));
+
+  const bool to_stdout = out == "-";
+  const int out_fd =
+      to_stdout ? STDOUT_FILENO
+                : ::open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                         0644);
+  if (out_fd < 0) {
+    if (error) {
+      *error = "Failed to create " + out.string();
+    }
+    return false;
+  }
+
+  ExportStats local;
+  TarWriter writer(out_fd);
+  bool ok = writer.AddData(
+      kBundleMetadata, json_min::Serialize(json_min::Value(std::move(metadata)), 1),
+      0644, error);
+  for (std::size_t i = 0; ok && i < members.size(); ++i) {
+    const std::string prefix = "profiles/" + std::to_string(i);
+    ok = writer.AddDirectory(prefix, 0755, error) &&
+         WriteTree(&writer, dirs[i], prefix + "/", items[i], manifests[i],
+                   [&](const ManifestEntry& entry) {
+                     if (have.count(KnownFileKey(entry.size, entry.hash)) ==
+                         0) {
+                       local.files += 1;
+                       local.bytes += entry.size;
+                       return false;
+                     }
+                     local.files_skipped += 1;
+                     local.bytes_skipped += entry.size;
+                     return true;
+                   },
+                   error);
+  }
+  ok = ok && writer.Finish(error);
+  if (!to_stdout) {
+    ::close(out_fd);
+    if (!ok) {
+      ::unlink(out.c_str());
+    }
+  }
+  if (!ok) {
+    return false;
+  }
+  local.profiles = members.size();
+  if (stats) {
+    *stats = local;
+  }
+  return true;
+}
+
+bool ProfileManager::ImportBundle(const std::filesystem::path& bundle_path,
+                                  ImportStats* stats, std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::ImportBundle");
+  auto& cfg = config_manager_->config();
+  UhdRoot& current = CurrentRoot(cfg);
+  if (!EnsureUhdDir(current, error)) {
+    return false;
+  }
+  const int fd = OpenInput(bundle_path, error);
+  if (fd < 0) {
+    return false;
+  }
+  std::unique_ptr<ArchiveReader> reader = ArchiveReader::Open(fd, error);
+  if (!reader) {
+    CloseInput(fd);
+    return false;
+  }
+
+  // Every file is hashed by ExtractArchive while it is written; the checks
+  // below compare those hashes against the bundled manifests.
+  const auto staging = StagingBeside(current.uhd_dir / "bundle", kImportSuffix);
+  FileUtil::RemoveAll(staging, nullptr);
+  std::vector<ExtractedFile> files;
+  bool ok = FileUtil::EnsureDir(staging, error) &&
+            ExtractArchive(reader.get(), staging, nullptr, &files, error);
+  reader.reset();
+  CloseInput(fd);
+  const auto fail = [&]() {
+    FileUtil::RemoveAll(staging, nullptr);
+    return false;
+  };
+  if (!ok) {
+    return fail();
+  }
+
+  std::string group_name;
+  std::vector<BundleProfile> incoming;
+  if (!ReadBundleMetadata(staging / kBundleMetadata, &group_name, &incoming,
+                          error)) {
+    return fail();
+  }
+
+  std::unordered_map<std::string, const ExtractedFile*> extracted;
+  for (const auto& file : files) {
+    extracted.emplace(file.path, &file);
+  }
+  std::unordered_map<std::string, KnownFile> known;
+  bool known_loaded = false;
+  ImportStats local;
+  for (std::size_t i = 0; i < incoming.size(); ++i) {
+    const std::string prefix = "profiles/" + std::to_string(i) + "/";
+    const auto dir = staging / ("profiles/" + std::to_string(i));
+    if (!FileUtil::EnsureDir(dir, error)) {
+      return fail();
+    }
+    for (const auto& entry : incoming[i].manifest.entries) {
+      auto it = extracted.find(prefix + entry.path);
+      if (it != extracted.end()) {
+        if (it->second->size != entry.size ||
+            it->second->sha256 != entry.hash) {
+          if (error) {
+            *error = "Checksum mismatch in bundle: " + entry.path;
+          }
+          return fail();
+        }
+        ++local.files;
+        local.bytes += entry.size;
+        continue;
+      }
+
+      // Left out by the sender because this host has it.
+      if (!known_loaded) {
+        known = IndexKnownFiles(cfg, ManifestsDir(*config_manager_), {});
+        known_loaded = true;
+      }
+      auto source = known.find(KnownFileKey(entry.size, entry.hash));
+      if (source == known.end() || !KnownFileIntact(source->second)) {
+        if (error) {
+          *error = "Bundle omits " + entry.path +
+                   " and no local profile has a matching copy";
+        }
+        return fail();
+      }
+      const auto target = dir / entry.path;
+      std::error_code ec;
+      std::filesystem::create_directories(target.parent_path(), ec);
+      // A reflink or a copy, never a hardlink: the source may be the live
+      // images folder, and writes there must not reach the new profile.
+      bool reflinked = false;
+      if (!FileUtil::CloneFile(source->second.path, target, &reflinked,
+                               error)) {
+        return fail();
+      }
+      std::string hash;
+      if (!reflinked && !HashFile(target, &hash, nullptr, error)) {
+        return fail();
+      }
+      if (!reflinked && hash != entry.hash) {
+        if (error) {
+          *error = "Local copy of " + entry.path + " does not match";
+        }
+        return fail();
+      }
+      ++local.files_deduplicated;
+      local.bytes_deduplicated += entry.size;
+    }
+  }
+  // Every extracted file must be one a manifest lists; a count would miss
+  // an extra file next to a path listed twice. Symlinks are profile
+  // content without manifest entries, so they are only accepted inside a
+  // profile folder and never where a manifest expects a file.
+  std::unordered_set<std::string> expected;
+  for (std::size_t i = 0; i < incoming.size(); ++i) {
+    const std::string prefix = "profiles/" + std::to_string(i) + "/";
+    for (const auto& entry : incoming[i].manifest.entries) {
+      expected.insert(prefix + entry.path);
+    }
+  }
+  const auto in_profile = [&](const std::string& rel) {
+    for (std::size_t i = 0; i < incoming.size(); ++i) {
+      const std::string prefix = "profiles/" + std::to_string(i) + "/";
+      if (rel.compare(0, prefix.size(), prefix) == 0) {
+        return true;
+      }
+    }
+    return false;
+  };
+  std::string unlisted;
+  if (!TreeWalker::Walk(
+          staging, WalkOptions(),
+          [&](const WalkEntry& entry) {
+            const std::string& rel = *entry.rel_path;
+            const bool listed =
+                entry.type == EntryType::kDir || rel == kBundleMetadata ||
+                expected.count(rel) != 0
+                    ? entry.type != EntryType::kSymlink
+                    : entry.type == EntryType::kSymlink && in_profile(rel);
+            if (!listed) {
+              unlisted = rel;
+              return WalkAction::kStop;
+            }
+            return WalkAction::kContinue;
+          },
+          nullptr, error)) {
+    return fail();
+  }
+  if (!unlisted.empty()) {
+    if (error) {
+      *error = "Bundle holds " + unlisted + ", which no manifest lists";
+    }
+    return fail();
+  }
+
+  // Placement and registration are undone together if anything fails.
+  struct Placed {
+    UhdRoot* root;
+    std::string id;
+    std::filesystem::path dir;
+  };
+  std::vector<Placed> placed;
+  const auto rollback = [&]() {
+    for (const auto& item : placed) {
+      auto& profiles = item.root->profiles;
+      profiles.erase(std::remove_if(profiles.begin(), profiles.end(),
+                                    [&](const Profile& p) {
+                                      return p.id == item.id;
+                                    }),
+                     profiles.end());
+      FileUtil::RemoveAll(item.dir, nullptr);
+      std::error_code ec;
+      std::filesystem::remove(ManifestPath(*item.root, item.id), ec);
+    }
+    return fail();
+  };
+  std::vector<GroupMember> members;
+  for (std::size_t i = 0; i < incoming.size(); ++i) {
+    auto& source = incoming[i];
+    UhdRoot* root = FindRootByName(cfg, source.root);
+    if (!root) {
+      root = &current;
+    }
+    if (!EnsureUhdDir(*root, error)) {
+      return rollback();
+    }
+    Profile profile;
+    // The id names a folder and a manifest, so one from the bundle is only
+    // kept when it is already in the form GenerateProfileId produces.
+    profile.id = !source.id.empty() && source.id == Slugify(source.id) &&
+                         source.id != "official" &&
+                         !FindProfileById(*root, source.id)
+                     ? source.id
+                     : GenerateProfileId(*root, source.display_name);
+    profile.display_name =
+        source.display_name.empty() ? profile.id : source.display_name;
+    profile.folder_name = cfg.idle_profile_prefix + profile.id;
+    UhdRelease release;
+    if (ParseUhdRelease(source.uhd_version, &release)) {
+      profile.uhd_version = FormatUhdRelease(release);
+    }
+    profile.last_used = static_cast<std::int64_t>(std::time(nullptr));
+    const auto from = staging / ("profiles/" + std::to_string(i));
+    const auto dest = root->uhd_dir / profile.folder_name;
+    if (FolderExists(dest)) {
+      if (error) {
+        *error = "Profile folder already exists: " + dest.string();
+      }
+      return rollback();
+    }
+    if (!FileUtil::Rename(from, dest, nullptr) &&
+        !FileUtil::CopyDir(from, dest, error)) {
+      FileUtil::RemoveAll(dest, nullptr);
+      return rollback();
+    }
+    // Directory hashes in the bundle are not trusted; the file entries
+    // were checked while unpacking.
+    ComputeMerkle(&source.manifest);
+    profile.root_hash = source.manifest.RootHash();
+    root->profiles.push_back(profile);
+    placed.push_back({root, profile.id, dest});
+    for (auto& entry : source.manifest.entries) {
+      struct stat st;
+      if (::lstat((dest / entry.path).c_str(), &st) == 0) {
+        entry.mtime_ns = MtimeNs(st);
+      }
+    }
+    if (!SaveManifest(ManifestPath(*root, profile.id), source.manifest,
+                      error)) {
+      return rollback();
+    }
+    members.push_back({root->name, profile.id});
+  }
+
+  bool group_created = false;
+  if (!group_name.empty() && !FindGroupByName(cfg, group_name)) {
+    ProfileGroup imported;
+    imported.name = group_name;
+    imported.members = members;
+    cfg.groups.push_back(std::move(imported));
+    group_created = true;
+  }
+  if (!config_manager_->Save(error)) {
+    if (group_created) {
+      cfg.groups.pop_back();
+    }
+    return rollback();
+  }
+  FileUtil::RemoveAll(staging, nullptr);
+  if (stats) {
+    *stats = local;
+  }
+  EnforceDiskBudgetIfSet();
+  return true;
+}
+
+bool ProfileManager::WriteInventory(const std::filesystem::path& out,
+                                    std::string* error) const {
+  Manifest inventory;
+  for (const auto& root : config_manager_->config().roots) {
+    for (const auto& profile : root.profiles) {
+      Manifest manifest;
+      if (!LoadManifest(ManifestPath(root, profile.id), &manifest, nullptr)) {
+        continue;
+      }
+      for (auto& entry : manifest.entries) {
+        entry.path = root.name + "/" + profile.id + "/" + entry.path;
+        inventory.entries.push_back(std::move(entry));
+      }
+    }
+  }
+  if (out == "-") {
+    std::cout << json_min::Serialize(ManifestToJson(inventory), 1) << "\n";
+    return static_cast<bool>(std::cout);
+  }
+  return SaveManifest(out, inventory, error);
+}
+
+void ProfileManager::MeasureProfiles() {
+  UHD_TRACE_SCOPE("ProfileManager::MeasureProfiles");
+  std::vector<std::pair<const UhdRoot*, Profile*>> targets;
+  for (auto& root : config_manager_->config().roots) {
+    for (auto& profile : root.profiles) {
+      if (!profile.packed) {
+        targets.emplace_back(&root, &profile);
+      }
+    }
+  }
+  ParallelFor(targets.size(), [&](std::size_t i) {
+    targets[i].second->size_bytes =
+        MeasureDiskUsage(ProfileContentPath(*targets[i].first, *targets[i].second));
+  });
+}
+
+bool ProfileManager::SetDiskBudget(std::uint64_t bytes, EvictionStats* stats,
+                                   std::string* error) {
+  config_manager_->config().idle_budget_bytes = bytes;
+  return EnforceDiskBudget(stats, error);
+}
+
+bool ProfileManager::EnforceDiskBudget(EvictionStats* stats,
+                                       std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::EnforceDiskBudget");
+  auto& cfg = config_manager_->config();
+  MeasureProfiles();
+  EvictionStats local;
+  std::string evict_error;
+  const std::uint64_t budget = cfg.idle_budget_bytes;
+  for (auto& root : cfg.roots) {
+    if (budget == 0) {
+      break;
+    }
+    std::uint64_t footprint = 0;
+    std::vector<Profile*> candidates;
+    for (auto& profile : root.profiles) {
+      if (profile.id == root.active_profile_id || profile.is_official) {
+        continue;
+      }
+      if (profile.packed) {
+        footprint += FileSize(PackedPath(root, profile));
+        continue;
+      }
+      footprint += profile.size_bytes;
+      candidates.push_back(&profile);
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              [](const Profile* a, const Profile* b) {
+                return a->last_used < b->last_used;
+              });
+    for (Profile* profile : candidates) {
+      if (footprint <= budget) {
+        break;
+      }
+      std::uint64_t packed_size = 0;
+      if (!PackInRoot(root, *profile, &packed_size, &evict_error)) {
+        break;
+      }
+      ++local.profiles_packed;
+      const std::uint64_t freed =
+          profile->size_bytes > packed_size ? profile->size_bytes - packed_size
+                                            : 0;
+      local.bytes_freed += freed;
+      footprint -= freed;
+    }
+    if (footprint > budget) {
+      local.roots_over_budget += 1;
+    }
+  }
+  if (stats) {
+    *stats = local;
+  }
+  if (!config_manager_->Save(error)) {
+    return false;
+  }
+  if (!evict_error.empty()) {
+    if (error) {
+      *error = evict_error;
+    }
+    return false;
+  }
+  return true;
+}
+
+void ProfileManager::EnforceDiskBudgetIfSet() {
+  if (config_manager_->config().idle_budget_bytes > 0) {
+    EnforceDiskBudget(nullptr, nullptr);
+  }
+}
+
+bool ProfileManager::PackProfile(const std::string& profile_id,
+                                 std::string* error) {
+  UhdRoot& root = CurrentRoot(config_manager_->config());
+  Profile* profile = FindProfileById(root, profile_id);
+  if (!profile) {
+    if (error) {
+      *error = "Unknown profile id: " + profile_id;
+    }
+    return false;
+  }
+  if (profile->id == root.active_profile_id || profile->is_official) {
+    if (error) {
+      *error = "The active and the official profile stay unpacked";
+    }
+    return false;
+  }
+  if (profile->packed) {
+    return true;
+  }
+  profile->size_bytes = MeasureDiskUsage(root.uhd_dir / profile->folder_name);
+  return PackInRoot(root, *profile, nullptr, error) &&
+         config_manager_->Save(error);
+}
+
+bool ProfileManager::PackInRoot(UhdRoot& root, Profile& profile,
+                                std::uint64_t* packed_size,
+                                std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::PackInRoot");
+  const auto dir = root.uhd_dir / profile.folder_name;
+  if (!FolderExists(dir)) {
+    if (error) {
+      *error = "Profile folder does not exist: " + dir.string();
+    }
+    return false;
+  }
+  // The manifest saved here is what UnpackInRoot verifies against.
+  Manifest manifest;
+  std::vector<BundleItem> items;
+  if (!ScanForExport(dir, ManifestPath(root, profile.id), &manifest, &items,
+                     error)) {
+    return false;
+  }
+  Manifest sorted = manifest;
+  std::sort(sorted.entries.begin(), sorted.entries.end(),
+            [](const ManifestEntry& a, const ManifestEntry& b) {
+              return a.path < b.path;
+            });
+  ComputeMerkle(&sorted);
+  if (!SaveManifest(ManifestPath(root, profile.id), sorted, error)) {
+    return false;
+  }
+  profile.root_hash = sorted.RootHash();
+
+  const auto archive = PackedPath(root, profile);
+  auto temp = archive;
+  temp += ".tmp";
+  if (!FileUtil::EnsureDir(archive.parent_path(), error)) {
+    return false;
+  }
+  const int fd =
+      ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    if (error) {
+      *error = "Failed to create " + temp.string();
+    }
+    return false;
+  }
+  bool ok;
+  {
+    TarWriter writer(fd, PreferredCompression());
+    ok = WriteTree(&writer, dir, "", items, manifest, nullptr, error) &&
+         writer.Finish(error);
+  }
+  // The folder is deleted next, so the archive has to be on disk first.
+  if (ok && ::fsync(fd) != 0) {
+    if (error) {
+      *error = "Failed to sync " + temp.string();
+    }
+    ok = false;
+  }
+  ::close(fd);
+  if (!ok || !FileUtil::Rename(temp, archive, error)) {
+    ::unlink(temp.c_str());
+    return false;
+  }
+  if (!FileUtil::RemoveAll(dir, error)) {
+    // Both copies exist; keep the folder authoritative.
+    ::unlink(archive.c_str());
+    return false;
+  }
+  profile.packed = true;
+  if (packed_size) {
+    *packed_size = FileSize(archive);
+  }
+  return true;
+}
+
+bool ProfileManager::UnpackInRoot(UhdRoot& root, Profile& profile,
+                                  std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::UnpackInRoot");
+  const auto archive = PackedPath(root, profile);
+  const int fd = ::open(archive.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (error) {
+      *error = "Packed profile is missing: " + archive.string();
+    }
+    return false;
+  }
+  std::unique_ptr<ArchiveReader> reader = ArchiveReader::Open(fd, error);
+  const auto dest = root.uhd_dir / profile.folder_name;
+  const auto staging = StagingBeside(dest, kRestoreSuffix);
+  FileUtil::RemoveAll(staging, nullptr);
+  std::vector<ExtractedFile> files;
+  bool ok = reader && FileUtil::EnsureDir(staging, error) &&
+            ExtractArchive(reader.get(), staging, nullptr, &files, error);
+  reader.reset();
+  ::close(fd);
+
+  // Checked against the manifest saved at pack time, from the hashes taken
+  // while extracting. Without it nothing vouches for the archive, so the
+  // restore is refused rather than applying unverified content.
+  Manifest manifest;
+  std::string manifest_error;
+  if (ok && !LoadManifest(ManifestPath(root, profile.id), &manifest,
+                          &manifest_error)) {
+    if (error) {
+      *error = "Cannot verify packed profile " + profile.id + ": " +
+               manifest_error;
+    }
+    ok = false;
+  }
+  if (ok) {
+    std::unordered_map<std::string, const ExtractedFile*> by_path;
+    for (const auto& file : files) {
+      by_path.emplace(file.path, &file);
+    }
+    for (auto& entry : manifest.entries) {
+      auto it = by_path.find(entry.path);
+      if (it == by_path.end() || it->second->size != entry.size ||
+          it->second->sha256 != entry.hash) {
+        if (error) {
+          *error = "Packed profile " + profile.id + " is damaged at " +
+                   entry.path;
+        }
+        ok = false;
+        break;
+      }
+      struct stat st;
+      if (::lstat((staging / entry.path).c_str(), &st) == 0) {
+        entry.mtime_ns = MtimeNs(st);
+      }
+    }
+    ok = ok && files.size() == manifest.entries.size() &&
+         SaveManifest(ManifestPath(root, profile.id), manifest, error);
+  }
+  if (!ok || !FileUtil::Rename(staging, dest, error)) {
+    FileUtil::RemoveAll(staging, nullptr);
+    if (error && error->empty()) {
+      *error = "Failed to restore packed profile " + profile.id;
+    }
+    return false;
+  }
+  ::unlink(archive.c_str());
+  profile.packed = false;
+  return true;
+}
+
+bool ProfileManager::DeleteProfile(const std::string& profile_id,
+                                   std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::DeleteProfile");
+  UhdRoot& root = CurrentRoot(config_manager_->config());
+  if (profile_id.empty()) {
+    if (error) {
+      *error = "Profile id is empty";
+    }
+    return false;
+  }
+  if (profile_id == root.active_profile_id) {
+    if (error) {
+      *error = "Cannot delete the active profile";
+    }
+    return false;
+  }
+
+  auto it = std::find_if(root.profiles.begin(), root.profiles.end(),
+                         [&](const Profile& p) { return p.id == profile_id; });
+  if (it == root.profiles.end()) {
+    if (error) {
+      *error = "Profile not found";
+    }
+    return false;
+  }
+  if (it->is_official) {
+    if (error) {
+      *error = "Cannot delete the official profile";
+    }
+    return false;
+  }
+
+  if (!RemoveProfileStorage(root, *it, error)) {
+    return false;
+  }
+  root.profiles.erase(it);
+  RemoveFromGroups(root.name, {profile_id});
+  return config_manager_->Save(error);
+}
+
+bool ProfileManager::RemoveProfileStorage(const UhdRoot& root,
+                                          const Profile& profile,
+                                          std::string* error) const {
+  const auto path = root.uhd_dir / profile.folder_name;
+  if (FolderExists(path) && !FileUtil::RemoveAll(path, error)) {
+    return false;
+  }
+  if (profile.packed) {
+    ::unlink(PackedPath(root, profile).c_str());
+  }
+  std::error_code ec;
+  std::filesystem::remove(ManifestPath(root, profile.id), ec);
+  return true;
+}
+
+bool ProfileManager::ResetToOfficial(std::string* error) {
+  return ApplyProfile("official", nullptr, error);
+}
+
+bool ProfileManager::RefreshRoot(UhdRoot& root, std::string* error) {
+  const auto& cfg = config_manager_->config();
+  // An install that is gone or not mounted keeps its recorded profiles
+  // instead of being recreated empty.
+  if (!FolderExists(root.uhd_dir)) {
+    return true;
+  }
+
+  const auto official_path = root.uhd_dir / cfg.official_profile_folder;
+  if (!FolderExists(official_path) && FolderExists(RootImagesPath(root))) {
+    if (!FileUtil::CopyDir(RootImagesPath(root), official_path, error)) {
+      return false;
+    }
+  }
+
+  // Views into root.profiles, so new profiles are only appended after the
+  // loop.
+  std::unordered_set<std::string_view> known_folders;
+  known_folders.reserve(root.profiles.size());
+  for (const auto& profile : root.profiles) {
+    known_folders.insert(profile.folder_name);
+  }
+
+  const auto dirs = FileUtil::ListDirs(root.uhd_dir);
+  std::vector<Profile> discovered;
+  for (const auto& dir : dirs) {
+    const std::string name = dir.filename().string();
+    if (name == root.images_folder_name) {
+      continue;
+    }
+    // Staging folders of copies, imports and restores in progress.
+    if (name.empty() || name[0] == '.') {
+      continue;
+    }
+    if (known_folders.count(name) > 0) {
+      continue;
+    }
+    if (name == cfg.backup_profile_folder) {
+      continue;
+    }
+    if (name.rfind(cfg.idle_profile_prefix, 0) != 0) {
+      continue;
+    }
+    Profile profile;
+    profile.folder_name = name;
+    profile.id = ToLowerAscii(name.substr(cfg.idle_profile_prefix.size()));
+    if (profile.id.empty()) {
+      continue;
+    }
+    profile.display_name = profile.id;
+    profile.is_official = false;
+    profile.last_used = static_cast<std::int64_t>(std::time(nullptr));
+    UhdRelease release;
+    if (FindUhdReleaseInName(name, &release)) {
+      profile.uhd_version = FormatUhdRelease(release);
+    }
+    discovered.push_back(std::move(profile));
+  }
+  for (auto& profile : discovered) {
+    root.profiles.push_back(std::move(profile));
+  }
+  return MigrateImagesLayout(root, cfg.activation_mode, error);
+}
+
+bool ProfileManager::RefreshFromDisk(std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::RefreshFromDisk");
+  // A rescan also picks up UHD upgrades done behind our back.
+  ForgetInstalledUhdReleases();
+  auto& cfg = config_manager_->config();
+  // One broken root must not keep the others from being picked up.
+  std::string failures;
+  for (auto& root : cfg.roots) {
+    std::string root_error;
+    if (!RefreshRoot(root, &root_error)) {
+      failures += (failures.empty() ? "" : "; ") + root.name + ": " +
+                  root_error;
+    }
+  }
+
+  NormalizeProfiles(cfg);
+  if (!config_manager_->Save(error)) {
+    return false;
+  }
+  if (!failures.empty()) {
+    if (error) {
+      *error = failures;
+    }
+    return false;
+  }
+  return true;
+}
+
+bool ProfileManager::CheckConsistency(bool repair, FsckReport* report,
+                                      std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::CheckConsistency");
+  auto& cfg = config_manager_->config();
+  const auto manifests_dir = ManifestsDir(*config_manager_);
+
+  // One task per profile, one per root for its folder listing and images,
+  // and one for the manifests folder.
+  struct Task {
+    const UhdRoot* root;
+    const Profile* profile;
+  };
+  std::vector<Task> tasks;
+  FsckReport local;
+  for (const auto& root : cfg.roots) {
+    tasks.push_back({&root, nullptr});
+    for (const auto& profile : root.profiles) {
+      tasks.push_back({&root, &profile});
+    }
+    local.roots++;
+    local.profiles += root.profiles.size();
+  }
+  tasks.push_back({nullptr, nullptr});
+  std::vector<std::vector<FsckFinding>> found(tasks.size());
+  ParallelFor(tasks.size(), [&](std::size_t i) {
+    const Task& task = tasks[i];
+    if (!task.root) {
+      CheckManifestsConsistency(cfg, manifests_dir, &found[i]);
+    } else if (!task.profile) {
+      CheckRootConsistency(cfg, *task.root, manifests_dir, &found[i]);
+    } else {
+      CheckProfileConsistency(cfg, *task.root, *task.profile, manifests_dir,
+                              &found[i]);
+    }
+  });
+  std::vector<FsckFinding> findings;
+  for (auto& task_findings : found) {
+    for (auto& finding : task_findings) {
+      findings.push_back(std::move(finding));
+    }
+  }
+
+  const auto finish = [&]() {
+    for (const auto& finding : findings) {
+      local.issues.push_back(finding.issue);
+      local.repaired += finding.issue.repaired ? 1 : 0;
+    }
+    if (report) {
+      *report = std::move(local);
+    }
+  };
+  if (!repair) {
+    finish();
+    return true;
+  }
+
+  const AppConfig before = cfg;
+  std::vector<std::function<void()>> undo;
+  std::vector<std::filesystem::path> removals;
+  const auto rollback = [&](const std::string& message) {
+    for (auto it = undo.rbegin(); it != undo.rend(); ++it) {
+      (*it)();
+    }
+    cfg = before;
+    for (auto& finding : findings) {
+      finding.issue.repaired = false;
+    }
+    finish();
+    if (error) {
+      *error = "Repair rolled back: " + message;
+    }
+    return false;
+  };
+  for (auto& finding : findings) {
+    if (finding.repair == FsckRepair::kNone ||
+        finding.repair == FsckRepair::kRemove) {
+      continue;
+    }
+    FsckIssue& issue = finding.issue;
+    UhdRoot* root = FindRootByName(cfg, issue.root);
+    Profile* profile = root ? FindProfileById(*root, issue.profile_id) : nullptr;
+    std::string repair_error;
+    switch (finding.repair) {
+      case FsckRepair::kUnregister:
+        if (profile) {
+          removals.push_back(ManifestPath(*root, profile->id));
+          root->profiles.erase(root->profiles.begin() +
+                               (profile - root->profiles.data()));
+          RemoveFromGroups(root->name, {issue.profile_id});
+        }
+        break;
+      case FsckRepair::kRegister:
+        if (root && !profile) {
+          Profile added;
+          added.id = issue.profile_id;
+          added.display_name = added.id;
+          added.folder_name = finding.value;
+          added.last_used = static_cast<std::int64_t>(std::time(nullptr));
+          root->profiles.push_back(std::move(added));
+        }
+        break;
+      case FsckRepair::kRenameFolder:
+        if (profile) {
+          const auto from = root->uhd_dir / profile->folder_name;
+          const auto to = root->uhd_dir / finding.value;
+          if (!FileUtil::Rename(from, to, &repair_error)) {
+            return rollback(repair_error);
+          }
+          undo.push_back([from, to]() { FileUtil::Rename(to, from, nullptr); });
+          profile->folder_name = finding.value;
+        }
+        break;
+      case FsckRepair::kSetFolderName:
+        if (profile) {
+          profile->folder_name = finding.value;
+        }
+        break;
+      case FsckRepair::kSetActive:
+        if (root) {
+          root->active_profile_id = finding.value;
+        }
+        break;
+      case FsckRepair::kSetRootHash:
+        if (profile) {
+          profile->root_hash = finding.value;
+        }
+        break;
+      case FsckRepair::kClearRootHash:
+        if (profile) {
+          profile->root_hash.clear();
+          removals.push_back(issue.path);
+        }
+        break;
+      case FsckRepair::kClearPacked:
+        if (profile) {
+          profile->packed = false;
+        }
+        break;
+      case FsckRepair::kBringIntoImages: {
+        const Profile* target =
+            root ? FindProfileById(*root, finding.value) : nullptr;
+        if (!target) {
+          break;
+        }
+        const auto images_path = RootImagesPath(*root);
+        const auto folder = root->uhd_dir / target->folder_name;
+        char old_target[PATH_MAX];
+        const ssize_t n = ::readlink(images_path.c_str(), old_target,
+                                     sizeof(old_target) - 1);
+        const std::string old_link =
+            n > 0 ? std::string(old_target, static_cast<std::size_t>(n)) : "";
+        if (!old_link.empty() && !FileUtil::RemoveAll(images_path,
+                                                      &repair_error)) {
+          return rollback(repair_error);
+        }
+        const bool link = cfg.activation_mode == ActivationMode::kSymlink ||
+                          FileUtil::IsMountPoint(folder);
+        const bool placed =
+            link ? LinkImages(images_path, target->folder_name, &repair_error)
+                 : FileUtil::Rename(folder, images_path, &repair_error);
+        undo.push_back([=]() {
+          if (placed && !link) {
+            FileUtil::Rename(images_path, folder, nullptr);
+          } else {
+            ::unlink(images_path.c_str());
+          }
+          if (!old_link.empty()) {
+            const int restored =
+                ::symlink(old_link.c_str(), images_path.c_str());
+            (void)restored;
+          }
+        });
+        if (!placed) {
+          return rollback(repair_error);
+        }
+        root->active_profile_id = target->id;
+        break;
+      }
+      case FsckRepair::kNone:
+      case FsckRepair::kRemove:
+        break;
+    }
+    issue.repaired = true;
+  }
+
+  NormalizeProfiles(cfg);
+  std::string save_error;
+  if (!config_manager_->Save(&save_error)) {
+    return rollback(save_error);
+  }
+
+  // Past this point nothing is undone; a failed removal stays reported.
+  for (auto& finding : findings) {
+    if (finding.repair == FsckRepair::kRemove) {
+      finding.issue.repaired = FileUtil::RemoveAll(finding.issue.path, nullptr);
+    }
+  }
+  for (const auto& path : removals) {
+    FileUtil::RemoveAll(path, nullptr);
+  }
+  finish();
+  return true;
+}
+
+bool ProfileManager::SetProfileUhdVersion(const std::string& profile_id,
+                                          const std::string& version,
+                                          std::string* error) {
+  UhdRoot& root = CurrentRoot(config_manager_->config());
+  Profile* profile = FindProfileById(root, profile_id);
+  if (!profile) {
+    if (error) {
+      *error = "Unknown profile id: " + profile_id;
+    }
+    return false;
+  }
+  UhdRelease release;
+  if (version == "installed") {
+    release = InstalledUhdRelease(root.uhd_dir);
+    if (!release.known()) {
+      if (error) {
+        *error = "No UHD release found for " + root.uhd_dir.string();
+      }
+      return false;
+    }
+  } else if (!version.empty() && version != "none" &&
+             !ParseUhdRelease(version, &release)) {
+    if (error) {
+      *error = "Not a UHD version: " + version;
+    }
+    return false;
+  }
+  profile->uhd_version = FormatUhdRelease(release);
+  return config_manager_->Save(error);
+}
+
+std::string ProfileManager::InstalledUhdVersion() const {
+  return FormatUhdRelease(InstalledUhdRelease(UhdDir()));
+}
+
+bool ProfileManager::SetIoLimits(const ThrottleLimits& limits,
+                                 std::string* error) {
+  auto& cfg = config_manager_->config();
+  cfg.io_bytes_per_second = limits.bytes_per_second;
+  cfg.io_ops_per_second = limits.ops_per_second;
+  cfg.background_idle_priority = limits.idle_priority;
+  Throttle::Instance().SetLimits(limits);
+  return config_manager_->Save(error);
+}
+
+bool ProfileManager::SetActivationMode(ActivationMode mode,
+                                       std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::SetActivationMode");
+  auto& cfg = config_manager_->config();
+  const ActivationMode previous = cfg.activation_mode;
+  cfg.activation_mode = mode;
+  if (RefreshFromDisk(error)) {
+    if (previous != ActivationMode::kHardlinks ||
+        mode == ActivationMode::kHardlinks) {
+      return true;
+    }
+    // Folders a fallback or an earlier farm left read-only are released
+    // too, not just the one images was linked from.
+    for (const auto& root : cfg.roots) {
+      if (!ReleaseProfileFiles(root, error)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  // Roots that were already migrated are moved back with the old mode.
+  cfg.activation_mode = previous;
+  RefreshFromDisk(nullptr);
+  return false;
+}
+
+bool ProfileManager::AddRoot(const std::string& name,
+                             const std::filesystem::path& uhd_dir,
+                             std::string* error) {
+  auto& cfg = config_manager_->config();
+  if (name.empty() || uhd_dir.empty()) {
+    if (error) {
+      *error = "Root name and directory are required";
+    }
+    return false;
+  }
+  if (FindRootByName(cfg, name)) {
+    if (error) {
+      *error = "Root already exists: " + name;
+    }
+    return false;
+  }
+
+  if (!FolderExists(uhd_dir)) {
+    if (error) {
+      *error = "No such directory: " + uhd_dir.string();
+    }
+    return false;
+  }
+
+  UhdRoot root;
+  root.name = name;
+  root.uhd_dir = uhd_dir;
+  root.images_folder_name = GetImagesFolderName(UhdVersion::kDefault);
+  if (!RefreshRoot(root, error)) {
+    return false;
+  }
+  cfg.roots.push_back(std::move(root));
+  NormalizeProfiles(cfg);
+  return config_manager_->Save(error);
+}
+
+bool ProfileManager::RemoveRoot(const std::string& name, std::string* error) {
+  auto& cfg = config_manager_->config();
+  if (cfg.roots.size() <= 1) {
+    if (error) {
+      *error = "Cannot remove the last root";
+    }
+    return false;
+  }
+  auto it = std::find_if(cfg.roots.begin(), cfg.roots.end(),
+                         [&](const UhdRoot& r) { return r.name == name; });
+  if (it == cfg.roots.end()) {
+    if (error) {
+      *error = "Unknown root: " + name;
+    }
+    return false;
+  }
+  cfg.roots.erase(it);
+  NormalizeProfiles(cfg);
+  return config_manager_->Save(error);
+}
+
+bool ProfileManager::SelectRoot(const std::string& name, std::string* error) {
+  auto& cfg = config_manager_->config();
+  if (!FindRootByName(cfg, name)) {
+    if (error) {
+      *error = "Unknown root: " + name;
+    }
+    return false;
+  }
+  cfg.current_root = name;
+  return config_manager_->Save(error);
+}
+
+bool ProfileManager::DeduplicateRoots(std::uint64_t* bytes_saved,
+                                      std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::DeduplicateRoots");
+  auto& roots = config_manager_->config().roots;
+  std::uint64_t saved = 0;
+
+  // Brings a linked profile's manifest, root hash and size up to date.
+  const auto refresh = [&](const UhdRoot& root, Profile& profile) {
+    Manifest manifest;
+    if (LoadManifest(ManifestPath(root, profile.id), &manifest, nullptr)) {
+      if (!RefreshManifest(ProfileContentPath(root, profile), &manifest,
+                           nullptr, error) ||
+          !SaveManifest(ManifestPath(root, profile.id), manifest, error)) {
+        return false;
+      }
+      profile.root_hash = manifest.RootHash();
+    }
+    profile.size_bytes = MeasureDiskUsage(ProfileContentPath(root, profile));
+    return true;
+  };
+
+  // Files are only ever reflinked: a hardlink would let a later edit
+  // through either root's images change the other root's copy. Only idle
+  // folders are touched; the tree a root is running from is left alone.
+  bool changed = false;
+  for (std::size_t i = 0; i < roots.size(); ++i) {
+    for (std::size_t j = i + 1; j < roots.size(); ++j) {
+      if (!FileUtil::SameFilesystem(roots[i].uhd_dir, roots[j].uhd_dir)) {
+        continue;
+      }
+      for (auto& profile : roots[j].profiles) {
+        Profile* peer = FindProfileById(roots[i], profile.id);
+        if (!peer || profile.id == roots[i].active_profile_id ||
+            profile.id == roots[j].active_profile_id) {
+          continue;
+        }
+        const auto source_dir = roots[i].uhd_dir / peer->folder_name;
+        const auto dup_dir = roots[j].uhd_dir / profile.folder_name;
+        if (!FolderExists(source_dir) || !FolderExists(dup_dir)) {
+          continue;
+        }
+
+        std::vector<std::string> files;
+        if (!TreeWalker::Walk(
+                dup_dir, WalkOptions(),
+                [&](const WalkEntry& entry) {
+                  if (entry.type == EntryType::kFile) {
+                    files.push_back(*entry.rel_path);
+                  }
+                  return WalkAction::kContinue;
+                },
+                nullptr, error)) {
+          return false;
+        }
+        bool linked = false;
+        for (const auto& rel : files) {
+          const auto source = source_dir / rel;
+          const auto duplicate = dup_dir / rel;
+          if (FileUtil::SameInode(source, duplicate) ||
+              !FileUtil::FilesEqual(source, duplicate)) {
+            continue;
+          }
+          std::error_code ec;
+          const auto size = std::filesystem::file_size(duplicate, ec);
+          if (!FileUtil::ReplaceWithReflink(source, duplicate, error)) {
+            return false;
+          }
+          saved += ec ? 0 : size;
+          linked = true;
+        }
+        if (linked &&
+            !(refresh(roots[i], *peer) && refresh(roots[j], profile))) {
+          return false;
+        }
+        changed = changed || linked;
+      }
+    }
+  }
+
+  if (changed && !config_manager_->Save(error)) {
+    return false;
+  }
+  if (bytes_saved) {
+    *bytes_saved = saved;
+  }
+  return true;
+}
+
+std::filesystem::path ProfileManager::ManifestPath(
+    const UhdRoot& root, const std::string& profile_id) const {
+  return ManifestsDir(*config_manager_) / root.name / (profile_id + ".json");
+}
+
+bool ProfileManager::RecordManifest(const UhdRoot& root,
+                                    const Profile& profile,
+                                    std::string* root_hash,
+                                    std::string* error) const {
+  Manifest manifest;
+  if (!BuildManifest(ProfileContentPath(root, profile), &manifest, error) ||
+      !SaveManifest(ManifestPath(root, profile.id), manifest, error)) {
+    return false;
+  }
+  if (root_hash) {
+    *root_hash = manifest.RootHash();
+  }
+  return true;
+}
+
+bool ProfileManager::LoadProfileManifest(const UhdRoot& root,
+                                         const std::string& profile_id,
+                                         Manifest* manifest,
+                                         std::string* error) const {
+  const auto path = ManifestPath(root, profile_id);
+  if (!FileUtil::Exists(path)) {
+    if (error) {
+      *error = "No manifest recorded for " + profile_id +
+               "; verify or rehash it first";
+    }
+    return false;
+  }
+  return LoadManifest(path, manifest, error);
+}
+
+bool ProfileManager::RehashProfile(const std::string& profile_id,
+                                   std::vector<std::string>* changed,
+                                   std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::RehashProfile");
+  UhdRoot& root = CurrentRoot(config_manager_->config());
+  Profile* profile = FindProfileById(root, profile_id);
+  if (!profile) {
+    if (error) {
+      *error = "Unknown profile id: " + profile_id;
+    }
+    return false;
+  }
+  if (profile->packed) {
+    if (error) {
+      *error = "Profile " + profile_id + " is packed";
+    }
+    return false;
+  }
+  const auto dir = ProfileContentPath(root, *profile);
+  Manifest manifest;
+  const bool have = LoadManifest(ManifestPath(root, profile_id), &manifest,
+                                 nullptr);
+  const bool ok = have ? RefreshManifest(dir, &manifest, changed, error)
+                       : BuildManifest(dir, &manifest, error);
+  if (!ok || !SaveManifest(ManifestPath(root, profile_id), manifest, error)) {
+    return false;
+  }
+  if (!have && changed) {
+    changed->clear();
+    for (const auto& entry : manifest.entries) {
+      changed->push_back(entry.path);
+    }
+  }
+  profile->root_hash = manifest.RootHash();
+  return config_manager_->Save(error);
+}
+
+bool ProfileManager::CompareProfiles(const std::string& a,
+                                     const std::string& b, ManifestDiff* diff,
+                                     std::string* error) const {
+  UHD_TRACE_SCOPE("ProfileManager::CompareProfiles");
+  const UhdRoot& root = CurrentRoot(config_manager_->config());
+  const Profile* left = FindProfileById(root, a);
+  const Profile* right = FindProfileById(root, b);
+  if (!left || !right) {
+    if (error) {
+      *error = "Unknown profile id: " + (left ? b : a);
+    }
+    return false;
+  }
+  if (!left->root_hash.empty() && left->root_hash == right->root_hash) {
+    *diff = ManifestDiff();
+    return true;
+  }
+  Manifest expected;
+  Manifest actual;
+  if (!LoadProfileManifest(root, a, &expected, error) ||
+      !LoadProfileManifest(root, b, &actual, error)) {
+    return false;
+  }
+  *diff = DiffManifestTrees(expected, actual);
+  return true;
+}
+
+bool ProfileManager::UpdateIndex(ImageIndex* index, IndexStats* stats,
+                                 std::string* error) const {
+  UHD_TRACE_SCOPE("ProfileManager::UpdateIndex");
+  std::vector<IndexTarget> targets;
+  for (const auto& root : config_manager_->config().roots) {
+    for (const auto& profile : root.profiles) {
+      IndexTarget target;
+      target.root = root.name;
+      target.profile_id = profile.id;
+      if (!profile.packed) {
+        target.dir = ProfileContentPath(root, profile);
+        if (!FolderExists(target.dir)) {
+          continue;
+        }
+        LoadManifest(ManifestPath(root, profile.id), &target.known, nullptr);
+      }
+      targets.push_back(std::move(target));
+    }
+  }
+  return index->Update(targets, stats, error);
+}
+
+std::filesystem::path ProfileManager::IndexPath() const {
+  return config_manager_->path().parent_path() / "index.json";
+}
+
+std::string ProfileManager::FindIdenticalProfile(
+    const std::string& profile_id) const {
+  const UhdRoot& root = CurrentRoot(config_manager_->config());
+  const Profile* profile = FindProfileById(root, profile_id);
+  if (!profile || profile->root_hash.empty()) {
+    return "";
+  }
+  for (const auto& other : root.profiles) {
+    if (other.id != profile_id && other.root_hash == profile->root_hash) {
+      return other.id;
+    }
+  }
+  return "";
+}
+
+bool ProfileManager::VerifyProfile(const std::string& profile_id,
+                                   std::string* report, std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::VerifyProfile");
+  UhdRoot& root = CurrentRoot(config_manager_->config());
+  std::string baseline_hash;
+  if (!VerifyInRoot(root, profile_id, report, &baseline_hash, error)) {
+    return false;
+  }
+  if (baseline_hash.empty()) {
+    return true;
+  }
+  FindProfileById(root, profile_id)->root_hash = baseline_hash;
+  return config_manager_->Save(error);
+}
+
+bool ProfileManager::VerifyInRoot(const UhdRoot& root,
+                                  const std::string& profile_id,
+                                  std::string* report,
+                                  std::string* baseline_hash,
+                                  std::string* error) const {
+  const Profile* profile = FindProfileById(root, profile_id);
+  if (!profile) {
+    if (error) {
+      *error = "Unknown profile id: " + profile_id;
+    }
+    return false;
+  }
+
+  const auto manifest_path = ManifestPath(root, profile_id);
+  if (!FileUtil::Exists(manifest_path)) {
+    if (!RecordManifest(root, *profile, baseline_hash, error)) {
+      return false;
+    }
+    if (report) {
+      *report = "Baseline manifest recorded";
+    }
+    return true;
+  }
+
+  Manifest expected;
+  if (!LoadManifest(manifest_path, &expected, error)) {
+    return false;
+  }
+  Manifest actual;
+  if (!BuildManifest(ProfileContentPath(root, *profile), &actual, error)) {
+    return false;
+  }
+  const ManifestDiff diff = DiffManifestTrees(expected, actual);
+  if (!diff.empty()) {
+    if (error) {
+      *error = "Profile " + profile_id + " differs: " + DescribeDiff(diff);
+    }
+    return false;
+  }
+  if (report) {
+    *report = "Verified " + std::to_string(actual.entries.size()) + " files";
+  }
+  return true;
+}
+
+void ProfileManager::RemoveFromGroups(
+    const std::string& root_name,
+    const std::unordered_set<std::string>& profile_ids) {
+  for (auto& group : config_manager_->config().groups) {
+    auto& members = group.members;
+    members.erase(std::remove_if(members.begin(), members.end(),
+                                 [&](const GroupMember& m) {
+                                   return m.root == root_name &&
+                                          profile_ids.count(m.profile_id) > 0;
+                                 }),
+                  members.end());
+  }
+}
+
+const std::vector<ProfileGroup>& ProfileManager::Groups() const {
+  return config_manager_->config().groups;
+}
+
+bool ProfileManager::CreateGroup(const std::string& name, std::string* error) {
+  auto& cfg = config_manager_->config();
+  if (name.empty()) {
+    if (error) {
+      *error = "Group name is empty";
+    }
+    return false;
+  }
+  if (FindGroupByName(cfg, name)) {
+    if (error) {
+      *error = "Group already exists: " + name;
+    }
+    return false;
+  }
+  ProfileGroup group;
+  group.name = name;
+  cfg.groups.push_back(std::move(group));
+  return config_manager_->Save(error);
+}
+
+bool ProfileManager::DeleteGroup(const std::string& name, std::string* error) {
+  auto& groups = config_manager_->config().groups;
+  auto it = std::find_if(groups.begin(), groups.end(),
+                         [&](const ProfileGroup& g) { return g.name == name; });
+  if (it == groups.end()) {
+    if (error) {
+      *error = "Unknown group: " + name;
+    }
+    return false;
+  }
+  groups.erase(it);
+  return config_manager_->Save(error);
+}
+
+bool ProfileManager::AddToGroup(const std::string& group_name,
+                                const std::string& profile_id,
+                                std::string* error) {
+  auto& cfg = config_manager_->config();
+  ProfileGroup* group = FindGroupByName(cfg, group_name);
+  if (!group) {
+    if (error) {
+      *error = "Unknown group: " + group_name;
+    }
+    return false;
+  }
+  const UhdRoot& root = CurrentRoot(cfg);
+  if (!FindProfileById(root, profile_id)) {
+    if (error) {
+      *error = "Unknown profile id: " + profile_id;
+    }
+    return false;
+  }
+  for (const auto& member : group->members) {
+    if (member.root == root.name) {
+      if (error) {
+        *error = "Group " + group_name + " already has a profile for root " +
+                 root.name;
+      }
+      return false;
+    }
+  }
+  group->members.push_back({root.name, profile_id});
+  return config_manager_->Save(error);
+}
+
+bool ProfileManager::RemoveFromGroup(const std::string& group_name,
+                                     const std::string& profile_id,
+                                     std::string* error) {
+  auto& cfg = config_manager_->config();
+  ProfileGroup* group = FindGroupByName(cfg, group_name);
+  if (!group) {
+    if (error) {
+      *error = "Unknown group: " + group_name;
+    }
+    return false;
+  }
+  const std::string root_name = CurrentRoot(cfg).name;
+  const auto before = group->members.size();
+  auto& members = group->members;
+  members.erase(std::remove_if(members.begin(), members.end(),
+                               [&](const GroupMember& m) {
+                                 return m.root == root_name &&
+                                        m.profile_id == profile_id;
+                               }),
+                members.end());
+  if (members.size() == before) {
+    if (error) {
+      *error = "Profile " + profile_id + " is not in group " + group_name;
+    }
+    return false;
+  }
+  return config_manager_->Save(error);
+}
+
+bool ProfileManager::ResolveGroup(const std::string& group_name,
+                                  std::vector<ResolvedMember>* resolved,
+                                  std::string* error) {
+  auto& cfg = config_manager_->config();
+  const ProfileGroup* group = FindGroupByName(cfg, group_name);
+  if (!group) {
+    if (error) {
+      *error = "Unknown group: " + group_name;
+    }
+    return false;
+  }
+  if (group->members.empty()) {
+    if (error) {
+      *error = "Group " + group_name + " is empty";
+    }
+    return false;
+  }
+  resolved->clear();
+  for (const auto& member : group->members) {
+    UhdRoot* root = FindRootByName(cfg, member.root);
+    Profile* profile = root ? FindProfileById(*root, member.profile_id)
+                            : nullptr;
+    if (!profile) {
+      if (error) {
+        *error = "Group member is missing: " + member.root + "/" +
+                 member.profile_id;
+      }
+      return false;
+    }
+    resolved->push_back({root, profile->id});
+  }
+  return true;
+}
+
+bool ProfileManager::ApplyGroup(const std::string& group_name,
+                                std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::ApplyGroup");
+  std::vector<ResolvedMember> members;
+  if (!ResolveGroup(group_name, &members, error)) {
+    return false;
+  }
+  std::unordered_set<const UhdRoot*> seen;
+  for (const auto& member : members) {
+    if (!seen.insert(member.root).second) {
+      if (error) {
+        *error = "Group " + group_name + " has two profiles for root " +
+                 member.root->name;
+      }
+      return false;
+    }
+    if (!CheckUhdRelease(*member.root, member.profile_id, error)) {
+      return false;
+    }
+  }
+
+  std::vector<std::string> previous(members.size());
+  std::vector<std::vector<Activation>> history(members.size());
+  std::vector<std::string> errors(members.size());
+  std::vector<char> applied(members.size(), 0);
+  for (std::size_t i = 0; i < members.size(); ++i) {
+    previous[i] = members[i].root->active_profile_id;
+    history[i] = members[i].root->history;
+  }
+  ParallelFor(members.size(), [&](std::size_t i) {
+    applied[i] = ApplyInRoot(*members[i].root, members[i].profile_id,
+                             nullptr, &errors[i]);
+  });
+
+  std::string combined;
+  for (std::size_t i = 0; i < members.size(); ++i) {
+    if (!applied[i]) {
+      combined += (combined.empty() ? "" : "; ") + members[i].root->name +
+                  ": " + errors[i];
+    }
+  }
+  if (!combined.empty()) {
+    // All or nothing: put every root that did switch back where it was,
+    // without the activations the apply and its undo recorded.
+    std::vector<std::string> rollback_errors(members.size());
+    std::vector<char> stuck(members.size(), 0);
+    ParallelFor(members.size(), [&](std::size_t i) {
+      if (!applied[i] || previous[i].empty()) {
+        return;
+      }
+      if (ApplyInRoot(*members[i].root, previous[i], nullptr,
+                      &rollback_errors[i])) {
+        members[i].root->history = std::move(history[i]);
+      } else {
+        stuck[i] = 1;
+      }
+    });
+    for (std::size_t i = 0; i < members.size(); ++i) {
+      if (stuck[i]) {
+        combined += "; rollback failed for " + members[i].root->name + ": " +
+                    rollback_errors[i];
+      }
+    }
+    // Roots that could not be rolled back keep the group's profile active.
+    config_manager_->Save(nullptr);
+    if (error) {
+      *error = "Group apply rolled back: " + combined;
+    }
+    return false;
+  }
+  return config_manager_->Save(error);
+}
+
+bool ProfileManager::DeleteGroupProfiles(const std::string& group_name,
+                                         std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::DeleteGroupProfiles");
+  std::vector<ResolvedMember> members;
+  if (!ResolveGroup(group_name, &members, error)) {
+    return false;
+  }
+  for (const auto& member : members) {
+    const Profile* profile = FindProfileById(*member.root, member.profile_id);
+    if (profile->is_official ||
+        member.profile_id == member.root->active_profile_id) {
+      if (error) {
+        *error = "Group " + group_name + " contains an official or active " +
+                 "profile: " + member.root->name + "/" + member.profile_id;
+      }
+      return false;
+    }
+  }
+
+  std::vector<std::string> errors(members.size());
+  std::vector<char> removed(members.size(), 0);
+  ParallelFor(members.size(), [&](std::size_t i) {
+    const Profile* profile =
+        FindProfileById(*members[i].root, members[i].profile_id);
+    removed[i] = RemoveProfileStorage(*members[i].root, *profile, &errors[i]);
+  });
+
+  std::string combined;
+  for (std::size_t i = 0; i < members.size(); ++i) {
+    if (!removed[i]) {
+      combined += (combined.empty() ? "" : "; ") + errors[i];
+      continue;
+    }
+    auto& profiles = members[i].root->profiles;
+    profiles.erase(std::remove_if(profiles.begin(), profiles.end(),
+                                  [&](const Profile& p) {
+                                    return p.id == members[i].profile_id;
+                                  }),
+                   profiles.end());
+    RemoveFromGroups(members[i].root->name, {members[i].profile_id});
+  }
+
+  std::string save_error;
+  const bool saved = config_manager_->Save(&save_error);
+  if (!combined.empty() || !saved) {
+    if (error) {
+      *error = combined.empty() ? save_error : combined;
+    }
+    return false;
+  }
+  return true;
+}
+
+bool ProfileManager::VerifyGroup(const std::string& group_name,
+                                 std::string* report, std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::VerifyGroup");
+  std::vector<ResolvedMember> members;
+  if (!ResolveGroup(group_name, &members, error)) {
+    return false;
+  }
+  std::vector<std::string> errors(members.size());
+  std::vector<std::string> baseline_hashes(members.size());
+  std::vector<char> ok(members.size(), 0);
+  ParallelFor(members.size(), [&](std::size_t i) {
+    ok[i] = VerifyInRoot(*members[i].root, members[i].profile_id, nullptr,
+                         &baseline_hashes[i], &errors[i]);
+  });
+
+  // Baselines are stored even when another member fails to verify.
+  bool recorded = false;
+  std::string combined;
+  for (std::size_t i = 0; i < members.size(); ++i) {
+    if (!baseline_hashes[i].empty()) {
+      FindProfileById(*members[i].root, members[i].profile_id)->root_hash =
+          baseline_hashes[i];
+      recorded = true;
+    }
+    if (!ok[i]) {
+      combined += (combined.empty() ? "" : "; ") + members[i].root->name +
+                  ": " + errors[i];
+    }
+  }
+  if (recorded && !config_manager_->Save(error)) {
+    return false;
+  }
+  if (!combined.empty()) {
+    if (error) {
+      *error = combined;
+    }
+    return false;
+  }
+  if (report) {
+    *report = "Verified " + std::to_string(members.size()) + " profiles";
+  }
+  return true;
+}
+
+bool ProfileManager::VerifyRecordsBaseline(
+    const std::string& profile_id) const {
+  const UhdRoot& root = CurrentRoot(config_manager_->config());
+  return FindProfileById(root, profile_id) &&
+         !FileUtil::Exists(ManifestPath(root, profile_id));
+}
+
+bool ProfileManager::GroupVerifyRecordsBaseline(
+    const std::string& group_name) const {
+  const auto& cfg = config_manager_->config();
+  const ProfileGroup* group = FindGroupByName(cfg, group_name);
+  if (!group) {
+    return false;
+  }
+  for (const auto& member : group->members) {
+    const UhdRoot* root = FindRootByName(cfg, member.root);
+    if (root && FindProfileById(*root, member.profile_id) &&
+        !FileUtil::Exists(ManifestPath(*root, member.profile_id))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ProfileManager::PrewarmGroup(const std::string& group_name,
+                                  std::uint64_t* bytes, std::string* error) {
+  UHD_TRACE_SCOPE("ProfileManager::PrewarmGroup");
+  std::vector<ResolvedMember> members;
+  if (!ResolveGroup(group_name, &members, error)) {
+    return false;
+  }
+  std::vector<std::uint64_t> warmed(members.size(), 0);
+  std::vector<std::string> errors(members.size());
+  ParallelFor(members.size(), [&](std::size_t i) {
+    const Profile* profile =
+        FindProfileById(*members[i].root, members[i].profile_id);
+    FileUtil::PrewarmDir(ProfileContentPath(*members[i].root, *profile),
+                         &warmed[i], &errors[i]);
+  });
+  for (const auto& item_error : errors) {
+    if (!item_error.empty()) {
+      if (error) {
+        *error = item_error;
+      }
+      return false;
+    }
+  }
+  if (bytes) {
+    *bytes = 0;
+    for (auto value : warmed) {
+      *bytes += value;
+    }
+  }
+  return true;
+}
+
 }  // namespace uhd_helper
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <cstdint>
 #include <filesystem>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
 namespace uhd_helper {
@@ -11,32 +13,333 @@ struct Profile {
   std::string display_name;
   std::string folder_name;
   bool is_official = false;
+  // Blocks the folder occupies, with blocks of files hardlinked elsewhere
+  // split between their links. Updated by MeasureProfiles.
+  std::uint64_t size_bytes = 0;
+  // Unix time the profile was created or last left or entered images.
+  std::int64_t last_used = 0;
+  // Evicted into <uhd_dir>/.packed/<folder_name>.pack; ApplyProfile
+  // restores it.
+  bool packed = false;
+  // Root of the Merkle tree of the recorded manifest; equal hashes mean
+  // equal contents. Empty until a manifest is recorded.
+  std::string root_hash;
+  // UHD release the images are for, "4.6.0"; empty when unknown. Applying
+  // it to a root with an incompatible release is refused.
+  std::string uhd_version;
 };
 
+struct ImportStats {
+  std::uint64_t files = 0;
+  std::uint64_t bytes = 0;
+  std::uint64_t files_deduplicated = 0;
+  std::uint64_t bytes_deduplicated = 0;
+};
+
+struct ExportStats {
+  std::uint64_t profiles = 0;
+  std::uint64_t files = 0;
+  std::uint64_t bytes = 0;
+  std::uint64_t files_skipped = 0;
+  std::uint64_t bytes_skipped = 0;
+};
+
+struct EvictionStats {
+  std::uint64_t profiles_packed = 0;
+  std::uint64_t bytes_freed = 0;
+  // Roots still above the budget once every candidate was packed.
+  std::uint64_t roots_over_budget = 0;
+};
+
+// Inconsistencies CheckConsistency finds between config.json, the UHD
+// roots and the recorded manifests.
+enum class FsckProblem {
+  // A registered idle profile whose folder is gone.
+  kMissingFolder,
+  // A packed profile whose archive is gone.
+  kMissingPack,
+  // A profile folder on disk that config.json does not list.
+  kUnregisteredFolder,
+  // Two profiles claiming one folder, or a folder whose id is taken by a
+  // profile registered under another folder.
+  kDuplicateFolder,
+  // folder_name does not follow the idle prefix and id.
+  kMisnamedFolder,
+  // Left behind by an interrupted copy, refill, pack or activation.
+  kStrayStaging,
+  // Saved images of unknown origin; only ever reported.
+  kStrayBackup,
+  // An archive in .packed that no packed profile owns.
+  kStrayPack,
+  // active_profile_id does not name what images holds.
+  kActiveMismatch,
+  kImagesMissing,
+  // The config's root hash differs from the recorded manifest.
+  kStaleRootHash,
+  // A root hash is recorded but its manifest is missing or unreadable.
+  kMissingManifest,
+  // A manifest of a profile or root that no longer exists.
+  kOrphanManifest,
+};
+
+const char* FsckProblemName(FsckProblem problem);
+
+struct FsckIssue {
+  FsckProblem problem = FsckProblem::kMissingFolder;
+  std::string root;
+  // Empty for issues that belong to the root rather than a profile.
+  std::string profile_id;
+  std::filesystem::path path;
+  std::string detail;
+  bool repairable = false;
+  bool repaired = false;
+};
+
+struct FsckReport {
+  std::uint64_t roots = 0;
+  std::uint64_t profiles = 0;
+  std::uint64_t repaired = 0;
+  std::vector<FsckIssue> issues;
+};
+
+// One line per issue, "root/profile: problem: detail", and a summary.
+std::string DescribeFsckReport(const FsckReport& report);
+
+// How ApplyProfile brings a profile into images, picked before anything
+// moves. kSymlink is what the symlink activation mode uses, and kLinkFarm
+// what the hardlinks mode uses when the profile is on the root's mount,
+// falling back to kSymlink otherwise. Renames cannot
+// cross a mount boundary, so a profile folder that is a mount point is
+// symlinked in under either mode, and an images folder that is a mount
+// point is refilled in place.
+enum class ApplyStrategy {
+  kRename,
+  kSymlink,
+  // images is refilled with hardlinks when the profile is on its mount,
+  kHardlinks,
+  // and with copies otherwise.
+  kCopy,
+  // images is rebuilt as hardlinks to the profile's read-only files, and
+  // folded back into the outgoing profile's folder when it is replaced.
+  kLinkFarm,
+};
+
+const char* ApplyStrategyName(ApplyStrategy strategy);
+
 class ConfigManager;
+enum class ActivationMode;
+struct Activation;
+struct CloneStats;
+class ImageIndex;
+struct IndexStats;
+struct Manifest;
+struct ManifestDiff;
+struct ProfileGroup;
+struct ThrottleLimits;
+struct UhdRoot;
 
 class ProfileManager {
  public:
   explicit ProfileManager(ConfigManager* config_manager);
 
+  // InitializeFromCache, then RefreshFromDisk.
   bool Initialize(std::string* error);
-  bool ApplyProfile(const std::string& profile_id, std::string* error);
+  // Loads config.json and applies its I/O limits without touching the
+  // roots, so a UI can draw the cached state at once. Calling it again
+  // picks up what another manager saved.
+  bool InitializeFromCache(std::string* error);
+  // strategy, if set, receives how the profile was brought in.
+  bool ApplyProfile(const std::string& profile_id, ApplyStrategy* strategy,
+                    std::string* error);
+  // Applies profile_id in every root that has it, one thread per root, and
+  // saves the config once at the end.
+  bool ApplyProfileToAllRoots(const std::string& profile_id,
+                              std::string* error);
   bool AddProfileFromActive(const std::string& display_name,
                             std::string* error);
+  // Captures the live images folder as a new idle profile. Files are
+  // reflinked where the filesystem allows, so the cost is metadata only.
+  bool SnapshotActive(const std::string& display_name, CloneStats* stats,
+                      std::string* error);
+  // Streams a zip, tar, tar.gz or tar.xz of images from archive_path ("-"
+  // reads stdin) into a new idle profile in one pass. Files already present
+  // in another profile are linked instead of kept twice, and the profile is
+  // only registered once the folder is complete.
+  bool ImportArchive(const std::string& display_name,
+                     const std::filesystem::path& archive_path,
+                     ImportStats* stats, std::string* error);
+  // Bundles carry profiles between hosts: a tar stream (out "-" is stdout)
+  // holding each profile's name, root and manifest followed by its files.
+  // Files whose size and hash appear in the manifest at have_manifest, as
+  // written by WriteInventory on the receiving host, are left out.
+  bool ExportProfile(const std::string& profile_id,
+                     const std::filesystem::path& out,
+                     const std::filesystem::path& have_manifest,
+                     ExportStats* stats, std::string* error);
+  bool ExportGroup(const std::string& group_name,
+                   const std::filesystem::path& out,
+                   const std::filesystem::path& have_manifest,
+                   ExportStats* stats, std::string* error);
+  // Unpacks a bundle ("-" reads stdin), checking every file against the
+  // bundled manifest as it is written and filling omitted files from local
+  // profiles. Profiles land in the root of the same name, or the current
+  // one; nothing is registered unless every profile is complete.
+  bool ImportBundle(const std::filesystem::path& bundle_path,
+                    ImportStats* stats, std::string* error);
+  // Manifest of every file recorded for any profile on this host.
+  bool WriteInventory(const std::filesystem::path& out,
+                      std::string* error) const;
   bool DeleteProfile(const std::string& profile_id, std::string* error);
+  // Switches the current root back to the profile that was active before
+  // the latest activation. Costs the same renames as any apply.
+  bool RevertActivation(std::string* report, std::string* error);
   bool ResetToOfficial(std::string* error);
+  // Also moves each root's images folder to the layout of the configured
+  // activation mode and takes the active profile from a symlinked images.
+  // Every root is refreshed even if an earlier one fails; the error then
+  // names each failed root. Missing UHD directories are skipped.
   bool RefreshFromDisk(std::string* error);
+  // Cross-checks every root's profiles against their folders, packs and
+  // manifests and its images folder against the active profile, all roots
+  // and profiles in one parallel pass that only reads. With repair set,
+  // the repairable issues are then fixed as one transaction: renames and
+  // config edits are undone if any of them fails, and stray files are only
+  // removed once the repaired config is saved.
+  bool CheckConsistency(bool repair, FsckReport* report, std::string* error);
+  // Records the UHD release a profile of the current root is for: a
+  // version such as "4.6", "installed" for the root's own release, or ""
+  // or "none" to forget it.
+  bool SetProfileUhdVersion(const std::string& profile_id,
+                            const std::string& version, std::string* error);
+  // Release installed with the current root, "" when it cannot be told.
+  std::string InstalledUhdVersion() const;
+  // Stores the I/O limits in the config and applies them to this process.
+  bool SetIoLimits(const ThrottleLimits& limits, std::string* error);
+  // Stores mode and migrates every root to it.
+  bool SetActivationMode(ActivationMode mode, std::string* error);
+  // Compares a profile's files against its recorded manifest. The first
+  // verify of a profile without one records the baseline and its root hash.
+  bool VerifyProfile(const std::string& profile_id, std::string* report,
+                     std::string* error);
+  // Brings the recorded manifest and root hash up to date with the folder,
+  // hashing only files whose size or mtime changed.
+  bool RehashProfile(const std::string& profile_id,
+                     std::vector<std::string>* changed, std::string* error);
+  // Equal root hashes settle it without touching the manifests; otherwise
+  // only subtrees whose hashes differ are walked.
+  bool CompareProfiles(const std::string& a, const std::string& b,
+                       ManifestDiff* diff, std::string* error) const;
+  // Another profile in the current root with the same contents, or "".
+  std::string FindIdenticalProfile(const std::string& profile_id) const;
+  // Re-indexes every profile of every root into index. Recorded manifest
+  // hashes are reused; packed profiles keep their previous entries.
+  bool UpdateIndex(ImageIndex* index, IndexStats* stats,
+                   std::string* error) const;
+  std::filesystem::path IndexPath() const;
+
+  // Idle profiles of each root may take idle_budget_bytes on disk (0 is
+  // unlimited). Over budget, the least recently used idle profiles are
+  // packed into a compressed archive until the root fits; the active and
+  // the official profile are never packed. Sizes are refreshed first.
+  bool EnforceDiskBudget(EvictionStats* stats, std::string* error);
+  bool SetDiskBudget(std::uint64_t bytes, EvictionStats* stats,
+                     std::string* error);
+  bool PackProfile(const std::string& profile_id, std::string* error);
+  // Recomputes size_bytes of every unpacked profile from allocated blocks.
+  void MeasureProfiles();
+
+  bool AddRoot(const std::string& name, const std::filesystem::path& uhd_dir,
+               std::string* error);
+  bool RemoveRoot(const std::string& name, std::string* error);
+  bool SelectRoot(const std::string& name, std::string* error);
+  // Reflinks identical files of same-id idle profiles across roots that
+  // share a filesystem, then refreshes both profiles' manifests and sizes.
+  // Fails on filesystems that cannot reflink.
+  bool DeduplicateRoots(std::uint64_t* bytes_saved, std::string* error);
+
+  // Groups name one profile per root. Group operations fan out across
+  // roots and cores and save the config once at the end; ApplyGroup rolls
+  // every root back if any of them fails.
+  bool CreateGroup(const std::string& name, std::string* error);
+  bool DeleteGroup(const std::string& name, std::string* error);
+  bool AddToGroup(const std::string& group_name, const std::string& profile_id,
+                  std::string* error);
+  bool RemoveFromGroup(const std::string& group_name,
+                       const std::string& profile_id, std::string* error);
+  bool ApplyGroup(const std::string& group_name, std::string* error);
+  bool DeleteGroupProfiles(const std::string& group_name, std::string* error);
+  bool VerifyGroup(const std::string& group_name, std::string* report,
+                   std::string* error);
+  // Whether verifying the profile, or a member of the group, records a
+  // baseline manifest first, which writes rather than only reads.
+  bool VerifyRecordsBaseline(const std::string& profile_id) const;
+  bool GroupVerifyRecordsBaseline(const std::string& group_name) const;
+  bool PrewarmGroup(const std::string& group_name, std::uint64_t* bytes,
+                    std::string* error);
 
   const std::vector<Profile>& Profiles() const;
+  const std::vector<ProfileGroup>& Groups() const;
+  // Activation history of the current root, oldest first.
+  const std::vector<Activation>& History() const;
+  const std::vector<UhdRoot>& Roots() const;
+  std::string CurrentRootName() const;
   std::string ActiveProfileId() const;
   std::filesystem::path UhdDir() const;
   std::filesystem::path ImagesPath() const;
   std::filesystem::path ConfigPath() const;
+  bool ConfigChangedOnDisk() const;
 
  private:
-  std::string GenerateProfileId(const std::string& display_name) const;
-  bool EnsureUhdDir(std::string* error) const;
-  bool RenameActiveToIdle(std::string* error);
+  struct ResolvedMember {
+    UhdRoot* root;
+    std::string profile_id;
+  };
+
+  bool ExportMembers(const std::vector<ResolvedMember>& members,
+                     const std::string& group_name,
+                     const std::filesystem::path& out,
+                     const std::filesystem::path& have_manifest,
+                     ExportStats* stats, std::string* error);
+  bool ResolveGroup(const std::string& group_name,
+                    std::vector<ResolvedMember>* resolved, std::string* error);
+  void RemoveFromGroups(const std::string& root_name,
+                        const std::unordered_set<std::string>& profile_ids);
+  // Sets baseline_hash to the root hash of a baseline it records and
+  // leaves it alone otherwise; the caller stores it in the config.
+  // Removes a profile's folder or pack and its manifest; the caller drops
+  // it from the config.
+  bool RemoveProfileStorage(const UhdRoot& root, const Profile& profile,
+                            std::string* error) const;
+  // Sets baseline_hash to the root hash of a baseline it records and
+  // leaves it alone otherwise; the caller stores it in the config.
+  bool VerifyInRoot(const UhdRoot& root, const std::string& profile_id,
+                    std::string* report, std::string* baseline_hash,
+                    std::string* error) const;
+  std::string GenerateProfileId(const UhdRoot& root,
+                                const std::string& display_name) const;
+  bool EnsureUhdDir(const UhdRoot& root, std::string* error) const;
+  bool PrepareNewProfile(const UhdRoot& root, const std::string& display_name,
+                         Profile* profile, std::string* error) const;
+  bool RenameActiveToIdle(UhdRoot& root, std::string* error);
+  void RecordActivation(UhdRoot& root, const std::string& previous_id) const;
+  // Refuses profile_id when it is for a UHD release incompatible with the
+  // one installed with root. Runs before anything moves.
+  bool CheckUhdRelease(const UhdRoot& root, const std::string& profile_id,
+                       std::string* error) const;
+  bool ApplyInRoot(UhdRoot& root, const std::string& profile_id,
+                   ApplyStrategy* strategy, std::string* error);
+  bool RefreshRoot(UhdRoot& root, std::string* error);
+  bool PackInRoot(UhdRoot& root, Profile& profile, std::uint64_t* packed_size,
+                  std::string* error);
+  bool UnpackInRoot(UhdRoot& root, Profile& profile, std::string* error);
+  // Best effort, after operations that add profiles.
+  void EnforceDiskBudgetIfSet();
+  std::filesystem::path ManifestPath(const UhdRoot& root,
+                                     const std::string& profile_id) const;
+  bool RecordManifest(const UhdRoot& root, const Profile& profile,
+                      std::string* root_hash, std::string* error) const;
+  bool LoadProfileManifest(const UhdRoot& root, const std::string& profile_id,
+                           Manifest* manifest, std::string* error) const;
 
   ConfigManager* config_manager_;
 };
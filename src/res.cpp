@@ -1,8 +1,132 @@
 #include "res.hpp"
 
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
 #include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <system_error>
+#include <tuple>
+#include <unordered_map>
 
 namespace uhd_helper {
+namespace {
+
+struct DetectedRelease {
+  UhdRelease release;
+  // The file the release was read from and its mtime; empty when none was
+  // found.
+  std::filesystem::path source;
+  std::int64_t mtime_ns = 0;
+};
+
+std::int64_t MtimeNsOf(const std::filesystem::path& path) {
+  struct stat st;
+  if (::stat(path.c_str(), &st) != 0) {
+    return -1;
+  }
+  return static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+         st.st_mtim.tv_nsec;
+}
+
+bool Newer(const UhdRelease& a, const UhdRelease& b) {
+  return std::tie(a.major, a.minor, a.patch) >
+         std::tie(b.major, b.minor, b.patch);
+}
+
+// Every libuhd.so.X.Y.Z in the usual library folders of prefix, the newest
+// winning when an old one was left behind.
+bool ReleaseFromLibrary(const std::filesystem::path& prefix,
+                        DetectedRelease* detected) {
+  std::error_code ec;
+  std::vector<std::filesystem::path> dirs = {prefix / "lib",
+                                             prefix / "lib64"};
+  // Debian's multiarch folders, such as lib/x86_64-linux-gnu.
+  for (const auto& entry :
+       std::filesystem::directory_iterator(prefix / "lib", ec)) {
+    if (entry.path().filename().string().find("-linux-") !=
+            std::string::npos &&
+        entry.is_directory(ec)) {
+      dirs.push_back(entry.path());
+    }
+  }
+  const std::string stem = "libuhd.so.";
+  bool found = false;
+  for (const auto& dir : dirs) {
+    for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+      const std::string name = entry.path().filename().string();
+      UhdRelease release;
+      if (name.compare(0, stem.size(), stem) != 0 ||
+          !ParseUhdRelease(std::string_view(name).substr(stem.size()),
+                           &release)) {
+        continue;
+      }
+      if (!found || Newer(release, detected->release)) {
+        detected->release = release;
+        detected->source = entry.path();
+        found = true;
+      }
+    }
+  }
+  return found;
+}
+
+// #define UHD_VERSION_ABI_STRING "4.6.0", present with the development
+// headers.
+bool ReleaseFromHeader(const std::filesystem::path& prefix,
+                       DetectedRelease* detected) {
+  const auto path = prefix / "include" / "uhd" / "version.hpp";
+  std::ifstream input(path);
+  if (!input.is_open()) {
+    return false;
+  }
+  const std::string content((std::istreambuf_iterator<char>(input)),
+                            std::istreambuf_iterator<char>());
+  const std::size_t define = content.find("UHD_VERSION_ABI_STRING");
+  const std::size_t quote =
+      define == std::string::npos ? define : content.find('"', define);
+  if (quote == std::string::npos ||
+      !ParseUhdRelease(std::string_view(content).substr(quote + 1),
+                       &detected->release)) {
+    return false;
+  }
+  detected->source = path;
+  return true;
+}
+
+// uhd_dir without a trailing separator, so both spellings share a cache
+// entry and a prefix.
+std::filesystem::path TrimmedUhdDir(const std::filesystem::path& uhd_dir) {
+  const auto normal = uhd_dir.lexically_normal();
+  return normal.has_filename() ? normal : normal.parent_path();
+}
+
+DetectedRelease DetectRelease(const std::filesystem::path& uhd_dir) {
+  DetectedRelease detected;
+  const auto prefix = uhd_dir.parent_path().parent_path();
+  if (prefix.empty() || (!ReleaseFromLibrary(prefix, &detected) &&
+                         !ReleaseFromHeader(prefix, &detected))) {
+    return DetectedRelease();
+  }
+  detected.mtime_ns = MtimeNsOf(detected.source);
+  return detected;
+}
+
+std::mutex& ReleaseCacheMutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+std::unordered_map<std::string, DetectedRelease>& ReleaseCache() {
+  static std::unordered_map<std::string, DetectedRelease> cache;
+  return cache;
+}
+
+}  // namespace
 
 Os DetectOs() {
 #if defined(__linux__)
@@ -22,8 +146,175 @@ std::filesystem::path GetUhdDirByOs(Os os) {
   return std::filesystem::path();
 }
 
-std::string GetImagesFolderName(UhdVersion /*version*/) {
-  return "images";
+std::string GetImagesFolderName(UhdVersion version) {
+  return WithUhdLayout(version, [](auto layout) {
+    return std::string(decltype(layout)::kImagesFolder);
+  });
+}
+
+bool ParseUhdRelease(std::string_view text, UhdRelease* release) {
+  std::size_t pos = 0;
+  if (pos < text.size() && (text[pos] == 'v' || text[pos] == 'V')) {
+    ++pos;
+  }
+  int parts[3] = {0, 0, 0};
+  int count = 0;
+  while (count < 3 && pos < text.size() &&
+         std::isdigit(static_cast<unsigned char>(text[pos]))) {
+    int value = 0;
+    std::size_t digits = 0;
+    while (pos < text.size() &&
+           std::isdigit(static_cast<unsigned char>(text[pos])) &&
+           digits < 6) {
+      value = value * 10 + (text[pos] - '0');
+      ++pos;
+      ++digits;
+    }
+    parts[count++] = value;
+    if (pos + 1 < text.size() && text[pos] == '.' &&
+        std::isdigit(static_cast<unsigned char>(text[pos + 1]))) {
+      ++pos;
+    } else {
+      break;
+    }
+  }
+  if (count < 2 || parts[0] == 0) {
+    return false;
+  }
+  release->major = parts[0];
+  release->minor = parts[1];
+  release->patch = parts[2];
+  return true;
+}
+
+bool FindUhdReleaseInName(std::string_view name, UhdRelease* release) {
+  std::string lower(name);
+  std::transform(lower.begin(), lower.end(), lower.begin(), [](char c) {
+    return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+  });
+  for (std::size_t at = lower.find("uhd"); at != std::string::npos;
+       at = lower.find("uhd", at + 1)) {
+    std::size_t pos = at + 3;
+    for (const char* infix : {"-images", "_images"}) {
+      if (lower.compare(pos, 7, infix) == 0) {
+        pos += 7;
+        break;
+      }
+    }
+    if (pos < lower.size() && (lower[pos] == '_' || lower[pos] == '-') &&
+        ParseUhdRelease(std::string_view(lower).substr(pos + 1), release)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string FormatUhdRelease(const UhdRelease& release) {
+  if (!release.known()) {
+    return "";
+  }
+  return std::to_string(release.major) + "." + std::to_string(release.minor) +
+         "." + std::to_string(release.patch);
+}
+
+UhdVersion UhdVersionOf(const UhdRelease& release) {
+  switch (release.major) {
+    case UhdLayout<UhdVersion::kUhd3>::kMajor:
+      return UhdVersion::kUhd3;
+    case UhdLayout<UhdVersion::kUhd4>::kMajor:
+      return UhdVersion::kUhd4;
+    default:
+      return UhdVersion::kDefault;
+  }
+}
+
+UhdRelease InstalledUhdRelease(const std::filesystem::path& uhd_dir) {
+  const auto dir = TrimmedUhdDir(uhd_dir);
+  const std::string key = dir.string();
+  {
+    std::lock_guard<std::mutex> lock(ReleaseCacheMutex());
+    auto it = ReleaseCache().find(key);
+    if (it != ReleaseCache().end() &&
+        (it->second.source.empty() ||
+         MtimeNsOf(it->second.source) == it->second.mtime_ns)) {
+      return it->second.release;
+    }
+  }
+  DetectedRelease detected = DetectRelease(dir);
+  const UhdRelease release = detected.release;
+  std::lock_guard<std::mutex> lock(ReleaseCacheMutex());
+  ReleaseCache()[key] = std::move(detected);
+  return release;
+}
+
+void ForgetInstalledUhdReleases() {
+  std::lock_guard<std::mutex> lock(ReleaseCacheMutex());
+  ReleaseCache().clear();
+}
+
+bool UhdReleasesCompatible(const UhdRelease& target,
+                           const UhdRelease& installed) {
+  if (!target.known() || !installed.known()) {
+    return true;
+  }
+  if (target.major != installed.major) {
+    return false;
+  }
+  return WithUhdLayout(UhdVersionOf(installed), [&](auto layout) {
+    return decltype(layout)::Compatible(target, installed);
+  });
+}
+
+std::vector<UhdRootLocation> DetectUhdRoots(Os os) {
+  std::vector<UhdRootLocation> roots;
+  const auto add_root = [&](std::string name, std::filesystem::path dir,
+                            std::string images_folder_name) {
+    for (const auto& root : roots) {
+      if (root.uhd_dir == dir) {
+        return;
+      }
+    }
+    roots.push_back({std::move(name), std::move(dir),
+                     std::move(images_folder_name)});
+  };
+
+  const auto images_folder = [](const std::filesystem::path& dir) {
+    return GetImagesFolderName(UhdVersionOf(InstalledUhdRelease(dir)));
+  };
+  add_root(Defaults().default_root_name, GetUhdDirByOs(os),
+           images_folder(GetUhdDirByOs(os)));
+  if (os != Os::kLinux) {
+    return roots;
+  }
+
+  std::error_code ec;
+  std::vector<std::filesystem::path> opt_roots;
+  for (const auto& entry : std::filesystem::directory_iterator("/opt", ec)) {
+    const std::string name = entry.path().filename().string();
+    if (name.rfind("uhd", 0) != 0) {
+      continue;
+    }
+    const auto dir = entry.path() / "share" / "uhd";
+    if (std::filesystem::is_directory(dir, ec)) {
+      opt_roots.push_back(dir);
+    }
+  }
+  std::sort(opt_roots.begin(), opt_roots.end());
+  for (const auto& dir : opt_roots) {
+    add_root(dir.parent_path().parent_path().filename().string(), dir,
+             images_folder(dir));
+  }
+
+  const char* images_dir = std::getenv("UHD_IMAGES_DIR");
+  if (images_dir && *images_dir) {
+    const std::filesystem::path path =
+        std::filesystem::path(images_dir).lexically_normal();
+    const auto trimmed = path.has_filename() ? path : path.parent_path();
+    if (!trimmed.parent_path().empty()) {
+      add_root("user", trimmed.parent_path(), trimmed.filename().string());
+    }
+  }
+  return roots;
 }
 
 const AppDefaults& Defaults() {
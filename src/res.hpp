@@ -1,7 +1,10 @@
 #pragma once
 
+#include <cstddef>
 #include <filesystem>
 #include <string>
+#include <string_view>
+#include <vector>
 
 namespace uhd_helper {
 
@@ -10,19 +13,111 @@ enum class Os {
   kUnknown,
 };
 
+// Release series with their own layout rules; kDefault covers an unknown
+// or unlisted release.
 enum class UhdVersion {
   kDefault,
+  kUhd3,
+  kUhd4,
 };
 
+// A UHD release; major 0 means unknown.
+struct UhdRelease {
+  int major = 0;
+  int minor = 0;
+  int patch = 0;
+
+  bool known() const { return major > 0; }
+};
+
+// "4.6.0", "v4.6" or "4.6.0.0-0ubuntu1"; needs at least major.minor.
+bool ParseUhdRelease(std::string_view text, UhdRelease* release);
+// The release after "uhd-images_", "uhd_" or "uhd-" in a file or folder
+// name, as in uhd-images_4.6.0.0-release.zip.
+bool FindUhdReleaseInName(std::string_view name, UhdRelease* release);
+// "4.6.0", or "" when unknown.
+std::string FormatUhdRelease(const UhdRelease& release);
+UhdVersion UhdVersionOf(const UhdRelease& release);
+
+template <UhdVersion V>
+struct UhdLayout;
+
+// Images of a release load under releases of the same major and minor;
+// FPGA compat numbers move with minor releases.
+template <int Major>
+struct UhdSeriesLayout {
+  static constexpr int kMajor = Major;
+  static constexpr const char* kImagesFolder = "images";
+  static constexpr bool Compatible(const UhdRelease& target,
+                                   const UhdRelease& installed) {
+    return target.major == Major && installed.major == Major &&
+           target.minor == installed.minor;
+  }
+};
+
+template <>
+struct UhdLayout<UhdVersion::kDefault> {
+  static constexpr int kMajor = 0;
+  static constexpr const char* kImagesFolder = "images";
+  // Nothing is known about the installed release, so nothing is refused.
+  static constexpr bool Compatible(const UhdRelease& /*target*/,
+                                   const UhdRelease& /*installed*/) {
+    return true;
+  }
+};
+
+template <>
+struct UhdLayout<UhdVersion::kUhd3> : UhdSeriesLayout<3> {};
+
+template <>
+struct UhdLayout<UhdVersion::kUhd4> : UhdSeriesLayout<4> {};
+
+// Calls f with the UhdLayout of version, so per-version code is written
+// once against the layout's static members and resolved at compile time.
+template <typename F>
+decltype(auto) WithUhdLayout(UhdVersion version, F&& f) {
+  switch (version) {
+    case UhdVersion::kUhd3:
+      return f(UhdLayout<UhdVersion::kUhd3>());
+    case UhdVersion::kUhd4:
+      return f(UhdLayout<UhdVersion::kUhd4>());
+    case UhdVersion::kDefault:
+      break;
+  }
+  return f(UhdLayout<UhdVersion::kDefault>());
+}
+
 Os DetectOs();
 std::filesystem::path GetUhdDirByOs(Os os);
 std::string GetImagesFolderName(UhdVersion version);
 
+// The release installed with uhd_dir (<prefix>/share/uhd), read from the
+// name of <prefix>/lib*/libuhd.so.X.Y.Z or else from
+// <prefix>/include/uhd/version.hpp. Cached per uhd_dir; a cached result is
+// reused while the file it came from keeps its mtime.
+UhdRelease InstalledUhdRelease(const std::filesystem::path& uhd_dir);
+// Drops the cache, so the next lookup sees an upgraded or removed UHD.
+void ForgetInstalledUhdReleases();
+// Whether images built for target may be applied under installed. An
+// unknown release on either side is not refused.
+bool UhdReleasesCompatible(const UhdRelease& target,
+                           const UhdRelease& installed);
+
+struct UhdRootLocation {
+  std::string name;
+  std::filesystem::path uhd_dir;
+  std::string images_folder_name;
+};
+
+std::vector<UhdRootLocation> DetectUhdRoots(Os os);
+
 struct AppDefaults {
   std::string idle_profile_prefix = "I_P_";
   std::string official_profile_folder = "R_NI";
   std::string backup_profile_folder = "I_P__backup";
-  int schema_version = 1;
+  std::string default_root_name = "default";
+  std::size_t activation_history_limit = 16;
+  int schema_version = 2;
 };
 
 const AppDefaults& Defaults();
@@ -0,0 +1,191 @@
+#include "throttle_util.hpp"
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <thread>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include "trace_util.hpp"
+
+namespace uhd_helper {
+namespace {
+
+// A bucket holds this many seconds of tokens.
+constexpr double kBurstSeconds = 0.1;
+// Smallest chunk ChunkSize hands out, so tight limits do not turn into a
+// storm of tiny requests.
+constexpr std::size_t kMinChunk = 64 * 1024;
+
+// Not in libc headers: IOPRIO_WHO_PROCESS with id 0 is the calling thread,
+// and IOPRIO_CLASS_IDLE sits above IOPRIO_CLASS_SHIFT.
+constexpr int kIoprioWhoProcess = 1;
+constexpr int kIoprioClassIdle = 3;
+constexpr int kIoprioClassShift = 13;
+
+std::string FormatBytes(double bytes) {
+  const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+  int unit = 0;
+  while (bytes >= 1024.0 && unit < 4) {
+    bytes /= 1024.0;
+    ++unit;
+  }
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), unit == 0 ? "%.0f %s" : "%.1f %s",
+                bytes, units[unit]);
+  return buffer;
+}
+
+}  // namespace
+
+double Throttle::Bucket::Take(double amount, double elapsed) {
+  if (rate <= 0) {
+    return 0;
+  }
+  tokens = std::min(rate * kBurstSeconds, tokens + rate * elapsed);
+  tokens -= amount;
+  return tokens < 0 ? -tokens / rate : 0;
+}
+
+Throttle& Throttle::Instance() {
+  static Throttle throttle;
+  return throttle;
+}
+
+Throttle::Throttle() : last_refill_(std::chrono::steady_clock::now()) {}
+
+void Throttle::SetLimits(const ThrottleLimits& limits) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  limits_ = limits;
+  bytes_.rate = static_cast<double>(limits.bytes_per_second);
+  bytes_.tokens = bytes_.rate * kBurstSeconds;
+  ops_.rate = static_cast<double>(limits.ops_per_second);
+  ops_.tokens = ops_.rate * kBurstSeconds;
+  last_refill_ = std::chrono::steady_clock::now();
+  limited_.store(limits.bytes_per_second > 0 || limits.ops_per_second > 0);
+  idle_priority_.store(limits.idle_priority);
+}
+
+ThrottleLimits Throttle::Limits() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return limits_;
+}
+
+void Throttle::Acquire(std::uint64_t bytes, std::uint64_t ops) {
+  if (!Limited()) {
+    return;
+  }
+  double wait = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto now = std::chrono::steady_clock::now();
+    const double elapsed =
+        std::chrono::duration<double>(now - last_refill_).count();
+    last_refill_ = now;
+    wait = std::max(bytes_.Take(static_cast<double>(bytes), elapsed),
+                    ops_.Take(static_cast<double>(ops), elapsed));
+    stats_.bytes += bytes;
+    stats_.ops += ops;
+    if (wait > 0) {
+      stats_.waits++;
+      stats_.wait_us += static_cast<std::uint64_t>(wait * 1e6);
+    }
+  }
+  if (wait > 0) {
+    UHD_TRACE_SCOPE("Throttle::Wait");
+    std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+  }
+}
+
+std::size_t Throttle::ChunkSize(std::size_t preferred) const {
+  if (!Limited()) {
+    return preferred;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (bytes_.rate <= 0) {
+    return preferred;
+  }
+  const auto burst = static_cast<std::size_t>(bytes_.rate * kBurstSeconds);
+  return std::min(preferred, std::max(burst, kMinChunk));
+}
+
+void Throttle::EnterBackground() const {
+  if (!IdlePriority()) {
+    return;
+  }
+#if defined(__linux__) && defined(SYS_ioprio_set) && defined(SYS_gettid)
+  ::syscall(SYS_ioprio_set, kIoprioWhoProcess, 0,
+            kIoprioClassIdle << kIoprioClassShift);
+  // Linux applies nice per thread.
+  ::setpriority(PRIO_PROCESS, static_cast<id_t>(::syscall(SYS_gettid)), 10);
+#endif
+}
+
+IdleIoScope::IdleIoScope() {
+  if (!Throttle::Instance().IdlePriority()) {
+    return;
+  }
+#if defined(__linux__) && defined(SYS_ioprio_get) && defined(SYS_ioprio_set)
+  previous_ =
+      static_cast<int>(::syscall(SYS_ioprio_get, kIoprioWhoProcess, 0));
+  if (previous_ >= 0) {
+    ::syscall(SYS_ioprio_set, kIoprioWhoProcess, 0,
+              kIoprioClassIdle << kIoprioClassShift);
+  }
+#endif
+}
+
+IdleIoScope::~IdleIoScope() {
+#if defined(__linux__) && defined(SYS_ioprio_set)
+  if (previous_ >= 0) {
+    ::syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, previous_);
+  }
+#endif
+}
+
+ThrottleStats Throttle::Stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+void Throttle::ResetStats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_ = ThrottleStats();
+}
+
+std::string Throttle::DescribeLimits() const {
+  const ThrottleLimits limits = Limits();
+  if (limits.bytes_per_second == 0 && limits.ops_per_second == 0) {
+    return "";
+  }
+  std::string summary = "I/O limit";
+  if (limits.bytes_per_second > 0) {
+    summary +=
+        " " + FormatBytes(static_cast<double>(limits.bytes_per_second)) + "/s";
+  }
+  if (limits.ops_per_second > 0) {
+    summary += (limits.bytes_per_second > 0 ? ", " : " ") +
+               std::to_string(limits.ops_per_second) + " ops/s";
+  }
+  return summary;
+}
+
+std::string Throttle::Summary() const {
+  const std::string limits = DescribeLimits();
+  if (limits.empty()) {
+    return "";
+  }
+  const ThrottleStats stats = Stats();
+  char waited[32];
+  std::snprintf(waited, sizeof(waited), "%.1f s",
+                static_cast<double>(stats.wait_us) / 1e6);
+  return limits + "; waited " + waited + " in " +
+         std::to_string(stats.waits) + " pauses";
+}
+
+}  // namespace uhd_helper
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+namespace uhd_helper {
+
+struct ThrottleLimits {
+  // 0 leaves that dimension unlimited.
+  std::uint64_t bytes_per_second = 0;
+  std::uint64_t ops_per_second = 0;
+  // Worker threads drop to the idle I/O class and nice 10, and a thread
+  // running a ParallelFor to the idle I/O class while it does.
+  bool idle_priority = false;
+};
+
+struct ThrottleStats {
+  std::uint64_t bytes = 0;
+  std::uint64_t ops = 0;
+  // Times a caller had to sleep, and for how long in total.
+  std::uint64_t waits = 0;
+  std::uint64_t wait_us = 0;
+};
+
+// Process-wide token buckets shared by the copy, delete, hash and prewarm
+// engines, so bulk work leaves the disk to a UHD application streaming
+// samples. A bucket holds a tenth of a second of tokens. Callers may
+// overdraw it and then sleep off the debt, so I/O is accounted after it
+// happens and requests larger than the bucket still pass at the set rate.
+class Throttle {
+ public:
+  static Throttle& Instance();
+
+  void SetLimits(const ThrottleLimits& limits);
+  ThrottleLimits Limits() const;
+  bool Limited() const { return limited_.load(std::memory_order_relaxed); }
+  bool IdlePriority() const {
+    return idle_priority_.load(std::memory_order_relaxed);
+  }
+
+  // Takes bytes and ops from the buckets and sleeps while they are in
+  // debt. Returns at once when no limit is set.
+  void Acquire(std::uint64_t bytes, std::uint64_t ops);
+  // Caps a single request so it stays within one bucket's worth of bytes.
+  std::size_t ChunkSize(std::size_t preferred) const;
+
+  // Lowers the calling thread's I/O and CPU priority if idle_priority is
+  // set. Worker threads call this once when they start.
+  void EnterBackground() const;
+
+  ThrottleStats Stats() const;
+  void ResetStats();
+  // "I/O limit 40.0 MiB/s, 500 ops/s", or "" without limits.
+  std::string DescribeLimits() const;
+  // DescribeLimits plus the time spent waiting since ResetStats.
+  std::string Summary() const;
+
+ private:
+  struct Bucket {
+    double rate = 0;
+    double tokens = 0;
+    // Returns how long to wait after taking amount.
+    double Take(double amount, double elapsed);
+  };
+
+  Throttle();
+
+  std::atomic<bool> limited_{false};
+  std::atomic<bool> idle_priority_{false};
+  mutable std::mutex mutex_;
+  ThrottleLimits limits_;
+  Bucket bytes_;
+  Bucket ops_;
+  std::chrono::steady_clock::time_point last_refill_;
+  ThrottleStats stats_;
+};
+
+// Gives the calling thread the idle I/O class, if idle_priority is set,
+// until the scope ends and the previous class comes back. Its CPU priority
+// is left alone, since an unprivileged thread could not raise it again.
+class IdleIoScope {
+ public:
+  IdleIoScope();
+  ~IdleIoScope();
+  IdleIoScope(const IdleIoScope&) = delete;
+  IdleIoScope& operator=(const IdleIoScope&) = delete;
+
+ private:
+  // The I/O priority to restore, or -1 when nothing was changed.
+  int previous_ = -1;
+};
+
+}  // namespace uhd_helper
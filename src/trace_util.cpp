@@ -0,0 +1,188 @@
+#include "trace_util.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <thread>
+
+#include "json_min.hpp"
+
+namespace uhd_helper {
+namespace {
+
+constexpr std::size_t kMaxEvents = 1 << 16;
+
+std::uint32_t CurrentThreadId() {
+  return static_cast<std::uint32_t>(
+      std::hash<std::thread::id>{}(std::this_thread::get_id()));
+}
+
+std::string FormatBytes(std::uint64_t bytes) {
+  const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+  double value = static_cast<double>(bytes);
+  int unit = 0;
+  while (value >= 1024.0 && unit < 4) {
+    value /= 1024.0;
+    ++unit;
+  }
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), unit == 0 ? "%.0f %s" : "%.1f %s",
+                value, units[unit]);
+  return buffer;
+}
+
+}  // namespace
+
+Tracer& Tracer::Instance() {
+  static Tracer tracer;
+  return tracer;
+}
+
+Tracer::Tracer() : origin_(std::chrono::steady_clock::now()) {}
+
+void Tracer::Reset() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  events_.clear();
+  std::fill(std::begin(counters_), std::end(counters_), 0);
+}
+
+void Tracer::AddCount(TraceCounter counter, std::uint64_t amount) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  counters_[static_cast<int>(counter)] += amount;
+}
+
+std::uint64_t Tracer::Count(TraceCounter counter) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return counters_[static_cast<int>(counter)];
+}
+
+void Tracer::Record(const TraceEvent& event) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (events_.size() < kMaxEvents) {
+    events_.push_back(event);
+  }
+}
+
+std::uint64_t Tracer::NowMicros() const {
+  return static_cast<std::uint64_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - origin_)
+          .count());
+}
+
+std::vector<TraceEvent> Tracer::Events() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return events_;
+}
+
+bool Tracer::DumpChromeTrace(const std::filesystem::path& path,
+                             std::string* error) const {
+  json_min::Array trace_events;
+  for (const auto& event : Events()) {
+    json_min::Object obj;
+    obj.emplace("name", json_min::Value(std::string(event.name)));
+    obj.emplace("cat", json_min::Value(std::string("uhd_helper")));
+    obj.emplace("ph", json_min::Value(std::string("X")));
+    obj.emplace("ts", json_min::Value(static_cast<double>(event.start_us)));
+    obj.emplace("dur",
+                json_min::Value(static_cast<double>(event.duration_us)));
+    obj.emplace("pid", json_min::Value(1.0));
+    obj.emplace("tid", json_min::Value(static_cast<double>(event.thread_id)));
+    trace_events.push_back(json_min::Value(std::move(obj)));
+  }
+
+  json_min::Object counters;
+  for (int i = 0; i < static_cast<int>(TraceCounter::kCount); ++i) {
+    const auto counter = static_cast<TraceCounter>(i);
+    counters.emplace(TraceCounterName(counter),
+                     json_min::Value(static_cast<double>(Count(counter))));
+  }
+
+  json_min::Object root_obj;
+  root_obj.emplace("traceEvents", json_min::Value(std::move(trace_events)));
+  root_obj.emplace("displayTimeUnit", json_min::Value(std::string("ms")));
+  root_obj.emplace("otherData", json_min::Value(std::move(counters)));
+
+  std::ofstream output(path);
+  if (!output.is_open()) {
+    if (error) {
+      *error = "Failed to open trace file for writing: " + path.string();
+    }
+    return false;
+  }
+  output << json_min::Serialize(json_min::Value(std::move(root_obj)), 0)
+         << '\n';
+  return true;
+}
+
+std::string Tracer::Summary() const {
+  struct Row {
+    std::uint64_t calls = 0;
+    std::uint64_t total_us = 0;
+    std::uint64_t max_us = 0;
+  };
+  std::map<std::string, Row> rows;
+  for (const auto& event : Events()) {
+    auto& row = rows[event.name];
+    row.calls++;
+    row.total_us += event.duration_us;
+    row.max_us = std::max(row.max_us, event.duration_us);
+  }
+
+  std::string out;
+  char line[160];
+  std::snprintf(line, sizeof(line), "%-36s %8s %12s %12s\n", "scope", "calls",
+                "total ms", "max ms");
+  out += line;
+  for (const auto& [name, row] : rows) {
+    std::snprintf(line, sizeof(line), "%-36s %8llu %12.3f %12.3f\n",
+                  name.c_str(), static_cast<unsigned long long>(row.calls),
+                  row.total_us / 1000.0, row.max_us / 1000.0);
+    out += line;
+  }
+  std::snprintf(line, sizeof(line),
+                "bytes=%s files=%llu syscalls=%llu renames=%llu fsyncs=%llu",
+                FormatBytes(Count(TraceCounter::kBytesCopied)).c_str(),
+                static_cast<unsigned long long>(
+                    Count(TraceCounter::kFilesCopied)),
+                static_cast<unsigned long long>(Count(TraceCounter::kSyscalls)),
+                static_cast<unsigned long long>(Count(TraceCounter::kRenames)),
+                static_cast<unsigned long long>(Count(TraceCounter::kFsyncs)));
+  out += line;
+  return out;
+}
+
+ScopedTimer::ScopedTimer(const char* name)
+    : name_(name), start_us_(Tracer::Instance().NowMicros()) {}
+
+ScopedTimer::~ScopedTimer() {
+  auto& tracer = Tracer::Instance();
+  TraceEvent event;
+  event.name = name_;
+  event.start_us = start_us_;
+  event.duration_us = tracer.NowMicros() - start_us_;
+  event.thread_id = CurrentThreadId();
+  tracer.Record(event);
+}
+
+const char* TraceCounterName(TraceCounter counter) {
+  switch (counter) {
+    case TraceCounter::kBytesCopied:
+      return "bytes_copied";
+    case TraceCounter::kFilesCopied:
+      return "files_copied";
+    case TraceCounter::kSyscalls:
+      return "syscalls";
+    case TraceCounter::kRenames:
+      return "renames";
+    case TraceCounter::kFsyncs:
+      return "fsyncs";
+    case TraceCounter::kCount:
+      break;
+  }
+  return "unknown";
+}
+
+}  // namespace uhd_helper
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifndef UHD_HELPER_TRACE_ENABLED
+#define UHD_HELPER_TRACE_ENABLED 0
+#endif
+
+namespace uhd_helper {
+
+enum class TraceCounter {
+  kBytesCopied,
+  kFilesCopied,
+  kSyscalls,
+  kRenames,
+  kFsyncs,
+  kCount,
+};
+
+struct TraceEvent {
+  const char* name = "";
+  std::uint64_t start_us = 0;
+  std::uint64_t duration_us = 0;
+  std::uint32_t thread_id = 0;
+};
+
+class Tracer {
+ public:
+  static Tracer& Instance();
+  static constexpr bool Enabled() { return UHD_HELPER_TRACE_ENABLED != 0; }
+
+  void Reset();
+  void AddCount(TraceCounter counter, std::uint64_t amount);
+  std::uint64_t Count(TraceCounter counter) const;
+  void Record(const TraceEvent& event);
+  std::uint64_t NowMicros() const;
+
+  std::vector<TraceEvent> Events() const;
+  bool DumpChromeTrace(const std::filesystem::path& path,
+                       std::string* error) const;
+  std::string Summary() const;
+
+ private:
+  Tracer();
+
+  std::chrono::steady_clock::time_point origin_;
+  mutable std::mutex mutex_;
+  std::vector<TraceEvent> events_;
+  std::uint64_t counters_[static_cast<int>(TraceCounter::kCount)] = {};
+};
+
+class ScopedTimer {
+ public:
+  explicit ScopedTimer(const char* name);
+  ~ScopedTimer();
+
+  ScopedTimer(const ScopedTimer&) = delete;
+  ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+ private:
+  const char* name_;
+  std::uint64_t start_us_;
+};
+
+const char* TraceCounterName(TraceCounter counter);
+
+}  // namespace uhd_helper
+
+#define UHD_TRACE_CONCAT_INNER(a, b) a##b
+#define UHD_TRACE_CONCAT(a, b) UHD_TRACE_CONCAT_INNER(a, b)
+
+#if UHD_HELPER_TRACE_ENABLED
+#define UHD_TRACE_SCOPE(name) \
+  ::uhd_helper::ScopedTimer UHD_TRACE_CONCAT(uhd_trace_scope_, __LINE__)(name)
+#define UHD_TRACE_COUNT(counter, amount)              \
+  ::uhd_helper::Tracer::Instance().AddCount(          \
+      ::uhd_helper::TraceCounter::counter,            \
+      static_cast<std::uint64_t>(amount))
+#else
+#define UHD_TRACE_SCOPE(name) static_cast<void>(0)
+#define UHD_TRACE_COUNT(counter, amount) static_cast<void>(0)
+#endif
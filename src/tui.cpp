@@ -1,5 +1,10 @@
 #include "tui.hpp"
 
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
 #include <ftxui/component/component.hpp>
 #include <ftxui/component/component_base.hpp>
 #include <ftxui/component/component_options.hpp>
@@ -7,46 +12,71 @@
 #include <ftxui/dom/elements.hpp>
 
 #include "config_util.hpp"
+#include "file_util.hpp"
 #include "profile_util.hpp"
+#include "res.hpp"
+#include "throttle_util.hpp"
+#include "trace_util.hpp"
 
 namespace uhd_helper {
 namespace {
 
-std::string ProfileStatusLabel(const Profile& profile,
-                               const std::string& active_id) {
-  std::string label = profile.display_name;
-  if (profile.id == active_id) {
-    label += " [active]";
-  }
-  if (profile.is_official) {
-    label += " (official)";
-  }
-  return label;
-}
+// Rows of the profile list drawn per frame; only this window of the
+// (possibly filtered) list is turned into elements.
+constexpr int kProfileRows = 15;
+// Image rows in the details pane; firmware and bitstreams come first.
+constexpr std::size_t kDetailRows = 6;
 
 }  // namespace
 
-TuiApp::TuiApp(ProfileManager* manager) : manager_(manager) {}
+TuiApp::TuiApp(ProfileManager* manager)
+    : manager_(manager), index_(manager->IndexPath()) {}
 
 void TuiApp::SetStatus(const std::string& message, bool is_error) {
   status_message_ = message;
   status_is_error_ = is_error;
 }
 
-void TuiApp::ReloadProfiles() {
-  profile_labels_.clear();
-  profile_ids_.clear();
-  const auto& profiles = manager_->Profiles();
-  const std::string active_id = manager_->ActiveProfileId();
-  for (const auto& profile : profiles) {
-    profile_labels_.push_back(ProfileStatusLabel(profile, active_id));
-    profile_ids_.push_back(profile.id);
+bool TuiApp::RunOperation(const std::function<bool(std::string*)>& operation,
+                          const std::string& success_message) {
+  if (reconciling_) {
+    SetStatus("Still reading the UHD roots; try again in a moment", true);
+    return false;
   }
-  if (selected_index_ >= static_cast<int>(profile_labels_.size())) {
-    selected_index_ = std::max(0, static_cast<int>(profile_labels_.size()) - 1);
+  if (Tracer::Enabled()) {
+    Tracer::Instance().Reset();
+  }
+  Throttle::Instance().ResetStats();
+  std::string error;
+  const bool ok = operation(&error);
+  throttle_summary_ = Throttle::Instance().Summary();
+  if (ok) {
+    ReloadProfiles();
+    SetStatus(success_message, false);
+  } else {
+    SetStatus(error, true);
+  }
+  if (Tracer::Enabled()) {
+    trace_summary_ = Tracer::Instance().Summary();
+  }
+  return ok;
+}
+
+void TuiApp::ReloadProfiles() {
+  const std::string selected_id = SelectedProfileId();
+  profile_list_.Sync(manager_->Profiles(), manager_->ActiveProfileId());
+  const int index = profile_list_.IndexOf(selected_id);
+  if (index >= 0) {
+    selected_index_ = index;
+  } else if (selected_index_ >= static_cast<int>(profile_list_.size())) {
+    selected_index_ = std::max(0, static_cast<int>(profile_list_.size()) - 1);
   }
   last_selected_index_ = selected_index_;
-  profile_confirmed_ = !profile_ids_.empty();
+  ReloadGroups();
+  if (!reconciling_) {
+    installed_uhd_version_ = manager_->InstalledUhdVersion();
+  }
+  profile_confirmed_ = profile_list_.total() > 0;
   if (!profile_confirmed_) {
     SetStatus("No profiles found", true);
   } else {
@@ -54,69 +84,425 @@ void TuiApp::ReloadProfiles() {
   }
 }
 
+void TuiApp::ApplyFilter() {
+  if (profile_filter_ == profile_list_.filter()) {
+    return;
+  }
+  // While typing, the best match is selected; clearing the filter returns
+  // to the previously selected profile.
+  const std::string selected_id = SelectedProfileId();
+  profile_list_.SetFilter(profile_filter_);
+  selected_index_ =
+      profile_filter_.empty() ? std::max(0, profile_list_.IndexOf(selected_id))
+                              : 0;
+  profile_scroll_ = 0;
+}
+
+std::string TuiApp::SelectedProfileId() const {
+  if (selected_index_ < 0 ||
+      selected_index_ >= static_cast<int>(profile_list_.size())) {
+    return std::string();
+  }
+  return std::string(profile_list_.at(selected_index_).id);
+}
+
+bool TuiApp::MoveSelection(int delta) {
+  const int count = static_cast<int>(profile_list_.size());
+  if (count == 0) {
+    return false;
+  }
+  const int previous = selected_index_;
+  selected_index_ = std::clamp(selected_index_ + delta, 0, count - 1);
+  return selected_index_ != previous;
+}
+
+ftxui::Element TuiApp::RenderProfileRows(bool focused) {
+  using namespace ftxui;
+  const int count = static_cast<int>(profile_list_.size());
+  selected_index_ = std::clamp(selected_index_, 0, std::max(0, count - 1));
+  if (selected_index_ < profile_scroll_) {
+    profile_scroll_ = selected_index_;
+  } else if (selected_index_ >= profile_scroll_ + kProfileRows) {
+    profile_scroll_ = selected_index_ - kProfileRows + 1;
+  }
+  profile_scroll_ =
+      std::clamp(profile_scroll_, 0, std::max(0, count - kProfileRows));
+
+  Elements rows;
+  const int end = std::min(count, profile_scroll_ + kProfileRows);
+  for (int i = profile_scroll_; i < end; ++i) {
+    Element row = text(std::string(profile_list_.at(i).label));
+    if (i == selected_index_) {
+      row = focused ? row | inverted : row | bold;
+    }
+    rows.push_back(row);
+  }
+  if (count == 0) {
+    rows.push_back(
+        text(profile_list_.total() == 0 ? "(no profiles)" : "(no matches)") |
+        dim);
+  }
+  return vbox(std::move(rows)) | size(HEIGHT, EQUAL, kProfileRows) |
+         reflect(profile_box_);
+}
+
+ftxui::Element TuiApp::RenderDetails() const {
+  using namespace ftxui;
+  if (reconciling_) {
+    return text("Details: loading the index") | dim;
+  }
+  const std::string id = SelectedProfileId();
+  const ProfileIndex* indexed =
+      id.empty() ? nullptr : index_.Find(manager_->CurrentRootName(), id);
+  if (!indexed) {
+    return text(id.empty() ? "Details" : "Details: " + id +
+                                             " is not indexed (press i)") |
+           dim;
+  }
+  std::vector<const IndexedFile*> images;
+  std::vector<std::string> devices;
+  for (const auto& file : indexed->files) {
+    if (file.kind == "other") {
+      continue;
+    }
+    images.push_back(&file);
+    if (!file.device.empty() &&
+        std::find(devices.begin(), devices.end(), file.device) ==
+            devices.end()) {
+      devices.push_back(file.device);
+    }
+  }
+  std::string header = "Details: " + id + "  " +
+                       std::to_string(indexed->files.size()) + " files";
+  if (!devices.empty()) {
+    header += ", devices:";
+    for (const auto& device : devices) {
+      header += " " + device;
+    }
+  }
+  Elements rows = {text(header)};
+  // Files with a version string are the interesting ones.
+  std::stable_partition(images.begin(), images.end(),
+                        [](const IndexedFile* file) {
+                          return !file->versions.empty();
+                        });
+  for (std::size_t i = 0; i < images.size() && i < kDetailRows; ++i) {
+    const IndexedFile& file = *images[i];
+    std::string versions;
+    for (const auto& version : file.versions) {
+      versions += (versions.empty() ? "" : ", ") + version;
+    }
+    rows.push_back(hbox({
+        text(file.device.empty() ? "-" : file.device) | size(WIDTH, EQUAL, 12),
+        text(file.kind) | size(WIDTH, EQUAL, 12),
+        text(versions.empty() ? "-" : versions) | size(WIDTH, EQUAL, 24),
+        text(file.path) | dim,
+    }));
+  }
+  if (images.size() > kDetailRows) {
+    rows.push_back(text("+" + std::to_string(images.size() - kDetailRows) +
+                        " more; main --query lists them") |
+                   dim);
+  }
+  return vbox(std::move(rows));
+}
+
+void TuiApp::FinishReconcile(bool ok, const std::string& error,
+                             ImageIndex* index,
+                             const std::string& index_error) {
+  reconciling_ = false;
+  std::string reload_error;
+  if (ok && !manager_->InitializeFromCache(&reload_error)) {
+    ok = false;
+  }
+  index_ = std::move(*index);
+  ReloadProfiles();
+  if (!ok) {
+    SetStatus("Reading the UHD roots failed: " +
+                  (error.empty() ? reload_error : error),
+              true);
+  } else if (!index_error.empty()) {
+    SetStatus(index_error, true);
+  } else if (profile_list_.total() > 0) {
+    SetStatus("", false);
+  }
+}
+
+void TuiApp::ReloadGroups() {
+  group_labels_.clear();
+  group_names_.clear();
+  for (const auto& group : manager_->Groups()) {
+    std::string label = group.name + " (";
+    for (size_t i = 0; i < group.members.size(); ++i) {
+      label += (i ? ", " : "") + group.members[i].root + "/" +
+               group.members[i].profile_id;
+    }
+    group_labels_.push_back(label + ")");
+    group_names_.push_back(group.name);
+  }
+  if (group_index_ >= static_cast<int>(group_labels_.size())) {
+    group_index_ = std::max(0, static_cast<int>(group_labels_.size()) - 1);
+  }
+}
+
+void TuiApp::RunGroupAction(int action_index) {
+  if (group_names_.empty()) {
+    SetStatus("No groups defined", true);
+    return;
+  }
+  const std::string group = group_names_[group_index_];
+  const std::string profile_id = SelectedProfileId();
+  switch (action_index) {
+    case 0:
+      RunOperation(
+          [&](std::string* error) { return manager_->ApplyGroup(group, error); },
+          "Group applied");
+      break;
+    case 1: {
+      std::string report;
+      if (RunOperation(
+              [&](std::string* error) {
+                return manager_->VerifyGroup(group, &report, error);
+              },
+              "Group verified")) {
+        SetStatus(report, false);
+      }
+      break;
+    }
+    case 2: {
+      std::uint64_t bytes = 0;
+      if (RunOperation(
+              [&](std::string* error) {
+                return manager_->PrewarmGroup(group, &bytes, error);
+              },
+              "Group prewarmed")) {
+        SetStatus("Prewarmed " + std::to_string(bytes >> 20) + " MiB", false);
+      }
+      break;
+    }
+    case 3:
+      RunOperation(
+          [&](std::string* error) {
+            return manager_->DeleteGroupProfiles(group, error);
+          },
+          "Group profiles deleted");
+      break;
+    case 4:
+      RunOperation(
+          [&](std::string* error) {
+            return manager_->AddToGroup(group, profile_id, error);
+          },
+          "Profile added to group");
+      break;
+    case 5:
+      RunOperation(
+          [&](std::string* error) {
+            return manager_->RemoveFromGroup(group, profile_id, error);
+          },
+          "Profile removed from group");
+      break;
+    case 6:
+      RunOperation(
+          [&](std::string* error) { return manager_->DeleteGroup(group, error); },
+          "Group deleted");
+      break;
+    default:
+      break;
+  }
+}
+
 void TuiApp::Run() {
   using namespace ftxui;
 
+  // The first frame shows the config as cached. A second manager on its
+  // own thread then reconciles the roots with the disk and saves, loads
+  // the index and looks up the installed releases, and this one reloads
+  // the result.
+  reconciling_ = true;
   ReloadProfiles();
+  SetStatus("Reading the UHD roots...", false);
 
   std::string add_profile_name;
   bool show_add_modal = false;
+  std::string group_name;
+  bool show_group_modal = false;
 
   ScreenInteractive screen = ScreenInteractive::FitComponent();
 
-  auto menu = Menu(&profile_labels_, &selected_index_);
+  auto filter_input = Input(&profile_filter_, "filter by id or name");
+  auto menu = Renderer(
+      [&](bool focused) { return RenderProfileRows(focused); });
+  menu = CatchEvent(menu, [&](Event event) {
+    // Arrows at either end fall through so focus can leave the list.
+    if (event == Event::ArrowUp) {
+      return MoveSelection(-1);
+    }
+    if (event == Event::ArrowDown) {
+      return MoveSelection(1);
+    }
+    if (event == Event::PageUp) {
+      MoveSelection(-kProfileRows);
+    } else if (event == Event::PageDown) {
+      MoveSelection(kProfileRows);
+    } else if (event == Event::Home) {
+      MoveSelection(-selected_index_);
+    } else if (event == Event::End) {
+      MoveSelection(static_cast<int>(profile_list_.size()));
+    } else if (event.is_mouse() &&
+               profile_box_.Contain(event.mouse().x, event.mouse().y) &&
+               (event.mouse().button == Mouse::WheelUp ||
+                event.mouse().button == Mouse::WheelDown)) {
+      MoveSelection(event.mouse().button == Mouse::WheelUp ? -1 : 1);
+    } else {
+      return false;
+    }
+    return true;
+  });
 
-  std::vector<std::string> action_labels = {"Apply", "Delete"};
+  std::vector<std::string> action_labels = {"Apply", "Delete",
+                                            "Apply All Roots"};
   int action_index = 0;
   auto action_menu = Menu(&action_labels, &action_index);
 
+  auto group_menu = Menu(&group_labels_, &group_index_);
+  std::vector<std::string> group_action_labels = {
+      "Apply Group",  "Verify",          "Prewarm",     "Delete Profiles",
+      "Add Selected", "Remove Selected", "Delete Group"};
+  int group_action_index = 0;
+  auto group_action_menu = Menu(&group_action_labels, &group_action_index);
+
   auto add_button = Button("Add", [&] {
     add_profile_name.clear();
     show_add_modal = true;
   });
   auto reset_button = Button("Reset Official", [&] {
-    std::string error;
-    if (manager_->ResetToOfficial(&error)) {
-      ReloadProfiles();
-      SetStatus("Official profile applied", false);
-    } else {
-      SetStatus(error, true);
-    }
+    RunOperation(
+        [&](std::string* error) { return manager_->ResetToOfficial(error); },
+        "Official profile applied");
   });
+  // Bound to 'u' as well, so a bad bitstream is one keystroke away from
+  // being undone.
+  const auto revert = [&] {
+    std::string report;
+    if (RunOperation(
+            [&](std::string* error) {
+              return manager_->RevertActivation(&report, error);
+            },
+            "Reverted")) {
+      SetStatus(report, false);
+    }
+  };
+  auto revert_button = Button("Revert (u)", revert);
+  const auto reindex = [&] {
+    IndexStats stats;
+    if (RunOperation(
+            [&](std::string* error) {
+              return manager_->UpdateIndex(&index_, &stats, error) &&
+                     index_.Save(error);
+            },
+            "Index updated")) {
+      SetStatus("Indexed " + std::to_string(stats.files) + " files, scanned " +
+                    std::to_string(stats.files_scanned),
+                false);
+    }
+  };
+  auto index_button = Button("Index (i)", reindex);
   auto refresh_button = Button("Refresh", [&] {
-    std::string error;
-    if (manager_->RefreshFromDisk(&error)) {
-      ReloadProfiles();
-      SetStatus("Profiles refreshed", false);
-    } else {
-      SetStatus(error, true);
+    RunOperation(
+        [&](std::string* error) { return manager_->RefreshFromDisk(error); },
+        "Profiles refreshed");
+  });
+  auto root_button = Button("Next Root", [&] {
+    const auto& roots = manager_->Roots();
+    const std::string current = manager_->CurrentRootName();
+    size_t index = 0;
+    for (size_t i = 0; i < roots.size(); ++i) {
+      if (roots[i].name == current) {
+        index = (i + 1) % roots.size();
+        break;
+      }
     }
+    const std::string next = roots[index].name;
+    RunOperation(
+        [&](std::string* error) { return manager_->SelectRoot(next, error); },
+        "Switched to root " + next);
+  });
+  auto group_button = Button("New Group", [&] {
+    group_name.clear();
+    show_group_modal = true;
   });
   auto quit_button = Button("Quit", [&] { screen.ExitLoopClosure()(); });
 
   auto bottom_buttons =
-      Container::Horizontal({add_button, reset_button, refresh_button, quit_button});
+      Container::Horizontal({add_button, reset_button, revert_button,
+                             index_button, refresh_button, root_button,
+                             group_button, quit_button});
 
-  auto main_container =
-      Container::Vertical({Container::Horizontal({menu, action_menu}),
-                           bottom_buttons});
+  auto main_container = Container::Vertical(
+      {Container::Horizontal(
+           {Container::Vertical({filter_input, menu}), action_menu}),
+       Container::Horizontal({group_menu, group_action_menu}), bottom_buttons});
 
   auto add_input = Input(&add_profile_name, "profile name");
   auto add_confirm = Button("Create", [&] {
-    std::string error;
-    if (manager_->AddProfileFromActive(add_profile_name, &error)) {
-      ReloadProfiles();
-      SetStatus("Profile created", false);
+    if (RunOperation(
+            [&](std::string* error) {
+              return manager_->AddProfileFromActive(add_profile_name, error);
+            },
+            "Profile created")) {
+      const std::string twin =
+          manager_->FindIdenticalProfile(manager_->Profiles().back().id);
+      if (!twin.empty()) {
+        SetStatus("Profile created; identical to " + twin, false);
+      }
+      show_add_modal = false;
+    }
+  });
+  auto add_snapshot = Button("Snapshot", [&] {
+    CloneStats stats;
+    if (RunOperation(
+            [&](std::string* error) {
+              return manager_->SnapshotActive(add_profile_name, &stats, error);
+            },
+            "Snapshot created")) {
+      std::string status = "Snapshot created (" +
+                           std::to_string(stats.files_cloned) +
+                           " reflinked, " + std::to_string(stats.files_copied) +
+                           " copied";
+      if (stats.files_resumed > 0) {
+        status += ", " + std::to_string(stats.files_resumed) +
+                  " kept from an interrupted run";
+      }
+      status += ")";
+      const std::string twin =
+          manager_->FindIdenticalProfile(manager_->Profiles().back().id);
+      if (!twin.empty()) {
+        status += "; identical to " + twin;
+      }
+      SetStatus(status, false);
       show_add_modal = false;
-    } else {
-      SetStatus(error, true);
     }
   });
   auto add_cancel = Button("Cancel", [&] { show_add_modal = false; });
   auto add_modal_container =
-      Container::Vertical({add_input, add_confirm, add_cancel});
+      Container::Vertical({add_input, add_confirm, add_snapshot, add_cancel});
+
+  auto group_input = Input(&group_name, "group name");
+  auto group_confirm = Button("Create", [&] {
+    if (RunOperation(
+            [&](std::string* error) {
+              return manager_->CreateGroup(group_name, error);
+            },
+            "Group created")) {
+      show_group_modal = false;
+    }
+  });
+  auto group_cancel = Button("Cancel", [&] { show_group_modal = false; });
+  auto group_modal_container =
+      Container::Vertical({group_input, group_confirm, group_cancel});
 
   auto main_renderer = Renderer(main_container, [&] {
+    ApplyFilter();
     if (selected_index_ != last_selected_index_) {
       profile_confirmed_ = false;
       last_selected_index_ = selected_index_;
@@ -129,8 +515,17 @@ void TuiApp::Run() {
       status = status | color(Color::GreenLight);
     }
 
+    const std::string uhd_version = installed_uhd_version_.empty()
+                                        ? ""
+                                        : ", UHD " + installed_uhd_version_;
     Element menu_box =
-        vbox({text("Profiles"), separator(), menu->Render()}) | border;
+        vbox({text("Profiles @ " + manager_->CurrentRootName() + " (" +
+                   manager_->UhdDir().string() + uhd_version + ")  " +
+                   std::to_string(profile_list_.size()) + "/" +
+                   std::to_string(profile_list_.total())),
+              separator(), hbox({text("Filter: "), filter_input->Render()}),
+              separator(), menu->Render()}) |
+        border;
 
     Element action_box =
         vbox({text("Actions"), separator(), action_menu->Render()}) | border;
@@ -138,40 +533,113 @@ void TuiApp::Run() {
       action_box = action_box | dim;
     }
 
+    Element group_box =
+        vbox({text("Groups"), separator(),
+              group_labels_.empty() ? text("(none)") | dim
+                                    : group_menu->Render()}) |
+        border;
+    Element group_action_box =
+        vbox({text("Group Actions"), separator(),
+              group_action_menu->Render()}) |
+        border;
+
     Element hint = text("Config: " + manager_->ConfigPath().string()) | dim;
 
-    Element content = vbox({
+    Elements rows = {
         hbox({menu_box | flex, action_box | size(WIDTH, EQUAL, 24)}),
+        RenderDetails() | border,
+        hbox({group_box | flex, group_action_box | size(WIDTH, EQUAL, 24)}),
         hbox({add_button->Render(), reset_button->Render(),
-              refresh_button->Render(), quit_button->Render()}) |
+              revert_button->Render(), index_button->Render(),
+              refresh_button->Render(), root_button->Render(),
+              group_button->Render(), quit_button->Render()}) |
             border,
-        status | border,
-        hint,
-    });
-    return content;
+        (throttle_summary_.empty()
+             ? status
+             : hbox({status | flex, text(throttle_summary_) | dim})) |
+            border,
+    };
+    if (Tracer::Enabled() && !trace_summary_.empty()) {
+      Elements trace_lines;
+      size_t start = 0;
+      while (start <= trace_summary_.size()) {
+        size_t end = trace_summary_.find('\n', start);
+        if (end == std::string::npos) {
+          end = trace_summary_.size();
+        }
+        trace_lines.push_back(text(trace_summary_.substr(start, end - start)));
+        start = end + 1;
+      }
+      rows.push_back(
+          vbox({text("Trace"), separator(), vbox(std::move(trace_lines))}) |
+          border | dim);
+    }
+    rows.push_back(hint);
+    return vbox(std::move(rows));
   });
 
   auto modal_renderer = Renderer(add_modal_container, [&] {
     return window(
         text("Add Profile"),
         vbox({
-            text("Create a profile from current images"),
+            text("Create: copy the official images"),
+            text("Snapshot: capture the active images"),
             separator(),
             add_input->Render(),
-            hbox({add_confirm->Render(), add_cancel->Render()}),
+            hbox({add_confirm->Render(), add_snapshot->Render(),
+                  add_cancel->Render()}),
         })) |
            center;
   });
 
+  auto group_modal_renderer = Renderer(group_modal_container, [&] {
+    return window(text("New Group"),
+                  vbox({
+                      text("Groups hold one profile per UHD root"),
+                      separator(),
+                      group_input->Render(),
+                      hbox({group_confirm->Render(), group_cancel->Render()}),
+                  })) |
+           center;
+  });
+
   auto root = Modal(main_renderer, modal_renderer, &show_add_modal);
+  root = Modal(root, group_modal_renderer, &show_group_modal);
 
   root = CatchEvent(root, [&](Event event) {
     if (show_add_modal && event == Event::Escape) {
       show_add_modal = false;
       return true;
     }
+    if (show_group_modal && event == Event::Escape) {
+      show_group_modal = false;
+      return true;
+    }
+    if (show_add_modal || show_group_modal) {
+      return false;
+    }
+    if (event == Event::Return && group_action_menu->Focused()) {
+      RunGroupAction(group_action_index);
+      return true;
+    }
+    if (event == Event::Return && group_menu->Focused()) {
+      SetStatus("Group selected. Choose a group action.", false);
+      return true;
+    }
+    if (event == Event::Return && filter_input->Focused()) {
+      menu->TakeFocus();
+      return true;
+    }
+    if (event == Event::Character('u') && !filter_input->Focused()) {
+      revert();
+      return true;
+    }
+    if (event == Event::Character('i') && !filter_input->Focused()) {
+      reindex();
+      return true;
+    }
     if (!show_add_modal && menu->Focused() && event == Event::Return) {
-      if (profile_ids_.empty()) {
+      if (profile_list_.empty()) {
         SetStatus("No profiles available", true);
       } else {
         profile_confirmed_ = true;
@@ -185,38 +653,73 @@ void TuiApp::Run() {
         return true;
       }
       if (action_index == 0) {
-        if (profile_ids_.empty()) {
+        const std::string id = SelectedProfileId();
+        if (id.empty()) {
           SetStatus("No profiles available", true);
           return true;
         }
-        std::string error;
-        if (manager_->ApplyProfile(profile_ids_[selected_index_], &error)) {
-          ReloadProfiles();
-          SetStatus("Profile applied", false);
-        } else {
-          SetStatus(error, true);
+        ApplyStrategy strategy = ApplyStrategy::kRename;
+        if (RunOperation(
+                [&](std::string* error) {
+                  return manager_->ApplyProfile(id, &strategy, error);
+                },
+                "Profile applied") &&
+            strategy != ApplyStrategy::kRename) {
+          SetStatus(std::string("Profile applied by ") +
+                        ApplyStrategyName(strategy),
+                    false);
         }
         return true;
       }
       if (action_index == 1) {
-        if (profile_ids_.empty()) {
+        const std::string id = SelectedProfileId();
+        if (id.empty()) {
           SetStatus("No profiles available", true);
           return true;
         }
-        std::string error;
-        if (manager_->DeleteProfile(profile_ids_[selected_index_], &error)) {
-          ReloadProfiles();
-          SetStatus("Profile deleted", false);
-        } else {
-          SetStatus(error, true);
+        RunOperation(
+            [&](std::string* error) {
+              return manager_->DeleteProfile(id, error);
+            },
+            "Profile deleted");
+        return true;
+      }
+      if (action_index == 2) {
+        const std::string id = SelectedProfileId();
+        if (id.empty()) {
+          SetStatus("No profiles available", true);
+          return true;
         }
+        RunOperation(
+            [&](std::string* error) {
+              return manager_->ApplyProfileToAllRoots(id, error);
+            },
+            "Profile applied to all roots");
         return true;
       }
     }
     return false;
   });
 
+  std::thread reconcile([this, &screen, config_path = manager_->ConfigPath(),
+                         index_path = manager_->IndexPath()] {
+    ConfigManager config(config_path);
+    ProfileManager scanner(&config);
+    std::string error;
+    const bool ok = scanner.Initialize(&error);
+    auto index = std::make_shared<ImageIndex>(index_path);
+    std::string index_error;
+    index->Load(&index_error);
+    for (const auto& uhd_root : scanner.Roots()) {
+      InstalledUhdRelease(uhd_root.uhd_dir);
+    }
+    screen.Post([this, ok, error, index, index_error] {
+      FinishReconcile(ok, error, index.get(), index_error);
+    });
+    screen.PostEvent(Event::Custom);
+  });
   screen.Loop(root);
+  reconcile.join();
 }
 
 }  // namespace uhd_helper
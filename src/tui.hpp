@@ -1,8 +1,14 @@
 #pragma once
 
+#include <functional>
 #include <string>
 #include <vector>
 
+#include <ftxui/dom/elements.hpp>
+
+#include "index_util.hpp"
+#include "profile_list.hpp"
+
 namespace uhd_helper {
 
 class ProfileManager;
@@ -15,16 +21,44 @@ class TuiApp {
 
  private:
   void ReloadProfiles();
+  void ApplyFilter();
+  std::string SelectedProfileId() const;
+  bool MoveSelection(int delta);
+  ftxui::Element RenderProfileRows(bool focused);
+  // Indexed images of the selected profile.
+  ftxui::Element RenderDetails() const;
+  void ReloadGroups();
+  // Takes over what the startup reconcile saved and loaded.
+  void FinishReconcile(bool ok, const std::string& error, ImageIndex* index,
+                       const std::string& index_error);
+  void RunGroupAction(int action_index);
   void SetStatus(const std::string& message, bool is_error);
+  bool RunOperation(const std::function<bool(std::string*)>& operation,
+                    const std::string& success_message);
 
   ProfileManager* manager_;
-  std::vector<std::string> profile_labels_;
-  std::vector<std::string> profile_ids_;
+  ImageIndex index_;
+  ProfileListModel profile_list_;
+  std::string profile_filter_;
+  int profile_scroll_ = 0;
+  ftxui::Box profile_box_;
+  std::vector<std::string> group_labels_;
+  std::vector<std::string> group_names_;
+  int group_index_ = 0;
   int selected_index_ = 0;
   int last_selected_index_ = -1;
   bool profile_confirmed_ = false;
   std::string status_message_;
   bool status_is_error_ = false;
+  // Set while the roots are reconciled with the disk after the first
+  // frame; operations wait for it, browsing does not.
+  bool reconciling_ = false;
+  // Release installed with the current root, looked up off the UI thread
+  // at startup and on reloads after that.
+  std::string installed_uhd_version_;
+  // I/O limits and time spent waiting on them in the last operation.
+  std::string throttle_summary_;
+  std::string trace_summary_;
 };
 
 }  // namespace uhd_helper
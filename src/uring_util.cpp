@@ -0,0 +1,685 @@
+#include "uring_util.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+
+#include "throttle_util.hpp"
+#include "trace_util.hpp"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define UHD_HELPER_HAVE_IO_URING 1
+#endif
+
+namespace uhd_helper {
+
+#if defined(UHD_HELPER_HAVE_IO_URING)
+
+namespace {
+
+constexpr std::size_t kSlotCount = 32;
+constexpr std::size_t kChunkSize = 256 * 1024;
+
+int SysSetup(unsigned entries, io_uring_params* params) {
+  return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+int SysEnter(int fd, unsigned to_submit, unsigned min_complete,
+             unsigned flags) {
+  return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit,
+                                    min_complete, flags, nullptr, 0));
+}
+
+int SysRegister(int fd, unsigned opcode, const void* arg, unsigned nr_args) {
+  return static_cast<int>(
+      ::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+// Single-threaded ring over the raw syscalls. Only the pieces the copy and
+// read pipelines need: no SQPOLL, no linked requests.
+class Ring {
+ public:
+  Ring() = default;
+  Ring(const Ring&) = delete;
+  Ring& operator=(const Ring&) = delete;
+
+  ~Ring() {
+    if (buffers_) {
+      ::munmap(buffers_, buffer_count_ * buffer_size_);
+    }
+    if (sqes_) {
+      ::munmap(sqes_, sqes_size_);
+    }
+    if (cq_ptr_ && cq_ptr_ != sq_ptr_) {
+      ::munmap(cq_ptr_, cq_size_);
+    }
+    if (sq_ptr_) {
+      ::munmap(sq_ptr_, sq_size_);
+    }
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  bool Init(unsigned entries, std::string* error) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    fd_ = SysSetup(entries, &params);
+    if (fd_ < 0) {
+      if (error) {
+        *error = std::string("io_uring_setup failed: ") + std::strerror(errno);
+      }
+      return false;
+    }
+
+    sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+    }
+    sq_ptr_ = ::mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sq_ptr_ == MAP_FAILED) {
+      sq_ptr_ = nullptr;
+      return MapFailed(error);
+    }
+    if (single_mmap) {
+      cq_ptr_ = sq_ptr_;
+    } else {
+      cq_ptr_ = ::mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+      if (cq_ptr_ == MAP_FAILED) {
+        cq_ptr_ = nullptr;
+        return MapFailed(error);
+      }
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      return MapFailed(error);
+    }
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    auto* sq = static_cast<char*>(sq_ptr_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    auto* cq = static_cast<char*>(cq_ptr_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    local_tail_ = *sq_tail_;
+    return true;
+  }
+
+  // Allocates count buffers of size bytes and registers them with the
+  // ring. Registration can fail under a low RLIMIT_MEMLOCK; the buffers
+  // still work for plain reads and writes then, and fixed() reports false.
+  bool AllocateBuffers(std::size_t count, std::size_t size,
+                       std::string* error) {
+    void* mem = ::mmap(nullptr, count * size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+      if (error) {
+        *error = "Failed to allocate io_uring buffers";
+      }
+      return false;
+    }
+    buffers_ = static_cast<char*>(mem);
+    buffer_count_ = count;
+    buffer_size_ = size;
+
+    std::vector<iovec> iovecs(count);
+    for (std::size_t i = 0; i < count; ++i) {
+      iovecs[i].iov_base = buffer(i);
+      iovecs[i].iov_len = size;
+    }
+    fixed_buffers_ = SysRegister(fd_, IORING_REGISTER_BUFFERS, iovecs.data(),
+                                 static_cast<unsigned>(count)) == 0;
+    return true;
+  }
+
+  int fd() const { return fd_; }
+  char* buffer(std::size_t index) { return buffers_ + index * buffer_size_; }
+  std::size_t buffer_size() const { return buffer_size_; }
+  bool fixed() const { return fixed_buffers_; }
+
+  // Returns a zeroed SQE, or nullptr when the submission queue is full.
+  io_uring_sqe* NextSqe() {
+    const unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (local_tail_ - head >= sq_entries_) {
+      return nullptr;
+    }
+    const unsigned index = local_tail_ & sq_mask_;
+    io_uring_sqe* sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    ++local_tail_;
+    return sqe;
+  }
+
+  // Publishes queued SQEs and waits for at least wait_nr completions.
+  bool Submit(unsigned wait_nr, std::string* error) {
+    const unsigned to_submit = local_tail_ - *sq_tail_;
+    __atomic_store_n(sq_tail_, local_tail_, __ATOMIC_RELEASE);
+    if (to_submit == 0 && wait_nr == 0) {
+      return true;
+    }
+    while (true) {
+      UHD_TRACE_COUNT(kSyscalls, 1);
+      const int ret = SysEnter(fd_, to_submit, wait_nr,
+                               wait_nr ? IORING_ENTER_GETEVENTS : 0);
+      if (ret >= 0) {
+        return true;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      if (error) {
+        *error = std::string("io_uring_enter failed: ") + std::strerror(errno);
+      }
+      return false;
+    }
+  }
+
+  bool PopCqe(io_uring_cqe* out) {
+    const unsigned head = *cq_head_;
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+    *out = cqes_[head & cq_mask_];
+    __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+ private:
+  bool MapFailed(std::string* error) {
+    if (error) {
+      *error = std::string("io_uring mmap failed: ") + std::strerror(errno);
+    }
+    return false;
+  }
+
+  int fd_ = -1;
+  void* sq_ptr_ = nullptr;
+  void* cq_ptr_ = nullptr;
+  std::size_t sq_size_ = 0;
+  std::size_t cq_size_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  std::size_t sqes_size_ = 0;
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_array_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned local_tail_ = 0;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe* cqes_ = nullptr;
+  char* buffers_ = nullptr;
+  std::size_t buffer_count_ = 0;
+  std::size_t buffer_size_ = 0;
+  bool fixed_buffers_ = false;
+};
+
+enum Op : std::uint64_t {
+  kOpenSource = 1,
+  kOpenDest,
+  kRead,
+  kWrite,
+  kFsync,
+  kCloseSource,
+  kCloseDest,
+};
+
+std::uint64_t UserData(std::size_t slot, Op op) {
+  return (static_cast<std::uint64_t>(slot) << 8) | op;
+}
+
+// One file in flight. Each slot owns one registered buffer and never has
+// more than two requests outstanding, so a ring of 2 * kSlotCount entries
+// can always take the next request after a submit.
+struct Slot {
+  bool busy = false;
+  std::size_t job = 0;
+  int source_fd = -1;
+  int dest_fd = -1;
+  std::uint64_t offset = 0;
+  std::uint64_t chunk = 0;
+  std::uint64_t written = 0;
+  int pending = 0;
+  bool closing = false;
+  bool failed = false;
+};
+
+// Drives either a copy (source and dest paths) or a read-only pass (dest
+// empty) over all jobs with up to kSlotCount files in flight.
+class Pipeline {
+ public:
+  Pipeline(Ring* ring, const std::vector<UringCopyJob>* jobs, bool copy,
+           bool sync, const UringDataFn* on_data, const UringDoneFn* on_done)
+      : ring_(ring),
+        jobs_(jobs),
+        copy_(copy),
+        sync_(sync),
+        on_data_(on_data),
+        on_done_(on_done),
+        slots_(kSlotCount) {}
+
+  bool Run(std::string* error) {
+    while (true) {
+      if (error_.empty()) {
+        for (std::size_t i = 0; i < slots_.size() && next_job_ < jobs_->size();
+             ++i) {
+          if (!slots_[i].busy) {
+            StartJob(i);
+          }
+        }
+      }
+      if (busy_ == 0 && queued_.empty()) {
+        break;
+      }
+      FlushQueued();
+      if (!ring_->Submit(1, error)) {
+        CloseAllSync();
+        return false;
+      }
+      io_uring_cqe cqe;
+      while (ring_->PopCqe(&cqe)) {
+        Complete(cqe);
+      }
+    }
+    if (!error_.empty()) {
+      if (error) {
+        *error = error_;
+      }
+      return false;
+    }
+    return true;
+  }
+
+  std::uint64_t bytes() const { return bytes_; }
+
+ private:
+  // Requests are staged here first so a full submission queue never loses
+  // one; FlushQueued moves as many as fit into the ring.
+  struct Request {
+    std::uint8_t opcode;
+    int fd;
+    std::uint64_t addr;
+    std::uint32_t len;
+    std::uint64_t off;
+    std::uint32_t flags;
+    std::uint16_t buf_index;
+    std::uint64_t user_data;
+  };
+
+  void Queue(const Request& request) { queued_.push_back(request); }
+
+  void FlushQueued() {
+    while (!queued_.empty()) {
+      io_uring_sqe* sqe = ring_->NextSqe();
+      if (!sqe) {
+        std::string ignored;
+        ring_->Submit(0, &ignored);
+        sqe = ring_->NextSqe();
+        if (!sqe) {
+          return;
+        }
+      }
+      const Request& r = queued_.front();
+      sqe->opcode = r.opcode;
+      sqe->fd = r.fd;
+      sqe->addr = r.addr;
+      sqe->len = r.len;
+      sqe->off = r.off;
+      sqe->open_flags = r.flags;
+      sqe->buf_index = r.buf_index;
+      sqe->user_data = r.user_data;
+      queued_.pop_front();
+    }
+  }
+
+  void StartJob(std::size_t index) {
+    Slot& slot = slots_[index];
+    slot = Slot();
+    slot.busy = true;
+    slot.job = next_job_++;
+    ++busy_;
+    Queue({IORING_OP_OPENAT, AT_FDCWD,
+           reinterpret_cast<std::uint64_t>(job(index).source.c_str()), 0, 0,
+           O_RDONLY | O_CLOEXEC, 0, UserData(index, kOpenSource)});
+    slot.pending = 1;
+    if (copy_) {
+      Queue({IORING_OP_OPENAT, AT_FDCWD,
+             reinterpret_cast<std::uint64_t>(job(index).dest.c_str()),
+             job(index).mode, 0,
+             O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0,
+             UserData(index, kOpenDest)});
+      slot.pending = 2;
+    }
+  }
+
+  void QueueRead(std::size_t index) {
+    Slot& slot = slots_[index];
+    std::uint64_t length = ring_->buffer_size();
+    if (copy_) {
+      length = std::min<std::uint64_t>(length, job(index).size - slot.offset);
+    }
+    slot.chunk = length;
+    slot.pending = 1;
+    // Blocking here holds back the whole ring, which is the point.
+    Throttle::Instance().Acquire(length, 1);
+    Queue({static_cast<std::uint8_t>(ring_->fixed() ? IORING_OP_READ_FIXED
+                                                    : IORING_OP_READ),
+           slot.source_fd, reinterpret_cast<std::uint64_t>(ring_->buffer(index)),
+           static_cast<std::uint32_t>(length), slot.offset, 0,
+           static_cast<std::uint16_t>(index), UserData(index, kRead)});
+  }
+
+  void QueueWrite(std::size_t index) {
+    Slot& slot = slots_[index];
+    slot.pending = 1;
+    Throttle::Instance().Acquire(0, 1);
+    Queue({static_cast<std::uint8_t>(ring_->fixed() ? IORING_OP_WRITE_FIXED
+                                                    : IORING_OP_WRITE),
+           slot.dest_fd,
+           reinterpret_cast<std::uint64_t>(ring_->buffer(index) + slot.written),
+           static_cast<std::uint32_t>(slot.chunk - slot.written),
+           slot.offset + slot.written, 0, static_cast<std::uint16_t>(index),
+           UserData(index, kWrite)});
+  }
+
+  void Finish(std::size_t index) {
+    Slot& slot = slots_[index];
+    if (copy_ && sync_ && slot.dest_fd >= 0 && error_.empty() &&
+        !slot.closing) {
+      slot.closing = true;
+      slot.pending = 1;
+      Queue({IORING_OP_FSYNC, slot.dest_fd, 0, 0, 0, 0, 0,
+             UserData(index, kFsync)});
+      return;
+    }
+    slot.closing = true;
+    slot.pending = 0;
+    if (slot.source_fd >= 0) {
+      Queue({IORING_OP_CLOSE, slot.source_fd, 0, 0, 0, 0, 0,
+             UserData(index, kCloseSource)});
+      ++slot.pending;
+    }
+    if (slot.dest_fd >= 0) {
+      Queue({IORING_OP_CLOSE, slot.dest_fd, 0, 0, 0, 0, 0,
+             UserData(index, kCloseDest)});
+      ++slot.pending;
+    }
+    if (slot.pending == 0) {
+      Release(index);
+    }
+  }
+
+  void Release(std::size_t index) {
+    slots_[index].busy = false;
+    --busy_;
+  }
+
+  const UringCopyJob& job(std::size_t index) const {
+    return (*jobs_)[slots_[index].job];
+  }
+
+  void Fail(std::size_t index, const char* what, bool dest, int res) {
+    slots_[index].failed = true;
+    if (error_.empty()) {
+      error_ = std::string("Failed to ") + what + " " +
+               (dest ? job(index).dest : job(index).source).string() + ": " +
+               std::strerror(-res);
+    }
+  }
+
+  void Complete(const io_uring_cqe& cqe) {
+    const std::size_t index = cqe.user_data >> 8;
+    const auto op = static_cast<Op>(cqe.user_data & 0xff);
+    Slot& slot = slots_[index];
+    --slot.pending;
+    switch (op) {
+      case kOpenSource:
+      case kOpenDest:
+        if (cqe.res < 0) {
+          Fail(index, "open", op == kOpenDest, cqe.res);
+        } else if (op == kOpenSource) {
+          slot.source_fd = cqe.res;
+        } else {
+          slot.dest_fd = cqe.res;
+        }
+        if (slot.pending > 0) {
+          return;
+        }
+        if (!error_.empty() || slot.source_fd < 0 ||
+            (copy_ && slot.dest_fd < 0) ||
+            (copy_ && job(index).size == 0)) {
+          Finish(index);
+        } else {
+          QueueRead(index);
+        }
+        return;
+      case kRead:
+        if (cqe.res < 0) {
+          Fail(index, "read", false, cqe.res);
+          Finish(index);
+          return;
+        }
+        // A source that shrank since it was stat'ed would leave a short
+        // copy that looks complete.
+        if (cqe.res == 0 && copy_ && slot.offset < job(index).size) {
+          Fail(index, "read", false, -EIO);
+          Finish(index);
+          return;
+        }
+        if (cqe.res == 0 || !error_.empty()) {
+          Finish(index);
+          return;
+        }
+        slot.chunk = static_cast<std::uint64_t>(cqe.res);
+        bytes_ += slot.chunk;
+        if (copy_) {
+          slot.written = 0;
+          QueueWrite(index);
+          return;
+        }
+        if (on_data_ && *on_data_) {
+          (*on_data_)(slot.job, ring_->buffer(index), slot.chunk);
+        }
+        slot.offset += slot.chunk;
+        QueueRead(index);
+        return;
+      case kWrite:
+        if (cqe.res <= 0) {
+          Fail(index, "write", true, cqe.res < 0 ? cqe.res : -EIO);
+          Finish(index);
+          return;
+        }
+        slot.written += static_cast<std::uint64_t>(cqe.res);
+        if (slot.written < slot.chunk) {
+          QueueWrite(index);
+          return;
+        }
+        slot.offset += slot.chunk;
+        UHD_TRACE_COUNT(kBytesCopied, slot.chunk);
+        if (slot.offset < job(index).size && error_.empty()) {
+          QueueRead(index);
+        } else {
+          Finish(index);
+        }
+        return;
+      case kFsync:
+        UHD_TRACE_COUNT(kFsyncs, 1);
+        if (cqe.res < 0) {
+          Fail(index, "fsync", true, cqe.res);
+        }
+        Finish(index);
+        return;
+      case kCloseSource:
+      case kCloseDest:
+        if (cqe.res < 0) {
+          Fail(index, "close", op == kCloseDest, cqe.res);
+        }
+        if (slot.pending == 0) {
+          // A file cut short by another one's failure is not done either.
+          if (copy_ && !slot.failed && slot.offset == job(index).size) {
+            UHD_TRACE_COUNT(kFilesCopied, 1);
+            if (on_done_ && *on_done_) {
+              (*on_done_)(slot.job);
+            }
+          }
+          Release(index);
+        }
+        return;
+    }
+  }
+
+  // Only reached when io_uring_enter itself fails; nothing else will
+  // complete, so descriptors the ring handed out are closed directly.
+  void CloseAllSync() {
+    for (auto& slot : slots_) {
+      if (slot.source_fd >= 0) {
+        ::close(slot.source_fd);
+      }
+      if (slot.dest_fd >= 0) {
+        ::close(slot.dest_fd);
+      }
+      slot = Slot();
+    }
+  }
+
+  Ring* ring_;
+  const std::vector<UringCopyJob>* jobs_;
+  bool copy_;
+  bool sync_;
+  const UringDataFn* on_data_;
+  const UringDoneFn* on_done_;
+  std::vector<Slot> slots_;
+  std::deque<Request> queued_;
+  std::size_t busy_ = 0;
+  std::size_t next_job_ = 0;
+  std::uint64_t bytes_ = 0;
+  std::string error_;
+};
+
+bool MakeRing(Ring* ring, std::string* error) {
+  if (!IoUringAvailable()) {
+    if (error) {
+      *error = "io_uring is not available";
+    }
+    return false;
+  }
+  return ring->Init(2 * kSlotCount, error) &&
+         ring->AllocateBuffers(kSlotCount, kChunkSize, error);
+}
+
+bool ProbeIoUring() {
+  Ring ring;
+  if (!ring.Init(4, nullptr)) {
+    return false;
+  }
+  // The probe lists opcodes the running kernel implements; the header we
+  // compiled against may be newer.
+  constexpr unsigned kProbeOps = 256;
+  std::vector<char> storage(sizeof(io_uring_probe) +
+                            kProbeOps * sizeof(io_uring_probe_op));
+  auto* probe = reinterpret_cast<io_uring_probe*>(storage.data());
+  if (SysRegister(ring.fd(), IORING_REGISTER_PROBE, probe, kProbeOps) != 0) {
+    return false;
+  }
+  for (const unsigned op : {IORING_OP_OPENAT, IORING_OP_READ_FIXED,
+                            IORING_OP_WRITE_FIXED, IORING_OP_READ,
+                            IORING_OP_WRITE, IORING_OP_FSYNC,
+                            IORING_OP_CLOSE}) {
+    if (op > probe->last_op ||
+        !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+bool IoUringAvailable() {
+  static const bool available = ProbeIoUring();
+  return available;
+}
+
+bool UringCopyFiles(const std::vector<UringCopyJob>& jobs, bool sync,
+                    const UringDoneFn& on_done, std::uint64_t* bytes,
+                    std::string* error) {
+  UHD_TRACE_SCOPE("UringCopyFiles");
+  Ring ring;
+  if (!MakeRing(&ring, error)) {
+    return false;
+  }
+  Pipeline pipeline(&ring, &jobs, true, sync, nullptr, &on_done);
+  const bool ok = pipeline.Run(error);
+  if (bytes) {
+    *bytes = pipeline.bytes();
+  }
+  return ok;
+}
+
+bool UringReadFiles(const std::vector<std::filesystem::path>& files,
+                    const UringDataFn& on_data, std::uint64_t* bytes,
+                    std::string* error) {
+  UHD_TRACE_SCOPE("UringReadFiles");
+  Ring ring;
+  if (!MakeRing(&ring, error)) {
+    return false;
+  }
+  std::vector<UringCopyJob> jobs(files.size());
+  for (std::size_t i = 0; i < files.size(); ++i) {
+    jobs[i].source = files[i];
+  }
+  Pipeline pipeline(&ring, &jobs, false, false, &on_data, nullptr);
+  const bool ok = pipeline.Run(error);
+  if (bytes) {
+    *bytes = pipeline.bytes();
+  }
+  return ok;
+}
+
+#else
+
+bool IoUringAvailable() { return false; }
+
+bool UringCopyFiles(const std::vector<UringCopyJob>& /*jobs*/, bool /*sync*/,
+                    const UringDoneFn& /*on_done*/, std::uint64_t* /*bytes*/,
+                    std::string* error) {
+  if (error) {
+    *error = "io_uring is not supported on this platform";
+  }
+  return false;
+}
+
+bool UringReadFiles(const std::vector<std::filesystem::path>& /*files*/,
+                    const UringDataFn& /*on_data*/, std::uint64_t* /*bytes*/,
+                    std::string* error) {
+  if (error) {
+    *error = "io_uring is not supported on this platform";
+  }
+  return false;
+}
+
+#endif
+
+}  // namespace uhd_helper
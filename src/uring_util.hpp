@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace uhd_helper {
+
+struct UringCopyJob {
+  std::filesystem::path source;
+  std::filesystem::path dest;
+  std::uint32_t mode = 0644;
+  std::uint64_t size = 0;
+};
+
+// Called for every chunk read by UringReadFiles. Chunks of one file arrive
+// in order; chunks of different files interleave.
+using UringDataFn =
+    std::function<void(std::size_t index, const char* data, std::size_t size)>;
+
+// Called by UringCopyFiles once a job's file is fully written and closed,
+// on the calling thread.
+using UringDoneFn = std::function<void(std::size_t index)>;
+
+// True when the kernel lets this process create a ring that supports
+// openat, fixed-buffer read/write, fsync and close. Probed once.
+bool IoUringAvailable();
+
+// Copies every job through a single ring. Opens, reads, writes, fsyncs and
+// closes for many files are in flight at once, using registered buffers
+// when the memlock limit allows. on_done may be empty; when the batch
+// fails it has still run for every file that completed.
+bool UringCopyFiles(const std::vector<UringCopyJob>& jobs, bool sync,
+                    const UringDoneFn& on_done, std::uint64_t* bytes,
+                    std::string* error);
+
+// Reads each file to EOF through a single ring. on_data may be empty when
+// only the page cache side effect is wanted.
+bool UringReadFiles(const std::vector<std::filesystem::path>& files,
+                    const UringDataFn& on_data, std::uint64_t* bytes,
+                    std::string* error);
+
+}  // namespace uhd_helper
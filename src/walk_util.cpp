@@ -0,0 +1,259 @@
+#include "walk_util.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+#include "parallel_util.hpp"
+#include "trace_util.hpp"
+
+namespace uhd_helper {
+namespace {
+
+constexpr std::size_t kDentsBufferSize = 64 * 1024;
+
+struct LinuxDirent64 {
+  std::uint64_t d_ino;
+  std::int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+EntryType TypeFromMode(mode_t mode) {
+  if (S_ISREG(mode)) {
+    return EntryType::kFile;
+  }
+  if (S_ISDIR(mode)) {
+    return EntryType::kDir;
+  }
+  if (S_ISLNK(mode)) {
+    return EntryType::kSymlink;
+  }
+  return EntryType::kOther;
+}
+
+EntryType TypeFromDirent(unsigned char d_type) {
+  switch (d_type) {
+    case DT_REG:
+      return EntryType::kFile;
+    case DT_DIR:
+      return EntryType::kDir;
+    case DT_LNK:
+      return EntryType::kSymlink;
+    default:
+      return EntryType::kOther;
+  }
+}
+
+EntryType StatType(int dir_fd, const char* name, bool follow) {
+  UHD_TRACE_COUNT(kSyscalls, 1);
+#if defined(STATX_TYPE)
+  struct statx stx;
+  if (::statx(dir_fd, name, follow ? 0 : AT_SYMLINK_NOFOLLOW, STATX_TYPE,
+              &stx) == 0) {
+    return TypeFromMode(stx.stx_mode);
+  }
+#endif
+  struct stat st;
+  if (::fstatat(dir_fd, name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0) {
+    return TypeFromMode(st.st_mode);
+  }
+  return EntryType::kOther;
+}
+
+std::string ErrnoMessage(const std::string& what) {
+  return what + ": " + std::strerror(errno);
+}
+
+class WalkState {
+ public:
+  WalkState(const TreeWalker::Visitor& pre, const TreeWalker::Visitor& post)
+      : pre_(pre), post_(post) {}
+
+  // Returns false on a hard error or when a visitor asked to stop; failed()
+  // tells the two apart.
+  bool WalkDir(int dir_fd, const std::string& rel, int depth,
+               std::string* error) {
+    std::vector<DirEntry> entries;
+    if (!TreeWalker::ReadDir(dir_fd, false, &entries, error)) {
+      failed_.store(true);
+      return false;
+    }
+    for (const auto& entry : entries) {
+      if (!VisitEntry(dir_fd, entry, rel, depth, error)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool VisitEntry(int dir_fd, const DirEntry& entry, const std::string& rel,
+                  int depth, std::string* error) {
+    if (stopped_.load()) {
+      return false;
+    }
+    const std::string child_rel = JoinRelPath(rel, entry.name);
+    WalkEntry walk_entry;
+    walk_entry.parent_fd = dir_fd;
+    walk_entry.name = &entry.name;
+    walk_entry.rel_path = &child_rel;
+    walk_entry.type = entry.type;
+    walk_entry.depth = depth;
+
+    const WalkAction action = pre_(walk_entry);
+    if (action == WalkAction::kStop) {
+      stopped_.store(true);
+      return false;
+    }
+    if (entry.type != EntryType::kDir || action == WalkAction::kSkip) {
+      return true;
+    }
+
+    const int child_fd =
+        ::openat(dir_fd, entry.name.c_str(),
+                 O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    UHD_TRACE_COUNT(kSyscalls, 2);
+    if (child_fd < 0) {
+      if (error) {
+        *error = ErrnoMessage("Failed to open directory " + child_rel);
+      }
+      failed_.store(true);
+      return false;
+    }
+    const bool ok = WalkDir(child_fd, child_rel, depth + 1, error);
+    ::close(child_fd);
+    if (!ok) {
+      return false;
+    }
+    if (post_ && post_(walk_entry) == WalkAction::kStop) {
+      stopped_.store(true);
+      return false;
+    }
+    return true;
+  }
+
+  bool failed() const { return failed_.load(); }
+
+ private:
+  const TreeWalker::Visitor& pre_;
+  const TreeWalker::Visitor& post_;
+  std::atomic<bool> stopped_{false};
+  std::atomic<bool> failed_{false};
+};
+
+}  // namespace
+
+std::string JoinRelPath(const std::string& parent, const std::string& name) {
+  if (parent.empty()) {
+    return name;
+  }
+  std::string out;
+  out.reserve(parent.size() + 1 + name.size());
+  out += parent;
+  out += '/';
+  out += name;
+  return out;
+}
+
+bool TreeWalker::ReadDir(int dir_fd, bool follow_symlinks,
+                         std::vector<DirEntry>* entries, std::string* error) {
+  alignas(LinuxDirent64) char buffer[kDentsBufferSize];
+  while (true) {
+    const long n = ::syscall(SYS_getdents64, dir_fd, buffer, sizeof(buffer));
+    UHD_TRACE_COUNT(kSyscalls, 1);
+    if (n < 0) {
+      if (error) {
+        *error = ErrnoMessage("getdents64 failed");
+      }
+      return false;
+    }
+    if (n == 0) {
+      return true;
+    }
+    for (long offset = 0; offset < n;) {
+      const auto* dirent = reinterpret_cast<const LinuxDirent64*>(buffer + offset);
+      offset += dirent->d_reclen;
+      const char* name = dirent->d_name;
+      if (name[0] == '.' &&
+          (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        continue;
+      }
+      DirEntry entry;
+      entry.name = name;
+      entry.inode = dirent->d_ino;
+      entry.type = dirent->d_type == DT_UNKNOWN
+                       ? StatType(dir_fd, name, false)
+                       : TypeFromDirent(dirent->d_type);
+      if (follow_symlinks && entry.type == EntryType::kSymlink) {
+        entry.type = StatType(dir_fd, name, true);
+      }
+      entries->push_back(std::move(entry));
+    }
+  }
+}
+
+bool TreeWalker::ReadDir(const std::filesystem::path& dir, bool follow_symlinks,
+                         std::vector<DirEntry>* entries, std::string* error) {
+  const int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  UHD_TRACE_COUNT(kSyscalls, 2);
+  if (fd < 0) {
+    if (error) {
+      *error = ErrnoMessage("Failed to open directory " + dir.string());
+    }
+    return false;
+  }
+  const bool ok = ReadDir(fd, follow_symlinks, entries, error);
+  ::close(fd);
+  return ok;
+}
+
+bool TreeWalker::Walk(const std::filesystem::path& root,
+                      const WalkOptions& options, const Visitor& pre,
+                      const Visitor& post, std::string* error) {
+  UHD_TRACE_SCOPE("TreeWalker::Walk");
+  const int root_fd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  UHD_TRACE_COUNT(kSyscalls, 2);
+  if (root_fd < 0) {
+    if (error) {
+      *error = ErrnoMessage("Failed to open directory " + root.string());
+    }
+    return false;
+  }
+
+  WalkState state(pre, post);
+  if (!options.parallel) {
+    state.WalkDir(root_fd, "", 0, error);
+  } else {
+    std::vector<DirEntry> entries;
+    if (!ReadDir(root_fd, false, &entries, error)) {
+      ::close(root_fd);
+      return false;
+    }
+    std::vector<std::string> errors(entries.size());
+    ParallelFor(
+        entries.size(),
+        [&](std::size_t i) {
+          state.VisitEntry(root_fd, entries[i], "", 0, &errors[i]);
+        },
+        options.max_workers);
+    for (const auto& item_error : errors) {
+      if (!item_error.empty()) {
+        if (error) {
+          *error = item_error;
+        }
+        break;
+      }
+    }
+  }
+  ::close(root_fd);
+  return !state.failed();
+}
+
+}  // namespace uhd_helper
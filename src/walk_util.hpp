@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace uhd_helper {
+
+enum class EntryType {
+  kFile,
+  kDir,
+  kSymlink,
+  kOther,
+};
+
+struct DirEntry {
+  std::string name;
+  EntryType type = EntryType::kOther;
+  std::uint64_t inode = 0;
+};
+
+struct WalkEntry {
+  // Open descriptor of the directory holding this entry; valid only for the
+  // duration of the callback.
+  int parent_fd = -1;
+  const std::string* name = nullptr;
+  // Path relative to the walk root, '/'-separated.
+  const std::string* rel_path = nullptr;
+  EntryType type = EntryType::kOther;
+  int depth = 0;
+};
+
+enum class WalkAction {
+  kContinue,
+  kSkip,
+  kStop,
+};
+
+struct WalkOptions {
+  // Walk each top-level subdirectory on its own thread. Visitors must then
+  // be thread-safe.
+  bool parallel = false;
+  std::size_t max_workers = 0;
+};
+
+// Directory walker built on openat/getdents64. Entry types come from d_type;
+// statx is issued only for filesystems that report DT_UNKNOWN. Everything is
+// resolved relative to directory fds, so there is no per-entry path lookup.
+class TreeWalker {
+ public:
+  using Visitor = std::function<WalkAction(const WalkEntry&)>;
+
+  // pre runs for every entry before a directory's children; returning kSkip
+  // for a directory prunes it. post, if set, runs for directories after
+  // their children, which is what removal needs.
+  static bool Walk(const std::filesystem::path& root,
+                   const WalkOptions& options, const Visitor& pre,
+                   const Visitor& post, std::string* error);
+
+  // Reads one directory in getdents64 batches. follow_symlinks resolves
+  // kSymlink entries to the type of their target.
+  static bool ReadDir(int dir_fd, bool follow_symlinks,
+                      std::vector<DirEntry>* entries, std::string* error);
+  static bool ReadDir(const std::filesystem::path& dir, bool follow_symlinks,
+                      std::vector<DirEntry>* entries, std::string* error);
+};
+
+std::string JoinRelPath(const std::string& parent, const std::string& name);
+
+}  // namespace uhd_helper